@@ -0,0 +1,374 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "inode.h"
+#include "fileops.h"
+#include "journal.h"
+#include "fs_include.h"
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include <pthread.h>
+
+/*
+ * Asynchronous file I/O.
+ * An aio context owns a pool of worker threads and two queues:
+ * requests waiting for a worker and completed requests waiting
+ * to be reaped with fsaio_getevents(). A request which has a
+ * callback is instead freed as soon as its callback returns.
+ * At most 'depth' requests of a context can be outstanding
+ * (submitted and not yet reaped); submitting more fails with
+ * EAGAIN.
+ * The workers do the I/O with internal_readv()/internal_writev()
+ * under the inode lock, so the requests of a context run in
+ * parallel the way calls from separate threads would.
+ * ac_lock is only held to queue and dequeue requests, never
+ * across file system operations.
+ */
+
+struct aio_req {
+	struct aio_req		*ar_next;
+	struct file_handle	*ar_fh;
+	int			ar_rw;
+	struct iovec		ar_iov;
+	fs_u64_t		ar_off;
+	fsaio_cb_t		ar_cb;
+	void			*ar_arg;
+	int			ar_result;
+	int			ar_error;
+};
+
+struct aio_ctx {
+	pthread_mutex_t		ac_lock;
+	pthread_cond_t		ac_workcv;
+	pthread_cond_t		ac_donecv;
+	struct aio_req		*ac_pending;
+	struct aio_req		**ac_pendtail;
+	struct aio_req		*ac_done;
+	struct aio_req		**ac_donetail;
+	int			ac_depth;
+	int			ac_inflight;
+	int			ac_nqueued;
+	int			ac_ndone;
+	int			ac_nthreads;
+	int			ac_shutdown;
+	pthread_t		*ac_threads;
+};
+
+#define AIO_READ	0
+#define AIO_WRITE	1
+
+static void
+aio_do(
+	struct aio_req		*req)
+{
+	struct file_handle	*fh = req->ar_fh;
+	struct minode		*mino = fh->fh_inode;
+
+	if (req->ar_rw == AIO_READ) {
+		ILOCK_SHARED(mino);
+		req->ar_result = internal_readv(mino, &req->ar_iov, 1,
+						req->ar_off);
+		req->ar_error = errno;
+		IUNLOCK(mino);
+		return;
+	}
+	jnl_begin(fh->fh_fsh->fsh_mem);
+	ILOCK_EXCL(mino);
+	req->ar_error = internal_writev(fh->fh_fsh->fsh_mem, mino,
+					&req->ar_iov, 1, req->ar_off);
+	req->ar_result = req->ar_error ? 0 : (int)req->ar_iov.iov_len;
+	IUNLOCK(mino);
+	jnl_end(fh->fh_fsh->fsh_mem);
+}
+
+static void *
+aio_worker(
+	void			*arg)
+{
+	struct aio_ctx		*ac = (struct aio_ctx *)arg;
+	struct aio_req		*req;
+
+	pthread_mutex_lock(&ac->ac_lock);
+	for (;;) {
+		while (ac->ac_pending == NULL && !ac->ac_shutdown) {
+			pthread_cond_wait(&ac->ac_workcv, &ac->ac_lock);
+		}
+		if ((req = ac->ac_pending) == NULL) {
+			break;
+		}
+		if ((ac->ac_pending = req->ar_next) == NULL) {
+			ac->ac_pendtail = &ac->ac_pending;
+		}
+		pthread_mutex_unlock(&ac->ac_lock);
+
+		aio_do(req);
+		if (req->ar_cb) {
+			req->ar_cb(req, req->ar_arg, req->ar_result,
+				   req->ar_error);
+			free(req);
+			pthread_mutex_lock(&ac->ac_lock);
+			ac->ac_inflight--;
+			continue;
+		}
+		req->ar_next = NULL;
+		pthread_mutex_lock(&ac->ac_lock);
+		*ac->ac_donetail = req;
+		ac->ac_donetail = &req->ar_next;
+		ac->ac_ndone++;
+		pthread_cond_broadcast(&ac->ac_donecv);
+	}
+	pthread_mutex_unlock(&ac->ac_lock);
+	return NULL;
+}
+
+/*
+ * Create an aio context with 'nthreads' worker threads
+ * allowing up to 'depth' outstanding requests.
+ * Returns the context or NULL with errno set.
+ */
+
+void *
+fsaio_create(
+	void			*vfsh,
+	int			depth,
+	int			nthreads)
+{
+	struct aio_ctx		*ac;
+	int			i, error;
+
+	if (vfsh == NULL || depth <= 0 || nthreads <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	ac = (struct aio_ctx *)malloc(sizeof(struct aio_ctx));
+	if (!ac) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(ac, 0, sizeof(struct aio_ctx));
+	ac->ac_threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	if (!ac->ac_threads) {
+		free(ac);
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&ac->ac_lock, NULL);
+	pthread_cond_init(&ac->ac_workcv, NULL);
+	pthread_cond_init(&ac->ac_donecv, NULL);
+	ac->ac_pendtail = &ac->ac_pending;
+	ac->ac_donetail = &ac->ac_done;
+	ac->ac_depth = depth;
+	for (i = 0; i < nthreads; i++) {
+		if ((error = pthread_create(&ac->ac_threads[i], NULL,
+					    aio_worker, ac)) != 0) {
+			fprintf(stderr, "fsaio_create: Failed to start worker"
+				" thread: %s\n", strerror(error));
+			break;
+		}
+	}
+	ac->ac_nthreads = i;
+	if (i == 0) {
+		fsaio_destroy(ac);
+		errno = error;
+		return NULL;
+	}
+	return (void *)ac;
+}
+
+/*
+ * Wait for all the outstanding requests to complete, stop the
+ * worker threads and free the context. Completed requests which
+ * weren't reaped are discarded.
+ */
+
+int
+fsaio_destroy(
+	void			*vac)
+{
+	struct aio_ctx		*ac = (struct aio_ctx *)vac;
+	struct aio_req		*req;
+	int			i;
+
+	if (ac == NULL) {
+		return EINVAL;
+	}
+	pthread_mutex_lock(&ac->ac_lock);
+	ac->ac_shutdown = 1;
+	pthread_cond_broadcast(&ac->ac_workcv);
+	pthread_mutex_unlock(&ac->ac_lock);
+	for (i = 0; i < ac->ac_nthreads; i++) {
+		pthread_join(ac->ac_threads[i], NULL);
+	}
+	while ((req = ac->ac_done) != NULL) {
+		ac->ac_done = req->ar_next;
+		free(req);
+	}
+	pthread_mutex_destroy(&ac->ac_lock);
+	pthread_cond_destroy(&ac->ac_workcv);
+	pthread_cond_destroy(&ac->ac_donecv);
+	free(ac->ac_threads);
+	free(ac);
+	return 0;
+}
+
+static void *
+aio_submit(
+	struct aio_ctx		*ac,
+	int			rw,
+	struct file_handle	*fh,
+	char			*buf,
+	fs_u32_t		len,
+	fs_u64_t		offset,
+	fsaio_cb_t		cb,
+	void			*arg)
+{
+	struct aio_req		*req;
+	int			error;
+
+	if (ac == NULL || fh == NULL || buf == NULL || len > INT_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (fh->fh_inode->mino_type != IFREG) {
+		errno = EISDIR;
+		return NULL;
+	}
+
+	/*
+	 * Data in the write buffer of the handle was written
+	 * before this request, so it must reach the file first.
+	 */
+
+	if ((error = fh_flush(fh)) != 0) {
+		errno = error;
+		return NULL;
+	}
+	req = (struct aio_req *)malloc(sizeof(struct aio_req));
+	if (!req) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	req->ar_next = NULL;
+	req->ar_fh = fh;
+	req->ar_rw = rw;
+	req->ar_iov.iov_base = buf;
+	req->ar_iov.iov_len = len;
+	req->ar_off = offset;
+	req->ar_cb = cb;
+	req->ar_arg = arg;
+	req->ar_result = 0;
+	req->ar_error = 0;
+	pthread_mutex_lock(&ac->ac_lock);
+	if (ac->ac_inflight >= ac->ac_depth || ac->ac_shutdown) {
+		pthread_mutex_unlock(&ac->ac_lock);
+		free(req);
+		errno = EAGAIN;
+		return NULL;
+	}
+	ac->ac_inflight++;
+	if (cb == NULL) {
+		ac->ac_nqueued++;
+	}
+	*ac->ac_pendtail = req;
+	ac->ac_pendtail = &req->ar_next;
+	pthread_cond_signal(&ac->ac_workcv);
+	pthread_mutex_unlock(&ac->ac_lock);
+	return (void *)req;
+}
+
+/*
+ * Queue a read of 'len' bytes at offset 'offset' of the file
+ * into 'buf'. The offset of the handle isn't used or changed.
+ * If 'cb' isn't NULL, it's called from a worker thread when
+ * the read completes and the request is freed after it returns;
+ * otherwise the completion is reaped with fsaio_getevents().
+ * Returns the request handle, or NULL with errno set (EAGAIN
+ * if 'depth' requests are already outstanding).
+ */
+
+void *
+fsread_async(
+	void			*vac,
+	void			*vfh,
+	char			*buf,
+	unsigned int		len,
+	unsigned long long	offset,
+	fsaio_cb_t		cb,
+	void			*arg)
+{
+	return aio_submit((struct aio_ctx *)vac, AIO_READ,
+			  (struct file_handle *)vfh, buf, len, offset, cb, arg);
+}
+
+/*
+ * Queue a write of 'len' bytes from 'buf' at offset 'offset'
+ * of the file. As with fspwritev(), the write can't start
+ * beyond the end of file; requests extending a file must be
+ * issued in order, each after the previous one completed.
+ * Otherwise same as fsread_async().
+ */
+
+void *
+fswrite_async(
+	void			*vac,
+	void			*vfh,
+	char			*buf,
+	unsigned int		len,
+	unsigned long long	offset,
+	fsaio_cb_t		cb,
+	void			*arg)
+{
+	return aio_submit((struct aio_ctx *)vac, AIO_WRITE,
+			  (struct file_handle *)vfh, buf, len, offset, cb, arg);
+}
+
+/*
+ * Reap between 'min' and 'max' completed requests (that were
+ * submitted without a callback) into 'events', waiting until
+ * at least 'min' of them have completed. With 'min' zero, it
+ * just polls. 'min' is capped to the number of outstanding
+ * requests submitted without a callback.
+ * Returns the number of events filled.
+ */
+
+int
+fsaio_getevents(
+	void			*vac,
+	struct fsaio_event	*events,
+	int			min,
+	int			max)
+{
+	struct aio_ctx		*ac = (struct aio_ctx *)vac;
+	struct aio_req		*req;
+	int			n = 0;
+
+	if (ac == NULL || events == NULL || max < min) {
+		errno = EINVAL;
+		return 0;
+	}
+	pthread_mutex_lock(&ac->ac_lock);
+	min = MIN(min, ac->ac_nqueued);
+	while (ac->ac_ndone < min) {
+		pthread_cond_wait(&ac->ac_donecv, &ac->ac_lock);
+	}
+	while (n < max && (req = ac->ac_done) != NULL) {
+		if ((ac->ac_done = req->ar_next) == NULL) {
+			ac->ac_donetail = &ac->ac_done;
+		}
+		ac->ac_ndone--;
+		ac->ac_nqueued--;
+		ac->ac_inflight--;
+		events[n].ev_req = req;
+		events[n].ev_arg = req->ar_arg;
+		events[n].ev_result = req->ar_result;
+		events[n].ev_error = req->ar_error;
+		free(req);
+		n++;
+	}
+	pthread_mutex_unlock(&ac->ac_lock);
+	return n;
+}
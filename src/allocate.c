@@ -6,10 +6,41 @@
 #include <assert.h>
 #include <string.h>
 #include "fileops.h"
+#include "allocate.h"
+#include "bio.h"
+#include "journal.h"
+#include "cksum.h"
+#include <unistd.h>
 
 #define EMAP_BLKSZ	8192
 
 static fs_u64_t	traverse_emapbuf(char *, fs_u64_t, fs_u64_t *, int);
+static int	allocate_locked(struct fsmem *, fs_u64_t, fs_u64_t *,
+				fs_u64_t *);
+static int	deallocate_locked(struct fsmem *, fs_u64_t, fs_u64_t,
+				  fs_u64_t *);
+static int	deallocate_freed_locked(struct fsmem *);
+
+/*
+ * Write the in-core superblock to disk.
+ * fsm_sblock makes sure that the superblock is written
+ * as a whole, even if its fields are changed concurrently
+ * under fsm_imaplock and fsm_alloclock.
+ */
+
+int
+write_sb(
+	struct fsmem		*fsm)
+{
+	struct super_block	sb;
+	int			error = 0;
+
+	pthread_mutex_lock(&fsm->fsm_sblock);
+	memcpy(&sb, fsm->fsm_sb, sizeof(struct super_block));
+	error = jnl_write(fsm, &sb, sizeof(struct super_block), SB_OFFSET);
+	pthread_mutex_unlock(&fsm->fsm_sblock);
+	return error;
+}
 
 static fs_u64_t
 traverse_emapbuf(
@@ -44,7 +75,7 @@ traverse_emapbuf(
 			if (buf[i] & (1 << j)) {
 				if (start == -1) {
 					assert(next == 0);
-					start = (fs_u64_t)i << 3 + j;
+					start = ((fs_u64_t)i << 3) + j;
 				}
 				buf[i] &= ~(1 << j);
 				nbits++;
@@ -79,6 +110,10 @@ traverse_emapbuf(
  * The caller may need to call this function
  * multiple times in case the allocated chunk
  * size is less than the requested one.
+ * Block allocation is serialized by fsm_alloclock.
+ * The blocks whose free has been committed since the last
+ * call are put in the emap first, except within an explicit
+ * transaction, whose abort would undo that.
  */
 
 int
@@ -87,11 +122,34 @@ allocate(
 	fs_u64_t	req,
 	fs_u64_t	*blknop,
 	fs_u64_t	*lenp)
+{
+	int		error;
+
+	pthread_mutex_lock(&fsm->fsm_alloclock);
+	if (jnl_intx(fsm) ||
+	    (error = deallocate_freed_locked(fsm)) == 0) {
+		error = allocate_locked(fsm, req, blknop, lenp);
+	}
+	pthread_mutex_unlock(&fsm->fsm_alloclock);
+	if (error == 0 && (error = cksum_clear(fsm, *blknop,
+						*lenp)) != 0) {
+		deallocate(fsm, *blknop, *lenp);
+		*blknop = *lenp = 0;
+	}
+	return error;
+}
+
+static int
+allocate_locked(
+	struct fsmem	*fsm,
+	fs_u64_t	req,
+	fs_u64_t	*blknop,
+	fs_u64_t	*lenp)
 {
 	fs_u64_t	off = 0, sz, blkno = 0;
 	fs_u64_t	ret;
 	char		*buf = NULL;
-	int		rd, readsz, found = 0;
+	int		rd, readsz, found = 0, error;
 
 	*blknop = *lenp = 0;
 	if (req == 0) {
@@ -122,7 +180,7 @@ allocate(
 		}
 		readsz = MIN(EMAP_BLKSZ, (int)(sz - off));
 		memset(buf, 0, EMAP_BLKSZ);
-		if ((rd = internal_read(fsm->fsm_devfd, fsm->fsm_emapip, buf,
+		if ((rd = internal_read(fsm->fsm_emapip, buf,
 					off, readsz)) != readsz) {
 			fprintf(stderr, "allocate: Failed to read emap "
 				"file at offset %llu for %s\n", off,
@@ -174,16 +232,128 @@ allocate(
 	 */
 
 	fsm->fsm_sb->freeblks -= *lenp;
-	lseek(fsm->fsm_devfd, SB_OFFSET, SEEK_SET);
-	if (write(fsm->fsm_devfd, fsm->fsm_sb, sizeof(struct super_block)) !=
-            sizeof(struct super_block)) {
+	if ((error = write_sb(fsm)) != 0) {
 		fprintf(stderr, "allocate: Failed to write super block"
 			" for %s\n", fsm->fsm_mntpt);
 		free(buf);
-		return errno;
+		return error;
 	}
 
 	*blknop = blkno;
 	free(buf);
 	return 0;
 }
+
+/*
+ * Free the 'len' blocks starting at 'blkno'. With a journal,
+ * they are only put in the emap once the transaction freeing
+ * them is committed (see jnl_defer()).
+ * Returns zero or error number.
+ */
+
+int
+deallocate(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	fs_u64_t	len)
+{
+	fs_u64_t	done;
+	int		error;
+
+	if (len == 0 || jnl_defer(fsm, blkno, len)) {
+		return 0;
+	}
+	pthread_mutex_lock(&fsm->fsm_alloclock);
+	error = deallocate_locked(fsm, blkno, len, &done);
+	pthread_mutex_unlock(&fsm->fsm_alloclock);
+	return error;
+}
+
+/*
+ * Put the blocks whose free has been committed in the emap.
+ * Those it fails to put there stay listed by the journal for
+ * the next call.
+ * Returns zero or error number.
+ */
+
+int
+deallocate_freed(
+	struct fsmem	*fsm)
+{
+	int		error;
+
+	pthread_mutex_lock(&fsm->fsm_alloclock);
+	error = deallocate_freed_locked(fsm);
+	pthread_mutex_unlock(&fsm->fsm_alloclock);
+	return error;
+}
+
+static int
+deallocate_freed_locked(
+	struct fsmem	*fsm)
+{
+	fs_u64_t	blkno, len, done;
+	int		error = 0;
+
+	while (error == 0 && jnl_freed(fsm, &blkno, &len)) {
+		error = deallocate_locked(fsm, blkno, len, &done);
+		jnl_freed_done(fsm, done);
+	}
+	return error;
+}
+
+/*
+ * Set the bits of the 'len' blocks starting at 'blkno' in
+ * the emap file, setting '*donep' to the number of the first
+ * ones which are free, all of them unless it fails.
+ * Called with fsm_alloclock held. Returns zero or error number.
+ */
+
+static int
+deallocate_locked(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	fs_u64_t	len,
+	fs_u64_t	*donep)
+{
+	char		buf[ONE_K];
+	fs_u64_t	off, bit, end = blkno + len;
+	int		sz, error = 0, sberr;
+
+	/*
+	 * Update the emap a block at a time, since metadata_write()
+	 * can't write across extents of the emap file.
+	 */
+
+	*donep = 0;
+	for (bit = blkno; bit < end; ) {
+		off = (bit >> LOG_8) & ~((fs_u64_t)ONE_K - 1);
+		sz = (int)MIN(ONE_K, fsm->fsm_emapip->mino_size - off);
+		if (internal_read(fsm->fsm_emapip, buf, off, sz) != sz) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		for (; bit < end && (bit >> LOG_8) < off + sz; bit++) {
+			assert(!(buf[(bit >> LOG_8) - off] & (1 << (bit & 7))));
+			buf[(bit >> LOG_8) - off] |= (1 << (bit & 7));
+		}
+		if (metadata_write(fsm, off, buf, sz,
+				   fsm->fsm_emapip) != sz) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		*donep = bit - blkno;
+	}
+	if (*donep > 0) {
+		fsm->fsm_sb->freeblks += *donep;
+		if ((sberr = write_sb(fsm)) != 0 && error == 0) {
+			error = sberr;
+		}
+	}
+	if (error) {
+		fprintf(stderr, "deallocate: Failed to free %llu blocks at"
+			" %llu for %s\n", len - *donep, blkno + *donep,
+			fsm->fsm_mntpt);
+	}
+	return error;
+}
@@ -1,6 +1,9 @@
 #ifndef _FS_ALLOCATE_
 #define _FS_ALLOCATE_
 
-extern int	allocate(struct fsmem *, fs_u32_t, fs_u64_t *, fs_u64_t *);
+extern int	allocate(struct fsmem *, fs_u64_t, fs_u64_t *, fs_u64_t *);
+extern int	write_sb(struct fsmem *);
+extern int	deallocate(struct fsmem *, fs_u64_t, fs_u64_t);
+extern int	deallocate_freed(struct fsmem *);
 
 #endif
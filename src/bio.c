@@ -0,0 +1,1134 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "bio.h"
+#include "journal.h"
+#include "fs_include.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+
+/*
+ * fs.h has its own struct file_handle, so this file can't
+ * be built with _GNU_SOURCE, which is what glibc wants for
+ * O_DIRECT and statx().
+ */
+
+#ifndef O_DIRECT
+#define O_DIRECT	__O_DIRECT
+#endif
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ	22
+#endif
+
+/*
+ * Block I/O layer.
+ * All the I/O to the device file of a mounted file system
+ * goes through here. A single segment is done with pread/
+ * pwrite. A batch of segments (e.g. all the extents of a
+ * read on a fragmented file) is submitted with io_uring in
+ * a single io_uring_enter() call. If io_uring isn't
+ * available, device-contiguous segments of the batch are
+ * coalesced and done with preadv/pwritev.
+ *
+ * When mounted with FSMNT_DIRECT, I/O which is aligned to
+ * fsm_dioalign goes to the O_DIRECT descriptor. Reads which
+ * aren't aligned are widened to the alignment and read into
+ * a buffer from the pool. The aligned part of a write is done
+ * directly (through a pool buffer if the caller's buffer isn't
+ * aligned) and the unaligned head and tail through the page
+ * cache. The kernel flushes and invalidates cached pages over
+ * the range of an O_DIRECT request, so both paths see the same
+ * data.
+ *
+ * When mounted with FSMNT_MMAP, the device file is mapped
+ * shared and all the I/O is a copy to/from the mapping, so
+ * no system call is made once the pages are faulted in.
+ * The device file is sized by mkfs and never grows, so it's
+ * mapped once, whole, at mount time and the mapping needs
+ * no lock.
+ *
+ * The blocks of metadata which the journal has in core (see
+ * journal.c) are newer than the device file: I/O touching
+ * them goes through the journal. bio_dev_read() and
+ * bio_dev_write() do I/O to the device file as it is.
+ */
+
+/*
+ * Number and size of the aligned buffers in the pool
+ * of a file system mounted with FSMNT_DIRECT.
+ */
+
+#define BIO_POOLBUFS	16
+#define BIO_POOLBUFSZ	(1 << 18)
+
+struct bio_pool {
+	pthread_mutex_t		bp_lock;
+	pthread_cond_t		bp_cv;
+	int			bp_nfree;
+	char			*bp_free[BIO_POOLBUFS];
+	char			*bp_mem;
+};
+
+#define DIO_ALIGNED(fsm, x)	\
+	(((fs_u64_t)(x) & ((fsm)->fsm_dioalign - 1)) == 0)
+#define DIO_ROUNDDOWN(fsm, x)	((x) & ~((fs_u64_t)(fsm)->fsm_dioalign - 1))
+#define DIO_ROUNDUP(fsm, x)	\
+	DIO_ROUNDDOWN(fsm, (x) + (fsm)->fsm_dioalign - 1)
+
+/*
+ * Maximum number of segments coalesced into one
+ * preadv/pwritev call.
+ */
+
+#define BIO_MAXIOV	64
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define BIO_URING
+#endif
+#endif
+
+#ifdef BIO_URING
+#include <linux/io_uring.h>
+
+/*
+ * Number of entries of the submission queue.
+ * Larger batches are submitted in pieces of this size.
+ */
+
+#define URING_ENTRIES	64
+
+/*
+ * A minimal io_uring instance. Every thread doing
+ * batched I/O gets its own ring, so no locking is needed
+ * around submission and completion.
+ */
+
+struct uring {
+	int			ur_fd;
+	void			*ur_sqring;
+	size_t			ur_sqringsz;
+	void			*ur_cqring;
+	size_t			ur_cqringsz;
+	struct io_uring_sqe	*ur_sqes;
+	size_t			ur_sqesz;
+	unsigned		*ur_sqhead;
+	unsigned		*ur_sqtail;
+	unsigned		*ur_sqmask;
+	unsigned		*ur_sqarray;
+	unsigned		*ur_cqhead;
+	unsigned		*ur_cqtail;
+	unsigned		*ur_cqmask;
+	struct io_uring_cqe	*ur_cqes;
+};
+
+static pthread_once_t	uring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	uring_key;
+static int		uring_disabled;
+
+static void
+uring_free(
+	void		*arg)
+{
+	struct uring	*ur = (struct uring *)arg;
+
+	if (ur->ur_sqes) {
+		munmap(ur->ur_sqes, ur->ur_sqesz);
+	}
+	if (ur->ur_cqring && ur->ur_cqring != ur->ur_sqring) {
+		munmap(ur->ur_cqring, ur->ur_cqringsz);
+	}
+	if (ur->ur_sqring) {
+		munmap(ur->ur_sqring, ur->ur_sqringsz);
+	}
+	close(ur->ur_fd);
+	free(ur);
+}
+
+static void
+uring_init_key(void)
+{
+	pthread_key_create(&uring_key, uring_free);
+}
+
+/*
+ * Get the ring of the calling thread, setting it up on
+ * first use. Returns NULL if io_uring can't be used, in
+ * which case it isn't tried again.
+ */
+
+static struct uring *
+uring_get(void)
+{
+	struct io_uring_params	p;
+	struct uring		*ur;
+	char			*sq, *cq;
+
+	if (uring_disabled) {
+		return NULL;
+	}
+	pthread_once(&uring_once, uring_init_key);
+	if ((ur = (struct uring *)pthread_getspecific(uring_key)) != NULL) {
+		return ur;
+	}
+	ur = (struct uring *)malloc(sizeof(struct uring));
+	if (!ur) {
+		return NULL;
+	}
+	memset(ur, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	ur->ur_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ur->ur_fd < 0) {
+		uring_disabled = 1;
+		free(ur);
+		return NULL;
+	}
+	ur->ur_sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->ur_cqringsz = p.cq_off.cqes +
+			  p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->ur_sqringsz = ur->ur_cqringsz =
+			MAX(ur->ur_sqringsz, ur->ur_cqringsz);
+	}
+	ur->ur_sqring = mmap(NULL, ur->ur_sqringsz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+			     IORING_OFF_SQ_RING);
+	if (ur->ur_sqring == MAP_FAILED) {
+		ur->ur_sqring = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->ur_cqring = ur->ur_sqring;
+	} else {
+		ur->ur_cqring = mmap(NULL, ur->ur_cqringsz,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+				     IORING_OFF_CQ_RING);
+		if (ur->ur_cqring == MAP_FAILED) {
+			ur->ur_cqring = NULL;
+			goto fail;
+		}
+	}
+	ur->ur_sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->ur_sqes = (struct io_uring_sqe *)mmap(NULL, ur->ur_sqesz,
+						  PROT_READ | PROT_WRITE,
+						  MAP_SHARED | MAP_POPULATE,
+						  ur->ur_fd, IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED) {
+		ur->ur_sqes = NULL;
+		goto fail;
+	}
+	sq = (char *)ur->ur_sqring;
+	cq = (char *)ur->ur_cqring;
+	ur->ur_sqhead = (unsigned *)(sq + p.sq_off.head);
+	ur->ur_sqtail = (unsigned *)(sq + p.sq_off.tail);
+	ur->ur_sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur->ur_sqarray = (unsigned *)(sq + p.sq_off.array);
+	ur->ur_cqhead = (unsigned *)(cq + p.cq_off.head);
+	ur->ur_cqtail = (unsigned *)(cq + p.cq_off.tail);
+	ur->ur_cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	pthread_setspecific(uring_key, ur);
+	return ur;
+
+fail:
+	uring_disabled = 1;
+	uring_free(ur);
+	return NULL;
+}
+
+/*
+ * Reap the completions there are, saving the result of each
+ * segment in 'res' and counting them in '*donep'.
+ */
+
+static void
+uring_reap(
+	struct uring		*ur,
+	int			*res,
+	int			*donep)
+{
+	struct io_uring_cqe	*cqe;
+	unsigned		head;
+
+	head = *ur->ur_cqhead;
+	while (head != __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE)) {
+		cqe = &ur->ur_cqes[head & *ur->ur_cqmask];
+		res[cqe->user_data] = cqe->res;
+		head++;
+		(*donep)++;
+	}
+	__atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Submit up to URING_ENTRIES segments and wait for all of
+ * them with a single io_uring_enter() call.
+ * If io_uring_enter() fails, the segments the kernel hasn't
+ * taken are withdrawn from the submission queue and the ones
+ * it has are waited for, since they use the caller's buffers.
+ * Segments which complete short or not at all are finished
+ * with pread/pwrite. Returns zero or error number.
+ */
+
+static int
+uring_submit(
+	struct uring		*ur,
+	int			fd,
+	int			rw,
+	struct bio_vec		*bv,
+	int			n)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned		tail, idx;
+	int			i, done = 0, submitted = 0, ret, error = 0;
+	int			res[URING_ENTRIES];
+
+	assert(n <= URING_ENTRIES);
+	tail = *ur->ur_sqtail;
+	for (i = 0; i < n; i++) {
+		idx = tail & *ur->ur_sqmask;
+		sqe = &ur->ur_sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = (rw == BIO_READ) ? IORING_OP_READ :
+						 IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->addr = (unsigned long)bv[i].bv_buf;
+		sqe->len = bv[i].bv_len;
+		sqe->off = bv[i].bv_off;
+		sqe->user_data = i;
+		ur->ur_sqarray[idx] = idx;
+		res[i] = 0;
+		tail++;
+	}
+	__atomic_store_n(ur->ur_sqtail, tail, __ATOMIC_RELEASE);
+	while (done < n) {
+		ret = (int)syscall(__NR_io_uring_enter, ur->ur_fd,
+				   n - submitted, n - done,
+				   IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0) {
+			submitted += ret;
+		} else if (errno != EINTR) {
+			break;
+		}
+		uring_reap(ur, res, &done);
+	}
+	if (done < n) {
+
+		/*
+		 * Nobody else uses the ring and the kernel only
+		 * takes entries in io_uring_enter(), so moving the
+		 * tail back to the head withdraws what it hasn't
+		 * taken.
+		 */
+
+		__atomic_store_n(ur->ur_sqtail,
+				 __atomic_load_n(ur->ur_sqhead,
+						 __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELEASE);
+		submitted = n - (tail - *ur->ur_sqtail);
+		while (done < submitted) {
+			ret = (int)syscall(__NR_io_uring_enter, ur->ur_fd, 0,
+					   submitted - done,
+					   IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret < 0 && errno != EINTR) {
+				break;
+			}
+			uring_reap(ur, res, &done);
+		}
+		if (done < submitted) {
+
+			/*
+			 * The ring is unusable: closing it cancels what
+			 * is still in flight. The thread gets a new one
+			 * on its next batch.
+			 */
+
+			fprintf(stderr, "WARNING: io_uring_enter failed: "
+				"%s; dropping the ring\n", strerror(errno));
+			pthread_setspecific(uring_key, NULL);
+			uring_free(ur);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (res[i] < 0) {
+			res[i] = 0;
+		}
+		if ((fs_u32_t)res[i] == bv[i].bv_len) {
+			continue;
+		}
+		if (rw == BIO_READ) {
+			ret = pread(fd, bv[i].bv_buf + res[i],
+				    bv[i].bv_len - res[i],
+				    bv[i].bv_off + res[i]);
+		} else {
+			ret = pwrite(fd, bv[i].bv_buf + res[i],
+				     bv[i].bv_len - res[i],
+				     bv[i].bv_off + res[i]);
+		}
+		if (ret != (int)(bv[i].bv_len - res[i])) {
+			error = errno ? errno : EIO;
+		}
+	}
+	return error;
+}
+#endif /* BIO_URING */
+
+/*
+ * Get a buffer from the pool, waiting for one
+ * to be freed if all of them are in use.
+ */
+
+static char *
+bio_getbuf(
+	struct bio_pool		*bp)
+{
+	char			*buf;
+
+	pthread_mutex_lock(&bp->bp_lock);
+	while (bp->bp_nfree == 0) {
+		pthread_cond_wait(&bp->bp_cv, &bp->bp_lock);
+	}
+	buf = bp->bp_free[--bp->bp_nfree];
+	pthread_mutex_unlock(&bp->bp_lock);
+	return buf;
+}
+
+static void
+bio_putbuf(
+	struct bio_pool		*bp,
+	char			*buf)
+{
+	pthread_mutex_lock(&bp->bp_lock);
+	bp->bp_free[bp->bp_nfree++] = buf;
+	pthread_cond_signal(&bp->bp_cv);
+	pthread_mutex_unlock(&bp->bp_lock);
+}
+
+/*
+ * Read through the O_DIRECT descriptor. Aligned pieces are
+ * read straight into 'buf', everything else is read into a
+ * pool buffer covering the enclosing aligned range.
+ * Returns zero or error number.
+ */
+
+static int
+bio_dio_read(
+	struct fsmem	*fsm,
+	char		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	fs_u64_t	start, end;
+	fs_u32_t	n, skip;
+	ssize_t		ret;
+	char		*pb;
+
+	while (len > 0) {
+		if (DIO_ALIGNED(fsm, buf) && DIO_ALIGNED(fsm, off) &&
+		    len >= fsm->fsm_dioalign) {
+			n = (fs_u32_t)DIO_ROUNDDOWN(fsm, len);
+			if (pread(fsm->fsm_dfd, buf, n, off) != (ssize_t)n) {
+				return errno ? errno : EIO;
+			}
+		} else {
+			start = DIO_ROUNDDOWN(fsm, off);
+			skip = (fs_u32_t)(off - start);
+			n = MIN(len, BIO_POOLBUFSZ - skip);
+			end = DIO_ROUNDUP(fsm, off + n);
+			pb = bio_getbuf(fsm->fsm_biopool);
+			ret = pread(fsm->fsm_dfd, pb, end - start, start);
+
+			/*
+			 * The aligned range may go past the end of
+			 * the device file, so only the part asked
+			 * for has to be read in full.
+			 */
+
+			if (ret < (ssize_t)(skip + n)) {
+				bio_putbuf(fsm->fsm_biopool, pb);
+				return (ret < 0 && errno) ? errno : EIO;
+			}
+			memcpy(buf, pb + skip, n);
+			bio_putbuf(fsm->fsm_biopool, pb);
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Write through the O_DIRECT descriptor. The unaligned head
+ * and tail of the range go through the page cache.
+ * Returns zero or error number.
+ */
+
+static int
+bio_dio_write(
+	struct fsmem	*fsm,
+	char		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	fs_u32_t	n;
+	char		*pb;
+	int		error = 0;
+
+	if (!DIO_ALIGNED(fsm, off)) {
+		n = (fs_u32_t)MIN(len, DIO_ROUNDUP(fsm, off) - off);
+		if (pwrite(fsm->fsm_devfd, buf, n, off) != (ssize_t)n) {
+			return errno ? errno : EIO;
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	while (len >= fsm->fsm_dioalign) {
+		n = (fs_u32_t)DIO_ROUNDDOWN(fsm, len);
+		if (DIO_ALIGNED(fsm, buf)) {
+			if (pwrite(fsm->fsm_dfd, buf, n, off) != (ssize_t)n) {
+				return errno ? errno : EIO;
+			}
+		} else {
+			n = MIN(n, BIO_POOLBUFSZ);
+			pb = bio_getbuf(fsm->fsm_biopool);
+			memcpy(pb, buf, n);
+			if (pwrite(fsm->fsm_dfd, pb, n, off) != (ssize_t)n) {
+				error = errno ? errno : EIO;
+			}
+			bio_putbuf(fsm->fsm_biopool, pb);
+			if (error) {
+				return error;
+			}
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	if (len > 0 &&
+	    pwrite(fsm->fsm_devfd, buf, len, off) != (ssize_t)len) {
+		return errno ? errno : EIO;
+	}
+	return 0;
+}
+
+/*
+ * Map the whole device file.
+ * Returns zero or error number.
+ */
+
+static int
+bio_map(
+	struct fsmem	*fsm)
+{
+	struct stat	st;
+	char		*map;
+
+	if (fstat(fsm->fsm_devfd, &st) != 0) {
+		return errno;
+	}
+	if (st.st_size == 0) {
+		return EIO;
+	}
+	map = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fsm->fsm_devfd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %s\n", fsm->fsm_devf,
+			strerror(errno));
+		return errno;
+	}
+	fsm->fsm_map = map;
+	fsm->fsm_mapsz = st.st_size;
+	return 0;
+}
+
+/*
+ * Copy to/from the mapping of the device file.
+ * Returns zero or error number.
+ */
+
+static int
+bio_mmap_rw(
+	struct fsmem	*fsm,
+	int		rw,
+	char		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	if (off + len > fsm->fsm_mapsz) {
+		return EIO;
+	}
+	if (rw == BIO_READ) {
+		memcpy(buf, fsm->fsm_map + off, len);
+	} else {
+		memcpy(fsm->fsm_map + off, buf, len);
+	}
+	return 0;
+}
+
+/*
+ * Read 'len' bytes at offset 'off' of the device file as it
+ * is, without the blocks the journal has in core.
+ * Returns zero or error number.
+ */
+
+int
+bio_dev_read(
+	struct fsmem	*fsm,
+	void		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	if (fsm->fsm_mntflags & FSMNT_MMAP) {
+		return bio_mmap_rw(fsm, BIO_READ, (char *)buf, len, off);
+	}
+	if (fsm->fsm_mntflags & FSMNT_DIRECT) {
+		return bio_dio_read(fsm, (char *)buf, len, off);
+	}
+	if (pread(fsm->fsm_devfd, buf, len, off) != (ssize_t)len) {
+		return errno ? errno : EIO;
+	}
+	return 0;
+}
+
+/*
+ * Write 'len' bytes at offset 'off' of the device file in
+ * place, whether the journal has the blocks in core or not.
+ * Returns zero or error number.
+ */
+
+int
+bio_dev_write(
+	struct fsmem	*fsm,
+	void		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	__atomic_store_n(&fsm->fsm_unsynced, 1, __ATOMIC_RELEASE);
+	if (fsm->fsm_mntflags & FSMNT_MMAP) {
+		return bio_mmap_rw(fsm, BIO_WRITE, (char *)buf, len, off);
+	}
+	if (fsm->fsm_mntflags & FSMNT_DIRECT) {
+		return bio_dio_write(fsm, (char *)buf, len, off);
+	}
+	if (pwrite(fsm->fsm_devfd, buf, len, off) != (ssize_t)len) {
+		return errno ? errno : EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read 'len' bytes at offset 'off' of the device file.
+ * Returns zero or error number.
+ */
+
+int
+bio_read(
+	struct fsmem	*fsm,
+	void		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	if (jnl_busy(fsm, off, len)) {
+		return jnl_read(fsm, buf, len, off);
+	}
+	return bio_dev_read(fsm, buf, len, off);
+}
+
+/*
+ * Write 'len' bytes at offset 'off' of the device file.
+ * Returns zero or error number.
+ */
+
+int
+bio_write(
+	struct fsmem	*fsm,
+	void		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	if (jnl_busy(fsm, off, len)) {
+		return jnl_write(fsm, buf, len, off);
+	}
+	return bio_dev_write(fsm, buf, len, off);
+}
+
+/*
+ * Fallback for batches: do device-contiguous runs of
+ * segments with one preadv/pwritev each.
+ */
+
+static int
+bio_submit_vec(
+	int		fd,
+	int		rw,
+	struct bio_vec	*bv,
+	int		n)
+{
+	struct iovec	iov[BIO_MAXIOV];
+	fs_u64_t	off;
+	ssize_t		total, ret;
+	int		i = 0, j, cnt;
+
+	while (i < n) {
+		off = bv[i].bv_off;
+		total = 0;
+		for (cnt = 0, j = i; j < n && cnt < BIO_MAXIOV; j++, cnt++) {
+			if (bv[j].bv_off != off + total) {
+				break;
+			}
+			iov[cnt].iov_base = bv[j].bv_buf;
+			iov[cnt].iov_len = bv[j].bv_len;
+			total += bv[j].bv_len;
+		}
+		if (rw == BIO_READ) {
+			ret = preadv(fd, iov, cnt, off);
+		} else {
+			ret = pwritev(fd, iov, cnt, off);
+		}
+		if (ret != total) {
+			return errno ? errno : EIO;
+		}
+		i = j;
+	}
+	return 0;
+}
+
+/*
+ * Do a batch of 'n' segments on 'fd'.
+ * Returns zero or error number.
+ */
+
+static int
+bio_batch(
+	int		fd,
+	int		rw,
+	struct bio_vec	*bv,
+	int		n)
+{
+#ifdef BIO_URING
+	struct uring	*ur;
+	int		i, cnt, error;
+
+	/*
+	 * The ring is looked up for every piece, since
+	 * uring_submit() drops it if it breaks.
+	 */
+
+	for (i = 0; i < n; i += cnt) {
+		if ((ur = uring_get()) == NULL) {
+			return bio_submit_vec(fd, rw, bv + i, n - i);
+		}
+		cnt = MIN(n - i, URING_ENTRIES);
+		if ((error = uring_submit(ur, fd, rw, bv + i, cnt)) != 0) {
+			return error;
+		}
+	}
+	return 0;
+#else
+	return bio_submit_vec(fd, rw, bv, n);
+#endif
+}
+
+/*
+ * Do a batch of 'n' segments.
+ * With FSMNT_MMAP, the segments are just copied one by one.
+ * With FSMNT_DIRECT, the segments which are entirely aligned
+ * are batched on the O_DIRECT descriptor and the others are
+ * done one by one with bio_read()/bio_write().
+ * Returns zero or error number.
+ */
+
+int
+bio_submit(
+	struct fsmem	*fsm,
+	int		rw,
+	struct bio_vec	*bv,
+	int		n)
+{
+	int		i, error = 0;
+
+	/*
+	 * Segments with blocks the journal has in core are done
+	 * through it, so the batch is done one segment at a time.
+	 */
+
+	for (i = 0; fsm->fsm_jnl && i < n; i++) {
+		if (jnl_busy(fsm, bv[i].bv_off, bv[i].bv_len)) {
+			break;
+		}
+	}
+	if (fsm->fsm_jnl && i < n) {
+		for (i = 0; i < n && error == 0; i++) {
+			error = (rw == BIO_READ) ?
+				bio_read(fsm, bv[i].bv_buf, bv[i].bv_len,
+					 bv[i].bv_off) :
+				bio_write(fsm, bv[i].bv_buf, bv[i].bv_len,
+					  bv[i].bv_off);
+		}
+		return error;
+	}
+	return bio_dev_submit(fsm, rw, bv, n);
+}
+
+/*
+ * Do a batch of 'n' segments to the device file as it is,
+ * like bio_dev_read()/bio_dev_write() do single segments.
+ * Returns zero or error number.
+ */
+
+int
+bio_dev_submit(
+	struct fsmem	*fsm,
+	int		rw,
+	struct bio_vec	*bv,
+	int		n)
+{
+	struct bio_vec	dv[BIO_MAXIOV];
+	int		i, cnt = 0, error = 0;
+
+	if (rw == BIO_WRITE) {
+		__atomic_store_n(&fsm->fsm_unsynced, 1, __ATOMIC_RELEASE);
+	}
+	if (fsm->fsm_mntflags & FSMNT_MMAP) {
+		for (i = 0; i < n && error == 0; i++) {
+			error = bio_mmap_rw(fsm, rw, bv[i].bv_buf,
+					    bv[i].bv_len, bv[i].bv_off);
+		}
+		return error;
+	}
+	if (n == 1) {
+		return (rw == BIO_READ) ?
+			bio_dev_read(fsm, bv->bv_buf, bv->bv_len, bv->bv_off) :
+			bio_dev_write(fsm, bv->bv_buf, bv->bv_len, bv->bv_off);
+	}
+	if (!(fsm->fsm_mntflags & FSMNT_DIRECT)) {
+		return bio_batch(fsm->fsm_devfd, rw, bv, n);
+	}
+	for (i = 0; i < n && error == 0; i++) {
+		if (DIO_ALIGNED(fsm, bv[i].bv_buf) &&
+		    DIO_ALIGNED(fsm, bv[i].bv_off) &&
+		    DIO_ALIGNED(fsm, bv[i].bv_len)) {
+			dv[cnt++] = bv[i];
+			if (cnt == BIO_MAXIOV) {
+				error = bio_batch(fsm->fsm_dfd, rw, dv, cnt);
+				cnt = 0;
+			}
+		} else if (rw == BIO_READ) {
+			error = bio_dio_read(fsm, bv[i].bv_buf, bv[i].bv_len,
+					     bv[i].bv_off);
+		} else {
+			error = bio_dio_write(fsm, bv[i].bv_buf, bv[i].bv_len,
+					      bv[i].bv_off);
+		}
+	}
+	if (error == 0 && cnt > 0) {
+		error = bio_batch(fsm->fsm_dfd, rw, dv, cnt);
+	}
+	return error;
+}
+
+/*
+ * Set up the I/O path of a file system being mounted
+ * with 'flags'. For FSMNT_MMAP, map the device file. For
+ * FSMNT_DIRECT, open the device file with O_DIRECT, find the
+ * alignment it needs and allocate the buffer pool.
+ * Returns zero or error number.
+ */
+
+int
+bio_init(
+	struct fsmem	*fsm,
+	unsigned int	flags)
+{
+	struct statx	stx;
+	struct bio_pool	*bp;
+	fs_u32_t	align;
+	int		i, error;
+
+	fsm->fsm_dfd = -1;
+	if ((flags & FSMNT_MMAP) && (flags & FSMNT_DIRECT)) {
+		fprintf(stderr, "Direct I/O and mmap modes can't be used"
+			" together\n");
+		return EINVAL;
+	}
+	if (flags & FSMNT_MMAP) {
+		if ((error = bio_map(fsm)) != 0) {
+			return error;
+		}
+		fsm->fsm_mntflags |= (flags & (FSMNT_MMAP | FSMNT_POPULATE));
+		return 0;
+	}
+	if (!(flags & FSMNT_DIRECT)) {
+		return 0;
+	}
+
+	/*
+	 * The alignment is at least a page, so the unaligned
+	 * head or tail of a write, which goes through the page
+	 * cache, never shares a cached page with a concurrent
+	 * O_DIRECT write of another block.
+	 */
+
+	align = (fs_u32_t)sysconf(_SC_PAGESIZE);
+	if (syscall(__NR_statx, AT_FDCWD, fsm->fsm_devf, 0,
+		    STATX_DIOALIGN, &stx) == 0 &&
+	    (stx.stx_mask & STATX_DIOALIGN)) {
+		if (stx.stx_dio_offset_align == 0) {
+			fprintf(stderr, "%s doesn't support direct I/O\n",
+				fsm->fsm_devf);
+			return EINVAL;
+		}
+		align = MAX(align, stx.stx_dio_offset_align);
+		align = MAX(align, stx.stx_dio_mem_align);
+	}
+	assert((align & (align - 1)) == 0);
+	if ((fsm->fsm_dfd = open(fsm->fsm_devf, O_RDWR | O_DIRECT)) < 0) {
+		error = errno;
+		fprintf(stderr, "Failed to open %s for direct I/O: %s\n",
+			fsm->fsm_devf, strerror(error));
+		return error;
+	}
+	bp = (struct bio_pool *)malloc(sizeof(struct bio_pool));
+	if (!bp || posix_memalign((void **)&bp->bp_mem, align,
+				  BIO_POOLBUFS * BIO_POOLBUFSZ) != 0) {
+		fprintf(stderr, "Failed to allocate direct I/O buffers for"
+			" %s\n", fsm->fsm_devf);
+		free(bp);
+		close(fsm->fsm_dfd);
+		fsm->fsm_dfd = -1;
+		return ENOMEM;
+	}
+	pthread_mutex_init(&bp->bp_lock, NULL);
+	pthread_cond_init(&bp->bp_cv, NULL);
+	for (i = 0; i < BIO_POOLBUFS; i++) {
+		bp->bp_free[i] = bp->bp_mem + i * BIO_POOLBUFSZ;
+	}
+	bp->bp_nfree = BIO_POOLBUFS;
+	fsm->fsm_biopool = bp;
+	fsm->fsm_dioalign = align;
+	fsm->fsm_mntflags |= FSMNT_DIRECT;
+	return 0;
+}
+
+/*
+ * Undo bio_init().
+ */
+
+void
+bio_fini(
+	struct fsmem	*fsm)
+{
+	struct bio_pool	*bp = fsm->fsm_biopool;
+
+	if (fsm->fsm_map) {
+		munmap(fsm->fsm_map, fsm->fsm_mapsz);
+		fsm->fsm_map = NULL;
+		fsm->fsm_mapsz = 0;
+	}
+
+	if (bp) {
+		free(bp->bp_mem);
+		free(bp);
+		fsm->fsm_biopool = NULL;
+	}
+	if (fsm->fsm_dfd >= 0) {
+		close(fsm->fsm_dfd);
+		fsm->fsm_dfd = -1;
+	}
+	fsm->fsm_mntflags &= ~(FSMNT_DIRECT | FSMNT_MMAP | FSMNT_POPULATE);
+}
+
+/*
+ * Make everything written so far stable on disk.
+ * Returns zero or error number.
+ */
+
+int
+bio_sync(
+	struct fsmem	*fsm)
+{
+	int		error = 0;
+
+	/*
+	 * Writes done from now on need another sync.
+	 */
+
+	__atomic_store_n(&fsm->fsm_unsynced, 0, __ATOMIC_SEQ_CST);
+	if (fsm->fsm_mntflags & FSMNT_MMAP) {
+		if (msync(fsm->fsm_map, fsm->fsm_mapsz, MS_SYNC) != 0) {
+			error = errno;
+		}
+	} else if (fdatasync(fsm->fsm_devfd) != 0) {
+		error = errno;
+	}
+	if (error) {
+		__atomic_store_n(&fsm->fsm_unsynced, 1, __ATOMIC_RELEASE);
+	}
+	return error;
+}
+
+/*
+ * Sync the device file if anything was written in place since
+ * the last sync.
+ * Returns zero or error number.
+ */
+
+int
+bio_sync_unsynced(
+	struct fsmem	*fsm)
+{
+	if (!__atomic_load_n(&fsm->fsm_unsynced, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	return bio_sync(fsm);
+}
+
+/*
+ * With FSMNT_POPULATE, fault in the pages mapping
+ * [off, off + len) of the device file, so that later
+ * accesses to them don't take a page fault.
+ */
+
+void
+bio_populate(
+	struct fsmem	*fsm,
+	fs_u64_t	off,
+	fs_u64_t	len)
+{
+	fs_u64_t	pgmask = (fs_u64_t)sysconf(_SC_PAGESIZE) - 1;
+	fs_u64_t	start, end;
+
+	if (!(fsm->fsm_mntflags & FSMNT_POPULATE) || len == 0) {
+		return;
+	}
+	start = off & ~pgmask;
+	end = MIN((off + len + pgmask) & ~pgmask, fsm->fsm_mapsz);
+	if (start < end &&
+	    madvise(fsm->fsm_map + start, end - start,
+		    MADV_POPULATE_READ) != 0) {
+
+		/*
+		 * Kernels before 5.14 don't have MADV_POPULATE_READ;
+		 * at least start reading the pages in.
+		 */
+
+		(void) madvise(fsm->fsm_map + start, end - start,
+			       MADV_WILLNEED);
+	}
+}
+
+/*
+ * Length of the part of the 'len' bytes at offset 'off' of the
+ * device file which starts there and has no block the journal
+ * has in core.
+ */
+
+static fs_u64_t
+bio_cleanlen(
+	struct fsmem	*fsm,
+	fs_u64_t	off,
+	fs_u64_t	len)
+{
+	fs_u64_t	n = 0, step;
+
+	if (!jnl_busy(fsm, off, len)) {
+		return len;
+	}
+	while (n < len) {
+		step = MIN(len - n, ONE_K - ((off + n) & (ONE_K - 1)));
+		if (jnl_busy(fsm, off + n, step)) {
+			break;
+		}
+		n += step;
+	}
+	return n;
+}
+
+/*
+ * Copy 'len' bytes at offset 'off' of the device file to
+ * 'outfd' at its current file offset, inside the kernel.
+ * copy_file_range() is tried first (it can share or offload
+ * the copy when both files are on the same file system); if
+ * 'outfd' doesn't support it (e.g. a socket or pipe), the
+ * copy is done with sendfile(). The blocks the journal has in
+ * core are read and written through a buffer, one at a time.
+ * Returns zero or error number; '*donep' is the number of
+ * bytes copied.
+ */
+
+int
+bio_copyout(
+	struct fsmem	*fsm,
+	fs_u64_t	off,
+	fs_u64_t	len,
+	int		outfd,
+	fs_u64_t	*donep)
+{
+	char		buf[ONE_K];
+	fs_u64_t	run;
+	off_t		inoff;
+	ssize_t		ret;
+	int		usecfr = 1, error;
+
+	*donep = 0;
+	while (len > 0) {
+		if ((run = bio_cleanlen(fsm, off, len)) == 0) {
+			ret = (ssize_t)MIN(len, ONE_K - (off & (ONE_K - 1)));
+			if ((error = bio_read(fsm, buf, (fs_u32_t)ret,
+					      off)) != 0) {
+				return error;
+			}
+			if ((ret = write(outfd, buf, (size_t)ret)) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return errno;
+			}
+			off += ret;
+			len -= ret;
+			*donep += ret;
+			continue;
+		}
+		inoff = (off_t)off;
+		if (usecfr) {
+			ret = syscall(__NR_copy_file_range, fsm->fsm_devfd,
+				      &inoff, outfd, NULL, (size_t)run, 0);
+			if (ret < 0 && (errno == EINVAL || errno == EXDEV ||
+					errno == EBADF || errno == ENOSYS ||
+					errno == EOPNOTSUPP)) {
+				usecfr = 0;
+				continue;
+			}
+		} else {
+			ret = sendfile(outfd, fsm->fsm_devfd, &inoff,
+				       (size_t)MIN(run, 1 << 30));
+		}
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		if (ret == 0) {
+			return EIO;
+		}
+		off += ret;
+		len -= ret;
+		*donep += ret;
+	}
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef _FS_BIO_H_
+#define _FS_BIO_H_
+
+/*
+ * One segment of a block I/O request: 'bv_len' bytes at
+ * offset 'bv_off' of the device file to/from 'bv_buf'.
+ */
+
+struct bio_vec {
+	char		*bv_buf;
+	fs_u64_t	bv_off;
+	fs_u32_t	bv_len;
+};
+
+#define BIO_READ	0
+#define BIO_WRITE	1
+
+extern int	bio_read(struct fsmem *, void *, fs_u32_t, fs_u64_t);
+extern int	bio_write(struct fsmem *, void *, fs_u32_t, fs_u64_t);
+extern int	bio_dev_read(struct fsmem *, void *, fs_u32_t, fs_u64_t);
+extern int	bio_dev_write(struct fsmem *, void *, fs_u32_t, fs_u64_t);
+extern int	bio_submit(struct fsmem *, int, struct bio_vec *, int);
+extern int	bio_dev_submit(struct fsmem *, int, struct bio_vec *, int);
+extern int	bio_init(struct fsmem *, unsigned int);
+extern void	bio_fini(struct fsmem *);
+extern int	bio_sync(struct fsmem *);
+extern int	bio_sync_unsynced(struct fsmem *);
+extern void	bio_populate(struct fsmem *, fs_u64_t, fs_u64_t);
+extern int	bio_copyout(struct fsmem *, fs_u64_t, fs_u64_t, int, fs_u64_t *);
+
+#endif /*_FS_BIO_H_*/
@@ -3,6 +3,10 @@
 #include "fs.h"
 #include "inode.h"
 #include "allocate.h"
+#include "bio.h"
+#include "journal.h"
+#include "refcount.h"
+#include "fs_include.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -11,10 +15,25 @@
 
 static int	bmap_direct(struct minode *, fs_u64_t *, fs_u64_t *,
 			    fs_u64_t *, fs_u64_t);
-static int	bmap_indirect(int, struct minode *, fs_u64_t *, fs_u64_t *,
+static int	bmap_indirect(struct minode *, fs_u64_t *, fs_u64_t *,
 			      fs_u64_t *, fs_u64_t);
-static int	bmap_2indirect(int, struct minode *, fs_u64_t *, fs_u64_t *,
+static int	bmap_2indirect(struct minode *, fs_u64_t *, fs_u64_t *,
 			       fs_u64_t *, fs_u64_t);
+static int	bmap_walk_direct(struct direct *, int, int *, fs_u64_t *,
+				 int (*)(void *, fs_u64_t, fs_u64_t, fs_u64_t),
+				 void *);
+
+/*
+ * State carried across bmap_walk() callbacks by bmap_extents().
+ */
+
+struct extent_walk {
+	struct file_extent	*ew_extp;
+	fs_u64_t		ew_start;
+	fs_u64_t		ew_end;
+	int			ew_max;
+	int			ew_nfilled;
+};
 
 static int
 bmap_direct(
@@ -27,12 +46,10 @@ bmap_direct(
         int             i;
         fs_u64_t        total = 0, blkno, len;
 
-	printf("Entered bmap_direct\n");
 	assert(mp != NULL);
         for (i = 0; i < MAX_DIRECT; i++) {
                 blkno = mp->mino_orgarea.dir[i].blkno;
                 len = mp->mino_orgarea.dir[i].len;
-		printf("bmap_direct: blkno %llu, len: %llu\n", blkno, len);
                 if ((len == 0) || (total + (len << LOG_ONE_K)) > offset) {
                         break;
                 }
@@ -50,7 +67,6 @@ bmap_direct(
 
 static int
 bmap_indirect(
-        int             fd,
         struct minode   *mp,
         fs_u64_t        *blknop,
         fs_u64_t        *lenp,
@@ -70,9 +86,8 @@ bmap_indirect(
 
         for (i = 0; i < MAX_INDIRECT; i++) {
                 blkno = mp->mino_orgarea.indir[i].ind_blkno;
-                lseek(fd, blkno << LOG_ONE_K, SEEK_SET);
-                if (read(fd, buf, INDIR_BLKSZ) != INDIR_BLKSZ) {
-                        error = errno;
+                if ((error = bio_read(mp->mino_fsm, buf, INDIR_BLKSZ,
+				      blkno << LOG_ONE_K)) != 0) {
                         goto out;
                 }
                 dir = (struct direct *)buf;
@@ -109,7 +124,6 @@ out:
 
 static int
 bmap_2indirect(
-        int             fd,
         struct minode   *mp,
         fs_u64_t        *blknop,
         fs_u64_t        *lenp,
@@ -139,17 +153,16 @@ bmap_2indirect(
         ndirs = INDIR_BLKSZ/(sizeof(struct direct));
         for (i = 0; i < MAX_INDIRECT; i++) {
                 blkno = mp->mino_orgarea.indir[i].ind_blkno;
-                lseek(fd, (blkno * ONE_K), SEEK_SET);
-                if (read(fd, indirbuf, INDIR_BLKSZ) != INDIR_BLKSZ) {
-                        error = errno;
+                if ((error = bio_read(mp->mino_fsm, indirbuf, INDIR_BLKSZ,
+				      (blkno * ONE_K))) != 0) {
                         goto out;
                 }
                 indir = (fs_u64_t *)indirbuf;
                 for (j = 0; j < nindirs; j++) {
                         blkno = indir[j];
-                        lseek(fd, (blkno * ONE_K), SEEK_SET);
-                        if (read(fd, dirbuf, INDIR_BLKSZ) != INDIR_BLKSZ) {
-                                error = errno;
+                        if ((error = bio_read(mp->mino_fsm, dirbuf,
+					      INDIR_BLKSZ,
+					      (blkno * ONE_K))) != 0) {
                                 goto out;
                         }
                         dir = (struct direct *)dirbuf;
@@ -184,6 +197,44 @@ out:
         return error;
 }
 
+/*
+ * Allocate a contiguous extent of INDIR_BLKSZ for an indirect
+ * block. allocate() hands out the first free run even if it's
+ * short, so short runs are held while looking further and given
+ * back once a whole extent is found, or on failure.
+ * Returns zero or error number.
+ */
+
+#define INDIR_TRIES	32
+
+static int
+bmap_alloc_indir(
+	struct fsmem	*fsm,
+	fs_u64_t	*blkp)
+{
+	struct direct	runs[INDIR_TRIES];
+	fs_u64_t	blk, ln;
+	fs_u32_t	extsz = INDIR_BLKSZ >> LOG_ONE_K;
+	int		i, n, error = ENOSPC;
+
+	for (n = 0; n < INDIR_TRIES; n++) {
+		if ((error = allocate(fsm, extsz, &blk, &ln)) != 0) {
+			break;
+		}
+		if (ln == extsz) {
+			*blkp = blk;
+			break;
+		}
+		runs[n].blkno = blk;
+		runs[n].len = ln;
+		error = ENOSPC;
+	}
+	for (i = 0; i < n; i++) {
+		deallocate(fsm, runs[i].blkno, runs[i].len);
+	}
+	return error;
+}
+
 /*
  * Convert direct orgtype to indirect and add
  * the extent entry to hte inode.
@@ -197,17 +248,17 @@ bmap_direct_to_indirect(
 	fs_u64_t	len)
 {
 	struct direct	*dir = NULL;
-	fs_u64_t	off, blk, ln;
-	fs_u32_t	extsz = INDIR_BLKSZ >> LOG_ONE_K;
+	fs_u64_t	off, blk;
 	int		error = 0, i;
 
-	if ((error = allocate(fsm, extsz , &blk, &ln)) != 0 || ln < extsz) {
+	if ((error = bmap_alloc_indir(fsm, &blk)) != 0) {
 		return error;
 	}
 	dir = (struct direct *)malloc(INDIR_BLKSZ);
 	if (!dir) {
 		fprintf(stderr, "bmap_direct_to_indirect: failed to allocate "
 			"memory for indirect extent for %s\n", fsm->fsm_mntpt);
+		deallocate(fsm, blk, INDIR_BLKSZ >> LOG_ONE_K);
 		return ENOMEM;
 	}
 	memset((void *)dir, 0, INDIR_BLKSZ);
@@ -233,13 +284,12 @@ bmap_direct_to_indirect(
 	bzero(&mino->mino_orgarea, sizeof(union org));
 	mino->mino_orgarea.indir[0].ind_blkno = blk;
 	mino->mino_orgtype = ORG_INDIRECT;
+	mino->mino_mapgen++;
 
 	off = blk << LOG_ONE_K;
-	lseek(fsm->fsm_devfd, off, SEEK_SET);
-	if (write(fsm->fsm_devfd, dir, INDIR_BLKSZ) != INDIR_BLKSZ) {
+	if ((error = jnl_write(fsm, (char *)dir, INDIR_BLKSZ, off)) != 0) {
 		fprintf(stderr, "bmap_direct_to_indirect: failed to write "
 			"indirect block extent for %s\n", fsm->fsm_mntpt);
-		error = errno;
 	}
 	free(dir);
 	return error;
@@ -266,7 +316,14 @@ bmap_direct_alloc(
 			break;
 		}
 	}
-	if (i != MAX_DIRECT) {
+	if (i != 0 && ino->mino_orgarea.dir[i - 1].blkno +
+		      ino->mino_orgarea.dir[i - 1].len == blkno) {
+		/*
+		 * The new extent starts right where the last one
+		 * ends; just extend the last extent.
+		 */
+		ino->mino_orgarea.dir[i - 1].len += len;
+	} else if (i != MAX_DIRECT) {
 		printf("Adding %llu blkno and %llu len to inode\n",
 			blkno, len);
 		/*
@@ -285,9 +342,79 @@ bmap_direct_alloc(
 	return error;
 }
 
+/*
+ * Add an extent entry to the last indirect block of an
+ * inode with indirect orgtype. If the last indirect block
+ * is full, allocate a new one.
+ */
+
+static int
+bmap_indirect_alloc(
+	struct fsmem	*fsm,
+	struct minode	*ino,
+	fs_u64_t	blkno,
+	fs_u64_t	len)
+{
+	struct direct	*dir = NULL;
+	fs_u64_t	blk;
+	int		i, j, ndirs, error = 0;
+
+	for (i = 0; i < MAX_INDIRECT; i++) {
+		if (ino->mino_orgarea.indir[i].ind_blkno == 0) {
+			break;
+		}
+	}
+	assert(i > 0);
+	i--;
+	dir = (struct direct *)malloc(INDIR_BLKSZ);
+	if (!dir) {
+		fprintf(stderr, "bmap_indirect_alloc: failed to allocate "
+			"memory for indirect extent for %s\n", fsm->fsm_mntpt);
+		return ENOMEM;
+	}
+	if ((error = bio_read(fsm, (char *)dir, INDIR_BLKSZ,
+			      ino->mino_orgarea.indir[i].ind_blkno <<
+			      LOG_ONE_K)) != 0) {
+		goto out;
+	}
+	ndirs = INDIR_BLKSZ/(sizeof(struct direct));
+	for (j = 0; j < ndirs; j++) {
+		if (dir[j].len == 0) {
+			break;
+		}
+	}
+	if (j != 0 && dir[j - 1].blkno + dir[j - 1].len == blkno) {
+		dir[j - 1].len += len;
+	} else if (j != ndirs) {
+		dir[j].blkno = blkno;
+		dir[j].len = len;
+	} else {
+		if (i + 1 == MAX_INDIRECT) {
+			error = EFBIG;
+			goto out;
+		}
+		if ((error = bmap_alloc_indir(fsm, &blk)) != 0) {
+			goto out;
+		}
+		memset(dir, 0, INDIR_BLKSZ);
+		dir[0].blkno = blkno;
+		dir[0].len = len;
+		ino->mino_orgarea.indir[++i].ind_blkno = blk;
+	}
+	if ((error = jnl_write(fsm, (char *)dir, INDIR_BLKSZ,
+			       ino->mino_orgarea.indir[i].ind_blkno <<
+			       LOG_ONE_K)) != 0) {
+		fprintf(stderr, "bmap_indirect_alloc: failed to write "
+			"indirect block extent for %s\n", fsm->fsm_mntpt);
+	}
+
+out:
+	free(dir);
+	return error;
+}
+
 int
 bmap(
-	int		fd,
 	struct minode	*mp,
         fs_u64_t        *blknop,
         fs_u64_t        *lenp,
@@ -303,10 +430,10 @@ bmap(
                 error = bmap_direct(mp, blknop, lenp,
                                     offp, offset);
         } else if (mp->mino_orgtype == ORG_INDIRECT) {
-                error = bmap_indirect(fd, mp, blknop, lenp,
+                error = bmap_indirect(mp, blknop, lenp,
                                       offp, offset);
         } else {
-                error = bmap_2indirect(fd, mp, blknop, lenp,
+                error = bmap_2indirect(mp, blknop, lenp,
                                        offp, offset);
         }
 
@@ -328,7 +455,6 @@ bmap_alloc(
 {
 	int		error;
 
-	printf("Entered Writing inode \n");
 	assert(ino->mino_orgtype == ORG_DIRECT ||
 	       ino->mino_orgtype == ORG_INDIRECT ||
 	       ino->mino_orgtype == ORG_2INDIRECT);
@@ -338,12 +464,23 @@ bmap_alloc(
 	}
 	if (ino->mino_orgtype == ORG_DIRECT) {
 		error = bmap_direct_alloc(fsm, ino, *blknop, *lenp);
-	}/*
 	} else if (ino->mino_orgtype == ORG_INDIRECT) {
-		error = bmap_indirect_alloc(fsm, ino, *blknop, len);
+		error = bmap_indirect_alloc(fsm, ino, *blknop, *lenp);
 	} else {
-		error = bmap_2indirect_alloc(fsm, ino, *blknop, len);
-	}*/
+
+		/*
+		 * No inode is ever converted to ORG_2INDIRECT:
+		 * the block map of a file is limited to
+		 * MAX_INDIRECT indirect blocks of extents, beyond
+		 * which bmap_indirect_alloc() fails with EFBIG.
+		 */
+
+		error = EFBIG;
+	}
+	if (error) {
+		deallocate(fsm, *blknop, *lenp);
+		return error;
+	}
 
 	/*
 	 * In case of allocation success, increase the 'nblocks'
@@ -357,3 +494,459 @@ bmap_alloc(
 
 	return error;
 }
+
+/*
+ * Call 'func' for every extent in the array of direct
+ * extent descriptors from extent '*posp' on, in logical
+ * order. '*totalp' is the logical offset of extent '*posp'.
+ * Both are advanced past every extent visited, so that
+ * they're left at the extent the walk stopped at.
+ * Returns 1 if the walk is over (either the end of the
+ * block map was reached or 'func' asked to stop).
+ */
+
+static int
+bmap_walk_direct(
+	struct direct	*dir,
+	int		ndirs,
+	int		*posp,
+	fs_u64_t	*totalp,
+	int		(*func)(void *, fs_u64_t, fs_u64_t, fs_u64_t),
+	void		*arg)
+{
+	int		i;
+
+	for (i = *posp; i < ndirs; i++, *posp = i) {
+		if (dir[i].len == 0) {
+			return 1;
+		}
+		if (func(arg, *totalp, dir[i].blkno, dir[i].len)) {
+			return 1;
+		}
+		*totalp += dir[i].len << LOG_ONE_K;
+	}
+	return 0;
+}
+
+/*
+ * Walk the block map of an inode from the position of 'bc'
+ * (from the start if NULL), calling 'func' with (arg, logical
+ * offset, blkno, len in blocks) for every extent. The walk
+ * stops as soon as 'func' returns non-zero, and 'bc' is left
+ * at the extent it stopped at. The caller checks that 'bc'
+ * is valid.
+ */
+
+static int
+bmap_walk_from(
+	struct minode		*mp,
+	struct bmap_cursor	*bc,
+	int			(*func)(void *, fs_u64_t, fs_u64_t,
+					fs_u64_t),
+	void			*arg)
+{
+	fs_u64_t		total = 0, *indir;
+	char			*indirbuf = NULL, *dirbuf = NULL;
+	int			i = 0, j, pos = 0, nindirs, ndirs, error = 0;
+
+	assert(mp->mino_orgtype == ORG_DIRECT ||
+	       mp->mino_orgtype == ORG_INDIRECT ||
+	       mp->mino_orgtype == ORG_2INDIRECT);
+
+	/*
+	 * Positions in a second level indirect map aren't kept;
+	 * it's always walked from the start.
+	 */
+
+	if (bc && mp->mino_orgtype != ORG_2INDIRECT) {
+		i = bc->bc_ind;
+		pos = bc->bc_ent;
+		total = bc->bc_logical;
+	}
+	if (mp->mino_orgtype == ORG_DIRECT) {
+		bmap_walk_direct(mp->mino_orgarea.dir, MAX_DIRECT, &pos,
+				 &total, func, arg);
+		goto out;
+	}
+	dirbuf = (char *)malloc(INDIR_BLKSZ);
+	if (!dirbuf) {
+		return ENOMEM;
+	}
+	if (mp->mino_orgtype == ORG_2INDIRECT) {
+		indirbuf = (char *)malloc(INDIR_BLKSZ);
+		if (!indirbuf) {
+			free(dirbuf);
+			return ENOMEM;
+		}
+	}
+	nindirs = INDIR_BLKSZ/(sizeof(fs_u64_t));
+	ndirs = INDIR_BLKSZ/(sizeof(struct direct));
+	for (; i < MAX_INDIRECT; i++, pos = 0) {
+		if (mp->mino_orgarea.indir[i].ind_blkno == 0) {
+			break;
+		}
+		if (mp->mino_orgtype == ORG_INDIRECT) {
+			if ((error = bio_read(mp->mino_fsm, dirbuf,
+					      INDIR_BLKSZ,
+					      mp->mino_orgarea.indir[i].ind_blkno
+					      << LOG_ONE_K)) != 0) {
+				goto out;
+			}
+			if (bmap_walk_direct((struct direct *)dirbuf, ndirs,
+					     &pos, &total, func, arg)) {
+				goto out;
+			}
+			continue;
+		}
+		if ((error = bio_read(mp->mino_fsm, indirbuf, INDIR_BLKSZ,
+				      mp->mino_orgarea.indir[i].ind_blkno <<
+				      LOG_ONE_K)) != 0) {
+			goto out;
+		}
+		indir = (fs_u64_t *)indirbuf;
+		for (j = 0; j < nindirs; j++) {
+			if (indir[j] == 0) {
+				goto out;
+			}
+			if ((error = bio_read(mp->mino_fsm, dirbuf,
+					      INDIR_BLKSZ,
+					      indir[j] << LOG_ONE_K)) != 0) {
+				goto out;
+			}
+			pos = 0;
+			if (bmap_walk_direct((struct direct *)dirbuf, ndirs,
+					     &pos, &total, func, arg)) {
+				goto out;
+			}
+		}
+	}
+
+out:
+	if (bc && error == 0 && mp->mino_orgtype != ORG_2INDIRECT) {
+		bc->bc_ind = i;
+		bc->bc_ent = pos;
+		bc->bc_logical = total;
+	}
+	free(indirbuf);
+	free(dirbuf);
+	return error;
+}
+
+/*
+ * Walk the whole block map of an inode once, calling
+ * 'func' with (arg, logical offset, blkno, len in blocks)
+ * for every extent. The walk stops as soon as 'func'
+ * returns non-zero.
+ * Unlike bmap(), indirect blocks are read only once
+ * for the entire walk.
+ */
+
+int
+bmap_walk(
+	struct minode	*mp,
+	int		(*func)(void *, fs_u64_t, fs_u64_t, fs_u64_t),
+	void		*arg)
+{
+	return bmap_walk_from(mp, NULL, func, arg);
+}
+
+static int
+bmap_extents_cb(
+	void			*arg,
+	fs_u64_t		logical,
+	fs_u64_t		blkno,
+	fs_u64_t		len)
+{
+	struct extent_walk	*ew = (struct extent_walk *)arg;
+	struct file_extent	*ext;
+	fs_u64_t		start, end;
+
+	end = logical + (len << LOG_ONE_K);
+	if (end <= ew->ew_start) {
+		return 0;
+	}
+	if (logical >= ew->ew_end || ew->ew_nfilled == ew->ew_max) {
+		return 1;
+	}
+	start = MAX(logical, ew->ew_start);
+	end = MIN(end, ew->ew_end);
+	ext = &ew->ew_extp[ew->ew_nfilled++];
+	ext->fext_logical = start;
+	ext->fext_physical = (blkno << LOG_ONE_K) + (start - logical);
+	ext->fext_len = end - start;
+	return 0;
+}
+
+/*
+ * Map a range like bmap_extents(), but the walk of the block
+ * map starts at cursor 'bc' (if non-NULL) when it's valid and
+ * not beyond 'offset', and 'bc' is left where the walk
+ * ended, so that mapping successive ranges of a file costs
+ * no more than walking its block map once.
+ */
+
+int
+bmap_extents_at(
+	struct minode		*mp,
+	struct bmap_cursor	*bc,
+	fs_u64_t		offset,
+	fs_u64_t		len,
+	struct file_extent	*extp,
+	int			max,
+	int			*nfilledp)
+{
+	struct extent_walk	ew;
+	int			error;
+
+	*nfilledp = 0;
+	if (len == 0 || max == 0) {
+		return 0;
+	}
+	if (bc && (bc->bc_gen != mp->mino_mapgen ||
+		   bc->bc_logical > offset)) {
+		memset(bc, 0, sizeof(struct bmap_cursor));
+		bc->bc_gen = mp->mino_mapgen;
+	}
+	len = MIN(len, ~0ULL - offset);
+	ew.ew_extp = extp;
+	ew.ew_start = offset;
+	ew.ew_end = offset + len;
+	ew.ew_max = max;
+	ew.ew_nfilled = 0;
+	error = bmap_walk_from(mp, bc, bmap_extents_cb, &ew);
+	*nfilledp = ew.ew_nfilled;
+	return error;
+}
+
+/*
+ * Map the logical range [offset, offset + len) of an
+ * inode to byte ranges inside the device file.
+ * At most 'max' extents are filled in 'extp'; the
+ * number actually filled is returned in '*nfilledp'.
+ * The range isn't clipped to the inode size; the part
+ * of the range beyond the allocated blocks isn't mapped,
+ * so 'len' may be anything up to ~0ULL ("to the end").
+ */
+
+int
+bmap_extents(
+	struct minode		*mp,
+	fs_u64_t		offset,
+	fs_u64_t		len,
+	struct file_extent	*extp,
+	int			max,
+	int			*nfilledp)
+{
+	return bmap_extents_at(mp, NULL, offset, len, extp, max, nfilledp);
+}
+
+/*
+ * State carried across bmap_walk() callbacks by bmap_getmap().
+ */
+
+struct map_walk {
+	struct direct	*mw_ext;
+	int		mw_n;
+	int		mw_max;
+};
+
+static int
+bmap_getmap_cb(
+	void		*arg,
+	fs_u64_t	off,
+	fs_u64_t	blkno,
+	fs_u64_t	len)
+{
+	struct map_walk	*mw = (struct map_walk *)arg;
+	struct direct	*ext;
+
+	(void) off;
+	if (mw->mw_n == mw->mw_max) {
+		ext = (struct direct *)realloc(mw->mw_ext, 2 * mw->mw_max *
+					       sizeof(struct direct));
+		if (!ext) {
+			return 1;
+		}
+		mw->mw_ext = ext;
+		mw->mw_max *= 2;
+	}
+	mw->mw_ext[mw->mw_n].blkno = blkno;
+	mw->mw_ext[mw->mw_n].len = len;
+	mw->mw_n++;
+	return 0;
+}
+
+/*
+ * Get the whole block map of an inode as an array of
+ * extents in logical order, allocated with malloc().
+ * Returns zero or error number.
+ */
+
+int
+bmap_getmap(
+	struct minode	*mp,
+	struct direct	**extp,
+	int		*np)
+{
+	struct map_walk	mw;
+	int		error;
+
+	mw.mw_max = MAX_DIRECT;
+	mw.mw_n = 0;
+	mw.mw_ext = (struct direct *)malloc(mw.mw_max * sizeof(struct direct));
+	if (!mw.mw_ext) {
+		return ENOMEM;
+	}
+	if ((error = bmap_walk(mp, bmap_getmap_cb, &mw)) != 0) {
+		free(mw.mw_ext);
+		return error;
+	}
+	*extp = mw.mw_ext;
+	*np = mw.mw_n;
+	return 0;
+}
+
+/*
+ * Replace the block map of an inode with the 'n' extents of
+ * 'ext' (in logical order), which are merged where they are
+ * contiguous. The map is made direct if it fits in the inode
+ * and indirect otherwise. The new map is built in a scratch
+ * org area, written to newly allocated indirect blocks and
+ * only installed in the inode once all of it is written, so
+ * that on failure the inode keeps its old map and nothing is
+ * leaked. The indirect blocks of the old map are freed then.
+ * The number of blocks and the size of the inode aren't
+ * changed.
+ * The caller must hold the inode lock exclusive.
+ * Returns zero or error number.
+ */
+
+int
+bmap_setmap(
+	struct fsmem	*fsm,
+	struct minode	*mp,
+	struct direct	*ext,
+	int		n)
+{
+	struct direct	*dir = NULL;
+	union org	org;
+	fs_u64_t	oldind[MAX_INDIRECT], blk;
+	fs_u32_t	extsz = INDIR_BLKSZ >> LOG_ONE_K;
+	int		ndirs = INDIR_BLKSZ / sizeof(struct direct);
+	int		i, j, nold = 0, nind, error = 0;
+
+	assert(mp->mino_orgtype == ORG_DIRECT ||
+	       mp->mino_orgtype == ORG_INDIRECT);
+	for (i = 1, j = 0; i < n; i++) {
+		if (ext[j].blkno + ext[j].len == ext[i].blkno) {
+			ext[j].len += ext[i].len;
+		} else {
+			ext[++j] = ext[i];
+		}
+	}
+	n = MIN(n, j + 1);
+	nind = (n <= MAX_DIRECT) ? 0 : (n + ndirs - 1) / ndirs;
+	if (nind > MAX_INDIRECT) {
+		return EFBIG;
+	}
+	memset(&org, 0, sizeof(union org));
+	if (nind == 0) {
+		memcpy(org.dir, ext, n * sizeof(struct direct));
+		goto install;
+	}
+	dir = (struct direct *)malloc(INDIR_BLKSZ);
+	if (!dir) {
+		return ENOMEM;
+	}
+	for (i = 0; i < nind; i++) {
+		if ((error = bmap_alloc_indir(fsm, &blk)) != 0) {
+			break;
+		}
+		org.indir[i].ind_blkno = blk;
+		memset(dir, 0, INDIR_BLKSZ);
+		j = MIN(ndirs, n - i * ndirs);
+		memcpy(dir, ext + i * ndirs, j * sizeof(struct direct));
+		if ((error = jnl_write(fsm, (char *)dir, INDIR_BLKSZ,
+				       blk << LOG_ONE_K)) != 0) {
+			break;
+		}
+	}
+	free(dir);
+	if (error) {
+		fprintf(stderr, "bmap_setmap: Failed to write block map of "
+			"inode %llu for %s\n", mp->mino_number,
+			fsm->fsm_mntpt);
+		for (i = 0; i < nind && org.indir[i].ind_blkno != 0; i++) {
+			deallocate(fsm, org.indir[i].ind_blkno, extsz);
+		}
+		return error;
+	}
+
+install:
+	if (mp->mino_orgtype == ORG_INDIRECT) {
+		for (nold = 0; nold < MAX_INDIRECT &&
+		     mp->mino_orgarea.indir[nold].ind_blkno != 0; nold++) {
+			oldind[nold] = mp->mino_orgarea.indir[nold].ind_blkno;
+		}
+	}
+	mp->mino_orgtype = nind ? ORG_INDIRECT : ORG_DIRECT;
+	mp->mino_orgarea = org;
+	mp->mino_mapgen++;
+	if ((error = iwrite(mp)) != 0) {
+		return error;
+	}
+	for (i = 0; i < nold; i++) {
+		deallocate(fsm, oldind[i], extsz);
+	}
+	return 0;
+}
+
+/*
+ * Give back the blocks of an inode beyond its first 'nblocks':
+ * they're cut off the block map and, unless shared with a
+ * clone, freed.
+ * The caller must hold the inode lock exclusive.
+ * Returns zero or error number.
+ */
+
+int
+bmap_trim(
+	struct fsmem	*fsm,
+	struct minode	*mp,
+	fs_u64_t	nblocks)
+{
+	struct direct	*ext, *tail;
+	fs_u64_t	total = 0, cut;
+	int		i, n, ntail, error;
+
+	if ((error = bmap_getmap(mp, &ext, &n)) != 0) {
+		return error;
+	}
+	for (i = 0; i < n && total + ext[i].len <= nblocks; i++) {
+		total += ext[i].len;
+	}
+	if (i == n) {
+		free(ext);
+		return 0;
+	}
+	ntail = n - i;
+	if ((tail = (struct direct *)malloc(ntail *
+					    sizeof(struct direct))) == NULL) {
+		free(ext);
+		return ENOMEM;
+	}
+	memcpy(tail, ext + i, ntail * sizeof(struct direct));
+	cut = nblocks - total;
+	tail[0].blkno += cut;
+	tail[0].len -= cut;
+	ext[i].len = cut;
+	if ((error = bmap_setmap(fsm, mp, ext, cut ? i + 1 : i)) == 0) {
+		mp->mino_nblocks = nblocks;
+		if ((error = iwrite(mp)) == 0) {
+			error = refcount_release(fsm, tail, ntail);
+		}
+	}
+	free(tail);
+	free(ext);
+	return error;
+}
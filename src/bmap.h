@@ -1,9 +1,25 @@
 #ifndef _FS_EXTERNS_H_
 #define _FS_EXTERNS_H_
 
-extern int	bmap(int, struct minode *, fs_u64_t *, fs_u64_t *,
-		     fs_u64_t *, fs_u64_t);
+struct file_extent;
+struct direct;
+struct bmap_cursor;
+
+extern int	bmap(struct minode *, fs_u64_t *, fs_u64_t *, fs_u64_t *,
+		     fs_u64_t);
 extern int	bmap_alloc(struct fsmem *, struct minode *, fs_u64_t,
 			   fs_u64_t *, fs_u64_t *);
+extern int	bmap_walk(struct minode *,
+			  int (*)(void *, fs_u64_t, fs_u64_t, fs_u64_t),
+			  void *);
+extern int	bmap_extents(struct minode *, fs_u64_t, fs_u64_t,
+			     struct file_extent *, int, int *);
+extern int	bmap_extents_at(struct minode *, struct bmap_cursor *,
+				fs_u64_t, fs_u64_t, struct file_extent *, int,
+				int *);
+extern int	bmap_getmap(struct minode *, struct direct **, int *);
+extern int	bmap_setmap(struct fsmem *, struct minode *, struct direct *,
+			    int);
+extern int	bmap_trim(struct fsmem *, struct minode *, fs_u64_t);
 
 #endif /*_FS_EXTERNS_H_*/
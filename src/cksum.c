@@ -0,0 +1,509 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "fs_include.h"
+#include "inode.h"
+#include "bmap.h"
+#include "allocate.h"
+#include "fileops.h"
+#include "bio.h"
+#include "crc32c.h"
+#include "cksum.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * Block checksums.
+ * The checksum file (IFCKS) holds the CRC32C of every block of
+ * the file system, indexed by block number, 4 bytes a block. It
+ * is created the first time the file system is mounted and its
+ * block map never changes after that.
+ * The checksums cover the data blocks of regular files, which
+ * are written and read through internal_iov(): every write
+ * stores the checksums of the blocks it touched and every read
+ * verifies them. A checksum of zero means the block isn't
+ * checked, which is what blocks get when they're allocated, so
+ * the rare block whose CRC is really zero isn't checked either.
+ * fsscrub() verifies all the checksummed blocks of the file
+ * system.
+ */
+
+/*
+ * Number of blocks whose checksums are read or written at once.
+ */
+
+#define CK_CHUNK	256
+
+static int	ck_io(struct fsmem *, int, fs_u64_t, fs_u64_t, fs_u32_t *);
+static int	ck_block(struct fsmem *, struct bio_vec *, fs_u64_t,
+			 fs_u32_t *);
+
+/*
+ * Read or write the checksums of the 'n' blocks at 'blkno'.
+ * Returns zero or error number.
+ */
+
+static int
+ck_io(
+	struct fsmem	*fsm,
+	int		rw,
+	fs_u64_t	blkno,
+	fs_u64_t	n,
+	fs_u32_t	*crc)
+{
+	struct iovec	iov;
+
+	iov.iov_base = crc;
+	iov.iov_len = n * sizeof(fs_u32_t);
+	return internal_iov(fsm->fsm_csip, rw, &iov,
+			    blkno * sizeof(fs_u32_t), iov.iov_len);
+}
+
+/*
+ * Checksum of block 'blkno', part of which is in the segment
+ * 'bv'. The part that isn't is read from the device file.
+ * Returns zero or error number.
+ */
+
+static int
+ck_block(
+	struct fsmem	*fsm,
+	struct bio_vec	*bv,
+	fs_u64_t	blkno,
+	fs_u32_t	*crcp)
+{
+	char		buf[ONE_K];
+	fs_u64_t	start = blkno << LOG_ONE_K;
+	int		error;
+
+	if (start >= bv->bv_off &&
+	    start + ONE_K <= bv->bv_off + bv->bv_len) {
+		*crcp = crc32c(0, bv->bv_buf + (start - bv->bv_off), ONE_K);
+		return 0;
+	}
+	if ((error = bio_read(fsm, buf, ONE_K, start)) != 0) {
+		return error;
+	}
+	*crcp = crc32c(0, buf, ONE_K);
+	return 0;
+}
+
+/*
+ * Open the checksum file, creating it if the file system
+ * doesn't have one yet. If there isn't enough space for
+ * it, the file system is used without checksums.
+ * Returns zero or error number.
+ */
+
+int
+cksum_load(
+	struct fsmem		*fsm)
+{
+	struct super_block	*sb = fsm->fsm_sb;
+	struct minode		*csip;
+	struct iovec		iov;
+	fs_u64_t		inum, size, off, blkno, len;
+	int			error;
+
+	size = sb->size * sizeof(fs_u32_t);
+	if (sb->cksumino) {
+		if ((csip = iget(fsm, sb->cksumino)) == NULL) {
+			return EIO;
+		}
+		if (csip->mino_type != IFCKS || csip->mino_size != size) {
+			fprintf(stderr, "cksum_load: Bad checksum inode %llu "
+				"for %s\n", csip->mino_number, fsm->fsm_mntpt);
+			iput(csip);
+			return EINVAL;
+		}
+		fsm->fsm_csip = csip;
+		return 0;
+	}
+	if (sb->freeblks < ((size + ONE_K - 1) >> LOG_ONE_K) * 2) {
+		fprintf(stderr, "cksum_load: Not enough space for a checksum "
+			"file on %s, data won't be checksummed\n",
+			fsm->fsm_mntpt);
+		return 0;
+	}
+	if ((error = ialloc(fsm, IFCKS, &inum)) != 0) {
+		return error;
+	}
+	if ((csip = iget(fsm, inum)) == NULL) {
+		return EIO;
+	}
+	while ((csip->mino_nblocks << LOG_ONE_K) < size) {
+		if ((error = bmap_alloc(fsm, csip, ((size + ONE_K - 1) >>
+						    LOG_ONE_K) -
+					csip->mino_nblocks, &blkno,
+					&len)) != 0) {
+			fprintf(stderr, "cksum_load: Failed to allocate "
+				"checksum file for %s\n", fsm->fsm_mntpt);
+			iput(csip);
+			return error;
+		}
+	}
+
+	/*
+	 * No block has a checksum yet.
+	 */
+
+	iov.iov_len = MIN(size, WBUF_SIZE);
+	if ((iov.iov_base = calloc(1, iov.iov_len)) == NULL) {
+		iput(csip);
+		return ENOMEM;
+	}
+	for (off = 0; off < size && error == 0; off += len) {
+		len = MIN(iov.iov_len, size - off);
+		error = internal_iov(csip, BIO_WRITE, &iov, off, len);
+	}
+	free(iov.iov_base);
+	csip->mino_size = size;
+	if (error || (error = iwrite(csip)) != 0) {
+		iput(csip);
+		return error;
+	}
+	sb->cksumino = inum;
+	if ((error = write_sb(fsm)) != 0) {
+		iput(csip);
+		return error;
+	}
+	fsm->fsm_csip = csip;
+	return 0;
+}
+
+/*
+ * Forget the checksums of the 'len' blocks at 'blkno',
+ * which have just been allocated.
+ * Returns zero or error number.
+ */
+
+int
+cksum_clear(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	fs_u64_t	len)
+{
+	fs_u32_t	crc[CK_CHUNK];
+	fs_u64_t	n;
+	int		error = 0;
+
+	if (fsm->fsm_csip == NULL) {
+		return 0;
+	}
+	memset(crc, 0, sizeof(crc));
+	for (; len > 0 && error == 0; blkno += n, len -= n) {
+		n = MIN(len, CK_CHUNK);
+		error = ck_io(fsm, BIO_WRITE, blkno, n, crc);
+	}
+	return error;
+}
+
+/*
+ * Store the checksums of the blocks written by the 'n'
+ * segments of 'bv'.
+ * Returns zero or error number.
+ */
+
+int
+cksum_update(
+	struct fsmem	*fsm,
+	struct bio_vec	*bv,
+	int		n)
+{
+	fs_u32_t	crc[CK_CHUNK];
+	fs_u64_t	b, first, last, cnt;
+	int		i, error = 0;
+
+	for (i = 0; i < n && error == 0; i++) {
+		first = bv[i].bv_off >> LOG_ONE_K;
+		last = (bv[i].bv_off + bv[i].bv_len - 1) >> LOG_ONE_K;
+		for (; first <= last && error == 0; first += cnt) {
+			cnt = MIN(last - first + 1, CK_CHUNK);
+			for (b = 0; b < cnt && error == 0; b++) {
+				error = ck_block(fsm, &bv[i], first + b,
+						 &crc[b]);
+			}
+			if (error == 0) {
+				error = ck_io(fsm, BIO_WRITE, first, cnt, crc);
+			}
+		}
+	}
+	return error;
+}
+
+/*
+ * Read the checksums of all the blocks of the 'n' segments of
+ * 'bv' into 'crc', one after the other, as a single batch.
+ * Returns zero or error number.
+ */
+
+static int
+ck_read_batch(
+	struct fsmem		*fsm,
+	struct bio_vec		*bv,
+	int			n,
+	fs_u32_t		*crc)
+{
+	struct file_extent	ext[16];
+	struct bio_vec		*cv, *tmp;
+	fs_u64_t		off, len;
+	char			*pos = (char *)crc;
+	int			i, j, m, ncv = 0, max = n + 16, error = 0;
+
+	if ((cv = (struct bio_vec *)malloc(max * sizeof(*cv))) == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < n && error == 0; i++) {
+		off = (bv[i].bv_off >> LOG_ONE_K) * sizeof(fs_u32_t);
+		len = (((bv[i].bv_off + bv[i].bv_len - 1) >> LOG_ONE_K) -
+		       (bv[i].bv_off >> LOG_ONE_K) + 1) * sizeof(fs_u32_t);
+		while (len > 0 && error == 0) {
+			if ((error = bmap_extents(fsm->fsm_csip, off, len, ext,
+						  16, &m)) != 0) {
+				break;
+			}
+			if (m == 0) {
+				error = EIO;
+				break;
+			}
+			if (ncv + m > max) {
+				max = 2 * (ncv + m);
+				tmp = (struct bio_vec *)realloc(cv, max *
+								sizeof(*cv));
+				if (tmp == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				cv = tmp;
+			}
+			for (j = 0; j < m; j++) {
+				cv[ncv].bv_buf = pos;
+				cv[ncv].bv_off = ext[j].fext_physical;
+				cv[ncv].bv_len = (fs_u32_t)ext[j].fext_len;
+				ncv++;
+				pos += ext[j].fext_len;
+				off += ext[j].fext_len;
+				len -= ext[j].fext_len;
+			}
+		}
+	}
+	if (error == 0) {
+		error = bio_submit(fsm, BIO_READ, cv, ncv);
+	}
+	free(cv);
+	return error;
+}
+
+/*
+ * Verify the checksums of the blocks read by the 'n'
+ * segments of 'bv'. The checksums of all the segments are
+ * read with one batch.
+ * Returns zero, EIO if a block doesn't match its checksum,
+ * or error number.
+ */
+
+int
+cksum_verify(
+	struct fsmem	*fsm,
+	struct bio_vec	*bv,
+	int		n)
+{
+	fs_u32_t	*crc, c;
+	fs_u64_t	b, first, last, total = 0;
+	int		i, error = 0;
+
+	if (fsm->fsm_mntflags & FSMNT_NOVERIFY) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		total += ((bv[i].bv_off + bv[i].bv_len - 1) >> LOG_ONE_K) -
+			 (bv[i].bv_off >> LOG_ONE_K) + 1;
+	}
+	if ((crc = (fs_u32_t *)malloc(total * sizeof(fs_u32_t))) == NULL) {
+		return ENOMEM;
+	}
+	if ((error = ck_read_batch(fsm, bv, n, crc)) != 0) {
+		free(crc);
+		return error;
+	}
+	for (i = 0, total = 0; i < n && error == 0; i++) {
+		first = bv[i].bv_off >> LOG_ONE_K;
+		last = (bv[i].bv_off + bv[i].bv_len - 1) >> LOG_ONE_K;
+		for (b = first; b <= last && error == 0; b++, total++) {
+			if (crc[total] == 0 ||
+			    (error = ck_block(fsm, &bv[i], b, &c)) != 0) {
+				continue;
+			}
+			if (c != crc[total]) {
+				fprintf(stderr, "cksum_verify: Checksum "
+					"mismatch in block %llu of %s: "
+					"%08x, expected %08x\n", b,
+					fsm->fsm_mntpt, c, crc[total]);
+				error = EIO;
+			}
+		}
+	}
+	free(crc);
+	return error;
+}
+
+/*
+ * State shared by the scrub threads.
+ */
+
+struct scrub {
+	struct fsmem		*sc_fsm;
+	pthread_mutex_t		sc_lock;
+	fs_u64_t		sc_next;
+	int			sc_error;
+	struct fsscrub_result	sc_res;
+};
+
+/*
+ * Check block 'blkno' again after a mismatch, in case it was
+ * being rewritten. Returns 1 if it's still bad.
+ */
+
+static int
+scrub_recheck(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno)
+{
+	char		buf[ONE_K];
+	fs_u32_t	crc;
+
+	if (ck_io(fsm, BIO_READ, blkno, 1, &crc) != 0 ||
+	    bio_read(fsm, buf, ONE_K, blkno << LOG_ONE_K) != 0) {
+		return 1;
+	}
+	return crc != 0 && crc32c(0, buf, ONE_K) != crc;
+}
+
+/*
+ * Scrub thread: verify chunks of CK_CHUNK blocks until
+ * there are none left.
+ */
+
+static void *
+scrub_thread(
+	void			*arg)
+{
+	struct scrub		*sc = (struct scrub *)arg;
+	struct fsmem		*fsm = sc->sc_fsm;
+	struct fsscrub_result	res;
+	fs_u32_t		crc[CK_CHUNK];
+	fs_u64_t		blkno, cnt, b, nset;
+	char			*buf;
+	int			error = 0;
+
+	memset(&res, 0, sizeof(res));
+	res.sr_firstbad = ~0ULL;
+	if ((buf = (char *)malloc(CK_CHUNK << LOG_ONE_K)) == NULL) {
+		error = ENOMEM;
+	}
+	while (error == 0) {
+		pthread_mutex_lock(&sc->sc_lock);
+		blkno = sc->sc_next;
+		cnt = MIN(CK_CHUNK, fsm->fsm_sb->size - blkno);
+		sc->sc_next += cnt;
+		pthread_mutex_unlock(&sc->sc_lock);
+		if (cnt == 0) {
+			break;
+		}
+		if ((error = ck_io(fsm, BIO_READ, blkno, cnt, crc)) != 0) {
+			break;
+		}
+		for (b = nset = 0; b < cnt; b++) {
+			nset += (crc[b] != 0);
+		}
+		res.sr_skipped += cnt - nset;
+		res.sr_checked += nset;
+		if (nset == 0) {
+			continue;
+		}
+		if ((error = bio_read(fsm, buf, cnt << LOG_ONE_K,
+				      blkno << LOG_ONE_K)) != 0) {
+			break;
+		}
+		for (b = 0; b < cnt; b++) {
+			if (crc[b] == 0 ||
+			    crc32c(0, buf + (b << LOG_ONE_K), ONE_K) == crc[b] ||
+			    !scrub_recheck(fsm, blkno + b)) {
+				continue;
+			}
+			fprintf(stderr, "fsscrub: Checksum mismatch in block "
+				"%llu of %s\n", blkno + b, fsm->fsm_mntpt);
+			res.sr_bad++;
+			res.sr_firstbad = MIN(res.sr_firstbad, blkno + b);
+		}
+	}
+	free(buf);
+
+	pthread_mutex_lock(&sc->sc_lock);
+	sc->sc_res.sr_checked += res.sr_checked;
+	sc->sc_res.sr_skipped += res.sr_skipped;
+	sc->sc_res.sr_bad += res.sr_bad;
+	sc->sc_res.sr_firstbad = MIN(sc->sc_res.sr_firstbad,
+				     res.sr_firstbad);
+	if (error && sc->sc_error == 0) {
+		sc->sc_error = error;
+	}
+	pthread_mutex_unlock(&sc->sc_lock);
+	return NULL;
+}
+
+/*
+ * Verify the checksums of all the blocks of the file
+ * system with 'nthreads' threads, filling in '*resp'.
+ * sr_firstbad is ~0 if no block is bad.
+ * Returns zero, EIO if there are bad blocks, or error
+ * number.
+ */
+
+#define SCRUB_MAXTHREADS	64
+
+int
+fsscrub(
+	void			*vfsh,
+	int			nthreads,
+	struct fsscrub_result	*resp)
+{
+	struct fsmem		*fsm;
+	struct scrub		sc;
+	pthread_t		tid[SCRUB_MAXTHREADS];
+	int			i, n;
+
+	if (!vfsh || !resp || nthreads < 1) {
+		return EINVAL;
+	}
+	fsm = ((struct fs_handle *)vfsh)->fsh_mem;
+	if (fsm->fsm_csip == NULL) {
+		return ENOTSUP;
+	}
+	nthreads = MIN(nthreads, SCRUB_MAXTHREADS);
+	memset(&sc, 0, sizeof(sc));
+	sc.sc_fsm = fsm;
+	sc.sc_res.sr_firstbad = ~0ULL;
+	pthread_mutex_init(&sc.sc_lock, NULL);
+	for (n = 0; n < nthreads; n++) {
+		if (pthread_create(&tid[n], NULL, scrub_thread, &sc) != 0) {
+			break;
+		}
+	}
+	if (n == 0) {
+		scrub_thread(&sc);
+	}
+	for (i = 0; i < n; i++) {
+		pthread_join(tid[i], NULL);
+	}
+	pthread_mutex_destroy(&sc.sc_lock);
+	*resp = sc.sc_res;
+	if (sc.sc_error) {
+		return sc.sc_error;
+	}
+	return sc.sc_res.sr_bad ? EIO : 0;
+}
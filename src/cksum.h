@@ -0,0 +1,11 @@
+#ifndef _FS_CKSUM_H_
+#define _FS_CKSUM_H_
+
+struct bio_vec;
+
+extern int	cksum_load(struct fsmem *);
+extern int	cksum_clear(struct fsmem *, fs_u64_t, fs_u64_t);
+extern int	cksum_update(struct fsmem *, struct bio_vec *, int);
+extern int	cksum_verify(struct fsmem *, struct bio_vec *, int);
+
+#endif /*_FS_CKSUM_H_*/
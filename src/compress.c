@@ -0,0 +1,989 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "inode.h"
+#include "bmap.h"
+#include "bio.h"
+#include "fileops.h"
+#include "refcount.h"
+#include "compress.h"
+#include "fs_include.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Compressed files.
+ * The data of a compressed file is cut in clusters of
+ * CLUSTER_SIZE bytes, each compressed on its own, so that a
+ * read only has to decompress the clusters it touches. The
+ * compressed clusters are stored one after the other in the
+ * blocks of the file (the "stream"), each in a slot of whole
+ * blocks, and the cluster map inode of the file has an entry
+ * per cluster with its slot (see struct cmapent).
+ * A rewritten cluster is never written over its old slot: it
+ * goes to a free slot of the stream, or to a new one at its
+ * end, and the old slot is only freed once the cluster map
+ * entry pointing to the new one is written. So a failed write
+ * leaves the cluster as it was. The free slots of a file are
+ * kept in core (mino_sfree), found from the cluster map the
+ * first time the file is written after it's read in; a free
+ * slot at the end of the stream shortens the stream instead.
+ * The cluster map inode and the free slots are only accessed
+ * under the lock of the file.
+ */
+
+#define LZ_MINMATCH	4
+#define LZ_MAXDIST	65535
+
+#define LZ_HASH(v)	(((v) * 2654435761U) >> (32 - LZ_HASH_LOG))
+
+static fs_u32_t
+lz_read32(
+	const unsigned char	*p)
+{
+	fs_u32_t		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Encode the part of a length which didn't fit in the
+ * token, as bytes of 255 ended by a byte below 255.
+ */
+
+static unsigned char *
+lz_putlen(
+	unsigned char		*op,
+	unsigned char		*oend,
+	fs_u32_t		len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= oend) {
+			return NULL;
+		}
+		*op++ = 255;
+	}
+	if (op >= oend) {
+		return NULL;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/*
+ * Emit a sequence: a token holding the number of literals and
+ * the match length, the literals, then the match offset. The
+ * last sequence has no match (mlen zero).
+ * Returns the new output position or NULL if it doesn't fit.
+ */
+
+static unsigned char *
+lz_emit(
+	unsigned char		*op,
+	unsigned char		*oend,
+	const unsigned char	*lit,
+	fs_u32_t		nlit,
+	fs_u32_t		dist,
+	fs_u32_t		mlen)
+{
+	unsigned char		*tok = op++;
+	fs_u32_t		ml = mlen ? mlen - LZ_MINMATCH : 0;
+
+	if (tok >= oend) {
+		return NULL;
+	}
+	*tok = (unsigned char)((MIN(nlit, 15) << 4) | MIN(ml, 15));
+	if (nlit >= 15 && (op = lz_putlen(op, oend, nlit - 15)) == NULL) {
+		return NULL;
+	}
+	if (nlit > (fs_u32_t)(oend - op)) {
+		return NULL;
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0) {
+		return op;
+	}
+	if (oend - op < 2) {
+		return NULL;
+	}
+	*op++ = (unsigned char)(dist & 0xff);
+	*op++ = (unsigned char)(dist >> 8);
+	if (ml >= 15) {
+		op = lz_putlen(op, oend, ml - 15);
+	}
+	return op;
+}
+
+/*
+ * Add position 'pos' to its hash chain and return the
+ * previous head of the chain plus one (zero if none).
+ */
+
+static fs_u32_t
+lz_insert(
+	struct lz_work		*lz,
+	const unsigned char	*src,
+	fs_u32_t		pos)
+{
+	fs_u32_t		h = LZ_HASH(lz_read32(src + pos));
+	fs_u32_t		cand = lz->lz_head[h];
+
+	lz->lz_head[h] = pos + 1;
+	lz->lz_prev[pos] = (cand && pos - (cand - 1) <= LZ_MAXDIST) ?
+			   (fs_u16_t)(pos - (cand - 1)) : 0;
+	return cand;
+}
+
+/*
+ * Compress the 'srclen' bytes at 'src' (at most CLUSTER_SIZE)
+ * into at most 'dstmax' bytes at 'dst'. At each position, up to
+ * 2^(level - 1) earlier occurrences of the next four bytes are
+ * tried for the longest match. Level 1 also skips ahead faster
+ * through data which doesn't match.
+ * Returns the compressed length, or zero if it doesn't fit.
+ */
+
+int
+lz_compress(
+	const char		*src,
+	int			srclen,
+	char			*dst,
+	int			dstmax,
+	int			level,
+	struct lz_work		*lz)
+{
+	const unsigned char	*s = (const unsigned char *)src;
+	unsigned char		*op = (unsigned char *)dst;
+	unsigned char		*oend = op + dstmax;
+	fs_u32_t		ip = 0, anchor = 0, mflimit, cand, p, np;
+	fs_u32_t		best, bestpos = 0, l, q;
+	int			depth, d;
+
+	if (srclen > CLUSTER_SIZE || dstmax <= 0) {
+		return 0;
+	}
+	level = MIN(MAX(level, FSCMP_MINLEVEL), FSCMP_MAXLEVEL);
+	depth = 1 << (level - 1);
+	memset(lz->lz_head, 0, sizeof(lz->lz_head));
+	mflimit = (srclen > LZ_MINMATCH) ? srclen - LZ_MINMATCH : 0;
+	while (srclen > LZ_MINMATCH && ip <= mflimit) {
+		best = 0;
+		cand = lz_insert(lz, s, ip);
+		for (d = 0, p = cand - 1; cand && d < depth; d++) {
+			if (lz_read32(s + p) == lz_read32(s + ip)) {
+				for (l = LZ_MINMATCH; ip + l < (fs_u32_t)srclen &&
+				     s[p + l] == s[ip + l]; l++);
+				if (l > best) {
+					best = l;
+					bestpos = p;
+				}
+				if (ip + l == (fs_u32_t)srclen) {
+					break;
+				}
+			}
+			if (lz->lz_prev[p] == 0) {
+				break;
+			}
+			np = p - lz->lz_prev[p];
+			if (ip - np > LZ_MAXDIST) {
+				break;
+			}
+			p = np;
+		}
+		if (best < LZ_MINMATCH) {
+			ip += (level == 1) ? 1 + ((ip - anchor) >> 5) : 1;
+			continue;
+		}
+		if ((op = lz_emit(op, oend, s + anchor, ip - anchor,
+				  ip - bestpos, best)) == NULL) {
+			return 0;
+		}
+		if (level > 1) {
+			for (q = ip + 1; q < ip + best && q <= mflimit; q++) {
+				(void) lz_insert(lz, s, q);
+			}
+		}
+		ip += best;
+		anchor = ip;
+	}
+	if ((op = lz_emit(op, oend, s + anchor, srclen - anchor, 0,
+			  0)) == NULL) {
+		return 0;
+	}
+	return (int)(op - (unsigned char *)dst);
+}
+
+/*
+ * Decompress the 'srclen' bytes at 'src' into at most
+ * 'dstlen' bytes at 'dst'.
+ * Returns the decompressed length, or -1 if the input
+ * is corrupt.
+ */
+
+int
+lz_decompress(
+	const char		*src,
+	int			srclen,
+	char			*dst,
+	int			dstlen)
+{
+	const unsigned char	*s = (const unsigned char *)src;
+	unsigned char		*d = (unsigned char *)dst;
+	fs_u32_t		ip = 0, op = 0, nlit, mlen, dist, i;
+	unsigned char		tok, b;
+
+	for (;;) {
+		if (ip >= (fs_u32_t)srclen) {
+			return -1;
+		}
+		tok = s[ip++];
+		nlit = tok >> 4;
+		if (nlit == 15) {
+			do {
+				if (ip >= (fs_u32_t)srclen) {
+					return -1;
+				}
+				b = s[ip++];
+				nlit += b;
+			} while (b == 255);
+		}
+		if (nlit > srclen - ip || nlit > dstlen - op) {
+			return -1;
+		}
+		memcpy(d + op, s + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == (fs_u32_t)srclen) {
+			return (int)op;
+		}
+		if (srclen - ip < 2) {
+			return -1;
+		}
+		dist = s[ip] | (s[ip + 1] << 8);
+		ip += 2;
+		if (dist == 0 || dist > op) {
+			return -1;
+		}
+		mlen = tok & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= (fs_u32_t)srclen) {
+					return -1;
+				}
+				b = s[ip++];
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MINMATCH;
+		if (mlen > dstlen - op) {
+			return -1;
+		}
+		if (dist >= mlen) {
+			memcpy(d + op, d + op - dist, mlen);
+		} else {
+			for (i = 0; i < mlen; i++) {
+				d[op + i] = d[op + i - dist];
+			}
+		}
+		op += mlen;
+	}
+}
+
+/*
+ * Buffers used to rewrite clusters.
+ */
+
+struct cmp_work {
+	char			cw_ubuf[CLUSTER_SIZE];
+	char			cw_cbuf[CLUSTER_SIZE];
+	struct lz_work		cw_lz;
+};
+
+/*
+ * Copy 'len' bytes between 'buf' and the buffers described by
+ * 'iov', starting 'pos' bytes into them.
+ */
+
+static void
+iov_copy(
+	const struct iovec	*iov,
+	fs_u64_t		pos,
+	char			*buf,
+	fs_u32_t		len,
+	int			toiov)
+{
+	fs_u64_t		n;
+
+	if (len == 0) {
+		return;
+	}
+	for (; pos >= iov->iov_len; iov++) {
+		pos -= iov->iov_len;
+	}
+	while (len > 0) {
+		n = MIN(len, iov->iov_len - pos);
+		if (toiov) {
+			memcpy((char *)iov->iov_base + pos, buf, n);
+		} else {
+			memcpy(buf, (char *)iov->iov_base + pos, n);
+		}
+		buf += n;
+		len -= n;
+		pos = 0;
+		iov++;
+	}
+}
+
+/*
+ * Read or write 'len' bytes at offset 'off' of the stream.
+ */
+
+static int
+stream_io(
+	struct minode		*mino,
+	int			rw,
+	char			*buf,
+	fs_u64_t		off,
+	fs_u32_t		len)
+{
+	struct iovec		iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return internal_iov(mino, rw, &iov, off, len);
+}
+
+/*
+ * Read cluster 'ent', of 'len' bytes once decompressed,
+ * into 'ubuf'.
+ */
+
+static int
+cluster_read(
+	struct minode		*mino,
+	struct cmapent		*ent,
+	char			*ubuf,
+	char			*cbuf,
+	fs_u32_t		len)
+{
+	int			error;
+
+	if (ent->cm_flags & CM_RAW) {
+		if (ent->cm_len < len) {
+			return EIO;
+		}
+		return stream_io(mino, BIO_READ, ubuf, ent->cm_off, len);
+	}
+	if (ent->cm_len == 0 || ent->cm_len > CLUSTER_SIZE) {
+		return EIO;
+	}
+	if ((error = stream_io(mino, BIO_READ, cbuf, ent->cm_off,
+			       ent->cm_len)) != 0) {
+		return error;
+	}
+	if (lz_decompress(cbuf, ent->cm_len, ubuf,
+			  CLUSTER_SIZE) != (int)len) {
+		fprintf(stderr, "cluster_read: Corrupt cluster at %llu of "
+			"inode %llu\n", ent->cm_off, mino->mino_number);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read the entries of clusters [first, first + n) from the
+ * cluster map, zeroing the ones beyond its end.
+ */
+
+static int
+cmap_read(
+	struct minode		*mino,
+	struct minode		*cmapip,
+	fs_u64_t		first,
+	int			n,
+	struct cmapent		*ent)
+{
+	fs_u64_t		off = first * sizeof(struct cmapent);
+	fs_u32_t		len = n * sizeof(struct cmapent);
+	int			nread = 0;
+
+	memset(ent, 0, len);
+	if (off < cmapip->mino_size) {
+		len = (fs_u32_t)MIN(len, cmapip->mino_size - off);
+		if ((nread = internal_read(cmapip, (char *)ent, off,
+					   len)) != (int)len) {
+			fprintf(stderr, "cmap_read: Failed to read cluster "
+				"map of inode %llu\n", mino->mino_number);
+			return errno ? errno : EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The free slots of the stream of a compressed file, in order
+ * of offset and never adjacent to one another.
+ */
+
+struct cslot {
+	fs_u64_t		cs_off;
+	fs_u64_t		cs_nblks;
+};
+
+struct cmpfree {
+	struct cslot		*cf_slot;
+	int			cf_n;
+	int			cf_max;
+};
+
+static int
+cslot_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct cslot	*sa = (const struct cslot *)a;
+	const struct cslot	*sb = (const struct cslot *)b;
+
+	return (sa->cs_off > sb->cs_off) - (sa->cs_off < sb->cs_off);
+}
+
+/*
+ * Add the slot of 'nblks' blocks at 'off' to the free slots,
+ * merging it with its neighbours.
+ * Returns zero or error number.
+ */
+
+static int
+cf_add(
+	struct cmpfree		*cf,
+	fs_u64_t		off,
+	fs_u64_t		nblks)
+{
+	struct cslot		*sp;
+	fs_u64_t		end = off + (nblks << LOG_ONE_K);
+	int			i, n;
+
+	for (i = 0; i < cf->cf_n && cf->cf_slot[i].cs_off < off; i++);
+	if (i > 0 && cf->cf_slot[i - 1].cs_off +
+	    (cf->cf_slot[i - 1].cs_nblks << LOG_ONE_K) == off) {
+		cf->cf_slot[i - 1].cs_nblks += nblks;
+		if (i < cf->cf_n && cf->cf_slot[i].cs_off == end) {
+			cf->cf_slot[i - 1].cs_nblks += cf->cf_slot[i].cs_nblks;
+			memmove(&cf->cf_slot[i], &cf->cf_slot[i + 1],
+				(cf->cf_n - i - 1) * sizeof(struct cslot));
+			cf->cf_n--;
+		}
+		return 0;
+	}
+	if (i < cf->cf_n && cf->cf_slot[i].cs_off == end) {
+		cf->cf_slot[i].cs_off = off;
+		cf->cf_slot[i].cs_nblks += nblks;
+		return 0;
+	}
+	if (cf->cf_n == cf->cf_max) {
+		n = cf->cf_max ? 2 * cf->cf_max : 16;
+		sp = (struct cslot *)realloc(cf->cf_slot,
+					     n * sizeof(struct cslot));
+		if (!sp) {
+			return ENOMEM;
+		}
+		cf->cf_slot = sp;
+		cf->cf_max = n;
+	}
+	memmove(&cf->cf_slot[i + 1], &cf->cf_slot[i],
+		(cf->cf_n - i) * sizeof(struct cslot));
+	cf->cf_slot[i].cs_off = off;
+	cf->cf_slot[i].cs_nblks = nblks;
+	cf->cf_n++;
+	return 0;
+}
+
+static void
+cf_free(
+	struct cmpfree		*cf)
+{
+	free(cf->cf_slot);
+	free(cf);
+}
+
+/*
+ * Find the free slots of the stream of 'mino': the parts of
+ * the first mino_streamend bytes that no cluster map entry
+ * points to.
+ * Returns zero or error number.
+ */
+
+static int
+cmpfree_build(
+	struct minode		*mino,
+	struct minode		*cmapip)
+{
+	struct cmpfree		*cf;
+	struct cmapent		*ent = NULL;
+	struct cslot		*used = NULL;
+	fs_u64_t		pos = 0;
+	int			i, n, nused = 0, error = 0;
+
+	n = (int)(cmapip->mino_size / sizeof(struct cmapent));
+	if ((cf = (struct cmpfree *)calloc(1, sizeof(struct cmpfree))) ==
+	    NULL) {
+		return ENOMEM;
+	}
+	if (n > 0) {
+		ent = (struct cmapent *)malloc(n * sizeof(struct cmapent));
+		used = (struct cslot *)malloc(n * sizeof(struct cslot));
+		if (!ent || !used) {
+			error = ENOMEM;
+			goto out;
+		}
+		if ((error = cmap_read(mino, cmapip, 0, n, ent)) != 0) {
+			goto out;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (ent[i].cm_nblks > 0) {
+			used[nused].cs_off = ent[i].cm_off;
+			used[nused].cs_nblks = ent[i].cm_nblks;
+			nused++;
+		}
+	}
+	qsort(used, nused, sizeof(struct cslot), cslot_cmp);
+	for (i = 0; i < nused && error == 0; i++) {
+		if (used[i].cs_off > pos) {
+			error = cf_add(cf, pos, (used[i].cs_off - pos) >>
+				       LOG_ONE_K);
+		}
+		pos = MAX(pos, used[i].cs_off +
+			  (used[i].cs_nblks << LOG_ONE_K));
+	}
+	if (error == 0 && pos < mino->mino_streamend) {
+		error = cf_add(cf, pos, (mino->mino_streamend - pos) >>
+			       LOG_ONE_K);
+	}
+
+out:
+	free(ent);
+	free(used);
+	if (error) {
+		cf_free(cf);
+		return error;
+	}
+	mino->mino_sfree = cf;
+	return 0;
+}
+
+/*
+ * Take a slot of 'nblks' blocks for a cluster of 'mino', the
+ * first free one large enough or else a new one at the end of
+ * the stream, and set '*offp' to its offset.
+ */
+
+static void
+slot_take(
+	struct minode		*mino,
+	fs_u64_t		nblks,
+	fs_u64_t		*offp)
+{
+	struct cmpfree		*cf = mino->mino_sfree;
+	int			i;
+
+	for (i = 0; i < cf->cf_n && cf->cf_slot[i].cs_nblks < nblks; i++);
+	if (i == cf->cf_n) {
+		*offp = mino->mino_streamend;
+		mino->mino_streamend += nblks << LOG_ONE_K;
+		return;
+	}
+	*offp = cf->cf_slot[i].cs_off;
+	cf->cf_slot[i].cs_off += nblks << LOG_ONE_K;
+	if ((cf->cf_slot[i].cs_nblks -= nblks) == 0) {
+		memmove(&cf->cf_slot[i], &cf->cf_slot[i + 1],
+			(cf->cf_n - i - 1) * sizeof(struct cslot));
+		cf->cf_n--;
+	}
+}
+
+/*
+ * Free the slot of 'nblks' blocks at 'off' of 'mino'. If it
+ * ends up at the end of the stream, the stream is shortened.
+ * Returns zero or error number.
+ */
+
+static int
+slot_free(
+	struct minode		*mino,
+	fs_u64_t		off,
+	fs_u64_t		nblks)
+{
+	struct cmpfree		*cf = mino->mino_sfree;
+	struct cslot		*last;
+	int			error;
+
+	if ((error = cf_add(cf, off, nblks)) != 0) {
+		return error;
+	}
+	last = &cf->cf_slot[cf->cf_n - 1];
+	if (last->cs_off + (last->cs_nblks << LOG_ONE_K) ==
+	    mino->mino_streamend) {
+		mino->mino_streamend = last->cs_off;
+		cf->cf_n--;
+	}
+	return 0;
+}
+
+/*
+ * Free the free slots of a compressed file. They're found
+ * again from its cluster map when needed.
+ */
+
+void
+cmpfree_release(
+	struct minode		*mino)
+{
+	if (mino->mino_sfree) {
+		cf_free(mino->mino_sfree);
+		mino->mino_sfree = NULL;
+	}
+}
+
+/*
+ * Make an empty regular file compressed with 'codec' at
+ * 'level', allocating its cluster map inode. The level of a
+ * compressed file can be changed at any time, but its codec
+ * can't be changed once it has data.
+ * The caller must hold the inode lock exclusive.
+ * Returns zero or error number.
+ */
+
+int
+cmp_enable(
+	struct fsmem		*fsm,
+	struct minode		*mino,
+	int			codec,
+	int			level)
+{
+	fs_u64_t		inum;
+	int			error;
+
+	if (codec != FSCMP_NONE && codec != FSCMP_LZ) {
+		return EINVAL;
+	}
+	if (codec != FSCMP_NONE &&
+	    (level < FSCMP_MINLEVEL || level > FSCMP_MAXLEVEL)) {
+		return EINVAL;
+	}
+	if ((fs_u32_t)codec == mino->mino_codec) {
+		mino->mino_level = level;
+		return iwrite(mino);
+	}
+	if (mino->mino_size != 0) {
+		return EINVAL;
+	}
+	if (codec == FSCMP_NONE) {
+		mino->mino_codec = FSCMP_NONE;
+		mino->mino_level = 0;
+		mino->mino_streamend = 0;
+		return iwrite(mino);
+	}
+	if (mino->mino_cmapino == 0) {
+		if ((error = ialloc(fsm, IFCMP, &inum)) != 0) {
+			return error;
+		}
+		mino->mino_cmapino = inum;
+	}
+	mino->mino_codec = codec;
+	mino->mino_level = level;
+	mino->mino_streamend = 0;
+	return iwrite(mino);
+}
+
+/*
+ * Read 'len' bytes at offset 'off' of a compressed file into
+ * the buffers described by 'iov'. The range must be within
+ * the file. '*donep' is set to the number of bytes read from
+ * 'off' on, which is 'len' unless there was an error.
+ * The caller must hold the inode lock.
+ * Returns zero or error number.
+ */
+
+int
+cmp_readv(
+	struct minode		*mino,
+	const struct iovec	*iov,
+	fs_u64_t		off,
+	fs_u32_t		len,
+	fs_u64_t		*donep)
+{
+	struct fsmem		*fsm = mino->mino_fsm;
+	struct cmp_work		*cw = NULL;
+	struct cmapent		*ent = NULL;
+	struct minode		*cmapip;
+	fs_u64_t		first, last, c, cstart, s, e, done = 0;
+	fs_u32_t		clen;
+	int			error = 0;
+
+	assert(mino->mino_codec != FSCMP_NONE);
+	assert(off + len <= mino->mino_size && len > 0);
+	*donep = 0;
+	if ((cmapip = iget(fsm, mino->mino_cmapino)) == NULL) {
+		return EIO;
+	}
+	first = off >> LOG_CLUSTER;
+	last = (off + len - 1) >> LOG_CLUSTER;
+	ent = (struct cmapent *)malloc((last - first + 1) *
+				       sizeof(struct cmapent));
+	cw = (struct cmp_work *)malloc(sizeof(struct cmp_work));
+	if (!ent || !cw) {
+		error = ENOMEM;
+		goto out;
+	}
+	if ((error = cmap_read(mino, cmapip, first, (int)(last - first + 1),
+			       ent)) != 0) {
+		goto out;
+	}
+	for (c = first; c <= last; c++) {
+		cstart = c << LOG_CLUSTER;
+		clen = (fs_u32_t)MIN(CLUSTER_SIZE, mino->mino_size - cstart);
+		s = MAX(off, cstart) - cstart;
+		e = MIN(off + len, cstart + clen) - cstart;
+		if ((error = cluster_read(mino, &ent[c - first], cw->cw_ubuf,
+					  cw->cw_cbuf, clen)) != 0) {
+			break;
+		}
+		iov_copy(iov, done, cw->cw_ubuf + s, (fs_u32_t)(e - s), 1);
+		done += e - s;
+	}
+	*donep = done;
+
+out:
+	free(ent);
+	free(cw);
+	iput(cmapip);
+	return error;
+}
+
+/*
+ * Make sure the stream has blocks up to offset 'end'.
+ * Blocks are allocated in chunks of WBUF_SIZE at least,
+ * like for other files.
+ */
+
+static int
+stream_grow(
+	struct fsmem		*fsm,
+	struct minode		*mino,
+	fs_u64_t		end)
+{
+	fs_u64_t		req, blkno, alen;
+	int			error;
+
+	while ((mino->mino_nblocks << LOG_ONE_K) < end) {
+		req = (end - (mino->mino_nblocks << LOG_ONE_K) + ONE_K - 1) >>
+		      LOG_ONE_K;
+		req = MAX(req, WBUF_SIZE >> LOG_ONE_K);
+		if ((error = bmap_alloc(fsm, mino, req, &blkno,
+					&alen)) != 0) {
+			return error;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the 'len' bytes from the buffers described by 'iov'
+ * at offset 'off' of a compressed file, which can't be beyond
+ * the end of file. Every cluster touched is recompressed as a
+ * whole, reading the part of it that isn't overwritten.
+ * The caller must hold the inode lock exclusive.
+ * Returns zero or error number.
+ */
+
+int
+cmp_writev(
+	struct fsmem		*fsm,
+	struct minode		*mino,
+	const struct iovec	*iov,
+	fs_u64_t		off,
+	fs_u32_t		len)
+{
+	struct cmp_work		*cw = NULL;
+	struct cmapent		*ent = NULL, *ep;
+	struct cslot		*old = NULL;
+	struct minode		*cmapip;
+	fs_u64_t		first, last, c, cstart, newsize, streamend;
+	fs_u64_t		done = 0;
+	fs_u32_t		llen, oldlen, s, e, dlen, nblks, rawblks;
+	char			*data;
+	int			i, n, clen, error = 0;
+
+	assert(mino->mino_codec != FSCMP_NONE);
+	assert(off <= mino->mino_size && len > 0);
+	if ((cmapip = iget(fsm, mino->mino_cmapino)) == NULL) {
+		return EIO;
+	}
+	streamend = mino->mino_streamend;
+	newsize = MAX(mino->mino_size, off + len);
+	first = off >> LOG_CLUSTER;
+	last = (off + len - 1) >> LOG_CLUSTER;
+	n = (int)(last - first + 1);
+	ent = (struct cmapent *)malloc(n * sizeof(struct cmapent));
+	old = (struct cslot *)malloc(n * sizeof(struct cslot));
+	cw = (struct cmp_work *)malloc(sizeof(struct cmp_work));
+	if (!ent || !old || !cw) {
+		error = ENOMEM;
+		goto out;
+	}
+	if ((error = cmap_read(mino, cmapip, first, n, ent)) != 0) {
+		goto out;
+	}
+	if (mino->mino_sfree == NULL &&
+	    (error = cmpfree_build(mino, cmapip)) != 0) {
+		goto out;
+	}
+	for (c = first; c <= last; c++) {
+		ep = &ent[c - first];
+		cstart = c << LOG_CLUSTER;
+		llen = (fs_u32_t)MIN(CLUSTER_SIZE, newsize - cstart);
+		oldlen = (mino->mino_size > cstart) ?
+			 (fs_u32_t)MIN(CLUSTER_SIZE, mino->mino_size - cstart) : 0;
+		s = (fs_u32_t)(MAX(off, cstart) - cstart);
+		e = (fs_u32_t)(MIN(off + len, cstart + llen) - cstart);
+		if (oldlen && (s > 0 || e < oldlen) &&
+		    (error = cluster_read(mino, ep, cw->cw_ubuf, cw->cw_cbuf,
+					  oldlen)) != 0) {
+			break;
+		}
+		iov_copy(iov, done, cw->cw_ubuf + s, e - s, 0);
+		done += e - s;
+
+		/*
+		 * Keep the cluster compressed only if that
+		 * saves at least a block.
+		 */
+
+		rawblks = (llen + ONE_K - 1) >> LOG_ONE_K;
+		clen = lz_compress(cw->cw_ubuf, llen, cw->cw_cbuf,
+				   (rawblks - 1) << LOG_ONE_K,
+				   mino->mino_level, &cw->cw_lz);
+		if (clen > 0) {
+			data = cw->cw_cbuf;
+			dlen = clen;
+			ep->cm_flags = 0;
+		} else {
+			data = cw->cw_ubuf;
+			dlen = llen;
+			ep->cm_flags = CM_RAW;
+		}
+		nblks = (dlen + ONE_K - 1) >> LOG_ONE_K;
+		old[c - first].cs_off = ep->cm_off;
+		old[c - first].cs_nblks = ep->cm_nblks;
+		slot_take(mino, nblks, &ep->cm_off);
+		ep->cm_nblks = nblks;
+		ep->cm_len = dlen;
+		if ((error = stream_grow(fsm, mino,
+					 mino->mino_streamend)) != 0 ||
+		    (error = refcount_cow(fsm, mino, ep->cm_off, dlen)) != 0 ||
+		    (error = stream_io(mino, BIO_WRITE, data, ep->cm_off,
+				       dlen)) != 0) {
+			break;
+		}
+	}
+	if (error == 0) {
+		error = internal_write(fsm, cmapip, (char *)ent,
+				       first * sizeof(struct cmapent),
+				       n * sizeof(struct cmapent));
+	}
+	if (error) {
+
+		/*
+		 * The cluster map still points to the old slots:
+		 * forget the ones taken, they're found again from
+		 * the map.
+		 */
+
+		mino->mino_streamend = streamend;
+		cmpfree_release(mino);
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (old[i].cs_nblks > 0 &&
+		    slot_free(mino, old[i].cs_off, old[i].cs_nblks) != 0) {
+			cmpfree_release(mino);
+			break;
+		}
+	}
+	mino->mino_size = newsize;
+	error = iwrite(mino);
+
+out:
+	if (error) {
+		fprintf(stderr, "cmp_writev: Failed to write inode %llu at "
+			"offset %llu for %s\n", mino->mino_number, off,
+			fsm->fsm_mntpt);
+	}
+	free(ent);
+	free(old);
+	free(cw);
+	iput(cmapip);
+	return error;
+}
+
+/*
+ * Give the new file 'dmino', which was just made to share
+ * the blocks of the compressed file 'smino', the same codec
+ * and a copy of its cluster map.
+ * The caller must hold both inode locks.
+ * Returns zero or error number.
+ */
+
+int
+cmp_clone(
+	struct fsmem		*fsm,
+	struct minode		*smino,
+	struct minode		*dmino)
+{
+	struct minode		*scmap = NULL, *dcmap = NULL;
+	char			*buf = NULL;
+	fs_u64_t		size;
+	int			error;
+
+	if ((error = cmp_enable(fsm, dmino, smino->mino_codec,
+				smino->mino_level)) != 0) {
+		return error;
+	}
+	scmap = iget(fsm, smino->mino_cmapino);
+	dcmap = iget(fsm, dmino->mino_cmapino);
+	if (!scmap || !dcmap) {
+		error = EIO;
+		goto out;
+	}
+	if ((size = scmap->mino_size) > 0) {
+		if ((buf = (char *)malloc(size)) == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+		if (internal_read(scmap, buf, 0, (fs_u32_t)size) !=
+		    (int)size) {
+			error = EIO;
+			goto out;
+		}
+		if ((error = internal_write(fsm, dcmap, buf, 0,
+					    (fs_u32_t)size)) != 0) {
+			goto out;
+		}
+	}
+	dmino->mino_streamend = smino->mino_streamend;
+
+out:
+	free(buf);
+	if (scmap) {
+		iput(scmap);
+	}
+	if (dcmap) {
+		iput(dcmap);
+	}
+	return error;
+}
@@ -0,0 +1,30 @@
+#ifndef _FS_COMPRESS_H_
+#define _FS_COMPRESS_H_
+
+struct iovec;
+
+/*
+ * Work area of the LZ compressor: the head of the hash chains
+ * and the distance from each position to the previous one with
+ * the same hash.
+ */
+
+#define LZ_HASH_LOG	14
+
+struct lz_work {
+	fs_u32_t	lz_head[1 << LZ_HASH_LOG];
+	fs_u16_t	lz_prev[CLUSTER_SIZE];
+};
+
+extern int	lz_compress(const char *, int, char *, int, int,
+			    struct lz_work *);
+extern int	lz_decompress(const char *, int, char *, int);
+extern int	cmp_enable(struct fsmem *, struct minode *, int, int);
+extern int	cmp_readv(struct minode *, const struct iovec *, fs_u64_t,
+			  fs_u32_t, fs_u64_t *);
+extern int	cmp_writev(struct fsmem *, struct minode *,
+			   const struct iovec *, fs_u64_t, fs_u32_t);
+extern int	cmp_clone(struct fsmem *, struct minode *, struct minode *);
+extern void	cmpfree_release(struct minode *);
+
+#endif /*_FS_COMPRESS_H_*/
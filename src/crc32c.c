@@ -0,0 +1,229 @@
+#include "types.h"
+#include "crc32c.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+/*
+ * CRC32C (Castagnoli), as used for the block checksums.
+ * crc32c(0, buf, len) is the standard CRC32C of 'buf' and
+ * crc32c(crc32c(0, a, n), b, m) the CRC of 'a' followed by 'b'.
+ * The implementation is picked once, at first use:
+ * - with SSE4.2 and PCLMUL, the buffer is cut in three lanes
+ *   whose CRCs are computed together by crc32 instructions
+ *   (which have a latency of three cycles but can start one
+ *   per cycle) and then combined with a carry-less multiply;
+ * - with SSE4.2 only, a single stream of crc32 instructions;
+ * - otherwise, slicing-by-8 tables.
+ * All work on the inverted CRC register; see crc32c().
+ */
+
+#define CRC_POLY	0x82f63b78	/* reflected */
+
+/*
+ * Length of each of the three lanes. Three lanes cover a
+ * 1K block but for its last 16 bytes.
+ */
+
+#define CRC_LANE	336
+
+typedef fs_u32_t	(*crc_fn_t)(fs_u32_t, const unsigned char *, size_t);
+
+static pthread_once_t	crc_once = PTHREAD_ONCE_INIT;
+static fs_u32_t		crc_table[8][256];
+static fs_u32_t		crc_lanek;
+static crc_fn_t		crc_fn;
+static const char	*crc_name;
+
+static fs_u32_t
+crc_sw_raw(
+	fs_u32_t		crc,
+	const unsigned char	*p,
+	size_t			len)
+{
+	fs_u32_t		lo, hi;
+
+	for (; len && ((uintptr_t)p & 7); len--) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crc_table[7][lo & 0xff] ^
+		      crc_table[6][(lo >> 8) & 0xff] ^
+		      crc_table[5][(lo >> 16) & 0xff] ^
+		      crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xff] ^
+		      crc_table[2][(hi >> 8) & 0xff] ^
+		      crc_table[1][(hi >> 16) & 0xff] ^
+		      crc_table[0][hi >> 24];
+	}
+	for (; len; len--) {
+		crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static fs_u32_t
+crc_hw_raw(
+	fs_u32_t		crc,
+	const unsigned char	*p,
+	size_t			len)
+{
+	fs_u64_t		c = crc, v;
+
+	for (; len && ((uintptr_t)p & 7); len--) {
+		c = _mm_crc32_u8((fs_u32_t)c, *p++);
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	for (; len; len--) {
+		c = _mm_crc32_u8((fs_u32_t)c, *p++);
+	}
+	return (fs_u32_t)c;
+}
+
+/*
+ * Advance the CRC register 'crc' over CRC_LANE zero bytes:
+ * crc * x^(8 * CRC_LANE) mod P. The carry-less product of
+ * crc and crc_lanek (x^(8 * CRC_LANE - 33) mod P) fits in 64
+ * bits and the crc32 instruction reduces it, multiplying by
+ * the missing x^33.
+ */
+
+__attribute__((target("sse4.2,pclmul")))
+static fs_u32_t
+crc_shift(
+	fs_u32_t		crc)
+{
+	__m128i			t;
+
+	t = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc),
+				 _mm_cvtsi32_si128((int)crc_lanek), 0);
+	return (fs_u32_t)_mm_crc32_u64(0, (fs_u64_t)_mm_cvtsi128_si64(t));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static fs_u32_t
+crc_hw3_raw(
+	fs_u32_t		crc,
+	const unsigned char	*p,
+	size_t			len)
+{
+	fs_u64_t		c0, c1, c2, v0, v1, v2;
+	size_t			i;
+
+	for (; len && ((uintptr_t)p & 7); len--) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	for (; len >= 3 * CRC_LANE; len -= 3 * CRC_LANE, p += 3 * CRC_LANE) {
+		c0 = crc;
+		c1 = c2 = 0;
+		for (i = 0; i < CRC_LANE; i += 8) {
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + CRC_LANE + i, 8);
+			memcpy(&v2, p + 2 * CRC_LANE + i, 8);
+			c0 = _mm_crc32_u64(c0, v0);
+			c1 = _mm_crc32_u64(c1, v1);
+			c2 = _mm_crc32_u64(c2, v2);
+		}
+		crc = crc_shift((fs_u32_t)c0) ^ (fs_u32_t)c1;
+		crc = crc_shift(crc) ^ (fs_u32_t)c2;
+	}
+	return crc_hw_raw(crc, p, len);
+}
+
+#endif
+
+static void
+crc_init(void)
+{
+	fs_u32_t		c;
+	int			i, j;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++) {
+			c = (c & 1) ? (c >> 1) ^ CRC_POLY : c >> 1;
+		}
+		crc_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 8; j++) {
+			c = crc_table[j - 1][i];
+			crc_table[j][i] = crc_table[0][c & 0xff] ^ (c >> 8);
+		}
+	}
+
+	/*
+	 * x^n mod P, starting from x^0 (bit 31 when reflected)
+	 * and multiplying by x n times.
+	 */
+
+	for (c = 0x80000000, i = 0; i < 8 * CRC_LANE - 33; i++) {
+		c = (c & 1) ? (c >> 1) ^ CRC_POLY : c >> 1;
+	}
+	crc_lanek = c;
+	crc_fn = crc_sw_raw;
+	crc_name = "table";
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		if (__builtin_cpu_supports("pclmul")) {
+			crc_fn = crc_hw3_raw;
+			crc_name = "sse4.2+pclmul";
+		} else {
+			crc_fn = crc_hw_raw;
+			crc_name = "sse4.2";
+		}
+	}
+#endif
+}
+
+/*
+ * Update 'crc' with the 'len' bytes at 'buf'.
+ */
+
+fs_u32_t
+crc32c(
+	fs_u32_t		crc,
+	const void		*buf,
+	size_t			len)
+{
+	pthread_once(&crc_once, crc_init);
+	return ~crc_fn(~crc, (const unsigned char *)buf, len);
+}
+
+/*
+ * Same as crc32c(), always with the tables.
+ */
+
+fs_u32_t
+crc32c_sw(
+	fs_u32_t		crc,
+	const void		*buf,
+	size_t			len)
+{
+	pthread_once(&crc_once, crc_init);
+	return ~crc_sw_raw(~crc, (const unsigned char *)buf, len);
+}
+
+/*
+ * Name of the implementation used by crc32c().
+ */
+
+const char *
+crc32c_impl(void)
+{
+	pthread_once(&crc_once, crc_init);
+	return crc_name;
+}
@@ -0,0 +1,10 @@
+#ifndef _FS_CRC32C_H_
+#define _FS_CRC32C_H_
+
+#include <stddef.h>
+
+extern fs_u32_t		crc32c(fs_u32_t, const void *, size_t);
+extern fs_u32_t		crc32c_sw(fs_u32_t, const void *, size_t);
+extern const char	*crc32c_impl(void);
+
+#endif /*_FS_CRC32C_H_*/
@@ -0,0 +1,284 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "dir.h"
+#include "dcache.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Dentry cache.
+ * lookup_path() resolves a path a component at a time, each of
+ * which used to cost reading the directory inode and searching
+ * the directory. The dentry cache remembers the result of each
+ * of those lookups, keyed by the directory inode number and the
+ * name, whether the name was found (positive entry) or not
+ * (negative entry), so a path resolved before is resolved again
+ * without any I/O and a missing name isn't searched for again.
+ * Directories only change under fsm_nslock held exclusive, so
+ * an entry made by a lookup (which holds it shared) can't race
+ * with a change of the directory: add_direntry() and
+ * remove_direntry() update the entry of the name they change,
+ * and removing a directory purges all the entries of it.
+ * The cache holds at most DCACHE_MAX entries; when it's full,
+ * the least recently used entry is reused.
+ */
+
+#define DCACHE_MAX	16384
+#define DCACHE_HASHSZ	4096
+
+#define DCHASH(dir, h)	\
+	(((h) ^ (fs_u32_t)(((dir) * 0x9e3779b97f4a7c15ULL) >> 32)) & \
+	 (DCACHE_HASHSZ - 1))
+
+static struct dcent	*dc_find(struct dcache *, fs_u64_t, const char *,
+				 int, fs_u32_t);
+static void		dc_unlink(struct dcache *, struct dcent *);
+
+/*
+ * Find the entry of a name, with the cache locked.
+ */
+
+static struct dcent *
+dc_find(
+	struct dcache	*dc,
+	fs_u64_t	dir,
+	const char	*name,
+	int		len,
+	fs_u32_t	h)
+{
+	struct dcent	*de;
+
+	for (de = dc->dc_htab[DCHASH(dir, h)]; de; de = de->dc_hnext) {
+		if (de->dc_dir == dir && de->dc_hash == h &&
+		    de->dc_len == len && memcmp(de->dc_name, name, len) == 0) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry off its hash chain and the LRU list,
+ * with the cache locked.
+ */
+
+static void
+dc_unlink(
+	struct dcache	*dc,
+	struct dcent	*de)
+{
+	struct dcent	**dpp;
+
+	for (dpp = &dc->dc_htab[DCHASH(de->dc_dir, de->dc_hash)]; *dpp != de;
+	     dpp = &(*dpp)->dc_hnext);
+	*dpp = de->dc_hnext;
+	de->dc_prev->dc_next = de->dc_next;
+	de->dc_next->dc_prev = de->dc_prev;
+	dc->dc_nents--;
+}
+
+/*
+ * Set up the dentry cache at mount time.
+ * Returns zero or error number.
+ */
+
+int
+dcache_init(
+	struct fsmem	*fsm)
+{
+	struct dcache	*dc;
+
+	if ((dc = (struct dcache *)calloc(1, sizeof(struct dcache))) == NULL) {
+		return ENOMEM;
+	}
+	dc->dc_htab = (struct dcent **)calloc(DCACHE_HASHSZ,
+					      sizeof(struct dcent *));
+	if (dc->dc_htab == NULL) {
+		free(dc);
+		return ENOMEM;
+	}
+	pthread_mutex_init(&dc->dc_lock, NULL);
+	dc->dc_lru.dc_next = dc->dc_lru.dc_prev = &dc->dc_lru;
+	dc->dc_max = DCACHE_MAX;
+	fsm->fsm_dcache = dc;
+	return 0;
+}
+
+/*
+ * Free the dentry cache at unmount time.
+ */
+
+void
+dcache_fini(
+	struct fsmem	*fsm)
+{
+	struct dcache	*dc = fsm->fsm_dcache;
+	struct dcent	*de, *next;
+
+	if (dc == NULL) {
+		return;
+	}
+	for (de = dc->dc_lru.dc_next; de != &dc->dc_lru; de = next) {
+		next = de->dc_next;
+		free(de);
+	}
+	pthread_mutex_destroy(&dc->dc_lock);
+	free(dc->dc_htab);
+	free(dc);
+	fsm->fsm_dcache = NULL;
+}
+
+/*
+ * Look up the name made of the 'len' bytes at 'name' in
+ * directory 'dir' in the cache.
+ * Returns 1 if the name is cached, setting '*inump' to its
+ * inode number (zero if the name doesn't exist), or 0 if the
+ * directory has to be searched.
+ */
+
+int
+dcache_lookup(
+	struct fsmem	*fsm,
+	fs_u64_t	dir,
+	const char	*name,
+	int		len,
+	fs_u64_t	*inump)
+{
+	struct dcache	*dc = fsm->fsm_dcache;
+	struct dcent	*de;
+
+	pthread_mutex_lock(&dc->dc_lock);
+	if ((de = dc_find(dc, dir, name, len, dir_hash(name, len))) == NULL) {
+		dc->dc_misses++;
+		pthread_mutex_unlock(&dc->dc_lock);
+		return 0;
+	}
+	de->dc_prev->dc_next = de->dc_next;
+	de->dc_next->dc_prev = de->dc_prev;
+	de->dc_next = dc->dc_lru.dc_next;
+	de->dc_prev = &dc->dc_lru;
+	de->dc_next->dc_prev = de;
+	dc->dc_lru.dc_next = de;
+	dc->dc_hits++;
+	*inump = de->dc_inum;
+	pthread_mutex_unlock(&dc->dc_lock);
+	return 1;
+}
+
+/*
+ * Cache the name made of the 'len' bytes at 'name' in directory
+ * 'dir' as inode 'inum' (zero: the name doesn't exist),
+ * replacing what was cached for it. A name which can't be
+ * cached is just left out of the cache.
+ */
+
+void
+dcache_enter(
+	struct fsmem	*fsm,
+	fs_u64_t	dir,
+	const char	*name,
+	int		len,
+	fs_u64_t	inum)
+{
+	struct dcache	*dc = fsm->fsm_dcache;
+	struct dcent	*de, *old = NULL;
+	fs_u32_t	h = dir_hash(name, len), b;
+
+	pthread_mutex_lock(&dc->dc_lock);
+	if ((de = dc_find(dc, dir, name, len, h)) != NULL) {
+		dc_unlink(dc, de);
+	} else if (dc->dc_nents == dc->dc_max) {
+		old = dc->dc_lru.dc_prev;
+		dc_unlink(dc, old);
+	}
+	pthread_mutex_unlock(&dc->dc_lock);
+	free(old);
+	if (de == NULL &&
+	    (de = (struct dcent *)malloc(sizeof(struct dcent) + len)) == NULL) {
+		return;
+	}
+	de->dc_dir = dir;
+	de->dc_inum = inum;
+	de->dc_hash = h;
+	de->dc_len = len;
+	memcpy(de->dc_name, name, len);
+	de->dc_name[len] = '\0';
+
+	/*
+	 * Somebody else might have cached the same name while
+	 * the cache was unlocked. If so, theirs is as good.
+	 */
+
+	pthread_mutex_lock(&dc->dc_lock);
+	if (dc_find(dc, dir, name, len, h) != NULL) {
+		pthread_mutex_unlock(&dc->dc_lock);
+		free(de);
+		return;
+	}
+	b = DCHASH(dir, h);
+	de->dc_hnext = dc->dc_htab[b];
+	dc->dc_htab[b] = de;
+	de->dc_next = dc->dc_lru.dc_next;
+	de->dc_prev = &dc->dc_lru;
+	de->dc_next->dc_prev = de;
+	dc->dc_lru.dc_next = de;
+	dc->dc_nents++;
+	pthread_mutex_unlock(&dc->dc_lock);
+}
+
+/*
+ * Drop all the cached names of directory 'dir', which
+ * is being removed.
+ */
+
+void
+dcache_purge(
+	struct fsmem	*fsm,
+	fs_u64_t	dir)
+{
+	struct dcache	*dc = fsm->fsm_dcache;
+	struct dcent	*de, *next, *list = NULL;
+
+	pthread_mutex_lock(&dc->dc_lock);
+	for (de = dc->dc_lru.dc_next; de != &dc->dc_lru; de = next) {
+		next = de->dc_next;
+		if (de->dc_dir == dir) {
+			dc_unlink(dc, de);
+			de->dc_next = list;
+			list = de;
+		}
+	}
+	pthread_mutex_unlock(&dc->dc_lock);
+	for (; list; list = next) {
+		next = list->dc_next;
+		free(list);
+	}
+}
+
+/*
+ * Drop all the cached names, which may no longer be right
+ * after an explicit transaction has been aborted.
+ */
+
+void
+dcache_flush(
+	struct fsmem	*fsm)
+{
+	struct dcache	*dc = fsm->fsm_dcache;
+	struct dcent	*de, *next;
+
+	pthread_mutex_lock(&dc->dc_lock);
+	de = dc->dc_lru.dc_next;
+	dc->dc_lru.dc_next = dc->dc_lru.dc_prev = &dc->dc_lru;
+	memset(dc->dc_htab, 0, DCACHE_HASHSZ * sizeof(struct dcent *));
+	dc->dc_nents = 0;
+	pthread_mutex_unlock(&dc->dc_lock);
+	for (; de != &dc->dc_lru; de = next) {
+		next = de->dc_next;
+		free(de);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef _FS_DCACHE_H_
+#define _FS_DCACHE_H_
+
+/*
+ * A cached name: the name 'dc_name' (dc_len bytes, hashing to
+ * dc_hash) of directory dc_dir is inode dc_inum, or doesn't
+ * exist if dc_inum is zero.
+ */
+
+struct dcent {
+	struct dcent	*dc_hnext;
+	struct dcent	*dc_prev;
+	struct dcent	*dc_next;
+	fs_u64_t	dc_dir;
+	fs_u64_t	dc_inum;
+	fs_u32_t	dc_hash;
+	int		dc_len;
+	char		dc_name[1];
+};
+
+/*
+ * The dentry cache of a mount (see dcache.c). dc_lru is the
+ * head of the LRU list of the dc_nents entries, the most
+ * recently used first.
+ */
+
+struct dcache {
+	pthread_mutex_t	dc_lock;
+	struct dcent	**dc_htab;
+	struct dcent	dc_lru;
+	int		dc_nents;
+	int		dc_max;
+	fs_u64_t	dc_hits;
+	fs_u64_t	dc_misses;
+};
+
+extern int	dcache_init(struct fsmem *);
+extern void	dcache_fini(struct fsmem *);
+extern int	dcache_lookup(struct fsmem *, fs_u64_t, const char *, int,
+			      fs_u64_t *);
+extern void	dcache_enter(struct fsmem *, fs_u64_t, const char *, int,
+			     fs_u64_t);
+extern void	dcache_purge(struct fsmem *, fs_u64_t);
+extern void	dcache_flush(struct fsmem *);
+
+#endif /*_FS_DCACHE_H_*/
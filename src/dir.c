@@ -4,6 +4,11 @@
 #include "bmap.h"
 #include "inode.h"
 #include "fileops.h"
+#include "bio.h"
+#include "journal.h"
+#include "dir.h"
+#include "dcache.h"
+#include "dirscan.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -13,21 +18,1949 @@
 #define DIR_ALLOCSZ	8
 
 /*
- * Add a file entry to the directory.
+ * Directory formats.
+ * A DIRFMT_FIXED directory is an array of 64 byte struct
+ * direntry, as directories used to be. A DIRFMT_PACKED
+ * directory is made of 1K blocks of variable length struct
+ * dirrec records (see layout.h), so a short name takes a
+ * fraction of the space and names can be DIRREC_MAXNAME bytes
+ * long. Every directory that gets its first entry is made
+ * packed, while existing fixed directories keep working as
+ * they are. A new entry goes in the space an earlier entry left
+ * (see the free space maps below), or else in a new block.
+ * A directory created sorted is a DIRFMT_BTREE directory
+ * instead (see B-tree directories below).
+ *
+ * Hashed directories.
+ * Once a directory has DIRHASH_MIN entries it also gets a hash
+ * index (see struct dirspec in layout.h), which lets a lookup
+ * read a bucket block and the entry itself instead of the
+ * whole directory. The index is rebuilt with twice as many
+ * buckets whenever the buckets hold DH_FILL entries on
+ * average, so overflow blocks are only needed for the
+ * occasional crowded bucket.
+ * A directory with ds_nbuckets zero isn't indexed, whether or
+ * not it already has an index inode.
+ */
+
+#define DIRHASH_MIN	32
+#define DH_FILL		96
+
+static struct dirrec	*dir_rec(char *, fs_u32_t);
+static int		dir_walk(struct minode *, fs_u64_t,
+				 int (*)(void *, fs_u64_t, fs_u64_t,
+					 const char *, int, fs_u32_t),
+				 void *);
+static int		dirhash_build(struct fsmem *, struct minode *,
+				      fs_u32_t);
+static int		dirhash_insert(struct fsmem *, struct minode *,
+				       fs_u32_t, fs_u32_t);
+static int		dirhash_add(struct fsmem *, struct minode *, char *,
+				    fs_u64_t);
+static int		dirhash_remove(struct fsmem *, struct minode *,
+				       fs_u32_t, fs_u64_t);
+static int		dir_find(struct minode *, const char *, int,
+				 fs_u64_t *, fs_u64_t *);
+static int		bt_find(struct minode *, const char *, int,
+				fs_u64_t *, fs_u64_t *);
+static int		dir_freeblk(struct minode *, fs_u32_t, fs_u32_t *);
+static void		dir_setfree(struct minode *, fs_u32_t, fs_u32_t);
+
+/*
+ * FNV-1a hash of the 'len' bytes of a name.
+ */
+
+fs_u32_t
+dir_hash(
+	const char	*name,
+	int		len)
+{
+	fs_u32_t	h = 2166136261U;
+	int		i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619U;
+	}
+	return h;
+}
+
+/*
+ * The record at offset 'off' of the packed directory block
+ * 'blk', or NULL if it isn't a valid record.
+ */
+
+static struct dirrec *
+dir_rec(
+	char		*blk,
+	fs_u32_t	off)
+{
+	struct dirrec	*rec = (struct dirrec *)(blk + off);
+
+	if (off + DIRREC_HDRLEN > ONE_K || rec->dr_reclen < DIRREC_HDRLEN ||
+	    (rec->dr_reclen & 7) || off + rec->dr_reclen > ONE_K ||
+	    (rec->dr_inum != 0 &&
+	     DIRREC_LEN(rec->dr_namelen) > rec->dr_reclen)) {
+		return NULL;
+	}
+	return rec;
+}
+
+/*
+ * Call 'func' for every entry in use of directory 'dir' from
+ * offset 'start' on, which must be the offset of an entry or
+ * of a block, with the offset, inode number, name, name length
+ * and name hash of the entry, until 'func' returns nonzero.
+ * The caller must hold the directory lock (shared is enough).
+ * Returns zero or error number.
+ */
+
+static int
+dir_walk(
+	struct minode	*dir,
+	fs_u64_t	start,
+	int		(*func)(void *, fs_u64_t, fs_u64_t, const char *,
+				int, fs_u32_t),
+	void		*arg)
+{
+	struct direntry	*ent;
+	struct dirrec	*rec;
+	fs_u64_t	off;
+	fs_u32_t	len, boff, roff, i, nents;
+	char		*buf;
+	int		n, stop = 0, error = 0;
+
+	if ((buf = (char *)malloc(DIR_ALLOCSZ << LOG_ONE_K)) == NULL) {
+		return ENOMEM;
+	}
+	off = (dir->mino_dirfmt == DIRFMT_PACKED) ?
+	      start & ~(fs_u64_t)(ONE_K - 1) : start;
+	for (; off < dir->mino_size && !stop && !error; off += len) {
+		len = (fs_u32_t)MIN(dir->mino_size - off,
+				    DIR_ALLOCSZ << LOG_ONE_K);
+		if (internal_read(dir, buf, off, len) != (int)len) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		if (dir->mino_dirfmt != DIRFMT_PACKED) {
+			ent = (struct direntry *)buf;
+			nents = len / DIRENTRY_LEN;
+			for (i = 0; !stop; i++) {
+				i += dirscan_slot(ent + i, nents - i, 1);
+				if (i == nents) {
+					break;
+				}
+				n = strnlen(ent[i].name, sizeof(ent[i].name));
+				stop = func(arg, off + i * DIRENTRY_LEN,
+					    ent[i].inumber, ent[i].name, n,
+					    dir_hash(ent[i].name, n));
+			}
+			continue;
+		}
+		for (boff = 0; boff < len && !stop && !error; boff += ONE_K) {
+			for (roff = 0; roff < ONE_K && !stop;
+			     roff += rec->dr_reclen) {
+				if ((rec = dir_rec(buf + boff, roff)) == NULL) {
+					fprintf(stderr, "dir_walk: Bad record "
+						"at offset %llu of directory "
+						"inode %llu\n",
+						off + boff + roff,
+						dir->mino_number);
+					error = EIO;
+					break;
+				}
+				if (rec->dr_inum == 0 ||
+				    off + boff + roff < start) {
+					continue;
+				}
+				stop = func(arg, off + boff + roff,
+					    rec->dr_inum, (char *)(rec + 1),
+					    rec->dr_namelen, rec->dr_hash);
+			}
+		}
+	}
+	free(buf);
+	return error;
+}
+
+/*
+ * State of dirhash_build(): the index blocks being built.
+ */
+
+struct dh_build {
+	struct dirhash_blk	*db_blk;
+	fs_u32_t		db_nbuckets;
+	fs_u32_t		db_nblks;
+	fs_u32_t		db_maxblks;
+	int			db_error;
+};
+
+/*
+ * dir_walk() callback of dirhash_build(): add an entry
+ * to its bucket.
+ */
+
+static int
+dirhash_fill(
+	void			*arg,
+	fs_u64_t		off,
+	fs_u64_t		inum,
+	const char		*name,
+	int			len,
+	fs_u32_t		h)
+{
+	struct dh_build		*db = (struct dh_build *)arg;
+	struct dirhash_blk	*nblk;
+	fs_u32_t		b, n;
+
+	(void) inum;
+	(void) name;
+	(void) len;
+	b = h & (db->db_nbuckets - 1);
+	while (db->db_blk[b].dh_count == DH_NENTS) {
+		if (db->db_blk[b].dh_next) {
+			b = db->db_blk[b].dh_next;
+			continue;
+		}
+		if (db->db_nblks == db->db_maxblks) {
+			nblk = (struct dirhash_blk *)realloc(db->db_blk,
+				(size_t)db->db_maxblks * 2 * ONE_K);
+			if (nblk == NULL) {
+				db->db_error = ENOMEM;
+				return 1;
+			}
+			memset(nblk + db->db_maxblks, 0,
+			       (size_t)db->db_maxblks * ONE_K);
+			db->db_blk = nblk;
+			db->db_maxblks *= 2;
+		}
+		db->db_blk[b].dh_next = db->db_nblks;
+		b = db->db_nblks++;
+	}
+	n = db->db_blk[b].dh_count++;
+	db->db_blk[b].dh_ent[n].dh_hash = h;
+	db->db_blk[b].dh_ent[n].dh_off = (fs_u32_t)off;
+	return 0;
+}
+
+/*
+ * (Re)build the hash index of directory 'dir' with 'nbuckets'
+ * buckets (a power of two) from its entries, creating the index
+ * inode if need be. The caller must hold the directory lock
+ * exclusive and write the directory inode.
+ * Returns zero or error number.
+ */
+
+static int
+dirhash_build(
+	struct fsmem		*fsm,
+	struct minode		*dir,
+	fs_u32_t		nbuckets)
+{
+	struct dh_build		db;
+	struct minode		*ixp = NULL;
+	fs_u64_t		inum;
+	int			error = 0;
+
+	dir->mino_nbuckets = 0;
+	if (dir->mino_size > 0xffffffffULL) {
+		return EFBIG;
+	}
+	if (dir->mino_hashino == 0) {
+		if ((error = ialloc(fsm, IFDIX, &inum)) != 0) {
+			return error;
+		}
+		dir->mino_hashino = inum;
+	}
+	if ((ixp = iget(fsm, dir->mino_hashino)) == NULL) {
+		return EIO;
+	}
+	memset(&db, 0, sizeof(db));
+	db.db_nbuckets = db.db_nblks = db.db_maxblks = nbuckets;
+	if ((db.db_blk = (struct dirhash_blk *)calloc(nbuckets,
+						       ONE_K)) == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	if ((error = dir_walk(dir, 0, dirhash_fill, &db)) != 0 ||
+	    (error = db.db_error) != 0) {
+		goto out;
+	}
+	if ((error = internal_write(fsm, ixp, (char *)db.db_blk, 0,
+				    db.db_nblks << LOG_ONE_K)) != 0) {
+		goto out;
+	}
+	dir->mino_nbuckets = nbuckets;
+	dir->mino_nidxblks = db.db_nblks;
+
+out:
+	free(db.db_blk);
+	iput(ixp);
+	return error;
+}
+
+/*
+ * Add the entry at offset 'off' of directory 'dir', whose name
+ * hashes to 'h', to the hash index, chaining a new overflow
+ * block to the bucket if it's full.
+ * Returns zero or error number.
+ */
+
+static int
+dirhash_insert(
+	struct fsmem		*fsm,
+	struct minode		*dir,
+	fs_u32_t		h,
+	fs_u32_t		off)
+{
+	struct dirhash_blk	blk, nblk;
+	struct minode		*ixp;
+	fs_u32_t		b;
+	int			error = 0;
+
+	if ((ixp = iget(fsm, dir->mino_hashino)) == NULL) {
+		return EIO;
+	}
+	b = h & (dir->mino_nbuckets - 1);
+	for (;;) {
+		if (internal_read(ixp, (char *)&blk, (fs_u64_t)b << LOG_ONE_K,
+				  ONE_K) != ONE_K) {
+			error = errno ? errno : EIO;
+			goto out;
+		}
+		if (blk.dh_count < DH_NENTS) {
+			blk.dh_ent[blk.dh_count].dh_hash = h;
+			blk.dh_ent[blk.dh_count++].dh_off = off;
+			error = internal_write(fsm, ixp, (char *)&blk,
+					       (fs_u64_t)b << LOG_ONE_K, ONE_K);
+			goto out;
+		}
+		if (blk.dh_next == 0) {
+			break;
+		}
+		b = blk.dh_next;
+	}
+
+	/*
+	 * Every block of the bucket is full.
+	 */
+
+	memset(&nblk, 0, sizeof(nblk));
+	nblk.dh_count = 1;
+	nblk.dh_ent[0].dh_hash = h;
+	nblk.dh_ent[0].dh_off = off;
+	if ((error = internal_write(fsm, ixp, (char *)&nblk,
+				    (fs_u64_t)dir->mino_nidxblks << LOG_ONE_K,
+				    ONE_K)) != 0) {
+		goto out;
+	}
+	blk.dh_next = dir->mino_nidxblks++;
+	error = internal_write(fsm, ixp, (char *)&blk,
+			       (fs_u64_t)b << LOG_ONE_K, ONE_K);
+
+out:
+	iput(ixp);
+	return error;
+}
+
+/*
+ * Index the new entry 'name' at offset 'off' of directory
+ * 'dir', which has been counted in ds_ndirents already.
+ * This is where a directory gets its index and where the
+ * index grows. On failure, the directory is left unindexed.
+ * The caller must hold the directory lock exclusive and
+ * write the directory inode.
+ * Returns zero or error number.
+ */
+
+static int
+dirhash_add(
+	struct fsmem	*fsm,
+	struct minode	*dir,
+	char		*name,
+	fs_u64_t	off)
+{
+	fs_u32_t	nb;
+	int		error;
+
+	if (dir->mino_dirfmt == DIRFMT_BTREE) {
+		return 0;
+	}
+	if (dir->mino_nbuckets == 0) {
+		if (dir->mino_ndirents < DIRHASH_MIN) {
+			return 0;
+		}
+		for (nb = 1; (fs_u64_t)nb * DH_FILL < dir->mino_ndirents * 2;
+		     nb <<= 1);
+		error = dirhash_build(fsm, dir, nb);
+	} else if (dir->mino_ndirents > (fs_u64_t)dir->mino_nbuckets *
+					 DH_FILL) {
+		error = dirhash_build(fsm, dir, dir->mino_nbuckets * 2);
+	} else if (off > 0xffffffffULL) {
+		error = EFBIG;
+	} else {
+		error = dirhash_insert(fsm, dir, dir_hash(name, strlen(name)),
+				       (fs_u32_t)off);
+	}
+	if (error) {
+		dir->mino_nbuckets = 0;
+	}
+	return error;
+}
+
+/*
+ * Remove the entry at offset 'off' of directory 'dir', whose
+ * name hashes to 'h', from the hash index. The last entry of
+ * the index block takes its place. On failure, the directory
+ * is left unindexed.
+ * The caller must hold the directory lock exclusive and
+ * write the directory inode.
+ * Returns zero or error number.
+ */
+
+static int
+dirhash_remove(
+	struct fsmem		*fsm,
+	struct minode		*dir,
+	fs_u32_t		h,
+	fs_u64_t		off)
+{
+	struct dirhash_blk	blk;
+	struct minode		*ixp;
+	fs_u32_t		b, i;
+	int			error = ENOENT;
+
+	if (dir->mino_nbuckets == 0) {
+		return 0;
+	}
+	if ((ixp = iget(fsm, dir->mino_hashino)) == NULL) {
+		dir->mino_nbuckets = 0;
+		return EIO;
+	}
+	b = h & (dir->mino_nbuckets - 1);
+	do {
+		if (internal_read(ixp, (char *)&blk, (fs_u64_t)b << LOG_ONE_K,
+				  ONE_K) != ONE_K) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		for (i = 0; i < blk.dh_count; i++) {
+			i += dirscan_hash(blk.dh_ent + i, blk.dh_count - i, h);
+			if (i >= blk.dh_count || blk.dh_ent[i].dh_off == off) {
+				break;
+			}
+		}
+		if (i < blk.dh_count) {
+			blk.dh_ent[i] = blk.dh_ent[--blk.dh_count];
+			error = internal_write(fsm, ixp, (char *)&blk,
+					       (fs_u64_t)b << LOG_ONE_K, ONE_K);
+			break;
+		}
+		b = blk.dh_next;
+	} while (b != 0);
+	iput(ixp);
+	if (error) {
+		dir->mino_nbuckets = 0;
+	}
+	return error;
+}
+
+/*
+ * A name being looked up, and the inode number
+ * and offset of the entry found for it.
+ */
+
+struct dir_match {
+	const char	*dm_name;
+	int		dm_len;
+	fs_u32_t	dm_hash;
+	fs_u64_t	dm_inum;
+	fs_u64_t	dm_off;
+};
+
+/*
+ * dir_walk() callback of dir_find().
+ */
+
+static int
+dir_matchfn(
+	void			*arg,
+	fs_u64_t		off,
+	fs_u64_t		inum,
+	const char		*name,
+	int			len,
+	fs_u32_t		h)
+{
+	struct dir_match	*dm = (struct dir_match *)arg;
+
+	if (h != dm->dm_hash || len != dm->dm_len ||
+	    memcmp(name, dm->dm_name, len) != 0) {
+		return 0;
+	}
+	dm->dm_inum = inum;
+	dm->dm_off = off;
+	return 1;
+}
+
+/*
+ * Check the entry at offset 'off' of directory 'dir' against
+ * the name of 'dm', reading the entry (or, in a packed
+ * directory, its block).
+ * Returns zero or error number.
+ */
+
+static int
+dir_probe(
+	struct minode		*dir,
+	fs_u64_t		off,
+	struct dir_match	*dm)
+{
+	struct direntry		*ent;
+	struct dirrec		*rec;
+	char			buf[ONE_K];
+	int			n;
+
+	if (dir->mino_dirfmt != DIRFMT_PACKED) {
+		if (internal_read(dir, buf, off, DIRENTRY_LEN) !=
+		    DIRENTRY_LEN) {
+			return errno ? errno : EIO;
+		}
+		ent = (struct direntry *)buf;
+		if (ent->inumber != 0) {
+			n = strnlen(ent->name, sizeof(ent->name));
+			(void) dir_matchfn(dm, off, ent->inumber, ent->name,
+					   n, dir_hash(ent->name, n));
+		}
+		return 0;
+	}
+	if (internal_read(dir, buf, off & ~(fs_u64_t)(ONE_K - 1),
+			  ONE_K) != ONE_K) {
+		return errno ? errno : EIO;
+	}
+	if ((rec = dir_rec(buf, off & (ONE_K - 1))) == NULL) {
+		return EIO;
+	}
+	if (rec->dr_inum != 0) {
+		(void) dir_matchfn(dm, off, rec->dr_inum, (char *)(rec + 1),
+				   rec->dr_namelen, rec->dr_hash);
+	}
+	return 0;
+}
+
+/*
+ * Search fixed directory 'dir', which has no hash index, for
+ * the name of 'dm' a few blocks at a time, comparing the name
+ * against every entry of the blocks with dirscan_name().
+ * Returns zero or error number.
+ */
+
+static int
+dir_scan_fixed(
+	struct minode		*dir,
+	struct dir_match	*dm)
+{
+	struct direntry		*ent;
+	fs_u64_t		off;
+	fs_u32_t		len, i;
+	int			error = 0;
+
+	if ((ent = (struct direntry *)malloc(DIR_ALLOCSZ << LOG_ONE_K)) ==
+	    NULL) {
+		return ENOMEM;
+	}
+	for (off = 0; off < dir->mino_size; off += len) {
+		len = (fs_u32_t)MIN(dir->mino_size - off,
+				    DIR_ALLOCSZ << LOG_ONE_K);
+		if (internal_read(dir, (char *)ent, off, len) != (int)len) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		i = dirscan_name(ent, len / DIRENTRY_LEN, dm->dm_name,
+				 dm->dm_len);
+		if (i < len / DIRENTRY_LEN) {
+			dm->dm_inum = ent[i].inumber;
+			dm->dm_off = off + i * DIRENTRY_LEN;
+			break;
+		}
+	}
+	free(ent);
+	return error;
+}
+
+/*
+ * Look up the name made of the 'len' bytes at 'name' in
+ * directory 'dir', through its B-tree or its hash index if it
+ * has one, setting '*inump' to its inode number and '*offp' to the
+ * offset of its entry.
+ * The caller must hold the directory lock (shared is enough).
+ * Returns zero, ENOENT if there is no such name, or error
+ * number.
+ */
+
+static int
+dir_find(
+	struct minode		*dir,
+	const char		*name,
+	int			len,
+	fs_u64_t		*inump,
+	fs_u64_t		*offp)
+{
+	struct dirhash_blk	blk;
+	struct dir_match	dm;
+	struct minode		*ixp;
+	fs_u32_t		b, i;
+	int			error = 0;
+
+	*inump = 0;
+	if (len > DIRREC_MAXNAME) {
+		return ENOENT;
+	}
+	if (dir->mino_dirfmt == DIRFMT_BTREE) {
+		return bt_find(dir, name, len, inump, offp);
+	}
+	dm.dm_name = name;
+	dm.dm_len = len;
+	dm.dm_hash = dir_hash(name, len);
+	dm.dm_inum = 0;
+	dm.dm_off = 0;
+	if (dir->mino_nbuckets == 0) {
+		error = (dir->mino_dirfmt == DIRFMT_PACKED) ?
+			dir_walk(dir, 0, dir_matchfn, &dm) :
+			dir_scan_fixed(dir, &dm);
+	} else {
+		if ((ixp = iget(dir->mino_fsm, dir->mino_hashino)) == NULL) {
+			return EIO;
+		}
+		b = dm.dm_hash & (dir->mino_nbuckets - 1);
+		do {
+			if (internal_read(ixp, (char *)&blk,
+					  (fs_u64_t)b << LOG_ONE_K,
+					  ONE_K) != ONE_K) {
+				error = errno ? errno : EIO;
+				break;
+			}
+			for (i = 0; error == 0 && dm.dm_inum == 0; i++) {
+				i += dirscan_hash(blk.dh_ent + i,
+						  blk.dh_count - i, dm.dm_hash);
+				if (i >= blk.dh_count) {
+					break;
+				}
+				error = dir_probe(dir, blk.dh_ent[i].dh_off, &dm);
+			}
+			b = blk.dh_next;
+		} while (b != 0 && error == 0 && dm.dm_inum == 0);
+		iput(ixp);
+	}
+	if (error == 0 && dm.dm_inum == 0) {
+		error = ENOENT;
+	}
+	*inump = dm.dm_inum;
+	*offp = dm.dm_off;
+	return error;
+}
+
+/*
+ * Look up the name made of the 'len' bytes at 'name' in
+ * directory 'dir', setting '*inump' to its inode number.
+ * The caller must hold the directory lock (shared is enough).
+ * Returns zero, ENOENT if there is no such name, or error
+ * number.
+ */
+
+int
+dir_lookup(
+	struct minode		*dir,
+	const char		*name,
+	int			len,
+	fs_u64_t		*inump)
+{
+	fs_u64_t		off;
+
+	return dir_find(dir, name, len, inump, &off);
+}
+
+/*
+ * Entries being returned by dir_read().
+ */
+
+struct dir_fill {
+	struct udirentry	*df_ud;
+	fs_u32_t		df_n;
+	fs_u32_t		df_max;
+	fs_u64_t		df_next;
+};
+
+/*
+ * dir_walk() callback of dir_read().
+ */
+
+static int
+dir_fillfn(
+	void			*arg,
+	fs_u64_t		off,
+	fs_u64_t		inum,
+	const char		*name,
+	int			len,
+	fs_u32_t		h)
+{
+	struct dir_fill		*df = (struct dir_fill *)arg;
+	struct udirentry	*ud;
+
+	(void) h;
+	if (df->df_n == df->df_max) {
+		df->df_next = off;
+		return 1;
+	}
+	ud = &df->df_ud[df->df_n++];
+	memcpy(ud->udir_name, name, len);
+	ud->udir_name[len] = '\0';
+	ud->udir_inum = inum;
+	return 0;
+}
+
+/*
+ * Read up to 'n' entries in use of directory 'dir' into 'ud',
+ * from offset '*offp' on, setting '*np' to the number read
+ * and '*offp' to the offset to read the next ones from.
+ * The caller must hold the directory lock (shared is enough).
+ * Returns zero or error number.
+ */
+
+int
+dir_read(
+	struct minode		*dir,
+	fs_u64_t		*offp,
+	struct udirentry	*ud,
+	fs_u32_t		n,
+	fs_u32_t		*np)
+{
+	struct dir_fill		df;
+	int			error;
+
+	df.df_ud = ud;
+	df.df_n = 0;
+	df.df_max = n;
+	df.df_next = dir->mino_size;
+	error = dir_walk(dir, *offp, dir_fillfn, &df);
+	*np = df.df_n;
+	if (error == 0) {
+		*offp = df.df_next;
+	}
+	return error;
+}
+
+/*
+ * B-tree directories.
+ * A DIRFMT_BTREE directory keeps its entries sorted by name
+ * (bytewise, as strcmp() orders them) in a B+tree of 1K nodes
+ * (see struct dirbt_node in layout.h), so that it can be listed
+ * in order, a page at a time from any name on, and the names
+ * starting with a prefix read without going through the rest.
+ * A lookup reads one node per level; the tree is the index, so
+ * it never gets a hash index. A node which is full is split in
+ * two halves by size, the new node going at the end of the
+ * directory, and the root, which stays in block 0, moves its
+ * records to two new nodes when it splits. Removing an entry
+ * just takes it out of its leaf: nodes aren't merged, and
+ * the directory keeps its size, as the other formats do.
+ */
+
+#define DIRBT_MAXDEPTH	32
+
+#define BT_NAME(rec)	((char *)((rec) + 1))
+
+/*
+ * Compare the 'alen' bytes at 'a' with the 'blen' bytes at 'b'.
+ */
+
+static int
+bt_cmp(
+	const char	*a,
+	int		alen,
+	const char	*b,
+	int		blen)
+{
+	int		c = memcmp(a, b, MIN(alen, blen));
+
+	return c ? c : alen - blen;
+}
+
+/*
+ * The record at offset 'off' of the records of node 'np',
+ * or NULL if it isn't a valid record.
+ */
+
+static struct dirbt_rec *
+bt_rec(
+	struct dirbt_node	*np,
+	fs_u32_t		off)
+{
+	struct dirbt_rec	*rec = (struct dirbt_rec *)(np->bt_recs + off);
+
+	if (off + sizeof(struct dirbt_rec) > np->bt_used ||
+	    off + DIRBT_RECLEN(rec->br_namelen) > np->bt_used) {
+		return NULL;
+	}
+	return rec;
+}
+
+/*
+ * Read node 'b' of B-tree directory 'dir' into 'np'.
+ * Returns zero or error number.
+ */
+
+static int
+bt_read(
+	struct minode		*dir,
+	fs_u32_t		b,
+	struct dirbt_node	*np)
+{
+	if (((fs_u64_t)b << LOG_ONE_K) >= dir->mino_size) {
+		fprintf(stderr, "bt_read: Node %u beyond the end of directory "
+			"inode %llu\n", b, dir->mino_number);
+		return EIO;
+	}
+	if (internal_read(dir, (char *)np, (fs_u64_t)b << LOG_ONE_K,
+			  ONE_K) != ONE_K) {
+		return errno ? errno : EIO;
+	}
+	if (np->bt_used > DIRBT_SPACE || np->bt_level >= DIRBT_MAXDEPTH) {
+		fprintf(stderr, "bt_read: Bad node %u of directory inode "
+			"%llu\n", b, dir->mino_number);
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Write node 'np' as node 'b' of B-tree directory 'dir'.
+ * Returns zero or error number.
+ */
+
+static int
+bt_write(
+	struct fsmem		*fsm,
+	struct minode		*dir,
+	fs_u32_t		b,
+	struct dirbt_node	*np)
+{
+	if (metadata_write(fsm, (fs_u64_t)b << LOG_ONE_K, (char *)np, ONE_K,
+			   dir) != ONE_K) {
+		return errno ? errno : EIO;
+	}
+	return 0;
+}
+
+/*
+ * Set '*bp' to a new node at the end of B-tree directory 'dir',
+ * allocating blocks to the directory if it has none left.
+ * Returns zero or error number.
+ */
+
+static int
+bt_newblk(
+	struct fsmem	*fsm,
+	struct minode	*dir,
+	fs_u32_t	*bp)
+{
+	fs_u64_t	blkno, len;
+	int		error;
+
+	if ((dir->mino_size >> LOG_ONE_K) >= 0xffffffffULL) {
+		return EFBIG;
+	}
+	if ((dir->mino_nblocks << LOG_ONE_K) == dir->mino_size &&
+	    (error = bmap_alloc(fsm, dir, DIR_ALLOCSZ, &blkno, &len)) != 0) {
+		fprintf(stderr, "add_direntry: bmap allocation failed "
+			"for directory inode %llu for %s\n",
+			dir->mino_number, fsm->fsm_mntpt);
+		return error;
+	}
+	*bp = (fs_u32_t)(dir->mino_size >> LOG_ONE_K);
+	dir->mino_size += ONE_K;
+	return 0;
+}
+
+/*
+ * Set '*offp' to the offset of the first record of node 'np'
+ * whose name isn't less than the 'len' bytes at 'name'
+ * (bt_used if there is none).
+ * Returns 1 if that record has the very name, 0 if not, or -1
+ * if the node is bad.
+ */
+
+static int
+bt_search(
+	struct dirbt_node	*np,
+	const char		*name,
+	int			len,
+	fs_u32_t		*offp)
+{
+	struct dirbt_rec	*rec;
+	fs_u32_t		off;
+	int			c;
+
+	for (off = 0; off < np->bt_used;
+	     off += DIRBT_RECLEN(rec->br_namelen)) {
+		if ((rec = bt_rec(np, off)) == NULL) {
+			return -1;
+		}
+		if ((c = bt_cmp(BT_NAME(rec), rec->br_namelen, name,
+				len)) >= 0) {
+			*offp = off;
+			return c == 0;
+		}
+	}
+	*offp = np->bt_used;
+	return 0;
+}
+
+/*
+ * Read into 'np' the leaf of B-tree directory 'dir' where the
+ * 'len' bytes at 'name' are or would be, setting 'path[d]' to
+ * the block of the node at depth d on the way (the root being
+ * at depth 0) and '*depthp' to the depth of the leaf.
+ * Returns zero or error number.
+ */
+
+static int
+bt_descend(
+	struct minode		*dir,
+	const char		*name,
+	int			len,
+	struct dirbt_node	*np,
+	fs_u32_t		*path,
+	int			*depthp)
+{
+	struct dirbt_rec	*rec;
+	fs_u32_t		b = 0, off;
+	int			d, level = 0, error;
+
+	for (d = 0; d < DIRBT_MAXDEPTH; d++) {
+		if ((error = bt_read(dir, b, np)) != 0) {
+			return error;
+		}
+		if (d > 0 && np->bt_level != level - 1) {
+			break;
+		}
+		path[d] = b;
+		if ((level = np->bt_level) == 0) {
+			*depthp = d;
+			return 0;
+		}
+
+		/*
+		 * The child to go to is that of the last record
+		 * whose name isn't greater than the one looked for.
+		 */
+
+		b = np->bt_first;
+		for (off = 0; off < np->bt_used;
+		     off += DIRBT_RECLEN(rec->br_namelen)) {
+			if ((rec = bt_rec(np, off)) == NULL) {
+				return EIO;
+			}
+			if (bt_cmp(BT_NAME(rec), rec->br_namelen, name,
+				   len) > 0) {
+				break;
+			}
+			b = (fs_u32_t)rec->br_val;
+		}
+	}
+	fprintf(stderr, "bt_descend: Bad tree in directory inode %llu\n",
+		dir->mino_number);
+	return EIO;
+}
+
+/*
+ * Look up the 'len' bytes at 'name' in B-tree directory 'dir',
+ * setting '*inump' to its inode number and '*offp' to the
+ * offset of its record.
+ * Returns zero, ENOENT if there is no such name, or error
+ * number.
+ */
+
+static int
+bt_find(
+	struct minode		*dir,
+	const char		*name,
+	int			len,
+	fs_u64_t		*inump,
+	fs_u64_t		*offp)
+{
+	struct dirbt_node	node;
+	fs_u32_t		path[DIRBT_MAXDEPTH], off;
+	int			depth, found, error;
+
+	if (dir->mino_size == 0) {
+		return ENOENT;
+	}
+	if ((error = bt_descend(dir, name, len, &node, path, &depth)) != 0) {
+		return error;
+	}
+	if ((found = bt_search(&node, name, len, &off)) <= 0) {
+		return found ? EIO : ENOENT;
+	}
+	*inump = ((struct dirbt_rec *)(node.bt_recs + off))->br_val;
+	*offp = ((fs_u64_t)path[depth] << LOG_ONE_K) + DIRBT_HDRLEN + off;
+	return 0;
+}
+
+/*
+ * Put a record for the 'len' bytes at 'name' with value 'val'
+ * at offset 'off' of the records of node 'np', which has room
+ * for it.
+ */
+
+static void
+bt_put(
+	struct dirbt_node	*np,
+	fs_u32_t		off,
+	const char		*name,
+	int			len,
+	fs_u64_t		val)
+{
+	struct dirbt_rec	*rec;
+	fs_u32_t		reclen = DIRBT_RECLEN(len);
+
+	memmove(np->bt_recs + off + reclen, np->bt_recs + off,
+		np->bt_used - off);
+	rec = (struct dirbt_rec *)(np->bt_recs + off);
+	memset(rec, 0, reclen);
+	rec->br_val = val;
+	rec->br_namelen = (fs_u8_t)len;
+	memcpy(BT_NAME(rec), name, len);
+	np->bt_used += reclen;
+	np->bt_nrecs++;
+}
+
+/*
+ * Split node 'np', which has no room for the record of the
+ * 'len' bytes at 'name' with value 'val' to go at offset 'off',
+ * between 'np' and 'rp': the records which make the first half
+ * of the lot by size stay in 'np' and the others go to 'rp'.
+ * The name of the first record of 'rp' is copied to 'sep'
+ * ('*seplenp' bytes) for the parent. In an interior node,
+ * that record moves up to the parent instead, its child
+ * becoming the first child of 'rp'.
+ * 'name' may point at 'sep'.
+ */
+
+static void
+bt_split(
+	struct dirbt_node	*np,
+	fs_u32_t		off,
+	const char		*name,
+	int			len,
+	fs_u64_t		val,
+	struct dirbt_node	*rp,
+	char			*sep,
+	int			*seplenp)
+{
+	struct dirbt_rec	*rec;
+	char			buf[DIRBT_SPACE + DIRBT_RECLEN(DIRREC_MAXNAME)];
+	fs_u32_t		reclen = DIRBT_RECLEN(len), total, o, skip = 0;
+	int			n, nrecs = np->bt_nrecs + 1;
+
+	memcpy(buf, np->bt_recs, off);
+	rec = (struct dirbt_rec *)(buf + off);
+	memset(rec, 0, reclen);
+	rec->br_val = val;
+	rec->br_namelen = (fs_u8_t)len;
+	memcpy(BT_NAME(rec), name, len);
+	memcpy(buf + off + reclen, np->bt_recs + off, np->bt_used - off);
+	total = np->bt_used + reclen;
+
+	/*
+	 * The first half ends before the first record which
+	 * goes past half of the lot, keeping at least a record.
+	 */
+
+	for (o = 0, n = 0; ; o += DIRBT_RECLEN(rec->br_namelen), n++) {
+		rec = (struct dirbt_rec *)(buf + o);
+		if (n > 0 && o + DIRBT_RECLEN(rec->br_namelen) > total / 2) {
+			break;
+		}
+	}
+	*seplenp = rec->br_namelen;
+	memcpy(sep, BT_NAME(rec), rec->br_namelen);
+	memset(rp, 0, ONE_K);
+	rp->bt_level = np->bt_level;
+	if (np->bt_level) {
+		rp->bt_first = (fs_u32_t)rec->br_val;
+		skip = DIRBT_RECLEN(rec->br_namelen);
+	}
+	memcpy(rp->bt_recs, buf + o + skip, total - o - skip);
+	rp->bt_used = total - o - skip;
+	rp->bt_nrecs = nrecs - n - (skip != 0);
+	memset(np->bt_recs, 0, DIRBT_SPACE);
+	memcpy(np->bt_recs, buf, o);
+	np->bt_used = o;
+	np->bt_nrecs = n;
+}
+
+/*
+ * Add an entry to a B-tree directory, splitting the nodes on
+ * the way to its leaf which have no room left, from the leaf
+ * up.
+ * Returns zero or error number.
+ */
+
+static int
+dir_add_btree(
+	struct fsmem		*fsm,
+	struct minode		*dir,
+	char			*name,
+	fs_u64_t		inum)
+{
+	struct dirbt_node	node, right;
+	fs_u32_t		path[DIRBT_MAXDEPTH], off, nb, lb;
+	fs_u64_t		val = inum;
+	char			sep[DIRREC_MAXNAME];
+	const char		*key = name;
+	int			keylen = strlen(name), seplen, d, found;
+	int			error;
+
+	if (keylen > DIRREC_MAXNAME) {
+		return ENAMETOOLONG;
+	}
+	if (dir->mino_size == 0) {
+		if ((error = bt_newblk(fsm, dir, &nb)) != 0) {
+			return error;
+		}
+		memset(&node, 0, ONE_K);
+		path[0] = nb;
+		d = 0;
+	} else if ((error = bt_descend(dir, name, keylen, &node, path,
+				       &d)) != 0) {
+		return error;
+	}
+	for (;;) {
+		if ((found = bt_search(&node, key, keylen, &off)) != 0) {
+			return (found < 0) ? EIO : EEXIST;
+		}
+		if (node.bt_used + DIRBT_RECLEN(keylen) <= DIRBT_SPACE) {
+			bt_put(&node, off, key, keylen, val);
+			return bt_write(fsm, dir, path[d], &node);
+		}
+		if ((error = bt_newblk(fsm, dir, &nb)) != 0) {
+			return error;
+		}
+		bt_split(&node, off, key, keylen, val, &right, sep, &seplen);
+		if (node.bt_level == 0) {
+			right.bt_next = node.bt_next;
+			node.bt_next = nb;
+		}
+		if (d > 0) {
+
+			/*
+			 * The new node goes in the parent, after
+			 * the node split.
+			 */
+
+			if ((error = bt_write(fsm, dir, nb, &right)) != 0 ||
+			    (error = bt_write(fsm, dir, path[d], &node)) != 0 ||
+			    (error = bt_read(dir, path[--d], &node)) != 0) {
+				return error;
+			}
+			key = sep;
+			keylen = seplen;
+			val = nb;
+			continue;
+		}
+
+		/*
+		 * The root is split: both halves move to new nodes
+		 * and it gets a level more, pointing at them.
+		 */
+
+		if ((error = bt_newblk(fsm, dir, &lb)) != 0) {
+			return error;
+		}
+		if (node.bt_level == 0) {
+			node.bt_next = nb;
+		}
+		if ((error = bt_write(fsm, dir, nb, &right)) != 0 ||
+		    (error = bt_write(fsm, dir, lb, &node)) != 0) {
+			return error;
+		}
+		memset(&right, 0, ONE_K);
+		right.bt_level = node.bt_level + 1;
+		right.bt_first = lb;
+		bt_put(&right, 0, sep, seplen, nb);
+		return bt_write(fsm, dir, 0, &right);
+	}
+}
+
+/*
+ * Take the record at offset 'off' of B-tree directory 'dir'
+ * out of its leaf.
+ * Returns zero or error number.
+ */
+
+static int
+bt_delete(
+	struct fsmem		*fsm,
+	struct minode		*dir,
+	fs_u64_t		off)
+{
+	struct dirbt_node	node;
+	struct dirbt_rec	*rec;
+	fs_u32_t		b = (fs_u32_t)(off >> LOG_ONE_K), roff, reclen;
+	int			error;
+
+	if ((error = bt_read(dir, b, &node)) != 0) {
+		return error;
+	}
+	roff = (off & (ONE_K - 1)) - DIRBT_HDRLEN;
+	if (node.bt_level != 0 || (rec = bt_rec(&node, roff)) == NULL) {
+		return EIO;
+	}
+	reclen = DIRBT_RECLEN(rec->br_namelen);
+	memmove(node.bt_recs + roff, node.bt_recs + roff + reclen,
+		node.bt_used - roff - reclen);
+	node.bt_used -= reclen;
+	memset(node.bt_recs + node.bt_used, 0, reclen);
+	node.bt_nrecs--;
+	return bt_write(fsm, dir, b, &node);
+}
+
+/*
+ * Copy the 'len' bytes at 'name' and inode number 'inum'
+ * into 'ud'.
+ */
+
+static void
+dir_setud(
+	struct udirentry	*ud,
+	const char		*name,
+	int			len,
+	fs_u64_t		inum)
+{
+	memcpy(ud->udir_name, name, len);
+	ud->udir_name[len] = '\0';
+	ud->udir_inum = inum;
+}
+
+/*
+ * Entries being returned by dir_read_sorted() for a directory
+ * other than a B-tree: a heap of the 'ds_n' first names found
+ * so far, the greatest at the top, out of those after
+ * 'ds_cookie' starting with 'ds_prefix'.
+ */
+
+struct dir_sort {
+	struct udirentry	*ds_ud;
+	fs_u32_t		ds_n;
+	fs_u32_t		ds_max;
+	const char		*ds_prefix;
+	int			ds_plen;
+	const char		*ds_cookie;
+	int			ds_clen;
+};
+
+/*
+ * dir_walk() callback of dir_read_sorted().
+ */
+
+static int
+dir_sortfn(
+	void			*arg,
+	fs_u64_t		off,
+	fs_u64_t		inum,
+	const char		*name,
+	int			len,
+	fs_u32_t		h)
+{
+	struct dir_sort		*ds = (struct dir_sort *)arg;
+	struct udirentry	*ud = ds->ds_ud, tmp;
+	fs_u32_t		i, c;
+
+	(void) off;
+	(void) h;
+	if (len < ds->ds_plen || memcmp(name, ds->ds_prefix, ds->ds_plen) ||
+	    bt_cmp(name, len, ds->ds_cookie, ds->ds_clen) <= 0) {
+		return 0;
+	}
+	dir_setud(&tmp, name, len, inum);
+	if (ds->ds_n < ds->ds_max) {
+
+		/*
+		 * Add the name at the bottom and move it up.
+		 */
+
+		for (i = ds->ds_n++; i > 0 && strcmp(ud[(i - 1) / 2].udir_name,
+						     tmp.udir_name) < 0;
+		     i = (i - 1) / 2) {
+			ud[i] = ud[(i - 1) / 2];
+		}
+		ud[i] = tmp;
+		return 0;
+	}
+	if (strcmp(tmp.udir_name, ud[0].udir_name) >= 0) {
+		return 0;
+	}
+
+	/*
+	 * The name takes the place of the greatest one and
+	 * moves down.
+	 */
+
+	for (i = 0; (c = 2 * i + 1) < ds->ds_n; i = c) {
+		if (c + 1 < ds->ds_n &&
+		    strcmp(ud[c + 1].udir_name, ud[c].udir_name) > 0) {
+			c++;
+		}
+		if (strcmp(ud[c].udir_name, tmp.udir_name) <= 0) {
+			break;
+		}
+		ud[i] = ud[c];
+	}
+	ud[i] = tmp;
+	return 0;
+}
+
+/*
+ * qsort() comparison of entries by name.
+ */
+
+static int
+dir_udcmp(
+	const void	*a,
+	const void	*b)
+{
+	return strcmp(((struct udirentry *)a)->udir_name,
+		      ((struct udirentry *)b)->udir_name);
+}
+
+/*
+ * Read up to 'n' entries of directory 'dir' into 'ud' in the
+ * order of their names, taking the names which start with
+ * 'prefix' and come after 'cookie' (from the first name if it's
+ * empty), and set '*np' to the number read and 'cookie' (at
+ * least DIRREC_MAXNAME + 1 bytes) to the last name read, for the
+ * next call to go on from. A B-tree directory is read from the
+ * leaf where those names start; any other is read whole, the
+ * first 'n' of the names being kept.
+ * The caller must hold the directory lock (shared is enough).
+ * Returns zero or error number.
+ */
+
+int
+dir_read_sorted(
+	struct minode		*dir,
+	const char		*prefix,
+	char			*cookie,
+	struct udirentry	*ud,
+	fs_u32_t		n,
+	fs_u32_t		*np)
+{
+	struct dirbt_node	node;
+	struct dirbt_rec	*rec;
+	struct dir_sort		ds;
+	fs_u32_t		path[DIRBT_MAXDEPTH], off;
+	fs_u64_t		nleaves = 0;
+	const char		*start;
+	int			plen = strlen(prefix), clen = strlen(cookie);
+	int			slen, depth, error = 0;
+
+	*np = 0;
+	if (dir->mino_dirfmt != DIRFMT_BTREE) {
+		ds.ds_ud = ud;
+		ds.ds_n = 0;
+		ds.ds_max = n;
+		ds.ds_prefix = prefix;
+		ds.ds_plen = plen;
+		ds.ds_cookie = cookie;
+		ds.ds_clen = clen;
+		if (n > 0 && (error = dir_walk(dir, 0, dir_sortfn, &ds)) == 0) {
+			qsort(ud, ds.ds_n, sizeof(struct udirentry), dir_udcmp);
+			*np = ds.ds_n;
+		}
+		goto out;
+	}
+	if (dir->mino_size == 0 || n == 0) {
+		return 0;
+	}
+
+	/*
+	 * Start at the leaf of the greater of the prefix and the
+	 * cookie, and stop at the first name without the prefix.
+	 */
+
+	start = prefix;
+	slen = plen;
+	if (bt_cmp(cookie, clen, prefix, plen) > 0) {
+		start = cookie;
+		slen = clen;
+	}
+	if ((error = bt_descend(dir, start, slen, &node, path,
+				&depth)) != 0 ||
+	    bt_search(&node, start, slen, &off) < 0) {
+		return error ? error : EIO;
+	}
+	for (;;) {
+		for (; off < node.bt_used && *np < n;
+		     off += DIRBT_RECLEN(rec->br_namelen)) {
+			if ((rec = bt_rec(&node, off)) == NULL) {
+				return EIO;
+			}
+			if (rec->br_namelen < plen ||
+			    memcmp(BT_NAME(rec), prefix, plen) != 0) {
+				goto out;
+			}
+			if (bt_cmp(BT_NAME(rec), rec->br_namelen, cookie,
+				   clen) > 0) {
+				dir_setud(&ud[(*np)++], BT_NAME(rec),
+					  rec->br_namelen, rec->br_val);
+			}
+		}
+		if (*np == n || node.bt_next == 0) {
+			break;
+		}
+		if (++nleaves > (dir->mino_size >> LOG_ONE_K)) {
+			fprintf(stderr, "dir_read_sorted: Bad leaf chain in "
+				"directory inode %llu\n", dir->mino_number);
+			return EIO;
+		}
+		if ((error = bt_read(dir, node.bt_next, &node)) != 0) {
+			return error;
+		}
+		off = 0;
+	}
+
+out:
+	if (*np > 0) {
+		strcpy(cookie, ud[*np - 1].udir_name);
+	}
+	return error;
+}
+
+/*
+ * Make the new, empty directory 'inum' a B-tree directory.
+ * Returns zero or error number.
+ */
+
+int
+dir_makesorted(
+	struct fsmem	*fsm,
+	fs_u64_t	inum)
+{
+	struct minode	*dir;
+	int		error = 0;
+
+	if ((dir = iget(fsm, inum)) == NULL) {
+		return EIO;
+	}
+	ILOCK_EXCL(dir);
+	if (dir->mino_type != IFDIR || dir->mino_size != 0) {
+		error = EINVAL;
+	} else {
+		dir->mino_dirfmt = DIRFMT_BTREE;
+		if (iwrite(dir) != 0) {
+			error = EIO;
+		}
+	}
+	IUNLOCK(dir);
+	iput(dir);
+	return error;
+}
+
+/*
+ * Free space maps.
+ * Removing entries leaves holes in a directory, which a fixed
+ * format directory used to find by reading the whole directory
+ * and a packed one never reused. The free space map of a
+ * directory holds, for each of its blocks, the length of the
+ * longest record that fits in the block (for a fixed format
+ * directory, DIRENTRY_LEN if the block has a vacant slot), and
+ * keeps the blocks on FR_NCLASS lists by that length in units
+ * of 8 bytes, so finding a block where a new entry fits takes
+ * a look at the heads of at most FR_NCLASS lists, and the
+ * smallest hole it fits in is used.
+ * The map is built by reading the directory when an entry is
+ * first added to it, and add_direntry() and remove_direntry()
+ * keep it up to date, under the lock of the directory. It isn't
+ * kept on disk: iput() parks the map of a directory that goes
+ * out of core on the mount and iget() takes it back, so it
+ * lasts as long as the mount, and the maps of all but the last
+ * FR_NPARK directories parked are freed.
+ */
+
+#define FR_NCLASS	((ONE_K >> 3) + 1)
+#define FR_NONE		(~(fs_u32_t)0)
+#define FR_NPARK	64
+
+struct dirfree {
+	struct dirfree	*fr_next;
+	fs_u64_t	fr_ino;
+	fs_u32_t	fr_nblks;
+	fs_u32_t	fr_max;
+	fs_u16_t	*fr_space;
+	fs_u32_t	*fr_fnext;
+	fs_u32_t	*fr_fprev;
+	fs_u32_t	fr_head[FR_NCLASS];
+};
+
+/*
+ * Take block 'b' off the list of its class.
+ */
+
+static void
+fr_unlink(
+	struct dirfree	*fr,
+	fs_u32_t	b)
+{
+	fs_u32_t	next = fr->fr_fnext[b], prev = fr->fr_fprev[b];
+
+	if (prev == FR_NONE) {
+		fr->fr_head[fr->fr_space[b] >> 3] = next;
+	} else {
+		fr->fr_fnext[prev] = next;
+	}
+	if (next != FR_NONE) {
+		fr->fr_fprev[next] = prev;
+	}
+}
+
+/*
+ * Put block 'b' on the list of its class.
+ */
+
+static void
+fr_link(
+	struct dirfree	*fr,
+	fs_u32_t	b)
+{
+	fs_u32_t	c = fr->fr_space[b] >> 3;
+
+	fr->fr_fnext[b] = fr->fr_head[c];
+	fr->fr_fprev[b] = FR_NONE;
+	if (fr->fr_head[c] != FR_NONE) {
+		fr->fr_fprev[fr->fr_head[c]] = b;
+	}
+	fr->fr_head[c] = b;
+}
+
+/*
+ * Set the free space of block 'b' to 'space' bytes,
+ * growing the map if the block is new to it.
+ * Returns zero or ENOMEM.
+ */
+
+static int
+fr_set(
+	struct dirfree	*fr,
+	fs_u32_t	b,
+	fs_u32_t	space)
+{
+	fs_u32_t	max;
+	void		*p;
+
+	if (b >= fr->fr_max) {
+		max = MAX(b + 1, fr->fr_max * 2);
+		if ((p = realloc(fr->fr_space, max * sizeof(fs_u16_t))) ==
+		    NULL) {
+			return ENOMEM;
+		}
+		fr->fr_space = (fs_u16_t *)p;
+		if ((p = realloc(fr->fr_fnext, max * sizeof(fs_u32_t))) ==
+		    NULL) {
+			return ENOMEM;
+		}
+		fr->fr_fnext = (fs_u32_t *)p;
+		if ((p = realloc(fr->fr_fprev, max * sizeof(fs_u32_t))) ==
+		    NULL) {
+			return ENOMEM;
+		}
+		fr->fr_fprev = (fs_u32_t *)p;
+		fr->fr_max = max;
+	}
+	for (; fr->fr_nblks <= b; fr->fr_nblks++) {
+		fr->fr_space[fr->fr_nblks] = 0;
+		fr_link(fr, fr->fr_nblks);
+	}
+	fr_unlink(fr, b);
+	fr->fr_space[b] = (fs_u16_t)space;
+	fr_link(fr, b);
+	return 0;
+}
+
+static void
+fr_free(
+	struct dirfree	*fr)
+{
+	free(fr->fr_space);
+	free(fr->fr_fnext);
+	free(fr->fr_fprev);
+	free(fr);
+}
+
+/*
+ * Length of the longest record that fits in the 'blk' of
+ * block 'b' of a directory (a bad block is taken as full).
+ */
+
+static fs_u32_t
+dir_blkspace(
+	struct minode	*dir,
+	char		*blk,
+	fs_u32_t	b)
+{
+	struct direntry	*ent = (struct direntry *)blk;
+	struct dirrec	*rec;
+	fs_u32_t	off, n, space = 0;
+
+	if (dir->mino_dirfmt == DIRFMT_PACKED) {
+		for (off = 0; off < ONE_K; off += rec->dr_reclen) {
+			if ((rec = dir_rec(blk, off)) == NULL) {
+				return 0;
+			}
+			n = rec->dr_reclen;
+			if (rec->dr_inum != 0) {
+				n -= DIRREC_LEN(rec->dr_namelen);
+			}
+			space = MAX(space, n);
+		}
+		return space;
+	}
+
+	/*
+	 * Slot 0 of a fixed format directory is never reused
+	 * (see dir_add_fixed()).
+	 */
+
+	n = MIN(dir->mino_size - ((fs_u64_t)b << LOG_ONE_K), ONE_K) /
+		DIRENTRY_LEN;
+	off = (b == 0);
+	return (off + dirscan_slot(ent + off, n - off, 0) < n) ?
+		DIRENTRY_LEN : 0;
+}
+
+/*
+ * Build the free space map of a directory.
+ * Returns zero or error number.
  */
 
-int
-add_direntry(
+static int
+dirfree_build(
+	struct minode	*dir)
+{
+	struct dirfree	*fr;
+	fs_u64_t	off;
+	fs_u32_t	b, i, len;
+	char		*buf;
+	int		error = 0;
+
+	if ((fr = (struct dirfree *)calloc(1, sizeof(struct dirfree))) ==
+	    NULL) {
+		return ENOMEM;
+	}
+	if ((buf = (char *)malloc(DIR_ALLOCSZ << LOG_ONE_K)) == NULL) {
+		free(fr);
+		return ENOMEM;
+	}
+	fr->fr_ino = dir->mino_number;
+	for (i = 0; i < FR_NCLASS; i++) {
+		fr->fr_head[i] = FR_NONE;
+	}
+	for (off = 0; off < dir->mino_size && error == 0; off += len) {
+		len = MIN(dir->mino_size - off, DIR_ALLOCSZ << LOG_ONE_K);
+		if (internal_read(dir, buf, off, len) != (int)len) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		for (i = 0; i < len && error == 0; i += ONE_K) {
+			b = (off + i) >> LOG_ONE_K;
+			error = fr_set(fr, b, dir_blkspace(dir, buf + i, b));
+		}
+	}
+	free(buf);
+	if (error) {
+		fr_free(fr);
+		return error;
+	}
+	dir->mino_dfree = fr;
+	return 0;
+}
+
+/*
+ * Set '*bp' to a block of a directory where a record of 'need'
+ * bytes fits, or FR_NONE if there's none.
+ * Returns zero or error number.
+ */
+
+static int
+dir_freeblk(
+	struct minode	*dir,
+	fs_u32_t	need,
+	fs_u32_t	*bp)
+{
+	struct dirfree	*fr;
+	fs_u32_t	c;
+	int		error;
+
+	if (dir->mino_dfree == NULL && (error = dirfree_build(dir)) != 0) {
+		return error;
+	}
+	fr = dir->mino_dfree;
+	for (c = (need + 7) >> 3; c < FR_NCLASS; c++) {
+		if (fr->fr_head[c] != FR_NONE) {
+			*bp = fr->fr_head[c];
+			return 0;
+		}
+	}
+	*bp = FR_NONE;
+	return 0;
+}
+
+/*
+ * Record that block 'b' of a directory now has 'space' bytes
+ * free. A map which can't be updated is dropped, to be built
+ * again when it's next needed.
+ */
+
+static void
+dir_setfree(
+	struct minode	*dir,
+	fs_u32_t	b,
+	fs_u32_t	space)
+{
+	if (dir->mino_dfree && fr_set(dir->mino_dfree, b, space) != 0) {
+		dirfree_release(dir);
+	}
+}
+
+/*
+ * Free the free space map of a directory.
+ */
+
+void
+dirfree_release(
+	struct minode	*dir)
+{
+	if (dir->mino_dfree) {
+		fr_free(dir->mino_dfree);
+		dir->mino_dfree = NULL;
+	}
+}
+
+/*
+ * Park the free space map of a directory going out of core,
+ * freeing the map parked longest ago if there are too many.
+ * Called with fsm_icachelock held.
+ */
+
+void
+dirfree_park(
+	struct fsmem	*fsm,
+	struct minode	*dir)
+{
+	struct dirfree	*fr, **frp;
+	int		n;
+
+	if ((fr = dir->mino_dfree) == NULL) {
+		return;
+	}
+	dir->mino_dfree = NULL;
+	fr->fr_next = fsm->fsm_dfpark;
+	fsm->fsm_dfpark = fr;
+	for (n = 0, frp = &fsm->fsm_dfpark; *frp && n < FR_NPARK;
+	     n++, frp = &(*frp)->fr_next);
+	if ((fr = *frp) != NULL) {
+		*frp = NULL;
+		fr_free(fr);
+	}
+}
+
+/*
+ * Give a directory coming into core the map parked for it,
+ * if any. Called with fsm_icachelock held.
+ */
+
+void
+dirfree_unpark(
+	struct fsmem	*fsm,
+	struct minode	*dir)
+{
+	struct dirfree	*fr, **frp;
+
+	for (frp = &fsm->fsm_dfpark; (fr = *frp) != NULL;
+	     frp = &fr->fr_next) {
+		if (fr->fr_ino == dir->mino_number) {
+			*frp = fr->fr_next;
+			dir->mino_dfree = fr;
+			return;
+		}
+	}
+}
+
+/*
+ * Free all the parked maps at unmount time.
+ */
+
+void
+dirfree_fini(
+	struct fsmem	*fsm)
+{
+	struct dirfree	*fr;
+
+	while ((fr = fsm->fsm_dfpark) != NULL) {
+		fsm->fsm_dfpark = fr->fr_next;
+		fr_free(fr);
+	}
+}
+
+/*
+ * Put an entry for the 'namelen' bytes at 'name' (inode 'inum')
+ * in the first record with room for it in the packed directory
+ * block 'blk' and set '*roffp' to its offset in the block.
+ * Returns zero, ENOSPC if there's no room or EIO if the block
+ * is bad.
+ */
+
+static int
+dir_blkadd(
+	char		*blk,
+	const char	*name,
+	int		namelen,
+	fs_u64_t	inum,
+	fs_u32_t	*roffp)
+{
+	struct dirrec	*rec, *nrec;
+	fs_u32_t	roff, used = 0, need = DIRREC_LEN(namelen);
+
+	for (roff = 0; roff < ONE_K; roff += rec->dr_reclen) {
+		if ((rec = dir_rec(blk, roff)) == NULL) {
+			return EIO;
+		}
+		used = rec->dr_inum ? DIRREC_LEN(rec->dr_namelen) : 0;
+		if (rec->dr_reclen - used >= need) {
+			break;
+		}
+	}
+	if (roff >= ONE_K) {
+		return ENOSPC;
+	}
+	nrec = rec;
+	if (used) {
+		nrec = (struct dirrec *)(blk + roff + used);
+		nrec->dr_reclen = rec->dr_reclen - used;
+		rec->dr_reclen = used;
+		roff += used;
+	}
+	nrec->dr_inum = inum;
+	nrec->dr_hash = dir_hash(name, namelen);
+	nrec->dr_namelen = (fs_u8_t)namelen;
+	nrec->dr_pad = 0;
+	memcpy(nrec + 1, name, namelen);
+	*roffp = roff;
+	return 0;
+}
+
+/*
+ * Make 'blk' an empty packed directory block.
+ */
+
+static void
+dir_blkinit(
+	char		*blk)
+{
+	struct dirrec	*rec = (struct dirrec *)blk;
+
+	memset(blk, 0, ONE_K);
+	rec->dr_reclen = ONE_K;
+}
+
+/*
+ * Add an entry to a packed directory, in the smallest hole
+ * its free space map finds for it, or else in a new block,
+ * and set '*offp' to its offset.
+ * Returns zero or error number.
+ */
+
+static int
+dir_add_packed(
+	struct fsmem	*fsm,
+	struct minode	*dir,
+	char		*name,
+	fs_u64_t	inum,
+	fs_u64_t	*offp)
+{
+	fs_u64_t	boff, blkno, len;
+	fs_u32_t	roff, b;
+	char		blk[ONE_K];
+	int		namelen = strlen(name), error;
+
+	if (namelen > DIRREC_MAXNAME) {
+		return ENAMETOOLONG;
+	}
+	if ((error = dir_freeblk(dir, DIRREC_LEN(namelen), &b)) != 0) {
+		return error;
+	}
+	if (b != FR_NONE) {
+		boff = (fs_u64_t)b << LOG_ONE_K;
+		if (internal_read(dir, blk, boff, ONE_K) != ONE_K) {
+			return errno ? errno : EIO;
+		}
+	} else {
+
+		/*
+		 * No block has room: start a new one, allocating
+		 * blocks to the directory if it has none left.
+		 */
+
+		if ((dir->mino_nblocks << LOG_ONE_K) == dir->mino_size &&
+		    (error = bmap_alloc(fsm, dir, DIR_ALLOCSZ, &blkno,
+					&len)) != 0) {
+			fprintf(stderr, "add_direntry: bmap allocation failed "
+				"for directory inode %llu for %s\n",
+				dir->mino_number, fsm->fsm_mntpt);
+			return error;
+		}
+		boff = dir->mino_size;
+		dir_blkinit(blk);
+	}
+	if (dir_blkadd(blk, name, namelen, inum, &roff) != 0) {
+		fprintf(stderr, "add_direntry: No room in block %llu "
+			"of directory inode %llu\n", boff >> LOG_ONE_K,
+			dir->mino_number);
+		return EIO;
+	}
+	if (metadata_write(fsm, boff, blk, ONE_K, dir) != ONE_K) {
+		return errno;
+	}
+	if (boff == dir->mino_size) {
+		dir->mino_size += ONE_K;
+	}
+	dir_setfree(dir, boff >> LOG_ONE_K,
+		    dir_blkspace(dir, blk, boff >> LOG_ONE_K));
+	*offp = boff + roff;
+	return 0;
+}
+
+/*
+ * Add an entry to a fixed directory, in the first free
+ * entry, and set '*offp' to its offset.
+ * Returns zero or error number.
+ */
+
+static int
+dir_add_fixed(
 	struct fsmem	*fsm,
 	struct minode	*parent,
 	char		*name,
-	fs_u64_t	inum)
+	fs_u64_t	inum,
+	fs_u64_t	*offp)
 {
-	struct direntry	ent, *buf = NULL;
-	fs_u64_t	blkno, len, offset = 0;
-	int		i, error = 0, nent, remain;
+	struct direntry	ent, *buf = NULL, *slots;
+	fs_u64_t	blkno, len, offset = 0, boff = 0;
+	fs_u32_t	b, i, n;
+	char		blk[ONE_K];
+	int		error = 0;
 
-	assert(inum != 0);
+	if (strlen(name) >= sizeof(ent.name)) {
+		return ENAMETOOLONG;
+	}
 	assert((parent->mino_nblocks << LOG_ONE_K) >=
 		parent->mino_dirspec.ds_ndirents * DIRENTRY_LEN);
 	if ((parent->mino_nblocks << LOG_ONE_K) ==
@@ -52,116 +1985,422 @@ add_direntry(
 		memset(buf, 0, len << LOG_ONE_K);
 		strncpy(buf->name, name, strlen(name));
 		buf->inumber = inum;
-		lseek(fsm->fsm_devfd, blkno << LOG_ONE_K, SEEK_SET);
-		printf("add_direntry: Writing at %llu blkno\n", blkno);
-		if (write(fsm->fsm_devfd, buf, len << LOG_ONE_K) !=
-			  len << LOG_ONE_K) {
+		if ((error = jnl_write(fsm, buf, len << LOG_ONE_K,
+				       blkno << LOG_ONE_K)) != 0) {
 			fprintf(stderr, "add_direntry: Failed to write "
 				"new directory block %llu for %s\n", blkno,
 				fsm->fsm_mntpt);
 			free(buf);
-			return errno;
+			return error;
 		}
-		printf("add_direntry: Current dir size is: %llu\n",
-			parent->mino_size);
+		offset = parent->mino_size;
 		parent->mino_size += DIRENTRY_LEN;
 	} else {
 
 		/*
 		 * we've got some free space inside the existing directory
-		 * blocks. If we've free space at the end of directory
-		 * blocks, then we don't need to search the blocks for
-		 * free space. If even the last directory entry is occupied
-		 * then we need to do the search.
+		 * blocks. Take a vacant slot in the block the free space
+		 * map of the directory points at, if any (since inode
+		 * number of ilist inode is 0, the first slot is an
+		 * exception), or else the free space at the end of the
+		 * directory blocks. There must be one or the other; if
+		 * not, then there is some inconsistency in the directory
+		 * metadata!
 		 */
 
 		memset(&ent, 0, DIRENTRY_LEN);
 		strncpy(ent.name, name, strlen(name));
 		ent.inumber = inum;
-		if (parent->mino_size < (parent->mino_nblocks << LOG_ONE_K)) {
-			if (metadata_write(fsm, parent->mino_size, (char *)&ent,
-					   DIRENTRY_LEN, parent) !=
-					   DIRENTRY_LEN) {
-				return errno;
+		if ((error = dir_freeblk(parent, DIRENTRY_LEN, &b)) != 0) {
+			return error;
+		}
+		if (b != FR_NONE) {
+			boff = (fs_u64_t)b << LOG_ONE_K;
+			n = MIN(parent->mino_size - boff, ONE_K);
+			if (internal_read(parent, blk, boff, n) != (int)n) {
+				return errno ? errno : EIO;
 			}
-			parent->mino_size += DIRENTRY_LEN;
-		} else {
-			buf = (struct direntry *)malloc(DIR_ALLOCSZ << LOG_ONE_K);
-			if (buf == NULL) {
-				fprintf(stderr, "add_direntry: Failed to "
-					"allocate memory for internal buffer"
-					" for %s\n", fsm->fsm_mntpt);
-				return ENOMEM;
+			slots = (struct direntry *)blk;
+			i = (b == 0);
+			i += dirscan_slot(slots + i, n / DIRENTRY_LEN - i, 0);
+			if (i == n / DIRENTRY_LEN) {
+				fprintf(stderr, "add_direntry: No vacant entry "
+					"in block %u of directory inode %llu\n",
+					b, parent->mino_number);
+				return EIO;
 			}
-			memset(buf, 0, DIR_ALLOCSZ << LOG_ONE_K);
+			offset = boff + i * DIRENTRY_LEN;
+			slots[i] = ent;
+		} else if (parent->mino_size <
+			   (parent->mino_nblocks << LOG_ONE_K)) {
+			offset = parent->mino_size;
+		} else {
+			fprintf(stderr, "FATAL BUG: no free space "
+				"found in directory blocks\n");
+			assert(0);
+			return EIO;
+		}
+		if (metadata_write(fsm, offset, (char *)&ent,
+				   DIRENTRY_LEN, parent) != DIRENTRY_LEN) {
+			return errno;
+		}
+		if (b != FR_NONE) {
+			dir_setfree(parent, b, dir_blkspace(parent, blk, b));
+		} else {
+			parent->mino_size += DIRENTRY_LEN;
+		}
+	}
 
-			/*
-			 * Search for a vacant directory entry in the
-			 * already allocated extents. We must be able to
-			 * find such entry; if not, then there is some
-			 * inconsistency in the directory metadata!
-			 */
+	*offp = offset;
+	if (buf) {
+		free(buf);
+	}
 
-			for (;;) {
-				if (offset == parent->mino_size) {
-					break;
-				}
-				remain = MIN(parent->mino_size - offset,
-					     DIR_ALLOCSZ << LOG_ONE_K);
-				nent = internal_readdir(parent, buf, offset,
-							remain/DIRENTRY_LEN);
-				if (nent < remain/DIRENTRY_LEN) {
-					free(buf);
-					return errno;
-				}
-				for (i = 0; i < nent; i++) {
-
-					/*
-					 * look for the direntry for which
-					 * inode number is zero.
-					 * Since inode number of ilist inode
-					 * is 0, it will be an exception
-					 */
-
-					if (offset == 0 && i == 0) {
-						continue;
-					}
-					if (buf[i].inumber == 0) {
-						fprintf(stdout, "Found vacant "
-							"entry at %llu offset",
-							offset);
-						memcpy(buf[i].name, name,
-							strlen(name));
-						buf[i].inumber = inum;
-						break;
-					}
-					offset += DIRENTRY_LEN;
-				}
-				if (i != nent) {
-					break;
-				}
-				offset += (fs_u64_t)remain;
-			}
-			if (offset == parent->mino_size) {
-				fprintf(stderr, "FATAL BUG: no free space "
-					"found in directory blocks\n");
-				assert(0);
-				free(buf);
-				return EIO;
+	return error;
+}
+
+/*
+ * Length of the longest name which can be added to 'dir': a
+ * fixed directory which has entries keeps its short names.
+ */
+
+int
+dir_maxname(
+	struct minode	*dir)
+{
+	struct direntry	ent;
+
+	if (dir->mino_dirfmt == DIRFMT_FIXED && dir->mino_size > 0) {
+		return (int)sizeof(ent.name) - 1;
+	}
+	return DIRREC_MAXNAME;
+}
+
+/*
+ * Add a file entry to the directory.
+ * The caller must hold the directory inode lock exclusive.
+ */
+
+int
+add_direntry(
+	struct fsmem	*fsm,
+	struct minode	*parent,
+	char		*name,
+	fs_u64_t	inum)
+{
+	fs_u64_t	offset;
+	int		error;
+
+	assert(inum != 0);
+	if (parent->mino_size == 0 && parent->mino_dirfmt != DIRFMT_BTREE) {
+		parent->mino_dirfmt = DIRFMT_PACKED;
+	}
+	offset = 0;
+	error = (parent->mino_dirfmt == DIRFMT_BTREE) ?
+		dir_add_btree(fsm, parent, name, inum) :
+		(parent->mino_dirfmt == DIRFMT_PACKED) ?
+		dir_add_packed(fsm, parent, name, inum, &offset) :
+		dir_add_fixed(fsm, parent, name, inum, &offset);
+	if (error) {
+		return error;
+	}
+	parent->mino_dirspec.ds_ndirents++;
+
+	/*
+	 * A directory whose index can't be updated is just
+	 * searched linearly until the index is rebuilt.
+	 */
+
+	if (dirhash_add(fsm, parent, name, offset) != 0) {
+		fprintf(stderr, "add_direntry: Failed to index %s in "
+			"directory inode %llu for %s\n", name,
+			parent->mino_number, fsm->fsm_mntpt);
+	}
+	dcache_enter(fsm, parent->mino_number, name, strlen(name), inum);
+	return iwrite(parent);
+}
+
+/*
+ * Add a batch of entries to the hash index of a directory: 'n'
+ * entries hashing to 'hashes' at offsets 'offs'. A batch of at
+ * least as many entries as the index has buckets would rewrite
+ * about every bucket anyway, so the index is then built again
+ * in one pass instead, as it is when it has to grow.
+ * Returns zero or error number.
+ */
+
+static int
+dirhash_addbatch(
+	struct fsmem	*fsm,
+	struct minode	*dir,
+	fs_u32_t	*hashes,
+	fs_u64_t	*offs,
+	int		n)
+{
+	fs_u32_t	nb;
+	int		i, error = 0;
+
+	if (dir->mino_nbuckets == 0 && dir->mino_ndirents < DIRHASH_MIN) {
+		return 0;
+	}
+	if (dir->mino_nbuckets == 0 || (fs_u32_t)n >= dir->mino_nbuckets ||
+	    dir->mino_ndirents > (fs_u64_t)dir->mino_nbuckets * DH_FILL) {
+		for (nb = 1; (fs_u64_t)nb * DH_FILL < dir->mino_ndirents * 2;
+		     nb <<= 1);
+		error = dirhash_build(fsm, dir, MAX(nb, dir->mino_nbuckets));
+	} else {
+		for (i = 0; i < n && error == 0; i++) {
+			error = (offs[i] > 0xffffffffULL) ? EFBIG :
+				dirhash_insert(fsm, dir, hashes[i],
+					       (fs_u32_t)offs[i]);
+		}
+	}
+	if (error) {
+		dir->mino_nbuckets = 0;
+	}
+	return error;
+}
+
+/*
+ * Add the 'n' entries 'names' (inodes 'inums') to a directory
+ * as add_direntry() would, but filling the directory blocks in
+ * memory: each block with room left (see the free space maps)
+ * is read and written once, the new blocks are allocated and
+ * written in runs, and the hash index and the directory inode
+ * are updated once for the lot. The names must be valid and
+ * not in the directory. '*addedp' is set to the number of
+ * entries added, the first ones of the batch, which stay
+ * added if there's an error.
+ * Returns zero or error number.
+ */
+
+int
+add_direntries(
+	struct fsmem	*fsm,
+	struct minode	*dir,
+	char		**names,
+	fs_u64_t	*inums,
+	int		n,
+	int		*addedp)
+{
+	fs_u64_t	*offs = NULL, base, boff, blkno, len, off;
+	fs_u32_t	*hashes = NULL, roff, b, nblks = 0, maxblks = 0, k;
+	char		blk[ONE_K], *buf = NULL, *p;
+	int		i, j, error = 0;
+
+	*addedp = 0;
+	if (dir->mino_size == 0 && dir->mino_dirfmt != DIRFMT_BTREE) {
+		dir->mino_dirfmt = DIRFMT_PACKED;
+	}
+	if (dir->mino_dirfmt != DIRFMT_PACKED) {
+
+		/*
+		 * Fixed format and B-tree directories get their
+		 * entries one at a time.
+		 */
+
+		for (i = 0; i < n; i++) {
+			if ((error = add_direntry(fsm, dir, names[i],
+						  inums[i])) != 0) {
+				break;
 			}
-			if (metadata_write(fsm, offset, (char *)buf, remain,
-					   parent) != remain) {
-				free(buf);
-				return errno;
+		}
+		*addedp = i;
+		return error;
+	}
+	offs = (fs_u64_t *)malloc(n * sizeof(fs_u64_t));
+	hashes = (fs_u32_t *)malloc(n * sizeof(fs_u32_t));
+	if (offs == NULL || hashes == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+
+	/*
+	 * Fill the blocks with room left first.
+	 */
+
+	for (i = 0; i < n; i = j) {
+		if ((error = dir_freeblk(dir, DIRREC_LEN(strlen(names[i])),
+					 &b)) != 0 || b == FR_NONE) {
+			break;
+		}
+		boff = (fs_u64_t)b << LOG_ONE_K;
+		if (internal_read(dir, blk, boff, ONE_K) != ONE_K) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		for (j = i; j < n && dir_blkadd(blk, names[j], strlen(names[j]),
+						inums[j], &roff) == 0; j++) {
+			offs[j] = boff + roff;
+		}
+		if (j == i) {
+			fprintf(stderr, "add_direntries: No room in block %u "
+				"of directory inode %llu\n", b,
+				dir->mino_number);
+			error = EIO;
+			break;
+		}
+		if (metadata_write(fsm, boff, blk, ONE_K, dir) != ONE_K) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		dir_setfree(dir, b, dir_blkspace(dir, blk, b));
+		*addedp = j;
+	}
+
+	/*
+	 * Pack the rest in new blocks, then write those out a run
+	 * of blocks within one extent of the directory at a time,
+	 * allocating extents for all of them at once if possible.
+	 */
+
+	base = dir->mino_size;
+	for (j = i; error == 0 && j < n; nblks++) {
+		if (nblks == maxblks) {
+			maxblks = maxblks ? maxblks * 2 : DIR_ALLOCSZ;
+			if ((p = (char *)realloc(buf, (size_t)maxblks <<
+						 LOG_ONE_K)) == NULL) {
+				error = ENOMEM;
+				break;
 			}
+			buf = p;
 		}
+		p = buf + ((size_t)nblks << LOG_ONE_K);
+		dir_blkinit(p);
+		for (; j < n && dir_blkadd(p, names[j], strlen(names[j]),
+					   inums[j], &roff) == 0; j++) {
+			offs[j] = base + ((fs_u64_t)nblks << LOG_ONE_K) + roff;
+		}
+	}
+	for (k = 0; error == 0 && k < nblks; k += len) {
+		if ((dir->mino_nblocks << LOG_ONE_K) == dir->mino_size &&
+		    (error = bmap_alloc(fsm, dir, (nblks - k + DIR_ALLOCSZ - 1) &
+					~(DIR_ALLOCSZ - 1), &blkno,
+					&len)) != 0) {
+			fprintf(stderr, "add_direntries: bmap allocation "
+				"failed for directory inode %llu for %s\n",
+				dir->mino_number, fsm->fsm_mntpt);
+			break;
+		}
+		if ((error = bmap(dir, &blkno, &len, &off,
+				  dir->mino_size)) != 0) {
+			break;
+		}
+		len = MIN(len >> LOG_ONE_K, nblks - k);
+		if ((error = jnl_write(fsm, buf + ((size_t)k << LOG_ONE_K),
+				       len << LOG_ONE_K,
+				       (blkno << LOG_ONE_K) + off)) != 0) {
+			break;
+		}
+		for (b = 0; b < len; b++) {
+			dir_setfree(dir, (dir->mino_size >> LOG_ONE_K) + b,
+				    dir_blkspace(dir, buf + ((size_t)(k + b) <<
+						 LOG_ONE_K), 0));
+		}
+		dir->mino_size += len << LOG_ONE_K;
+		for (; *addedp < n && offs[*addedp] < dir->mino_size;
+		     (*addedp)++);
 	}
 
-	parent->mino_dirspec.ds_ndirents++;
-	error = iwrite(parent);
-	if (buf) {
-		free(buf);
+	/*
+	 * Whatever was added is accounted for, even if not all
+	 * of the batch was.
+	 */
+
+	if (*addedp == 0) {
+		goto out;
+	}
+	dir->mino_ndirents += *addedp;
+	for (j = 0; j < *addedp; j++) {
+		hashes[j] = dir_hash(names[j], strlen(names[j]));
+		dcache_enter(fsm, dir->mino_number, names[j], strlen(names[j]),
+			     inums[j]);
+	}
+	if (dirhash_addbatch(fsm, dir, hashes, offs, *addedp) != 0) {
+		fprintf(stderr, "add_direntries: Failed to index directory "
+			"inode %llu for %s\n", dir->mino_number,
+			fsm->fsm_mntpt);
+	}
+	if (iwrite(dir) != 0 && error == 0) {
+		error = EIO;
 	}
 
+out:
+	free(offs);
+	free(hashes);
+	free(buf);
 	return error;
 }
+
+/*
+ * Remove the entry 'name' from the directory. In a packed
+ * directory, the space of the record goes to the record
+ * before it in the block, if any.
+ * The caller must hold fsm_nslock and the directory inode
+ * lock exclusive.
+ * Returns zero, ENOENT if there is no such name, or error
+ * number.
+ */
+
+int
+remove_direntry(
+	struct fsmem	*fsm,
+	struct minode	*parent,
+	char		*name)
+{
+	struct direntry	ent;
+	struct dirrec	*rec, *prev = NULL;
+	fs_u64_t	inum, off, boff;
+	fs_u32_t	roff;
+	char		blk[ONE_K];
+	int		len = strlen(name), error;
+
+	if ((error = dir_find(parent, name, len, &inum, &off)) != 0) {
+		return error;
+	}
+	if (parent->mino_dirfmt == DIRFMT_BTREE) {
+		if ((error = bt_delete(fsm, parent, off)) != 0) {
+			return error;
+		}
+	} else if (parent->mino_dirfmt != DIRFMT_PACKED) {
+		memset(&ent, 0, DIRENTRY_LEN);
+		if (metadata_write(fsm, off, (char *)&ent, DIRENTRY_LEN,
+				   parent) != DIRENTRY_LEN) {
+			return errno ? errno : EIO;
+		}
+		if (off != 0) {
+			dir_setfree(parent, off >> LOG_ONE_K, DIRENTRY_LEN);
+		}
+	} else {
+		boff = off & ~(fs_u64_t)(ONE_K - 1);
+		if (internal_read(parent, blk, boff, ONE_K) != ONE_K) {
+			return errno ? errno : EIO;
+		}
+		for (roff = 0; roff < (off & (ONE_K - 1));
+		     roff += rec->dr_reclen) {
+			if ((rec = dir_rec(blk, roff)) == NULL) {
+				return EIO;
+			}
+			prev = rec;
+		}
+		rec = (struct dirrec *)(blk + roff);
+		if (prev) {
+			prev->dr_reclen += rec->dr_reclen;
+		} else {
+			rec->dr_inum = 0;
+		}
+		if (metadata_write(fsm, boff, blk, ONE_K, parent) != ONE_K) {
+			return errno ? errno : EIO;
+		}
+		dir_setfree(parent, boff >> LOG_ONE_K,
+			    dir_blkspace(parent, blk, boff >> LOG_ONE_K));
+	}
+	parent->mino_dirspec.ds_ndirents--;
+	if (dirhash_remove(fsm, parent, dir_hash(name, len), off) != 0) {
+		fprintf(stderr, "remove_direntry: Failed to remove %s from "
+			"the index of directory inode %llu for %s\n", name,
+			parent->mino_number, fsm->fsm_mntpt);
+	}
+	dcache_enter(fsm, parent->mino_number, name, len, 0);
+	return iwrite(parent);
+}
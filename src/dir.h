@@ -1,6 +1,21 @@
 #ifndef _FS_DIR_H
 #define _FS_DIR_H
 
+extern int	dir_maxname(struct minode *);
 extern int	add_direntry(struct fsmem *, struct minode *, char *, fs_u64_t);
+extern int	add_direntries(struct fsmem *, struct minode *, char **,
+			       fs_u64_t *, int, int *);
+extern int	remove_direntry(struct fsmem *, struct minode *, char *);
+extern fs_u32_t	dir_hash(const char *, int);
+extern int	dir_lookup(struct minode *, const char *, int, fs_u64_t *);
+extern int	dir_read(struct minode *, fs_u64_t *, struct udirentry *,
+			 fs_u32_t, fs_u32_t *);
+extern int	dir_read_sorted(struct minode *, const char *, char *,
+				struct udirentry *, fs_u32_t, fs_u32_t *);
+extern int	dir_makesorted(struct fsmem *, fs_u64_t);
+extern void	dirfree_release(struct minode *);
+extern void	dirfree_park(struct fsmem *, struct minode *);
+extern void	dirfree_unpark(struct fsmem *, struct minode *);
+extern void	dirfree_fini(struct fsmem *);
 
 #endif
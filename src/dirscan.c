@@ -0,0 +1,219 @@
+#include "layout.h"
+#include "types.h"
+#include "dirscan.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Directory block scanning.
+ * Kernels for the loops which look at every slot of a block of
+ * fixed size entries: finding the entry of a name in an array
+ * of struct direntry, the first vacant (or first used) entry of
+ * such an array, and the entries of a hash index block with a
+ * given hash. Each returns the index of the first slot found,
+ * or the number of slots if there is none.
+ * The implementation is picked once, at first use: with AVX2,
+ * a name is compared against an entry with two 32 byte compares
+ * and the hashes of eight index entries with two compares;
+ * otherwise, one slot at a time.
+ * Looking for a vacant entry is left scalar: there is a single
+ * inode number per 64 byte entry, so a vector load brings in
+ * one useful quadword out of four and is no faster than a
+ * plain load.
+ */
+
+struct dirscan_ops {
+	int		(*ds_name)(const struct direntry *, int, const char *,
+				   int);
+	int		(*ds_hash)(const struct dirhash_ent *, int, fs_u32_t);
+	const char	*ds_impl;
+};
+
+static pthread_once_t		ds_once = PTHREAD_ONCE_INIT;
+static struct dirscan_ops	ds_ops;
+
+/*
+ * Find the entry in use named 'name' ('len' bytes) among the
+ * 'n' entries at 'ent'. A name is stored NUL terminated, so
+ * the 'len' + 1 first bytes of the entry have to match.
+ */
+
+int
+dirscan_name_sw(
+	const struct direntry	*ent,
+	int			n,
+	const char		*name,
+	int			len)
+{
+	int			i;
+
+	if (len <= 0 || len >= (int)sizeof(ent->name)) {
+		return n;
+	}
+	for (i = 0; i < n; i++) {
+		if (ent[i].name[0] == name[0] && ent[i].name[len] == '\0' &&
+		    ent[i].inumber != 0 && memcmp(ent[i].name, name, len) == 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Find the first entry among the 'n' entries at 'ent' which
+ * is in use if 'used', or vacant otherwise.
+ */
+
+int
+dirscan_slot(
+	const struct direntry	*ent,
+	int			n,
+	int			used)
+{
+	int			i;
+
+	for (i = 0; i < n && (ent[i].inumber != 0) != (used != 0); i++);
+	return i;
+}
+
+/*
+ * Find the first of the 'n' hash index entries at 'de'
+ * whose hash is 'h'.
+ */
+
+int
+dirscan_hash_sw(
+	const struct dirhash_ent	*de,
+	int				n,
+	fs_u32_t			h)
+{
+	int				i;
+
+	for (i = 0; i < n && de[i].dh_hash != h; i++);
+	return i;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static int
+scan_name_avx2(
+	const struct direntry	*ent,
+	int			n,
+	const char		*name,
+	int			len)
+{
+	char			key[DIRENTRY_LEN];
+	__m256i			k0, k1, a, b;
+	fs_u32_t		mlo, mhi;
+	int			i;
+
+	if (len <= 0 || len >= (int)sizeof(ent->name)) {
+		return n;
+	}
+	memset(key, 0, sizeof(key));
+	memcpy(key, name, len);
+	k0 = _mm256_loadu_si256((const __m256i *)key);
+	k1 = _mm256_loadu_si256((const __m256i *)(key + 32));
+
+	/*
+	 * Bytes 0 to 'len' of each half of the entry must match.
+	 */
+
+	mlo = (len + 1 >= 32) ? 0xffffffffU : (1U << (len + 1)) - 1;
+	mhi = (len + 1 <= 32) ? 0 : (1U << (len + 1 - 32)) - 1;
+	for (i = 0; i < n; i++) {
+		a = _mm256_loadu_si256((const __m256i *)&ent[i]);
+		b = _mm256_loadu_si256((const __m256i *)&ent[i] + 1);
+		if (((fs_u32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, k0)) &
+		     mlo) == mlo &&
+		    ((fs_u32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, k1)) &
+		     mhi) == mhi && ent[i].inumber != 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int
+scan_hash_avx2(
+	const struct dirhash_ent	*de,
+	int				n,
+	fs_u32_t			h)
+{
+	__m256i				k = _mm256_set1_epi32((int)h), a, b;
+	int				i, m;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *)&de[i]);
+		b = _mm256_loadu_si256((const __m256i *)&de[i + 4]);
+		m = _mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(a, k))) |
+		    _mm256_movemask_ps(_mm256_castsi256_ps(
+			_mm256_cmpeq_epi32(b, k))) << 8;
+
+		/*
+		 * Only the even lanes are hashes; the odd
+		 * ones are offsets.
+		 */
+
+		if ((m &= 0x5555) != 0) {
+			return i + __builtin_ctz(m) / 2;
+		}
+	}
+	return i + dirscan_hash_sw(de + i, n - i, h);
+}
+
+#endif
+
+static void
+dirscan_init(void)
+{
+	ds_ops.ds_name = dirscan_name_sw;
+	ds_ops.ds_hash = dirscan_hash_sw;
+	ds_ops.ds_impl = "scalar";
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ds_ops.ds_name = scan_name_avx2;
+		ds_ops.ds_hash = scan_hash_avx2;
+		ds_ops.ds_impl = "avx2";
+	}
+#endif
+}
+
+int
+dirscan_name(
+	const struct direntry	*ent,
+	int			n,
+	const char		*name,
+	int			len)
+{
+	pthread_once(&ds_once, dirscan_init);
+	return ds_ops.ds_name(ent, n, name, len);
+}
+
+int
+dirscan_hash(
+	const struct dirhash_ent	*de,
+	int				n,
+	fs_u32_t			h)
+{
+	pthread_once(&ds_once, dirscan_init);
+	return ds_ops.ds_hash(de, n, h);
+}
+
+/*
+ * Name of the implementation used by the dirscan_*() kernels.
+ */
+
+const char *
+dirscan_impl(void)
+{
+	pthread_once(&ds_once, dirscan_init);
+	return ds_ops.ds_impl;
+}
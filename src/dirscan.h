@@ -0,0 +1,15 @@
+#ifndef _FS_DIRSCAN_H_
+#define _FS_DIRSCAN_H_
+
+extern int		dirscan_name(const struct direntry *, int,
+				     const char *, int);
+extern int		dirscan_slot(const struct direntry *, int, int);
+extern int		dirscan_hash(const struct dirhash_ent *, int,
+				     fs_u32_t);
+extern int		dirscan_name_sw(const struct direntry *, int,
+					const char *, int);
+extern int		dirscan_hash_sw(const struct dirhash_ent *, int,
+					fs_u32_t);
+extern const char	*dirscan_impl(void);
+
+#endif /*_FS_DIRSCAN_H_*/
@@ -3,19 +3,84 @@
 #include "fs.h"
 #include "bmap.h"
 #include "inode.h"
+#include "fs_include.h"
+#include "bio.h"
+#include "journal.h"
+#include "refcount.h"
+#include "compress.h"
+#include "cksum.h"
+#include "dir.h"
+#include "dcache.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
-int		internal_read(int, struct minode *, char *, fs_u64_t, fs_u32_t);
+int		internal_read(struct minode *, char *, fs_u64_t, fs_u32_t);
+static int	lookup_name(struct fsmem *, fs_u64_t, struct minode *,
+			    const char *, int, fs_u64_t *);
 static int	lookup_path(struct fsmem *, char *, struct direntry *);
 
+/*
+ * Maximum number of extents mapped at a time and of
+ * segments submitted as one batch by internal_iov().
+ */
+
+#define IO_BATCH	32
+#define IO_NSEGS	64
+
+static void	fh_readahead(struct file_handle *, fs_u64_t, fs_u32_t);
+static int	iov_submit(struct minode *, int, struct bio_vec *, int);
+
+/*
+ * Read the next entries of the directory of handle 'fh' for
+ * fsread_dir() and fsread_dirplus(), from the current offset
+ * of the handle or, for a B-tree directory, in the order of
+ * their names from after the last one read, wherever the
+ * entries have moved in the directory since.
+ * Returns zero or error number.
+ */
+
+static int
+fh_readdir(
+	struct file_handle	*fh,
+	struct udirentry	*ud,
+	fs_u32_t		nentries,
+	fs_u32_t		*np)
+{
+	struct minode		*mino = fh->fh_inode;
+	int			error;
+
+	*np = 0;
+	if (mino->mino_dirfmt == DIRFMT_BTREE && fh->fh_dircookie == NULL) {
+		if ((fh->fh_dircookie = (char *)malloc(FSDIR_COOKIELEN)) ==
+		    NULL) {
+			return ENOMEM;
+		}
+		fh->fh_dircookie[0] = '\0';
+	}
+
+	/*
+	 * dir_read() updates the current offset of the file
+	 * to where the next entries are to be read from.
+	 */
+
+	ILOCK_SHARED(mino);
+	error = (mino->mino_dirfmt == DIRFMT_BTREE) ?
+		dir_read_sorted(mino, "", fh->fh_dircookie, ud, nentries, np) :
+		dir_read(mino, &fh->fh_curoffset, ud, nentries, np);
+	IUNLOCK(mino);
+	return error;
+}
+
 /*
  * Read the directory specified by 'fh' handle.
  * 'nentries' specifies number of entries to be
- * read.
+ * read. Free entries are skipped. The entries of
+ * a sorted directory are read in the order of
+ * their names.
  * Returns the number of directory entries
  * actually read.
  * 'buf' should be allocated enough to occupy
@@ -30,14 +95,8 @@ fsread_dir(
 	fs_u32_t		nentries)
 {
 	struct file_handle	*fh;
-	struct udirentry	*udir = NULL;
-	struct direntry		*dir = NULL;
-	struct minode		*mino = NULL;
-	fs_u64_t		offset;
-	fs_u32_t		len, i;
-	char			*intbuf = NULL;
-	char			*tmp = NULL;
-	int			rd;
+	fs_u32_t		n = 0;
+	int			error;
 
 	if (nentries == 0) {
 		return 0;
@@ -47,43 +106,143 @@ fsread_dir(
 		return 0;
 	}
 	memset(buf, 0, nentries * UDIRENTRY_LEN);
-	tmp = intbuf = (char *) malloc(nentries * DIRENTRY_LEN);
-	if (intbuf == NULL) {
-		fprintf(stderr, "fsread_dir: Failed to allocate memory for "
-			"internal buffer\n");
+	fh = (struct file_handle *)vfh;
+	if ((error = fh_readdir(fh, (struct udirentry *)buf, nentries,
+				&n)) != 0) {
+		fprintf(stderr, "Failed to read directory inode %llu: %s\n",
+			fh->fh_inode->mino_number, strerror(error));
+		errno = error;
+	}
+
+	return n;
+}
+
+/*
+ * Read up to 'nentries' entries of the directory specified by
+ * 'fh' handle in the order of their names, taking those which
+ * start with 'prefix' (all of them if it's NULL or empty) and
+ * come after 'cookie'. 'cookie' (FSDIR_COOKIELEN bytes) is the
+ * position to read from: an empty string to read from the
+ * first name, and set to the last name read on return, so a
+ * listing can be read a page at a time, through any handle.
+ * A sorted directory (see FTYPE_SORTED) is read from where the
+ * names start; any other has to be read whole for every call.
+ * 'buf' should be allocated enough to occupy 'nentries'
+ * struct udirentry.
+ * Returns the number of directory entries actually read.
+ */
+
+int
+fsread_dir_prefix(
+	void			*vfh,
+	char			*prefix,
+	char			*cookie,
+	char			*buf,
+	fs_u32_t		nentries)
+{
+	struct file_handle	*fh;
+	struct minode		*mino;
+	fs_u32_t		n = 0;
+	int			error;
+
+	if (nentries == 0) {
+		return 0;
+	}
+	if (!buf || !vfh || !cookie ||
+	    strnlen(cookie, FSDIR_COOKIELEN) == FSDIR_COOKIELEN) {
+		errno = EINVAL;
 		return 0;
 	}
-	memset(intbuf, 0, nentries * DIRENTRY_LEN);
+	memset(buf, 0, nentries * UDIRENTRY_LEN);
 	fh = (struct file_handle *)vfh;
 	mino = fh->fh_inode;
-	offset = fh->fh_curoffset;
-	assert(offset % DIRENTRY_LEN == 0);
-	len = nentries * DIRENTRY_LEN;
-
-	printf("error string is: %s\n", strerror(errno));
-	if ((rd = internal_read(fh->fh_fsh->fsh_mem->fsm_devfd, mino, intbuf,
-				offset, len)) != (int)len && errno) {
-		fprintf(stderr, "Failed to read directory inode %llu: %s\n",
-			mino->mino_number, strerror(errno));
+	if (mino->mino_type != IFDIR) {
+		errno = ENOTDIR;
+		return 0;
 	}
-	nentries = rd/DIRENTRY_LEN;
-	for (i = 0; i < nentries; i++) {
-		dir = (struct direntry *)intbuf;
-		udir = (struct udirentry *)buf;
-		strcpy(udir->udir_name, dir->name);
-		udir->udir_inum = dir->inumber;
-		buf += UDIRENTRY_LEN;
-		intbuf += DIRENTRY_LEN;
+	ILOCK_SHARED(mino);
+	error = dir_read_sorted(mino, prefix ? prefix : "", cookie,
+				(struct udirentry *)buf, nentries, &n);
+	IUNLOCK(mino);
+	if (error != 0) {
+		fprintf(stderr, "Failed to read directory inode %llu: %s\n",
+			mino->mino_number, strerror(error));
+		errno = error;
 	}
+	return n;
+}
 
-	/*
-	 * Update the current offset of file after
-	 * successful/partial read.
-	 */
+/*
+ * Read the directory specified by 'fh' handle like
+ * fsread_dir(), along with the type, size and number of
+ * blocks of the inode of each entry, for a listing which
+ * would otherwise open every entry. The inodes of the
+ * entries read are fetched together (see iread_batch()).
+ * 'buf' should be allocated enough to occupy 'nentries'
+ * struct udirentplus.
+ * Returns the number of directory entries actually read.
+ */
+
+int
+fsread_dirplus(
+	void			*vfh,
+	char			*buf,
+	fs_u32_t		nentries)
+{
+	struct file_handle	*fh;
+	struct minode		*mino = NULL;
+	struct udirentplus	*up = (struct udirentplus *)buf;
+	struct udirentry	*ud;
+	struct dinode		*dips;
+	fs_u64_t		*inums;
+	fs_u32_t		i, n = 0;
+	int			error;
 
-	fh->fh_curoffset += (fs_u64_t)rd;
+	if (nentries == 0) {
+		return 0;
+	}
+	if (!buf || !vfh) {
+		errno = EINVAL;
+		return 0;
+	}
+	memset(buf, 0, nentries * UDIRENTPLUS_LEN);
+	fh = (struct file_handle *)vfh;
+	mino = fh->fh_inode;
+	ud = (struct udirentry *)malloc(nentries * UDIRENTRY_LEN);
+	inums = (fs_u64_t *)malloc(nentries * sizeof(fs_u64_t));
+	dips = (struct dinode *)malloc(nentries * sizeof(struct dinode));
+	if (ud == NULL || inums == NULL || dips == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	if ((error = fh_readdir(fh, ud, nentries, &n)) != 0) {
+		fprintf(stderr, "Failed to read directory inode %llu: %s\n",
+			mino->mino_number, strerror(error));
+		errno = error;
+	}
+	for (i = 0; i < n; i++) {
+		inums[i] = ud[i].udir_inum;
+	}
+	if (n > 0 && (error = iread_batch(mino->mino_fsm, inums, n,
+					  dips)) != 0) {
+		errno = error;
+		n = 0;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		memcpy(up[i].udp_name, ud[i].udir_name, sizeof(up[i].udp_name));
+		up[i].udp_inum = ud[i].udir_inum;
+		up[i].udp_size = dips[i].size;
+		up[i].udp_nblocks = dips[i].nblocks;
+		up[i].udp_type = (dips[i].type == IFDIR) ? FTYPE_DIR :
+				 (dips[i].type == IFREG) ? FTYPE_FILE : 0;
+	}
 
-	return nentries;
+out:
+	free(ud);
+	free(inums);
+	free(dips);
+	return n;
 }
 
 int
@@ -106,7 +265,7 @@ internal_readdir(
 	if (nentries == 0) {
 		return 0;
 	}
-	if ((rd = internal_read(mino->mino_fsm->fsm_devfd, mino, buf, offset,
+	if ((rd = internal_read(mino, buf, offset,
 				len)) != len) {
 		fprintf(stderr, "internal_readdir failed for inode %llu\n",
 			mino->mino_number);
@@ -115,18 +274,67 @@ internal_readdir(
 	return (int)rd/DIRENTRY_LEN;
 }
 
+/*
+ * Look up the name made of the 'len' bytes at 'name' in
+ * directory 'inum' ('dir' if the caller holds its in-core
+ * inode, or NULL), setting '*inump' to its inode number. A name
+ * looked up before, found or not, is usually still in the
+ * dentry cache, in which case neither the directory inode nor
+ * its blocks are read.
+ * The caller must hold fsm_nslock (shared is enough).
+ * Returns zero, ENOENT if there is no such name, ENOTDIR if
+ * 'inum' isn't a directory, or error number.
+ */
+
+static int
+lookup_name(
+	struct fsmem	*fsm,
+	fs_u64_t	inum,
+	struct minode	*dir,
+	const char	*name,
+	int		len,
+	fs_u64_t	*inump)
+{
+	struct minode	*mino = dir;
+	int		error;
+
+	if (dcache_lookup(fsm, inum, name, len, inump)) {
+		return *inump ? 0 : ENOENT;
+	}
+	if (mino == NULL && (mino = iget(fsm, inum)) == NULL) {
+		fprintf(stderr, "lookup_name: Failed to read inode %llu "
+			"for %s\n", inum, fsm->fsm_mntpt);
+		return EIO;
+	}
+	ILOCK_SHARED(mino);
+	error = (mino->mino_type == IFDIR) ?
+		dir_lookup(mino, name, len, inump) : ENOTDIR;
+	if (error == 0 || (error == ENOENT && mino->mino_type == IFDIR)) {
+		dcache_enter(fsm, inum, name, len, *inump);
+	}
+	IUNLOCK(mino);
+	if (dir == NULL) {
+		iput(mino);
+	}
+	return error;
+}
+
+/*
+ * Look up an absolute path, filling the directory
+ * entry of the last component in 'entp' if non-NULL.
+ * Returns 1 if the path exists, 0 otherwise.
+ * The caller must hold fsm_nslock (shared is enough).
+ */
+
 static int
 lookup_path(
 	struct fsmem	*fsm,
 	char		*path,
 	struct direntry	*entp)
 {
-	struct direntry	*dirp = NULL;
-	struct minode	*mino = NULL;
-	fs_u64_t	inum = MNTPT_INO, offset = 0;
-	char		*buf = NULL;
+	fs_u64_t	inum = MNTPT_INO, next;
 	int		start = 1, end = 1;
-	int		i = 1, j, nent, found = 0;
+	int		i = 1, error, found = 0;
 
 	if (entp) {
 		memset(entp, 0, sizeof(struct direntry));
@@ -145,129 +353,312 @@ lookup_path(
 		return 1;
 	}
 
-	/*
-	 * Allocate buffer for directory entries.
-	 * We'll be reading 16 directory entries
-	 * in each iteration.
-	 */
-
-	buf = (char *)malloc(16 * DIRENTRY_LEN);
-	if (!buf) {
-		fprintf(stderr, "Failed to allocate memory for lookup "
-			"buffer for %s\n", fsm->fsm_mntpt);
-		return 0;
-	}
-
 	for (;;) {
 		if (path[i] != '/' && path[i] != '\0') {
 			end++;
 			i++;
 			continue;
 		}
-		fprintf(stdout, "Component: ");
-		for (j = start; j <= end; j++) {
-			fprintf(stdout, "%c", path[j]);
-		}
-		fprintf(stdout, "\n");
-		mino = iget(fsm, inum);
-		if (mino == NULL) {
-			fprintf(stderr, "lookup_path: Failed to read inode %llu"
-				" for %s\n", inum, fsm->fsm_mntpt);
-			return 0;
-		}
-		found = 0;
-		for (;;) {
-			memset(buf, 0, 16 * DIRENTRY_LEN);
-			nent = internal_readdir(mino, buf, offset, 16);
-			if (nent == 0) {
-				break;
-			}
-			dirp = (struct direntry *)buf;
-			for (j = 0; j < nent; j++) {
-				fprintf(stdout, "Trying to match with %s",
-					dirp->name);
-				if (strlen(dirp->name) == (end - start) &&
-				    strncmp(path + start, dirp->name,
-				    (end - start)) == 0) {
-					fprintf(stdout, "Found matching entry:"
-						" %s\n", dirp->name);
-					found = 1;
-					break;
-				}
-				dirp++;
-			}
-			if (found) {
-				if (entp) {
-					memcpy(entp, dirp,
-					       sizeof(struct direntry));
-				}
-				break;
-			}
-			offset += nent * DIRENTRY_LEN;
-		}
+		/*
+		 * A name looked up before, found or not, is usually
+		 * still in the dentry cache, in which case neither the
+		 * directory inode nor its blocks are read.
+		 */
+
+		error = lookup_name(fsm, inum, NULL, path + start,
+				    end - start, &next);
+		found = (error == 0);
 		if (!found) {
-			fprintf(stdout, "component %s not found\n",
-				path + start);
-			errno = ENOENT;
+			errno = error;
 			goto out;
 		}
+		if (entp) {
+
+			/*
+			 * Names of packed directories can be longer
+			 * than a struct direntry holds.
+			 */
+
+			memset(entp->name, 0, sizeof(entp->name));
+			memcpy(entp->name, path + start,
+			       MIN(end - start, (int)sizeof(entp->name) - 1));
+			entp->inumber = next;
+		}
 		if (path[i] == '\0') {
 			break;
 		}
 		start = end = ++i;
-		inum = dirp->inumber;
-		fprintf(stdout, "Next inode number is %llu\n", inum);
+		inum = next;
 	}
 
 out:
-	free(buf);
 	return found;
 }
 
-int
-internal_read(
-	int		fd,
-	struct minode	*mino,
-	char		*buf,
-	fs_u64_t	curoff,
-	fs_u32_t	len)
+/*
+ * Submit a batch of segments for iov_range() and add the bytes
+ * done to '*donep'. If a batch of reads fails, its segments are
+ * read again one at a time, so that '*donep' covers the part of
+ * the range in front of the failure.
+ * Returns zero or error number.
+ */
+
+static int
+iov_flush(
+	struct minode		*mino,
+	int			rw,
+	struct bio_vec		*bv,
+	int			n,
+	fs_u64_t		*donep)
 {
-	fs_u64_t	off, foff, sz, blkno;
-	fs_u32_t	nread = 0, readlen;
-	fs_u32_t	remain = len;
-	int		error = 0;
+	int			i, error;
 
-	errno = 0;
-	printf("inode size iss: %llu\n", mino->mino_size);
-	while (nread < len) {
-		printf("curoff is: %llu\n", curoff);
-		if (remain == 0 || curoff >= mino->mino_size) {
-			printf("We're breaking properly\n");
+	if ((error = iov_submit(mino, rw, bv, n)) == 0) {
+		for (i = 0; i < n; i++) {
+			*donep += bv[i].bv_len;
+		}
+		return 0;
+	}
+	for (i = 0; i < n && rw == BIO_READ && n > 1; i++) {
+		if (iov_submit(mino, rw, &bv[i], 1) != 0) {
 			break;
 		}
-                if ((error = bmap(fd, mino, &blkno, &sz, &off, curoff)) != 0) {
-                        errno = error;
-                        goto out;
-                }
-		printf("Returned length is: %llu\n", sz);
-                readlen = (fs_u32_t)MIN(remain,
-					MIN(sz, mino->mino_size - curoff));
-		printf("readlen is %u\n", readlen);
-                foff = (blkno << LOG_ONE_K) + off;
-                lseek(fd, foff, SEEK_SET);
-		printf("internal_read: Reading from blkno %llu\n", blkno);
-                if (read(fd, (buf + nread), (int)readlen) != (int)readlen) {
-                        fprintf(stderr, "Failed to read from inode %llu at"
-                                " offset %llu\n", mino->mino_number, foff);
-                        goto out;
-                }
-                curoff += (fs_u64_t)readlen;
-                nread += readlen;
-		remain -= readlen;
-        }
+		*donep += bv[i].bv_len;
+	}
+	return error;
+}
 
-out:
-        return (int)nread;
+/*
+ * Do the I/O for the range [curoff, curoff + len) of an
+ * inode, to/from the buffers described by 'iov'. The range
+ * is mapped with a single walk of the block map per batch
+ * of extents and every (extent x iovec) piece becomes one
+ * segment of the batch handed to bio_submit().
+ * The range must be entirely allocated and 'iov' must hold
+ * at least 'len' bytes. '*donep' is set to the number of
+ * bytes from 'curoff' on that were done, which is 'len'
+ * unless there was an error.
+ * Returns zero or error number.
+ */
+
+static int
+iov_range(
+	struct minode		*mino,
+	int			rw,
+	const struct iovec	*iov,
+	fs_u64_t		curoff,
+	fs_u64_t		len,
+	fs_u64_t		*donep)
+{
+	struct file_extent	ext[IO_BATCH];
+	struct bio_vec		bv[IO_NSEGS];
+	fs_u64_t		pos, elen, seg, voff = 0;
+	int			i, n, nbv = 0, error = 0;
+
+	*donep = 0;
+	while (len > 0) {
+		if ((error = bmap_extents(mino, curoff, len, ext, IO_BATCH,
+					  &n)) == 0 && n == 0) {
+			error = EIO;
+		}
+		if (error != 0) {
+			if (nbv > 0) {
+				(void) iov_flush(mino, rw, bv, nbv, donep);
+			}
+			return error;
+		}
+		for (i = 0; i < n; i++) {
+			assert(ext[i].fext_logical == curoff);
+			pos = ext[i].fext_physical;
+			elen = ext[i].fext_len;
+			curoff += elen;
+			len -= elen;
+			while (elen > 0) {
+				while (voff == iov->iov_len) {
+					iov++;
+					voff = 0;
+				}
+				seg = MIN(elen, iov->iov_len - voff);
+				bv[nbv].bv_buf = (char *)iov->iov_base + voff;
+				bv[nbv].bv_off = pos;
+				bv[nbv].bv_len = (fs_u32_t)seg;
+				if (++nbv == IO_NSEGS) {
+					if ((error = iov_flush(mino, rw, bv,
+							       nbv, donep)) !=
+					    0) {
+						return error;
+					}
+					nbv = 0;
+				}
+				voff += seg;
+				pos += seg;
+				elen -= seg;
+			}
+		}
+	}
+	if (nbv > 0) {
+		error = iov_flush(mino, rw, bv, nbv, donep);
+	}
+	return error;
+}
+
+/*
+ * Do the I/O for the range [curoff, curoff + len) of an
+ * inode, to/from the buffers described by 'iov'; see
+ * iov_range(). Returns zero or error number.
+ */
+
+int
+internal_iov(
+	struct minode		*mino,
+	int			rw,
+	const struct iovec	*iov,
+	fs_u64_t		curoff,
+	fs_u64_t		len)
+{
+	fs_u64_t		done;
+
+	return iov_range(mino, rw, iov, curoff, len, &done);
+}
+
+/*
+ * Submit a batch of segments of inode 'mino', keeping the
+ * checksums of regular file data up to date on write and
+ * verifying them on read (see cksum.c). What is written to
+ * the metadata files goes to the journal; regular file data
+ * and the checksums of it are written in place, but within an
+ * explicit transaction (see fstx_begin()).
+ * Returns zero or error number.
+ */
+
+static int
+iov_submit(
+	struct minode		*mino,
+	int			rw,
+	struct bio_vec		*bv,
+	int			n)
+{
+	struct fsmem		*fsm = mino->mino_fsm;
+	int			i, error = 0;
+
+	if (rw == BIO_WRITE && ((mino->mino_type != IFREG &&
+	    mino->mino_type != IFCKS) || jnl_intx(fsm))) {
+		for (i = 0; i < n && error == 0; i++) {
+			error = jnl_write(fsm, bv[i].bv_buf, bv[i].bv_len,
+					  bv[i].bv_off);
+		}
+		if (error || mino->mino_type != IFREG ||
+		    fsm->fsm_csip == NULL) {
+			return error;
+		}
+
+		/*
+		 * File data written within an explicit transaction:
+		 * its checksums go to the same transaction.
+		 */
+
+		return cksum_update(fsm, bv, n);
+	}
+	if ((error = bio_submit(fsm, rw, bv, n)) != 0 ||
+	    mino->mino_type != IFREG || fsm->fsm_csip == NULL) {
+		return error;
+	}
+	return (rw == BIO_READ) ? cksum_verify(fsm, bv, n) :
+				  cksum_update(fsm, bv, n);
+}
+
+/*
+ * Total length of the buffers in 'iov', which must fit
+ * in the int returned by the read and write calls.
+ * Returns zero or error number.
+ */
+
+static int
+iov_total(
+	const struct iovec	*iov,
+	int			iovcnt,
+	fs_u32_t		*lenp)
+{
+	fs_u64_t		total = 0;
+	int			i;
+
+	if (iov == NULL || iovcnt < 0) {
+		return EINVAL;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+		if (total > INT_MAX) {
+			return EINVAL;
+		}
+	}
+	*lenp = (fs_u32_t)total;
+	return 0;
+}
+
+/*
+ * Read at offset 'curoff' of an inode into the buffers
+ * described by 'iov'. The read stops at the end of file.
+ * Returns the number of bytes read. In case of error
+ * errno is set and the number of bytes read in front of
+ * the failure is returned, which may be zero.
+ */
+
+int
+internal_readv(
+	struct minode		*mino,
+	const struct iovec	*iov,
+	int			iovcnt,
+	fs_u64_t		curoff)
+{
+	fs_u64_t		done;
+	fs_u32_t		len;
+	int			error;
+
+	if ((error = iov_total(iov, iovcnt, &len)) != 0) {
+		errno = error;
+		return 0;
+	}
+	errno = 0;
+	if (curoff >= mino->mino_size) {
+		return 0;
+	}
+	len = (fs_u32_t)MIN(len, mino->mino_size - curoff);
+	if (len == 0) {
+		return 0;
+	}
+	if (mino->mino_type == IFREG && mino->mino_codec != FSCMP_NONE) {
+		error = cmp_readv(mino, iov, curoff, len, &done);
+	} else {
+		error = iov_range(mino, BIO_READ, iov, curoff, len, &done);
+	}
+	if (error != 0) {
+		fprintf(stderr, "Failed to read from inode %llu at offset"
+			" %llu\n", mino->mino_number, curoff + done);
+		errno = error;
+		return (int)done;
+	}
+
+	return (int)len;
+}
+
+/*
+ * Read 'len' bytes at offset 'curoff' of an inode.
+ * Returns the number of bytes read, which is short at the
+ * end of file and, with errno set, in case of error.
+ */
+
+int
+internal_read(
+	struct minode		*mino,
+	char			*buf,
+	fs_u64_t		curoff,
+	fs_u32_t		len)
+{
+	struct iovec		iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return internal_readv(mino, &iov, 1, curoff);
 }
 
 /*
@@ -287,57 +678,920 @@ metadata_write(
 	struct minode	*ino)
 {
 	fs_u64_t	off, sz, blkno, foff;
-	int		error = 0, nwrite = 0;
+	int		error = 0;
 
-	error = bmap(fsm->fsm_devfd, ino, &blkno, &sz, &off, offset);
+	error = bmap(ino, &blkno, &sz, &off, offset);
 	if (error) {
 		errno = error;
 		return 0;
 	}
 	foff = (blkno << LOG_ONE_K) + off;
-	lseek(fsm->fsm_devfd, foff, SEEK_SET);
-	if ((nwrite = write(fsm->fsm_devfd, buf, len)) != len) {
+	if ((error = jnl_write(fsm, buf, len, foff)) != 0) {
 		fprintf(stderr, "Failed to write metadata inode %llu at offset"
 			" %llu for %s\n", ino->mino_number, foff,
 			fsm->fsm_mntpt);
+		errno = error;
 		return 0;
 	}
 
-	return nwrite;
+	return len;
 }
 
+/*
+ * Write the buffers described by 'iov' at offset 'curoff' of
+ * a regular file, allocating blocks to the file as needed and
+ * growing its size. The write can't start beyond the end of
+ * file, since we don't support sparse files.
+ * Returns zero on success and error number on failure.
+ * The caller must hold the inode lock exclusive.
+ */
+
 int
-fsread(
-	void			*vfh,
-	char			*buf,
-	fs_u32_t		len)
+internal_writev(
+	struct fsmem		*fsm,
+	struct minode		*mino,
+	const struct iovec	*iov,
+	int			iovcnt,
+	fs_u64_t		curoff)
 {
-	struct file_handle	*fh;
-	struct minode		*mino = NULL;
-	struct fsmem		*fsm = NULL;
-	int			nread;
-	int			error = 0, fd;
+	fs_u64_t		blkno, alen, req;
+	fs_u32_t		len;
+	int			error = 0;
 
-	if (len == 0) {
-		return 0;
+	assert(mino->mino_type == IFREG || mino->mino_type == IFRCT ||
+	       mino->mino_type == IFCMP || mino->mino_type == IFDIX);
+	if ((error = iov_total(iov, iovcnt, &len)) != 0) {
+		return error;
 	}
-	if (vfh == NULL || buf == NULL) {
-		errno = EINVAL;
-		return 0;
+	if (curoff > mino->mino_size) {
+		return EINVAL;
+	}
+	if (mino->mino_type == IFREG && mino->mino_codec != FSCMP_NONE) {
+		return len ? cmp_writev(fsm, mino, iov, curoff, len) : 0;
 	}
-	fh = (struct file_handle *)vfh;
-	fsm = fh->fh_fsh->fsh_mem;
-	assert(fsm->fsm_devfd != 0);
-	assert(fsm->fsm_sb && fsm->fsm_ilip && fsm->fsm_emapip &&
-	       fsm->fsm_imapip && fsm->fsm_mntip);
-	mino = fh->fh_inode;
-	fd = fsm->fsm_devfd;
-	assert(mino != NULL);
-	nread = internal_read(fd, mino, buf, fh->fh_curoffset, len);
-	fh->fh_curoffset += (fs_u64_t)nread;
 
-out:
-	return nread;
+	/*
+	 * Blocks shared with other files can't be written in place.
+	 */
+
+	if ((error = refcount_cow(fsm, mino, curoff, len)) != 0) {
+		return error;
+	}
+
+	/*
+	 * Allocate the blocks that are missing for the write.
+	 * Ask for at least WBUF_SIZE worth of blocks so that
+	 * a file growing by small writes still gets large
+	 * extents.
+	 */
+
+	while ((mino->mino_nblocks << LOG_ONE_K) < curoff + len) {
+		req = ((curoff + len - (mino->mino_nblocks << LOG_ONE_K)) +
+		       ONE_K - 1) >> LOG_ONE_K;
+		req = MAX(req, WBUF_SIZE >> LOG_ONE_K);
+		if ((error = bmap_alloc(fsm, mino, req, &blkno,
+					&alen)) != 0) {
+			fprintf(stderr, "internal_write: allocation failed "
+				"for inode %llu for %s\n", mino->mino_number,
+				fsm->fsm_mntpt);
+			return error;
+		}
+	}
+	if ((error = internal_iov(mino, BIO_WRITE, iov, curoff, len)) != 0) {
+		fprintf(stderr, "Failed to write to inode %llu at offset"
+			" %llu\n", mino->mino_number, curoff);
+		return error;
+	}
+	if (curoff + len > mino->mino_size) {
+		mino->mino_size = curoff + len;
+		error = iwrite(mino);
+	}
+
+	return error;
+}
+
+/*
+ * Write 'len' bytes at offset 'curoff' of a regular file.
+ * See internal_writev().
+ */
+
+int
+internal_write(
+	struct fsmem		*fsm,
+	struct minode		*mino,
+	char			*buf,
+	fs_u64_t		curoff,
+	fs_u32_t		len)
+{
+	struct iovec		iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	return internal_writev(fsm, mino, &iov, 1, curoff);
+}
+
+/*
+ * Write out the data gathered in the write buffer
+ * of the file handle.
+ */
+
+int
+fh_flush(
+	struct file_handle	*fh)
+{
+	struct minode		*mino = fh->fh_inode;
+	int			error;
+
+	if (fh->fh_wbuflen == 0) {
+		return 0;
+	}
+	jnl_begin(fh->fh_fsh->fsh_mem);
+	ILOCK_EXCL(mino);
+	error = internal_write(fh->fh_fsh->fsh_mem, mino, fh->fh_wbuf,
+			       fh->fh_wbufoff, fh->fh_wbuflen);
+	IUNLOCK(mino);
+	jnl_end(fh->fh_fsh->fsh_mem);
+	fh->fh_wbuflen = 0;
+	return error;
+}
+
+/*
+ * Write to a regular file at the current offset of
+ * the file handle.
+ * Small writes are gathered in the write buffer of the
+ * handle as long as they're sequential, and are written
+ * to the file only when the buffer fills up, a non-
+ * sequential write or a read is done through the handle,
+ * or the handle is closed. Writes of WBUF_SIZE or more
+ * bypass the buffer.
+ * Returns the number of bytes written. In case of error
+ * errno is set and the return value may be short.
+ */
+
+int
+fswrite(
+	void			*vfh,
+	char			*buf,
+	fs_u32_t		len)
+{
+	struct file_handle	*fh;
+	struct minode		*mino = NULL;
+	fs_u32_t		done = 0, n;
+	int			error = 0;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (vfh == NULL || buf == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	fh = (struct file_handle *)vfh;
+	mino = fh->fh_inode;
+	assert(mino != NULL);
+	if (mino->mino_type != IFREG) {
+		errno = EISDIR;
+		return 0;
+	}
+	while (done < len) {
+		if (fh->fh_wbuflen != 0 &&
+		    fh->fh_wbufoff + fh->fh_wbuflen != fh->fh_curoffset) {
+			if ((error = fh_flush(fh)) != 0) {
+				break;
+			}
+		}
+		if (fh->fh_wbuflen == 0 && len - done >= WBUF_SIZE) {
+			n = len - done;
+			jnl_begin(fh->fh_fsh->fsh_mem);
+			ILOCK_EXCL(mino);
+			error = internal_write(fh->fh_fsh->fsh_mem, mino,
+					       buf + done, fh->fh_curoffset, n);
+			IUNLOCK(mino);
+			jnl_end(fh->fh_fsh->fsh_mem);
+			if (error) {
+				break;
+			}
+			fh->fh_curoffset += n;
+			done += n;
+			continue;
+		}
+		if (fh->fh_wbuf == NULL) {
+			fh->fh_wbuf = (char *)malloc(WBUF_SIZE);
+			if (fh->fh_wbuf == NULL) {
+				error = ENOMEM;
+				break;
+			}
+		}
+		if (fh->fh_wbuflen == 0) {
+			fh->fh_wbufoff = fh->fh_curoffset;
+		}
+		n = MIN(len - done, WBUF_SIZE - fh->fh_wbuflen);
+		memcpy(fh->fh_wbuf + fh->fh_wbuflen, buf + done, n);
+		fh->fh_wbuflen += n;
+		fh->fh_curoffset += n;
+		done += n;
+		if (fh->fh_wbuflen == WBUF_SIZE &&
+		    (error = fh_flush(fh)) != 0) {
+			break;
+		}
+	}
+	if (error) {
+		fprintf(stderr, "fswrite: Failed to write inode %llu for %s: "
+			"%s\n", mino->mino_number,
+			fh->fh_fsh->fsh_mem->fsm_mntpt, strerror(error));
+		errno = error;
+	}
+
+	return (int)done;
+}
+
+/*
+ * Read into the buffers described by 'iov' from offset
+ * 'offset' of a regular file, without using or changing
+ * the current offset of the handle. The whole range is
+ * mapped once and read as a single batch.
+ * Returns the number of bytes read, which is short at the
+ * end of file and, with errno set, in case of error.
+ */
+
+int
+fspreadv(
+	void			*vfh,
+	const struct iovec	*iov,
+	int			iovcnt,
+	fs_u64_t		offset)
+{
+	struct file_handle	*fh = (struct file_handle *)vfh;
+	struct minode		*mino;
+	int			nread, error;
+
+	if (fh == NULL || iov == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	mino = fh->fh_inode;
+	if (mino->mino_type != IFREG) {
+		errno = EISDIR;
+		return 0;
+	}
+	if ((error = fh_flush(fh)) != 0) {
+		errno = error;
+		return 0;
+	}
+	ILOCK_SHARED(mino);
+	nread = internal_readv(mino, iov, iovcnt, offset);
+	IUNLOCK(mino);
+
+	return nread;
+}
+
+/*
+ * Read into the buffers described by 'iov' at the current
+ * offset of the handle, like fsread().
+ */
+
+int
+fsreadv(
+	void			*vfh,
+	const struct iovec	*iov,
+	int			iovcnt)
+{
+	struct file_handle	*fh = (struct file_handle *)vfh;
+	struct minode		*mino;
+	fs_u32_t		len;
+	int			nread, error;
+
+	if (fh == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	if ((error = iov_total(iov, iovcnt, &len)) != 0 ||
+	    (error = fh_flush(fh)) != 0) {
+		errno = error;
+		return 0;
+	}
+	mino = fh->fh_inode;
+	if (mino->mino_type != IFREG) {
+		errno = EISDIR;
+		return 0;
+	}
+	ILOCK_SHARED(mino);
+	fh_readahead(fh, fh->fh_curoffset, len);
+	nread = internal_readv(mino, iov, iovcnt, fh->fh_curoffset);
+	IUNLOCK(mino);
+	fh->fh_curoffset += (fs_u64_t)nread;
+
+	return nread;
+}
+
+/*
+ * Write the buffers described by 'iov' at offset 'offset'
+ * of a regular file, without using or changing the current
+ * offset of the handle. The whole range is mapped once and
+ * written as a single batch.
+ * Returns the number of bytes written; in case of error
+ * zero is returned and errno is set.
+ */
+
+int
+fspwritev(
+	void			*vfh,
+	const struct iovec	*iov,
+	int			iovcnt,
+	fs_u64_t		offset)
+{
+	struct file_handle	*fh = (struct file_handle *)vfh;
+	struct minode		*mino;
+	fs_u32_t		len;
+	int			error;
+
+	if (fh == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	mino = fh->fh_inode;
+	if (mino->mino_type != IFREG) {
+		errno = EISDIR;
+		return 0;
+	}
+	if ((error = iov_total(iov, iovcnt, &len)) != 0 ||
+	    (error = fh_flush(fh)) != 0) {
+		errno = error;
+		return 0;
+	}
+	jnl_begin(fh->fh_fsh->fsh_mem);
+	ILOCK_EXCL(mino);
+	error = internal_writev(fh->fh_fsh->fsh_mem, mino, iov, iovcnt,
+				offset);
+	IUNLOCK(mino);
+	jnl_end(fh->fh_fsh->fsh_mem);
+	if (error) {
+		errno = error;
+		return 0;
+	}
+
+	return (int)len;
+}
+
+/*
+ * Write the buffers described by 'iov' at the current offset
+ * of the handle, like fswrite(). Small writes go through the
+ * write buffer of the handle; others are written as a single
+ * batch.
+ */
+
+int
+fswritev(
+	void			*vfh,
+	const struct iovec	*iov,
+	int			iovcnt)
+{
+	struct file_handle	*fh = (struct file_handle *)vfh;
+	fs_u32_t		len, done = 0;
+	int			i, n, error;
+
+	if (fh == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	if ((error = iov_total(iov, iovcnt, &len)) != 0) {
+		errno = error;
+		return 0;
+	}
+	if (len < WBUF_SIZE) {
+		for (i = 0; i < iovcnt; i++) {
+			n = fswrite(fh, (char *)iov[i].iov_base,
+				    (fs_u32_t)iov[i].iov_len);
+			done += n;
+			if (n != (int)iov[i].iov_len) {
+				break;
+			}
+		}
+		return (int)done;
+	}
+	if ((n = fspwritev(fh, iov, iovcnt, fh->fh_curoffset)) > 0) {
+		fh->fh_curoffset += n;
+	}
+
+	return n;
+}
+
+/*
+ * Copy 'len' bytes at offset 'offset' of a file to 'outfd'
+ * through a buffer, for data which must be decompressed or
+ * have its checksums verified on the way.
+ * Sets *donep to the number of bytes copied.
+ */
+
+static int
+copy_through(
+	struct minode		*mino,
+	fs_u64_t		offset,
+	fs_u64_t		len,
+	int			outfd,
+	fs_u64_t		*donep)
+{
+	char			*buf;
+	ssize_t			w;
+	int			n, off, error = 0;
+
+	*donep = 0;
+	if ((buf = (char *)malloc(CLUSTER_SIZE)) == NULL) {
+		return ENOMEM;
+	}
+	while (*donep < len && error == 0) {
+		n = internal_read(mino, buf, offset + *donep,
+				  (fs_u32_t)MIN(CLUSTER_SIZE, len - *donep));
+		if (n <= 0) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		for (off = 0; off < n; off += w) {
+			if ((w = write(outfd, buf + off, n - off)) < 0) {
+				error = errno;
+				break;
+			}
+		}
+		*donep += off;
+	}
+	free(buf);
+	return error;
+}
+
+/*
+ * Copy 'len' bytes at offset 'offset' of a regular file to the
+ * host file descriptor 'outfd' (a file, socket or pipe), at its
+ * current file offset. The extents are resolved and each one is
+ * copied from the device file by the kernel, so the data never
+ * passes through user space. The offset of the handle isn't
+ * used or changed. The data of a compressed file, and of any
+ * file when the checksums are verified (see cksum.c), is read
+ * into a buffer and written from there instead, since the
+ * kernel can't check it.
+ * Returns the number of bytes copied, which is short at the end
+ * of file. In case of error errno is set and the return value
+ * may be short.
+ */
+
+long long
+fscopy_to_fd(
+	void			*vfh,
+	fs_u64_t		offset,
+	fs_u64_t		len,
+	int			outfd)
+{
+	struct file_handle	*fh = (struct file_handle *)vfh;
+	struct file_extent	ext[IO_BATCH];
+	struct minode		*mino;
+	fs_u64_t		done = 0, n;
+	int			i, nfilled, error;
+
+	if (fh == NULL || outfd < 0) {
+		errno = EINVAL;
+		return 0;
+	}
+	mino = fh->fh_inode;
+	if (mino->mino_type != IFREG) {
+		errno = EISDIR;
+		return 0;
+	}
+	if ((error = fh_flush(fh)) != 0) {
+		errno = error;
+		return 0;
+	}
+	errno = 0;
+	ILOCK_SHARED(mino);
+	if (offset >= mino->mino_size) {
+		IUNLOCK(mino);
+		return 0;
+	}
+	len = MIN(len, mino->mino_size - offset);
+	if (mino->mino_codec != FSCMP_NONE ||
+	    (mino->mino_fsm->fsm_csip != NULL &&
+	     !(mino->mino_fsm->fsm_mntflags & FSMNT_NOVERIFY))) {
+		error = copy_through(mino, offset, len, outfd, &done);
+		len = done;
+	}
+	while (done < len) {
+		if ((error = bmap_extents(mino, offset + done, len - done, ext,
+					  IO_BATCH, &nfilled)) != 0) {
+			break;
+		}
+		if (nfilled == 0) {
+			error = EIO;
+			break;
+		}
+		for (i = 0; i < nfilled; i++) {
+			error = bio_copyout(mino->mino_fsm,
+					    ext[i].fext_physical,
+					    ext[i].fext_len, outfd, &n);
+			done += n;
+			if (error) {
+				break;
+			}
+		}
+		if (error) {
+			break;
+		}
+	}
+	IUNLOCK(mino);
+	if (error) {
+		errno = error;
+	}
+
+	return (long long)done;
+}
+
+/*
+ * Give back the blocks allocated beyond the end of a regular
+ * file: growing writes ask for at least WBUF_SIZE worth of
+ * blocks, most of which a small file never uses.
+ */
+
+static int
+fh_trim(
+	struct file_handle	*fh)
+{
+	struct fsmem		*fsm = fh->fh_fsh->fsh_mem;
+	struct minode		*mino = fh->fh_inode;
+	fs_u64_t		nblocks;
+	int			error = 0;
+
+	if (mino->mino_type != IFREG || mino->mino_codec != FSCMP_NONE) {
+		return 0;
+	}
+
+	/*
+	 * Unlocked peek to spare readers the locks; it's checked
+	 * again below.
+	 */
+
+	nblocks = (mino->mino_size + ONE_K - 1) >> LOG_ONE_K;
+	if (mino->mino_nblocks <= nblocks) {
+		return 0;
+	}
+	jnl_begin(fsm);
+	ILOCK_EXCL(mino);
+	nblocks = (mino->mino_size + ONE_K - 1) >> LOG_ONE_K;
+	if (mino->mino_nblocks > nblocks) {
+		error = bmap_trim(fsm, mino, nblocks);
+	}
+	IUNLOCK(mino);
+	jnl_end(fsm);
+	return error;
+}
+
+/*
+ * Close a file handle.
+ * Any data in the write buffer is written to the file, and
+ * the blocks preallocated beyond its end are freed.
+ * Returns zero on success and error number on failure.
+ */
+
+int
+fsclose(
+	void			*vfh)
+{
+	struct file_handle	*fh;
+	int			error;
+
+	if (vfh == NULL) {
+		return EINVAL;
+	}
+	fh = (struct file_handle *)vfh;
+	if ((error = fh_flush(fh)) == 0) {
+		error = fh_trim(fh);
+	}
+	iput(fh->fh_inode);
+	free(fh->fh_wbuf);
+	free(fh->fh_dircookie);
+	free(fh);
+	return error;
+}
+
+/*
+ * Readahead for sequential readers.
+ * A read at the offset where the previous read through the
+ * handle ended is sequential; any other read resets the
+ * readahead window. For sequential reads, whenever less
+ * than half of the window is left ahead of the reader, the
+ * window is grown and the extents covering the next part of
+ * the file are handed to the kernel with POSIX_FADV_WILLNEED,
+ * which reads them asynchronously into the page cache.
+ * Since the range is mapped through the block map, the
+ * readahead never goes beyond the blocks of the file.
+ * The caller must hold the inode lock.
+ */
+
+static void
+fh_readahead(
+	struct file_handle	*fh,
+	fs_u64_t		offset,
+	fs_u32_t		len)
+{
+	struct file_extent	ext[16];
+	struct minode		*mino = fh->fh_inode;
+	fs_u64_t		end = offset + len, start, raend;
+	int			fd = fh->fh_fsh->fsh_mem->fsm_devfd;
+	int			i, n;
+
+	/*
+	 * With direct I/O the host page cache isn't used,
+	 * so there is nothing to prefetch into.
+	 */
+
+	if (fh->fh_fsh->fsh_mem->fsm_mntflags & (FSMNT_DIRECT | FSMNT_NORA)) {
+		return;
+	}
+
+	/*
+	 * The blocks of a compressed file don't map its
+	 * offsets; cmp_readv() reads whole clusters anyway.
+	 */
+
+	if (mino->mino_codec != FSCMP_NONE) {
+		return;
+	}
+	if (offset != fh->fh_ranext || offset == 0) {
+		fh->fh_rasize = 0;
+		fh->fh_raend = 0;
+		fh->fh_ranext = end;
+		if (offset != 0) {
+			return;
+		}
+	}
+	fh->fh_ranext = end;
+	if (fh->fh_raend > end &&
+	    fh->fh_raend - end >= fh->fh_rasize / 2) {
+		return;
+	}
+	if (fh->fh_rasize == 0) {
+		fh->fh_rasize = RA_MIN_SIZE;
+	} else if (fh->fh_rasize < RA_MAX_SIZE) {
+		fh->fh_rasize <<= 1;
+	}
+	start = MAX(fh->fh_raend, end);
+	raend = MIN(end + fh->fh_rasize, mino->mino_size);
+	while (start < raend) {
+		if (bmap_extents_at(mino, &fh->fh_racursor, start,
+				    raend - start, ext, 16, &n) != 0 ||
+		    n == 0) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			(void) posix_fadvise(fd, ext[i].fext_physical,
+					     ext[i].fext_len,
+					     POSIX_FADV_WILLNEED);
+		}
+		start = ext[n - 1].fext_logical + ext[n - 1].fext_len;
+	}
+	fh->fh_raend = MAX(fh->fh_raend, raend);
+}
+
+int
+fsread(
+	void			*vfh,
+	char			*buf,
+	fs_u32_t		len)
+{
+	struct file_handle	*fh;
+	struct minode		*mino = NULL;
+	struct fsmem		*fsm = NULL;
+	int			nread;
+	int			error = 0, fd;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (vfh == NULL || buf == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+	fh = (struct file_handle *)vfh;
+	fsm = fh->fh_fsh->fsh_mem;
+	assert(fsm->fsm_devfd != 0);
+	assert(fsm->fsm_sb && fsm->fsm_ilip && fsm->fsm_emapip &&
+	       fsm->fsm_imapip && fsm->fsm_mntip);
+	mino = fh->fh_inode;
+	fd = fsm->fsm_devfd;
+	assert(mino != NULL);
+	if ((error = fh_flush(fh)) != 0) {
+		errno = error;
+		return 0;
+	}
+	ILOCK_SHARED(mino);
+	fh_readahead(fh, fh->fh_curoffset, len);
+	nread = internal_read(mino, buf, fh->fh_curoffset, len);
+	IUNLOCK(mino);
+	fh->fh_curoffset += (fs_u64_t)nread;
+
+out:
+	return nread;
+}
+
+/*
+ * Map the range [offset, offset + len) of an open file
+ * to the byte ranges of the device file holding its data.
+ * Fills at most 'n' entries of 'extp' and returns the
+ * number of entries filled, or -1 with errno set on error.
+ * If the range needs more than 'n' extents, the caller can
+ * call again from the end of the last extent returned.
+ * This lets the caller read the file data straight from
+ * the device file (pread, mmap etc.) without fsread().
+ * The data isn't read, so its checksums aren't verified:
+ * what the caller reads from the device file is as it is
+ * there, corrupt or not (fsscrub() finds the bad blocks).
+ * For a compressed file, the range is one of the compressed
+ * stream (see compress.c) rather than of the file data.
+ */
+
+int
+fsmap(
+	void			*vfh,
+	fs_u64_t		offset,
+	fs_u64_t		len,
+	struct file_extent	*extp,
+	int			n)
+{
+	struct file_handle	*fh;
+	struct minode		*mino = NULL;
+	fs_u64_t		size;
+	int			error, nfilled;
+
+	if (vfh == NULL || extp == NULL || n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	fh = (struct file_handle *)vfh;
+	mino = fh->fh_inode;
+	assert(mino != NULL);
+	if ((error = fh_flush(fh)) != 0) {
+		errno = error;
+		return -1;
+	}
+	ILOCK_SHARED(mino);
+	size = (mino->mino_codec != FSCMP_NONE) ? mino->mino_streamend :
+						   mino->mino_size;
+	if (offset >= size) {
+		IUNLOCK(mino);
+		return 0;
+	}
+	len = MIN(len, size - offset);
+	error = bmap_extents(mino, offset,
+			     len, extp, n, &nfilled);
+	IUNLOCK(mino);
+	if (error != 0) {
+		fprintf(stderr, "fsmap: Failed to map inode %llu at offset "
+			"%llu\n", mino->mino_number, offset);
+		errno = error;
+		return -1;
+	}
+
+	return nfilled;
+}
+
+/*
+ * Open a handle to the new file 'path' (inode 'inum') created
+ * by fscreate() or fscreate_batch() as per 'flags'.
+ * Returns the handle, or NULL with errno set.
+ */
+
+static struct file_handle *
+new_handle(
+	struct fs_handle	*fsh,
+	fs_u64_t		inum,
+	fs_u32_t		flags,
+	char			*path)
+{
+	struct fsmem		*fsm = fsh->fsh_mem;
+	struct file_handle	*fh;
+	int			error, level;
+
+	fh = (struct file_handle *)malloc(sizeof(struct file_handle));
+	if (fh == NULL) {
+		fprintf(stderr, "ERROR: Failed to allocate memory to "
+			"file handle for %s\n", fsm->fsm_mntpt);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((fh->fh_inode = iget(fsm, inum)) == NULL) {
+		free(fh);
+		return NULL;
+	}
+	fh->fh_fsh = fsh;
+	fh->fh_curoffset = 0;
+	fh->fh_wbuf = NULL;
+	fh->fh_wbuflen = 0;
+	fh->fh_rasize = 0;
+	fh->fh_ranext = 0;
+	fh->fh_raend = 0;
+	memset(&fh->fh_racursor, 0, sizeof(struct bmap_cursor));
+	fh->fh_dircookie = NULL;
+
+	/*
+	 * On a compressing mount, regular files start compressed.
+	 * A failure here still leaves a usable (uncompressed) file.
+	 */
+
+	if ((flags & FTYPE_FILE) && !(flags & FTYPE_NOCOMPRESS) &&
+	    (fsm->fsm_mntflags & FSMNT_COMPRESS)) {
+		level = FSMNT_GETCLEVEL(fsm->fsm_mntflags);
+		level = level ? MIN(level, FSCMP_MAXLEVEL) : FSCMP_DEFLEVEL;
+		ILOCK_EXCL(fh->fh_inode);
+		if ((error = cmp_enable(fsm, fh->fh_inode, FSCMP_LZ,
+					level)) != 0) {
+			fprintf(stderr, "WARNING: Failed to make %s compressed"
+				" for %s\n", path, fsm->fsm_mntpt);
+		}
+		IUNLOCK(fh->fh_inode);
+	}
+	return fh;
+}
+
+/*
+ * Create the file or directory 'name' (as per 'flags') in
+ * directory 'parent' and return a handle to it, or NULL with
+ * errno set. 'path' names the new file in messages.
+ * The caller must hold fsm_nslock exclusive and a reference
+ * to 'parent'.
+ */
+
+static struct file_handle *
+create_in(
+	struct fs_handle	*fsh,
+	struct minode		*parent,
+	char			*name,
+	fs_u32_t		flags,
+	char			*path)
+{
+	struct fsmem		*fsm = fsh->fsh_mem;
+	struct minode		*mino;
+	fs_u64_t		inum;
+	int			len = strlen(name), error;
+
+	ILOCK_EXCL(parent);
+	if (parent->mino_type != IFDIR) {
+		error = ENOTDIR;
+	} else if (len > dir_maxname(parent)) {
+		error = ENAMETOOLONG;
+	} else if (dcache_lookup(fsm, parent->mino_number, name, len,
+				 &inum)) {
+		error = inum ? 0 : ENOENT;
+	} else {
+		error = dir_lookup(parent, name, len, &inum);
+	}
+	if (error != ENOENT) {
+		IUNLOCK(parent);
+		if (error == 0) {
+			fprintf(stderr, "ERROR: The file %s already exists\n",
+				path);
+			error = EEXIST;
+		}
+		errno = error;
+		return NULL;
+	}
+
+	/*
+	 * The file doesn't exist.
+	 * Allocate a new inode for it and create a new directory entry.
+	 */
+
+	if ((error = inode_alloc(fsm, flags, &inum)) != 0) {
+		IUNLOCK(parent);
+		errno = error;
+		return NULL;
+	}
+	if ((flags & FTYPE_DIR) && (flags & FTYPE_SORTED) &&
+	    (error = dir_makesorted(fsm, inum)) != 0) {
+		fprintf(stderr, "ERROR: Failed to make %s sorted for %s\n",
+			path, fsm->fsm_mntpt);
+	} else if ((error = add_direntry(fsm, parent, name, inum)) != 0) {
+		fprintf(stderr, "ERROR: Failed to add direntry: name-%s, "
+			"inum: %llu for %s\n", name, inum, fsm->fsm_mntpt);
+	}
+	if (error) {
+
+		/*
+		 * Nothing points to the new inode: free it.
+		 */
+
+		if ((mino = iget(fsm, inum)) != NULL) {
+			(void) ifree(fsm, mino);
+			iput(mino);
+		}
+		IUNLOCK(parent);
+		errno = error;
+		return NULL;
+	}
+	IUNLOCK(parent);
+
+	/*
+	 * Inode is successfully created and necessary metadata
+	 * is also written. Now fill the file handle structure
+	 * and return it to the caller.
+	 */
+
+	return new_handle(fsh, inum, flags, path);
 }
 
 /*
@@ -355,9 +1609,7 @@ fscreate(
 	struct fs_handle	*fsh;
 	struct minode		*parent = NULL;
 	struct fsmem		*fsm = NULL;
-	fs_u64_t		inum;
-	int			i, len = strlen(path);
-	int			error = 0, last;
+	int			i, len = strlen(path), last;
 
 	if (*path != '/') {
 		fprintf(stderr, "ERROR: %s: path must be absolute i.e. "
@@ -377,19 +1629,16 @@ fscreate(
 	}*/
 
 	/*
-	 * First, do lookup on full path and see if the file/directory
-	 * is already present. If so, return NULL.
-	 * If it doesn't, lookup again for its to-be parent directory
-	 * if parent isn't the root directory.
+	 * Look up the to-be parent directory (unless it's the
+	 * root directory), then the name in it: if it's already
+	 * there, return NULL.
 	 */
 
 	fsh = (struct fs_handle *)vfsh;
-	if (lookup_path(fsh->fsh_mem, path, NULL) != 0) {
-		fprintf(stderr, "ERROR: The file %s already exists\n", path);
-		return NULL;
-	}
 	fsm = fsh->fsh_mem;
 	assert(fsm != NULL);
+	jnl_begin(fsm);
+	pthread_rwlock_wrlock(&fsm->fsm_nslock);
 	for (i = 1, last = 0; i < len; i++) {
 		if (path[i] == '/') {
 			last = i;
@@ -401,62 +1650,179 @@ fscreate(
 			fprintf(stderr, "ERROR: %s doesn't exist\n", path);
 			errno = ENOENT;
 			path[last] = '/';
-			return NULL;
+			goto out;
 		}
 		path[last] = '/';
 	} else {
 		ent.inumber = MNTPT_INO;
 	}
-	printf("ent.inumber: %llu\n", ent.inumber);
-
-	/*
-	 * The file doesn't exist.
-	 * Allocate a new inode for it and create a new directory entry.
-	 */
-
 	assert(ent.inumber != 0);
 	if ((parent = iget(fsm, ent.inumber)) == NULL) {
 		fprintf(stderr, "Failed to get inode %llu of %s\n", ent.inumber,
 			fsm->fsm_mntpt);
-		return NULL;
+		goto out;
 	}
-	printf("Parent inode num: %llu, type: %u, size: %llu\n", parent->mino_number, parent->mino_type, parent->mino_size);
-	assert(parent->mino_type == IFDIR);
-	if ((error = inode_alloc(fsm, flags, &inum)) != 0) {
-		return NULL;
+	fh = create_in(fsh, parent, path + last + 1, flags, path);
+
+out:
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	if (parent) {
+		iput(parent);
 	}
+	jnl_end(fsm);
+	return fh;
+}
 
-	for (i = len - 1; path[i] != '/'; i--);
-	fprintf(stdout, "INFO: Passing file name %s to add_direntry()\n",
-		path + i + 1);
-	if ((error = add_direntry(fsm, parent, path + i + 1, inum)) != 0) {
-		fprintf(stderr, "ERROR: Failed to add direntry: name-%s, "
-			"inum: %llu for %s\n", path + i + 1, inum,
-			fsm->fsm_mntpt);
-		return NULL;
+/*
+ * Create the 'n' files or directories 'names' (of types 'types',
+ * FTYPE_*) in directory 'parent' in one go: the directory is
+ * looked up and locked once, the inodes are allocated together
+ * (see ialloc_batch()) and the entries are added together (see
+ * add_direntries()). If 'handles' isn't NULL, it's filled with
+ * handles to the new files, as fscreate() would return.
+ * Nothing is created if a name is invalid, exists already or
+ * is given twice. If an error happens while creating, the files
+ * created so far stay and the rest of 'handles' is NULL.
+ * Returns zero or error number.
+ */
+
+int
+fscreate_batch(
+	void			*vfsh,
+	char			*parent,
+	char			**names,
+	fs_u32_t		*types,
+	int			n,
+	void			**handles)
+{
+	struct fs_handle	*fsh = (struct fs_handle *)vfsh;
+	struct fsmem		*fsm;
+	struct direntry		ent;
+	struct minode		*dir = NULL, *mino;
+	fs_u64_t		*inums = NULL, inum;
+	fs_u32_t		*itypes = NULL;
+	int			*seen = NULL, i, j, len, nseen, added = 0;
+	int			error = 0;
+
+	if (fsh == NULL || n <= 0 || names == NULL || types == NULL ||
+	    parent == NULL || *parent != '/') {
+		return EINVAL;
+	}
+	if (handles) {
+		memset(handles, 0, n * sizeof(void *));
+	}
+	for (i = 0; i < n; i++) {
+		if (names[i] == NULL) {
+			return EINVAL;
+		}
+	}
+	fsm = fsh->fsh_mem;
+	inums = (fs_u64_t *)malloc(n * sizeof(fs_u64_t));
+	itypes = (fs_u32_t *)malloc(n * sizeof(fs_u32_t));
+	for (nseen = 1; nseen < 2 * n; nseen <<= 1);
+	seen = (int *)malloc(nseen * sizeof(int));
+	if (inums == NULL || itypes == NULL || seen == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	jnl_begin(fsm);
+	pthread_rwlock_wrlock(&fsm->fsm_nslock);
+	if (lookup_path(fsm, parent, &ent) == 0) {
+		error = ENOENT;
+		goto unlock;
+	}
+	if ((dir = iget(fsm, ent.inumber)) == NULL) {
+		error = EIO;
+		goto unlock;
+	}
+	ILOCK_EXCL(dir);
+	if (dir->mino_type != IFDIR) {
+		error = ENOTDIR;
+		goto iunlock;
 	}
 
 	/*
-	 * Inode is successfully created and necessary metadata
-	 * is also written. Now fill the file handle structure
-	 * and return it to the caller.
+	 * Check all the names before creating anything, using
+	 * 'seen' as a hash table of the names of the batch.
 	 */
 
-	fh = (struct file_handle *)malloc(sizeof(struct file_handle));
-	if (fh == NULL) {
-		fprintf(stderr, "ERROR: Failed to allocate memory to "
-			"file handle for %s\n", fsm->fsm_mntpt);
-		errno = ENOMEM;
-		return NULL;
+	memset(seen, -1, nseen * sizeof(int));
+	for (i = 0; i < n && error == 0; i++) {
+		len = strlen(names[i]);
+		if (len == 0 || strchr(names[i], '/') != NULL) {
+			error = EINVAL;
+		} else if (len > dir_maxname(dir)) {
+			error = ENAMETOOLONG;
+		} else if (dcache_lookup(fsm, dir->mino_number, names[i], len,
+					 &inum)) {
+			error = inum ? EEXIST : 0;
+		} else if ((error = dir_lookup(dir, names[i], len,
+					       &inum)) != ENOENT) {
+			error = error ? error : EEXIST;
+		} else {
+			error = 0;
+		}
+		for (j = dir_hash(names[i], len) & (nseen - 1);
+		     error == 0 && seen[j] >= 0; j = (j + 1) & (nseen - 1)) {
+			if (strcmp(names[seen[j]], names[i]) == 0) {
+				error = EEXIST;
+			}
+		}
+		seen[j] = i;
+		itypes[i] = (types[i] & FTYPE_FILE) ? IFREG : IFDIR;
 	}
-	if ((fh->fh_inode = iget(fsm, inum)) == NULL) {
-		free(fh);
-		return NULL;
+	if (error) {
+		goto iunlock;
 	}
-	fh->fh_fsh = fsh;
-	fh->fh_curoffset = 0;
+	if ((error = ialloc_batch(fsm, itypes, n, inums)) != 0) {
+		fprintf(stderr, "fscreate_batch: Failed to allocate %d inodes "
+			"for %s\n", n, fsm->fsm_mntpt);
+		goto iunlock;
+	}
+	for (i = 0; i < n && error == 0; i++) {
+		if ((types[i] & FTYPE_DIR) && (types[i] & FTYPE_SORTED)) {
+			error = dir_makesorted(fsm, inums[i]);
+		}
+	}
+	if (error == 0) {
+		error = add_direntries(fsm, dir, names, inums, n, &added);
+	}
+	if (error) {
+		fprintf(stderr, "fscreate_batch: Failed to add %d of %d "
+			"entries to %s for %s\n", n - added, n, parent,
+			fsm->fsm_mntpt);
 
-	return fh;
+		/*
+		 * The inodes of the entries which couldn't be
+		 * added are freed.
+		 */
+
+		for (i = added; i < n; i++) {
+			if ((mino = iget(fsm, inums[i])) != NULL) {
+				ifree(fsm, mino);
+				iput(mino);
+			}
+		}
+	}
+
+iunlock:
+	IUNLOCK(dir);
+	for (i = 0; handles && i < added; i++) {
+		handles[i] = new_handle(fsh, inums[i], types[i], names[i]);
+	}
+
+unlock:
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	if (dir) {
+		iput(dir);
+	}
+	jnl_end(fsm);
+
+out:
+	free(inums);
+	free(itypes);
+	free(seen);
+	return error;
 }
 
 /*
@@ -492,12 +1858,20 @@ fsopen(
 	 */
 
 	fsh = (struct fs_handle *)vfsh;
+	pthread_rwlock_rdlock(&fsh->fsh_mem->fsm_nslock);
 	if (lookup_path(fsh->fsh_mem, path, &de) == 0) {
+		pthread_rwlock_unlock(&fsh->fsh_mem->fsm_nslock);
 		fprintf(stderr, "The path %s doesn't exist\n", path);
 		return NULL;
 	}
-	fprintf(stdout, "Got inode number %llu from lookup\n", de.inumber);
+
+	/*
+	 * The inode is referenced before the namespace lock is
+	 * dropped, so that fsremove() sees the file is open.
+	 */
+
 	mino = iget(fsh->fsh_mem, de.inumber);
+	pthread_rwlock_unlock(&fsh->fsh_mem->fsm_nslock);
 	if (mino == NULL) {
 		fprintf(stderr, "Failed to get inode %llu for %s\n",
 			fsh->fsh_mem, path);
@@ -508,12 +1882,413 @@ fsopen(
 		fprintf(stderr, "ERROR: Failed to allocate memory to "
 			"file handle for %s\n", fsh->fsh_mem->fsm_mntpt);
 		errno = ENOMEM;
+		iput(mino);
 		return NULL;
 	}
 	fh->fh_inode = mino;
 	fh->fh_fsh = fsh;
 	fh->fh_curoffset = 0;
+	fh->fh_wbuf = NULL;
+	fh->fh_wbuflen = 0;
+	fh->fh_rasize = 0;
+	fh->fh_ranext = 0;
+	fh->fh_raend = 0;
+	memset(&fh->fh_racursor, 0, sizeof(struct bmap_cursor));
+	fh->fh_dircookie = NULL;
 
 	fprintf(stdin, "Opened file %s successfully\n", path);
 	return fh;
 }
+
+/*
+ * Check that 'name' is a single path component, as the *at()
+ * operations take.
+ * Returns zero or error number.
+ */
+
+static int
+check_name(
+	const char		*name)
+{
+	int			len;
+
+	if (name == NULL || (len = strlen(name)) == 0 ||
+	    strchr(name, '/') != NULL) {
+		return EINVAL;
+	}
+	return (len > DIRREC_MAXNAME) ? ENAMETOOLONG : 0;
+}
+
+/*
+ * Look up 'name', a single path component, in the directory
+ * of handle 'dirfh', setting '*inump' to its inode number. This
+ * is what looking up the path of the directory followed by
+ * 'name' would do, without walking the path from the root
+ * directory again.
+ * Returns zero, ENOENT if there is no such name, or error
+ * number.
+ */
+
+int
+fslookupat(
+	void			*vdirfh,
+	char			*name,
+	fs_u64_t		*inump)
+{
+	struct file_handle	*dfh = (struct file_handle *)vdirfh;
+	struct fsmem		*fsm;
+	fs_u64_t		inum = 0;
+	int			error;
+
+	if (dfh == NULL || inump == NULL) {
+		return EINVAL;
+	}
+	if ((error = check_name(name)) != 0) {
+		return error;
+	}
+	fsm = dfh->fh_fsh->fsh_mem;
+	pthread_rwlock_rdlock(&fsm->fsm_nslock);
+	error = lookup_name(fsm, dfh->fh_inode->mino_number, dfh->fh_inode,
+			    name, strlen(name), &inum);
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	*inump = error ? 0 : inum;
+	return error;
+}
+
+/*
+ * Open 'name', a single path component, in the directory of
+ * handle 'dirfh', as fsopen() would open the path of the
+ * directory followed by 'name'. No open flags are supported
+ * yet, so 'flags' must be zero.
+ * Returns a file handle, or NULL with errno set.
+ */
+
+void *
+fsopenat(
+	void			*vdirfh,
+	char			*name,
+	fs_u32_t		flags)
+{
+	struct file_handle	*dfh = (struct file_handle *)vdirfh;
+	struct file_handle	*fh = NULL;
+	struct fsmem		*fsm;
+	fs_u64_t		inum;
+	int			error;
+
+	if (dfh == NULL || flags != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((error = check_name(name)) != 0) {
+		errno = error;
+		return NULL;
+	}
+
+	/*
+	 * As in fsopen(), the inode is referenced before the
+	 * namespace lock is dropped.
+	 */
+
+	fsm = dfh->fh_fsh->fsh_mem;
+	pthread_rwlock_rdlock(&fsm->fsm_nslock);
+	if ((error = lookup_name(fsm, dfh->fh_inode->mino_number,
+				 dfh->fh_inode, name, strlen(name),
+				 &inum)) != 0) {
+		errno = error;
+	} else {
+		fh = new_handle(dfh->fh_fsh, inum, 0, name);
+	}
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	return fh;
+}
+
+/*
+ * Create the file or directory 'name' (as per 'flags'), a
+ * single path component, in the directory of handle 'dirfh',
+ * as fscreate() would create the path of the directory
+ * followed by 'name'.
+ * Returns a file handle, or NULL with errno set.
+ */
+
+void *
+fscreateat(
+	void			*vdirfh,
+	char			*name,
+	fs_u32_t		flags)
+{
+	struct file_handle	*dfh = (struct file_handle *)vdirfh;
+	struct file_handle	*fh;
+	struct fsmem		*fsm;
+	int			error;
+
+	if (dfh == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((error = check_name(name)) != 0) {
+		errno = error;
+		return NULL;
+	}
+	fsm = dfh->fh_fsh->fsh_mem;
+	jnl_begin(fsm);
+	pthread_rwlock_wrlock(&fsm->fsm_nslock);
+	fh = create_in(dfh->fh_fsh, dfh->fh_inode, name, flags, name);
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	jnl_end(fsm);
+	return fh;
+}
+
+/*
+ * Create the file 'dst' as a clone of the regular file 'src':
+ * the new file shares all the blocks of 'src' instead of
+ * getting a copy of its data, so this takes time proportional
+ * to the number of extents of 'src' rather than to its size.
+ * Either file can then be written without affecting the other;
+ * see refcount.c.
+ * Data written to 'src' which is still in the write buffer of
+ * a file handle isn't part of the clone.
+ * Returns zero on success or error number; 'dst' is removed
+ * again if the clone fails after creating it.
+ */
+
+int
+fsclone(
+	void			*vfsh,
+	char			*src,
+	char			*dst)
+{
+	struct fs_handle	*fsh = (struct fs_handle *)vfsh;
+	struct fsmem		*fsm;
+	struct file_handle	*fh;
+	struct direntry		de;
+	struct minode		*smino, *dmino;
+	struct direct		*ext = NULL;
+	int			n, shared = 0, error;
+
+	if (!fsh || !src || !dst) {
+		return EINVAL;
+	}
+	fsm = fsh->fsh_mem;
+	jnl_begin(fsm);
+	pthread_rwlock_rdlock(&fsm->fsm_nslock);
+	if (lookup_path(fsm, src, &de) == 0) {
+		pthread_rwlock_unlock(&fsm->fsm_nslock);
+		fprintf(stderr, "The path %s doesn't exist\n", src);
+		error = ENOENT;
+		goto done;
+	}
+	smino = iget(fsm, de.inumber);
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	if (smino == NULL) {
+		error = EIO;
+		goto done;
+	}
+	if (smino->mino_type != IFREG) {
+		iput(smino);
+		error = EISDIR;
+		goto done;
+	}
+	if ((error = refcount_create(fsm)) != 0) {
+		iput(smino);
+		goto done;
+	}
+	if ((fh = fscreate(vfsh, dst, FTYPE_FILE | FTYPE_NOCOMPRESS)) == NULL) {
+		iput(smino);
+		error = errno ? errno : EIO;
+		goto done;
+	}
+
+	/*
+	 * The new file is in the namespace already, but no thread
+	 * holding its lock waits for the lock of another regular
+	 * file but a clone, whose new file can't be our source:
+	 * locking it before the source can't deadlock.
+	 */
+
+	dmino = fh->fh_inode;
+	ILOCK_EXCL(dmino);
+	ILOCK_SHARED(smino);
+	if ((error = bmap_getmap(smino, &ext, &n)) != 0) {
+		goto out;
+	}
+	if ((error = refcount_share(fsm, ext, n)) != 0) {
+		goto out;
+	}
+	shared = 1;
+	if ((error = bmap_setmap(fsm, dmino, ext, n)) != 0) {
+		goto out;
+	}
+
+	/*
+	 * The new file holds the references now: removing it
+	 * drops them.
+	 */
+
+	shared = 0;
+	if (smino->mino_codec != FSCMP_NONE &&
+	    (error = cmp_clone(fsm, smino, dmino)) != 0) {
+		goto out;
+	}
+	dmino->mino_nblocks = smino->mino_nblocks;
+	dmino->mino_size = smino->mino_size;
+	error = iwrite(dmino);
+
+out:
+	if (shared) {
+		(void) refcount_release(fsm, ext, n);
+	}
+	IUNLOCK(smino);
+	IUNLOCK(dmino);
+	free(ext);
+	iput(smino);
+	fsclose(fh);
+	if (error) {
+		fprintf(stderr, "fsclone: Failed to clone %s to %s for %s\n",
+			src, dst, fsm->fsm_mntpt);
+		(void) fsremove(vfsh, dst);
+	}
+
+done:
+	jnl_end(fsm);
+	return error;
+}
+
+/*
+ * Remove the regular file or empty directory 'path'. The file
+ * mustn't be open. Its blocks are freed, except those it shares
+ * with clones, which just lose a reference.
+ * Returns zero on success or error number.
+ */
+
+int
+fsremove(
+	void			*vfsh,
+	char			*path)
+{
+	struct fs_handle	*fsh = (struct fs_handle *)vfsh;
+	struct fsmem		*fsm;
+	struct direntry		ent;
+	struct minode		*parent = NULL, *mino = NULL;
+	fs_u64_t		inum;
+	int			i, last, busy, len, error = 0;
+
+	if (!fsh || !path || *path != '/') {
+		return EINVAL;
+	}
+	len = strlen(path);
+	if (len == 1) {
+		return EBUSY;
+	}
+	fsm = fsh->fsh_mem;
+	jnl_begin(fsm);
+	pthread_rwlock_wrlock(&fsm->fsm_nslock);
+	for (i = 1, last = 0; i < len; i++) {
+		if (path[i] == '/') {
+			last = i;
+		}
+	}
+	if (last != 0) {
+		path[last] = '\0';
+		i = lookup_path(fsm, path, &ent);
+		path[last] = '/';
+		if (i == 0) {
+			error = ENOENT;
+			goto out;
+		}
+	} else {
+		ent.inumber = MNTPT_INO;
+	}
+	if ((parent = iget(fsm, ent.inumber)) == NULL) {
+		error = EIO;
+		goto out;
+	}
+	ILOCK_EXCL(parent);
+	error = (parent->mino_type == IFDIR) ?
+		dir_lookup(parent, path + last + 1, len - last - 1, &inum) :
+		ENOTDIR;
+	if (error != 0) {
+		goto unlock;
+	}
+	if ((mino = iget(fsm, inum)) == NULL) {
+		error = EIO;
+		goto unlock;
+	}
+
+	/*
+	 * Nobody can open the file while fsm_nslock is held, so
+	 * if ours is the only reference, it's going to stay so.
+	 */
+
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	busy = (mino->mino_count > 1);
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
+	if (busy) {
+		error = EBUSY;
+	} else if (mino->mino_type == IFDIR && mino->mino_ndirents != 0) {
+		error = ENOTEMPTY;
+	} else {
+		error = remove_direntry(fsm, parent, path + last + 1);
+	}
+
+unlock:
+	IUNLOCK(parent);
+	if (error == 0) {
+		if (mino->mino_type == IFDIR) {
+			dcache_purge(fsm, inum);
+		}
+		if ((error = ifree(fsm, mino)) != 0) {
+			fprintf(stderr, "fsremove: Removed %s but failed to "
+				"free inode %llu for %s\n", path, inum,
+				fsm->fsm_mntpt);
+		}
+	}
+
+out:
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	if (mino) {
+		iput(mino);
+	}
+	if (parent) {
+		iput(parent);
+	}
+	jnl_end(fsm);
+	return error;
+}
+
+/*
+ * Set the compression of a regular file: 'codec' is one of
+ * FSCMP_* and 'level' is between FSCMP_MINLEVEL and
+ * FSCMP_MAXLEVEL. A file can only be made compressed or
+ * uncompressed while it's empty; the level can be changed at
+ * any time and applies to the data written from then on.
+ * Returns zero on success or error number.
+ */
+
+int
+fssetcompress(
+	void			*vfh,
+	int			codec,
+	int			level)
+{
+	struct file_handle	*fh = (struct file_handle *)vfh;
+	struct minode		*mino;
+	int			error;
+
+	if (fh == NULL) {
+		return EINVAL;
+	}
+	mino = fh->fh_inode;
+	if (mino->mino_type != IFREG) {
+		return EISDIR;
+	}
+	if ((error = fh_flush(fh)) != 0) {
+		return error;
+	}
+	jnl_begin(fh->fh_fsh->fsh_mem);
+	ILOCK_EXCL(mino);
+	error = cmp_enable(fh->fh_fsh->fsh_mem, mino, codec, level);
+	IUNLOCK(mino);
+	jnl_end(fh->fh_fsh->fsh_mem);
+
+	return error;
+}
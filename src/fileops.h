@@ -1,8 +1,19 @@
 #ifndef _FS_FILEOPS_H_
 #define _FS_FILEOPS_H_
 
-int     internal_read(int, struct minode *, char *, fs_u64_t, fs_u32_t);
+struct iovec;
+struct file_handle;
+
+int	internal_iov(struct minode *, int, const struct iovec *, fs_u64_t,
+		     fs_u64_t);
+int	internal_read(struct minode *, char *, fs_u64_t, fs_u32_t);
+int	internal_readv(struct minode *, const struct iovec *, int, fs_u64_t);
 int	metadata_write(struct fsmem *, fs_u64_t, char *, int,
 		       struct minode *);
+int	internal_write(struct fsmem *, struct minode *, char *, fs_u64_t,
+		       fs_u32_t);
+int	internal_writev(struct fsmem *, struct minode *, const struct iovec *,
+			int, fs_u64_t);
+int	fh_flush(struct file_handle *);
 
 #endif
@@ -1,8 +1,94 @@
 #ifndef _FS_H_
 #define _FS_H_
 
+#include <pthread.h>
+
+/*
+ * Size of the in-core inode hash table.
+ */
+
+#define IHASH_SIZE		256
+
+/*
+ * Locking.
+ *
+ * All the I/O to the device file is positional (pread/pwrite),
+ * so the file offset of fsm_devfd is never used and threads
+ * don't need a lock just to do I/O.
+ * The file system state is protected by following locks,
+ * which must be acquired in the order listed:
+ *
+ * 0. An operation changing the file system runs between
+ *    jnl_begin() and jnl_end() (see journal.c), which can wait
+ *    for a commit, so jnl_begin() comes before any lock. An
+ *    explicit transaction (fstx_begin()) is one operation.
+ * 1. fsm_nslock (rwlock): the namespace lock. Path lookup
+ *    holds it shared; operations adding a name to a directory
+ *    hold it exclusive.
+ * 2. mino_rwlock of a file/directory (rwlock): protects the
+ *    in-core inode (size, block map etc.) and the data of
+ *    the file. Held shared for reading and exclusive for
+ *    modifying. A thread holds at most one of these, except
+ *    fsclone() which locks the new file before the source.
+ * 3. fsm_rclock (mutex): the refcounts of shared blocks;
+ *    fsm_rc, fsm_nrc and the refcount file.
+ * 4. fsm_imaplock (mutex): inode allocation; the imap file,
+ *    the growth of ilist file and the used inode count.
+ * 5. mino_rwlock of the ilist inode: held shared to locate
+ *    an inode in ilist file and exclusive to grow the file.
+ * 6. fsm_alloclock (mutex): block allocation; the emap file
+ *    and the free block count.
+ * 7. fsm_sblock (mutex): writing the superblock to disk.
+ * 8. fsm_icachelock (mutex): the in-core inode hash table,
+ *    the reference counts of in-core inodes and the parked
+ *    free space maps of directories (fsm_dfpark).
+ * 9. jn_lock of fsm_jnl (mutex): the blocks of metadata the
+ *    journal has in core (see journal.c).
+ * 10. dc_lock of fsm_dcache (mutex): the dentry cache (see
+ *    dcache.c). Nothing else is locked while holding it.
+ *
+ * The emap, imap and refcount inodes are only ever modified
+ * under fsm_alloclock, fsm_imaplock and fsm_rclock
+ * respectively, so their own rwlocks aren't used. The block
+ * map of the checksum inode doesn't change after mount and
+ * each of its entries is written by whoever writes (or
+ * allocates) the block it covers, so it needs no lock either.
+ * The hash index inode of a directory (see dir.c) is covered
+ * by the lock of the directory.
+ */
+
+/*
+ * With FSMNT_DIRECT, fsm_dfd is a second descriptor of the
+ * device file opened with O_DIRECT, fsm_dioalign is the
+ * alignment required for I/O through it and fsm_biopool
+ * holds the aligned buffers used to bounce I/O (see bio.c).
+ * With FSMNT_MMAP, the whole device file (fsm_mapsz bytes)
+ * is mapped at fsm_map for as long as it's mounted; the size
+ * of the device file is set by mkfs and never changes.
+ * fsm_unsynced is set when anything is written to the device
+ * file in place, and cleared by bio_sync() (see bio.c).
+ * fsm_rc holds the fsm_nrc records of the refcount file
+ * (see refcount.c); fsm_rcip is NULL until a file is cloned.
+ * fsm_csip is the checksum file (see cksum.c), or NULL if
+ * there is none.
+ * fsm_igen counts the in-core inodes of each chain of
+ * fsm_ihash freed by iput() (see iget()).
+ * fsm_dcache caches the names looked up in directories (see
+ * dcache.c). fsm_dfpark lists the free space maps of directories
+ * which aren't in core (see dir.c).
+ * fsm_jnl is the metadata journal (see journal.c), or NULL if the
+ * file system has none or is mounted with FSMNT_NOJOURNAL.
+ */
+
 struct fsmem {
 	int			fsm_devfd;
+	int			fsm_dfd;
+	unsigned int		fsm_mntflags;
+	fs_u32_t		fsm_dioalign;
+	struct bio_pool		*fsm_biopool;
+	char			*fsm_map;
+	fs_u64_t		fsm_mapsz;
+	int			fsm_unsynced;
 	char			*fsm_devf;
 	char			*fsm_mntpt;
 	struct super_block	*fsm_sb;
@@ -10,20 +96,111 @@ struct fsmem {
 	struct minode		*fsm_emapip;
 	struct minode		*fsm_imapip;
 	struct minode		*fsm_mntip;
+	struct minode		*fsm_rcip;
+	struct minode		*fsm_csip;
+	struct refcount		*fsm_rc;
+	int			fsm_nrc;
+	struct minode		*fsm_ihash[IHASH_SIZE];
+	fs_u64_t		fsm_igen[IHASH_SIZE];
+	struct dcache		*fsm_dcache;
+	struct dirfree		*fsm_dfpark;
+	struct jnl		*fsm_jnl;
+	pthread_rwlock_t	fsm_nslock;
+	pthread_mutex_t		fsm_rclock;
+	pthread_mutex_t		fsm_imaplock;
+	pthread_mutex_t		fsm_alloclock;
+	pthread_mutex_t		fsm_sblock;
+	pthread_mutex_t		fsm_icachelock;
 };
 
 struct fs_handle {
 	struct fsmem		*fsh_mem;
 };
 
+/*
+ * An explicit transaction, as returned by fstx_begin().
+ */
+
+struct fs_tx {
+	struct fs_handle	*tx_fsh;
+};
+
+/*
+ * Size of the per-handle write buffer.
+ * Small sequential writes are gathered in this buffer
+ * and written (and allocated) in chunks of this size.
+ */
+
+#define WBUF_SIZE		(1 << 16)
+
+/*
+ * Minimum and maximum size of the readahead window.
+ * The window starts at RA_MIN_SIZE when a handle is
+ * found to be read sequentially and doubles (up to
+ * RA_MAX_SIZE) every time the reader catches up with it.
+ */
+
+#define RA_MIN_SIZE		(1 << 17)
+#define RA_MAX_SIZE		(1 << 23)
+
+/*
+ * A position in the block map of an inode: extent bc_ent of
+ * indirect block bc_ind (of the inode itself for a direct
+ * map), which starts at file offset bc_logical. It's valid
+ * as long as the mino_mapgen of the inode is bc_gen; a
+ * cursor of all zeroes is the start of any block map.
+ */
+
+struct bmap_cursor {
+	fs_u32_t		bc_gen;
+	int			bc_ind;
+	int			bc_ent;
+	fs_u64_t		bc_logical;
+};
+
+/*
+ * fh_wbuf holds fh_wbuflen bytes of data written
+ * through this handle at file offset fh_wbufoff, which
+ * aren't yet written to the file.
+ * fh_ranext is the offset at which the next read is
+ * expected if the handle is read sequentially, fh_rasize
+ * is the current readahead window (zero if the reads
+ * aren't sequential) and fh_raend is the file offset up
+ * to which readahead has been issued.
+ * fh_racursor is where the readahead left off in the block
+ * map, so that each window is mapped without walking the
+ * map from the start of the file.
+ * For a B-tree directory, fh_dircookie is the last name
+ * fsread_dir() returned (NULL before the first one), the
+ * entries being read in the order of their names.
+ */
+
 struct file_handle {
 	struct fs_handle	*fh_fsh;
 	fs_u64_t		fh_curoffset;
 	struct minode		*fh_inode;
+	char			*fh_wbuf;
+	fs_u64_t		fh_wbufoff;
+	fs_u32_t		fh_wbuflen;
+	fs_u32_t		fh_rasize;
+	fs_u64_t		fh_ranext;
+	fs_u64_t		fh_raend;
+	struct bmap_cursor	fh_racursor;
+	char			*fh_dircookie;
 };
 
 #define FTYPE_MASK		0x03
 #define FTYPE_FILE		0x01
 #define FTYPE_DIR		0x02
+#define FTYPE_SORTED		0x04
+
+/*
+ * Internal flag of fscreate(): don't make the new file
+ * compressed even on an FSMNT_COMPRESS mount.
+ */
+
+#define FTYPE_NOCOMPRESS	0x10
+
+#define FSMNT_GETCLEVEL(f)	(((f) >> 8) & 0x0f)
 
 #endif
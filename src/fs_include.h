@@ -1,36 +1,180 @@
 #ifndef _FSONFILE_H_
 #define _FSONFILE_H_
 
+#include <sys/uio.h>
+
 struct dir_entry {
 	char			dir_name[256];
 	unsigned long long	dir_ino;
 };
 
+/*
+ * A piece of a file as it's laid out inside the device
+ * file, as returned by fsmap().
+ * The data at [fext_logical, fext_logical + fext_len) of
+ * the file lives at [fext_physical, fext_physical + fext_len)
+ * of the device file.
+ */
+
+struct file_extent {
+	unsigned long long	fext_logical;
+	unsigned long long	fext_physical;
+	unsigned long long	fext_len;
+};
+
+/*
+ * Completion of an asynchronous request, as returned by
+ * fsaio_getevents(). 'ev_result' is the number of bytes
+ * transferred and 'ev_error' the error number, if any.
+ */
+
+struct fsaio_event {
+	void			*ev_req;
+	void			*ev_arg;
+	int			ev_result;
+	int			ev_error;
+};
+
+/*
+ * Result of fsscrub(): the number of blocks verified, of
+ * blocks without a checksum and of blocks whose data doesn't
+ * match their checksum, and the first of those.
+ */
+
+struct fsscrub_result {
+	unsigned long long	sr_checked;
+	unsigned long long	sr_skipped;
+	unsigned long long	sr_bad;
+	unsigned long long	sr_firstbad;
+};
+
+/*
+ * Completion callback of an asynchronous request:
+ * (request, argument, result, error).
+ */
+
+typedef void	(*fsaio_cb_t)(void *, void *, int, int);
+
+/*
+ * Callback of fswalk(): (argument, path, entry), the entry
+ * being a struct udirentplus. A non-zero return stops the walk.
+ */
+
+struct udirentplus;
+typedef int	(*fswalk_cb_t)(void *, const char *, struct udirentplus *);
+
 typedef void *	FSHANDLE;
 typedef void *	FHANDLE;
 extern int	create_fs(char *, int);
 extern void	*fsmount(char *, char *);
-extern void	*fsopen(void *, char *, unsigned short);
+extern void	*fsmount_opts(char *, char *, unsigned int);
+extern void	*fsopen(void *, char *, unsigned int);
+extern void	*fsopenat(void *, char *, unsigned int);
 extern void	*fscreate(void *, char *, unsigned int);
-extern int	fsread_dir(void *, char *, int);
+extern void	*fscreateat(void *, char *, unsigned int);
+extern int	fslookupat(void *, char *, unsigned long long *);
+extern int	fscreate_batch(void *, char *, char **, unsigned int *, int,
+			       void **);
+extern int	fsread_dir(void *, char *, unsigned int);
+extern int	fsread_dirplus(void *, char *, unsigned int);
+extern int	fsread_dir_prefix(void *, char *, char *, char *,
+				  unsigned int);
+extern int	fswalk(void *, char *, fswalk_cb_t, void *, int);
+extern int	fsmap(void *, unsigned long long, unsigned long long,
+		      struct file_extent *, int);
+extern int	fsread(void *, char *, unsigned int);
+extern int	fswrite(void *, char *, unsigned int);
+extern int	fsreadv(void *, const struct iovec *, int);
+extern int	fswritev(void *, const struct iovec *, int);
+extern int	fspreadv(void *, const struct iovec *, int, unsigned long long);
+extern int	fspwritev(void *, const struct iovec *, int,
+			  unsigned long long);
+extern long long fscopy_to_fd(void *, unsigned long long, unsigned long long,
+			      int);
+extern int	fsclose(void *);
+extern int	fsclone(void *, char *, char *);
+extern int	fsremove(void *, char *);
+extern int	fssetcompress(void *, int, int);
+extern int	fsscrub(void *, int, struct fsscrub_result *);
+extern void	*fsaio_create(void *, int, int);
+extern int	fsaio_destroy(void *);
+extern void	*fsread_async(void *, void *, char *, unsigned int,
+			      unsigned long long, fsaio_cb_t, void *);
+extern void	*fswrite_async(void *, void *, char *, unsigned int,
+			       unsigned long long, fsaio_cb_t, void *);
+extern int	fsaio_getevents(void *, struct fsaio_event *, int, int);
+extern int	fssync(void *);
+extern void	*fstx_begin(void *);
+extern int	fstx_commit(void *);
+extern int	fstx_abort(void *);
+extern int	fsumount(void *);
 
 /*
  * File type (used as argument to fscreate())
+ * FTYPE_SORTED: with FTYPE_DIR, keep the entries of the
+ * directory sorted by name, so that fsread_dir() returns them
+ * in order and fsread_dir_prefix() reads a range of them
+ * without going through the whole directory.
  */
 
 #define	FTYPE_FILE	0x01
 #define FTYPE_DIR	0x02
+#define FTYPE_SORTED	0x04
+
+/*
+ * Size of the cookie of fsread_dir_prefix().
+ */
+
+#define FSDIR_COOKIELEN	256
+
+/*
+ * Mount flags (used as argument to fsmount_opts())
+ * FSMNT_DIRECT: do the I/O to the device file with O_DIRECT,
+ * bypassing the host page cache.
+ * FSMNT_MMAP: map the device file and access it through the
+ * mapping instead of read/write system calls.
+ * FSMNT_POPULATE: with FSMNT_MMAP, prefault the metadata
+ * (ilist, emap, imap and root directory) at mount time.
+ * FSMNT_COMPRESS: compress the regular files created on this
+ * mount with FSCMP_LZ, at the level given with FSMNT_CLEVEL()
+ * (default FSCMP_DEFLEVEL).
+ * FSMNT_NOVERIFY: don't verify the checksums of file data on
+ * read. They are still kept up to date on write.
+ * FSMNT_NOJOURNAL: write the metadata in place as it changes,
+ * instead of through the journal. The journal is still replayed
+ * at mount time.
+ * FSMNT_NORA: don't read ahead for sequential readers.
+ */
+
+#define FSMNT_DIRECT	0x01
+#define FSMNT_MMAP	0x02
+#define FSMNT_POPULATE	0x04
+#define FSMNT_COMPRESS	0x08
+#define FSMNT_NOVERIFY	0x10
+#define FSMNT_NOJOURNAL	0x20
+#define FSMNT_NORA	0x40
+#define FSMNT_CLEVEL(l)	(((l) & 0x0f) << 8)
+
+/*
+ * Compression codecs (used as argument to fssetcompress())
+ * FSCMP_NONE: data is stored as is.
+ * FSCMP_LZ: LZ77 with a hash chain match finder. The level
+ * (FSCMP_MINLEVEL to FSCMP_MAXLEVEL) bounds how many earlier
+ * matches are tried at each position, trading speed for ratio.
+ */
+
+#define FSCMP_NONE	0
+#define FSCMP_LZ	1
+
+#define FSCMP_MINLEVEL	1
+#define FSCMP_DEFLEVEL	1
+#define FSCMP_MAXLEVEL	9
 
 /*
 extern int	fslseek(void *, fs_u64_t, int);
-extern int	fsread(void *, char *, fs_u32_t);
-extern int	fswrite(void *, char *, int);
 extern int	fslookup(void *, char *);
-extern int	fsread_dir(void *, char *, int);
+extern int	fsread_dir(void *, char *, unsigned int);
 extern void	fsreset_dir(void *);
-extern int	fsremove(void *);
-extern int	fsclose(void *);
-extern int	fsumount(void *);
 */
 
 #endif	/*_FSONFILE_H_*/
@@ -4,6 +4,12 @@
 #include "bmap.h"
 #include "inode.h"
 #include "fileops.h"
+#include "allocate.h"
+#include "bio.h"
+#include "journal.h"
+#include "refcount.h"
+#include "dir.h"
+#include "compress.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -13,15 +19,73 @@
 #define ILIST_EXTSIZE	16
 #define IMAP_EXTSIZE	8
 
+/*
+ * iread_batch() reads inodes which are no more than IBATCH_MAXGAP
+ * bytes apart in ilist file with one read of up to IBATCH_MAXRUN
+ * bytes, and ialloc_batch() writes up to IBATCH_MAXRUN bytes of
+ * new inodes at once.
+ */
+
+#define IBATCH_MAXRUN	(64 << 10)
+#define IBATCH_MAXGAP	(8 << 10)
+
+struct iread_ent {
+	fs_u64_t	ir_inum;
+	int		ir_idx;
+};
+
+#define IHASH(inum)	((inum) & (IHASH_SIZE - 1))
+
+static struct minode *
+ihash_lookup(
+	struct fsmem	*fsm,
+	fs_u64_t	inum)
+{
+	struct minode	*mino;
+
+	for (mino = fsm->fsm_ihash[IHASH(inum)]; mino != NULL;
+	     mino = mino->mino_hnext) {
+		if (mino->mino_number == inum) {
+			return mino;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add an in-core inode to the inode hash table.
+ * The caller must make sure that the inode isn't
+ * already present in the table.
+ */
+
+void
+ihash_insert(
+	struct fsmem	*fsm,
+	struct minode	*mino)
+{
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	assert(ihash_lookup(fsm, mino->mino_number) == NULL);
+	mino->mino_hnext = fsm->fsm_ihash[IHASH(mino->mino_number)];
+	fsm->fsm_ihash[IHASH(mino->mino_number)] = mino;
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
+}
+
+/*
+ * Get the in-core inode for inode number 'inum'.
+ * If the inode is already in core, just take a reference
+ * on it, otherwise read it from the ilist file.
+ * The reference must be dropped with iput().
+ */
+
 struct minode *
 iget(
 	struct fsmem		*fsm,
 	fs_u64_t		inum)
 {
 	struct super_block	*sb = fsm->fsm_sb;
-	struct minode		*mino = NULL;
+	struct minode		*mino = NULL, *tmp = NULL;
 	fs_u64_t		offset;
-	fs_u64_t		blkno, off, len;
+	fs_u64_t		blkno, off, len, gen;
 	int			error = 0;
 
 	assert(sb != NULL);
@@ -34,36 +98,239 @@ iget(
 			inum, fsm->fsm_mntpt);
 		return NULL;
 	}*/
-	offset = inum << LOG_INOSIZE;
 	mino = (struct minode *)malloc(sizeof(struct minode));
 	if (!mino) {
 		fprintf(stderr, "Failed to allocate memory for inode %llu\n",
 			inum);
 		return NULL;
 	}
-	if ((error = bmap(fsm->fsm_devfd, fsm->fsm_ilip, &blkno, &len,
+
+again:
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	if ((tmp = ihash_lookup(fsm, inum)) != NULL) {
+		tmp->mino_count++;
+		pthread_mutex_unlock(&fsm->fsm_icachelock);
+		free(mino);
+		return tmp;
+	}
+	gen = fsm->fsm_igen[IHASH(inum)];
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
+
+	offset = inum << LOG_INOSIZE;
+	ILOCK_SHARED(fsm->fsm_ilip);
+	if ((error = bmap(fsm->fsm_ilip, &blkno, &len,
 			  &off, offset))) {
+		IUNLOCK(fsm->fsm_ilip);
 		fprintf(stderr, "Failed to bmap at %llu offset in ilist "
 			"file\n", offset);
 		free(mino);
 		return NULL;
 	}
+	IUNLOCK(fsm->fsm_ilip);
 	offset = (blkno << LOG_ONE_K) + off;
-	lseek(fsm->fsm_devfd, offset, SEEK_SET);
-	printf("iget:reading from blkno %llu and offset %llu\n", blkno, offset);
-	if (read(fsm->fsm_devfd, &mino->mino_dip, sizeof(struct dinode)) !=
-		 sizeof(struct dinode)) {
+	if (bio_read(fsm, &mino->mino_dip, sizeof(struct dinode),
+		     offset) != 0) {
 		fprintf(stderr, "Failed to read inode %llu\n", inum);
 		free(mino);
 		return NULL;
 	}
+
+	/*
+	 * Somebody else might have read the same inode while
+	 * we were doing the I/O: if so, use their copy. If an
+	 * inode of the hash chain was freed meanwhile, it may
+	 * have been this one, written after our read: read it
+	 * again.
+	 */
+
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	if (ihash_lookup(fsm, inum) != NULL ||
+	    fsm->fsm_igen[IHASH(inum)] != gen) {
+		pthread_mutex_unlock(&fsm->fsm_icachelock);
+		goto again;
+	}
 	mino->mino_number = inum;
 	mino->mino_fsm = fsm;
-	mino->mino_bno = blkno;
-	printf("iget mino_bno is: %llu, type: %u\n", mino->mino_bno, mino->mino_type);
+	mino->mino_bno = blkno + (off >> LOG_ONE_K);
+	mino->mino_count = 1;
+	mino->mino_dfree = NULL;
+	mino->mino_sfree = NULL;
+	mino->mino_mapgen = 0;
+	pthread_rwlock_init(&mino->mino_rwlock, NULL);
+	mino->mino_hnext = fsm->fsm_ihash[IHASH(inum)];
+	fsm->fsm_ihash[IHASH(inum)] = mino;
+	if (mino->mino_type == IFDIR) {
+		dirfree_unpark(fsm, mino);
+	}
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
 	return mino;
 }
 
+/*
+ * Drop a reference on the in-core inode taken by iget().
+ * The in-core inode is freed with its last reference.
+ */
+
+void
+iput(
+	struct minode	*mino)
+{
+	struct fsmem	*fsm = mino->mino_fsm;
+	struct minode	**mpp;
+
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	assert(mino->mino_count > 0);
+	if (--mino->mino_count > 0) {
+		pthread_mutex_unlock(&fsm->fsm_icachelock);
+		return;
+	}
+	for (mpp = &fsm->fsm_ihash[IHASH(mino->mino_number)]; *mpp != mino;
+	     mpp = &(*mpp)->mino_hnext);
+	*mpp = mino->mino_hnext;
+	fsm->fsm_igen[IHASH(mino->mino_number)]++;
+	dirfree_park(fsm, mino);
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
+	cmpfree_release(mino);
+	pthread_rwlock_destroy(&mino->mino_rwlock);
+	free(mino);
+}
+
+/*
+ * Read the dinode of in-core inode 'mino' again, as the ilist
+ * file has it now, and drop the free space map of a directory
+ * or the free slots of a compressed file: what was changed in
+ * core is forgotten. Used when an explicit transaction is
+ * aborted; the ilist inode must be read again first. Called
+ * with 'mino' locked exclusive.
+ * Returns zero or error number.
+ */
+
+int
+ireload(
+	struct minode	*mino)
+{
+	struct fsmem	*fsm = mino->mino_fsm;
+	fs_u64_t	blkno, off, len;
+	int		error;
+
+	if (mino != fsm->fsm_ilip) {
+		ILOCK_SHARED(fsm->fsm_ilip);
+	}
+	error = bmap(fsm->fsm_ilip, &blkno, &len, &off,
+		     mino->mino_number << LOG_INOSIZE);
+	if (mino != fsm->fsm_ilip) {
+		IUNLOCK(fsm->fsm_ilip);
+	}
+	if (error == 0) {
+		error = bio_read(fsm, &mino->mino_dip, sizeof(struct dinode),
+				 (blkno << LOG_ONE_K) + off);
+	}
+	mino->mino_mapgen++;
+	if (error) {
+		fprintf(stderr, "Failed to read inode %llu again for %s\n",
+			mino->mino_number, fsm->fsm_mntpt);
+	}
+	dirfree_release(mino);
+	cmpfree_release(mino);
+	return error;
+}
+
+static int
+iread_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct iread_ent	*ea = (const struct iread_ent *)a;
+	const struct iread_ent	*eb = (const struct iread_ent *)b;
+
+	return (ea->ir_inum > eb->ir_inum) - (ea->ir_inum < eb->ir_inum);
+}
+
+/*
+ * Read the dinodes of the 'n' inodes 'inums' into 'dips',
+ * without bringing them in core. Inodes which are in core are
+ * copied from there (a snapshot, as they can be changing). The
+ * others are read from ilist file in inode number order, which
+ * is the order they're laid out in, coalescing the reads of
+ * nearby inodes, so a batch of inodes costs a few sequential
+ * reads instead of a bmap and a random read per inode.
+ * Returns zero or error number.
+ */
+
+int
+iread_batch(
+	struct fsmem		*fsm,
+	fs_u64_t		*inums,
+	int			n,
+	struct dinode		*dips)
+{
+	struct iread_ent	*ents;
+	struct minode		*mino;
+	fs_u64_t		start, end, off, blkno, len, ioff;
+	char			*buf;
+	int			i, j, k, m, error = 0;
+
+	ents = (struct iread_ent *)malloc(n * sizeof(struct iread_ent));
+	buf = (char *)malloc(IBATCH_MAXRUN);
+	if (ents == NULL || buf == NULL) {
+		free(ents);
+		free(buf);
+		return ENOMEM;
+	}
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	for (i = 0, m = 0; i < n; i++) {
+		if ((mino = ihash_lookup(fsm, inums[i])) != NULL) {
+			dips[i] = mino->mino_dip;
+			continue;
+		}
+		ents[m].ir_inum = inums[i];
+		ents[m++].ir_idx = i;
+	}
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
+	qsort(ents, m, sizeof(struct iread_ent), iread_cmp);
+
+	/*
+	 * Each read covers a run of inodes within one extent
+	 * of ilist file.
+	 */
+
+	ILOCK_SHARED(fsm->fsm_ilip);
+	for (i = 0; i < m; i = j) {
+		start = ents[i].ir_inum << LOG_INOSIZE;
+		if ((error = bmap(fsm->fsm_ilip, &blkno, &len, &off,
+				  start)) != 0) {
+			fprintf(stderr, "Failed to bmap at %llu offset in "
+				"ilist file\n", start);
+			break;
+		}
+		len = MIN(len, IBATCH_MAXRUN);
+		end = start + INOSIZE;
+		for (j = i + 1; j < m; j++) {
+			ioff = ents[j].ir_inum << LOG_INOSIZE;
+			if (ioff + INOSIZE > start + len ||
+			    ioff > end + IBATCH_MAXGAP) {
+				break;
+			}
+			end = MAX(end, ioff + INOSIZE);
+		}
+		if ((error = bio_read(fsm, buf, end - start,
+				      (blkno << LOG_ONE_K) + off)) != 0) {
+			fprintf(stderr, "Failed to read inodes %llu-%llu\n",
+				ents[i].ir_inum, ents[j - 1].ir_inum);
+			break;
+		}
+		for (k = i; k < j; k++) {
+			memcpy(&dips[ents[k].ir_idx], buf +
+			       (ents[k].ir_inum << LOG_INOSIZE) - start,
+			       sizeof(struct dinode));
+		}
+	}
+	IUNLOCK(fsm->fsm_ilip);
+	free(ents);
+	free(buf);
+	return error;
+}
+
 /*
  * Write the inode on disk.
  */
@@ -73,26 +340,76 @@ iwrite(
 	struct minode	*ino)
 {
 	fs_u64_t	offset;
+	int		error;
 
-	printf("Entered iwrite\n");
 	assert(ino != NULL);
 	assert(ino->mino_fsm != NULL);
 	assert(ino->mino_bno != 0);
 	offset = (ino->mino_bno << LOG_ONE_K) +
-		  ((ino->mino_number) << LOG_INOSIZE);
-	fprintf(stdout, "INFO: writing inode number %llu at ilist block number"
-		" %llu with offset %llu\n", ino->mino_number, ino->mino_bno, offset);
-	lseek(ino->mino_fsm->fsm_devfd, offset, SEEK_SET);
-	if (write(ino->mino_fsm->fsm_devfd, &ino->mino_dip,
-		  sizeof(struct dinode)) != sizeof(struct dinode)) {
+		  ((ino->mino_number << LOG_INOSIZE) & (ONE_K - 1));
+	if ((error = jnl_write(ino->mino_fsm, &ino->mino_dip,
+			       sizeof(struct dinode), offset)) != 0) {
 		fprintf(stderr, "ERROR: failed to write inode number %llu:"
-			" %s\n",ino->mino_number, strerror(errno));
+			" %s\n",ino->mino_number, strerror(error));
 		return 1;
 	}
 
 	return 0;
 }
 
+/*
+ * Grow imap file by an extent of (up to) IMAP_EXTSIZE blocks,
+ * all of whose inodes are free but the first one if
+ * 'takefirst'. Called with fsm_imaplock held.
+ */
+
+static int
+imap_grow(
+	struct fsmem	*fsm,
+	int		takefirst)
+{
+	fs_u64_t	blkno, len;
+	char		*buf;
+	int		error;
+
+	if ((error = bmap_alloc(fsm, fsm->fsm_imapip, IMAP_EXTSIZE,
+				&blkno, &len)) != 0) {
+		fprintf(stderr, "imap_grow: imap allocation failed for %s\n",
+			fsm->fsm_mntpt);
+		return error;
+	}
+	buf = (char *)malloc(len << LOG_ONE_K);
+	if (!buf) {
+		fprintf(stderr, "imap_grow: memory allocation failed for "
+			"imap extent for %s\n", fsm->fsm_mntpt);
+		return ENOMEM;
+	}
+
+	/*
+	 * New extent of 8K means 8K * 8 = 64K new free inodes.
+	 */
+
+	memset(buf, -1, len << LOG_ONE_K);
+	if (takefirst) {
+		buf[0] &= ~(0x1);
+	}
+	if ((error = jnl_write(fsm, buf, len << LOG_ONE_K,
+			       blkno << LOG_ONE_K)) != 0) {
+		fprintf(stderr, "imap_grow: Failed to write new imap extent"
+			" at %llu for %s\n", blkno, fsm->fsm_mntpt);
+		free(buf);
+		return error;
+	}
+	free(buf);
+
+	/*
+	 * Increase the size of imap file
+	 */
+
+	fsm->fsm_imapip->mino_size += len << LOG_ONE_K;
+	return iwrite(fsm->fsm_imapip) ? EIO : 0;
+}
+
 /*
  * Get free inode.
  * This comes into picture whenever an inode needs
@@ -104,11 +421,11 @@ get_free_inum(
 	struct fsmem	*fsm,
 	fs_u64_t	*inump)
 {
-	fs_u64_t	off = 0, blkno, len;
+	fs_u64_t	off = 0;
 	fs_u64_t	inum = 0;
 	fs_u32_t	rd;
 	char		*buf = NULL, bit;
-	int		i, j, error = 0, nbytes = 0;
+	int		i, j, error = 0;
 
 	*inump = 0;
 
@@ -132,7 +449,7 @@ get_free_inum(
 				free(buf);
 				return EINVAL;
 			}
-			if ((rd = internal_read(fsm->fsm_devfd, fsm->fsm_imapip,
+			if ((rd = internal_read(fsm->fsm_imapip,
 						buf, off, ONE_K)) != ONE_K) {
 				fprintf(stderr, "ERROR: Failed to read imap "
 					"file for %s\n", fsm->fsm_mntpt);
@@ -164,7 +481,6 @@ get_free_inum(
 			}
 			off += ONE_K;
 		}
-		fprintf(stdout, "Found the inode %llu free\n", inum);
 		if (metadata_write(fsm, off, buf, ONE_K, fsm->fsm_imapip) !=
 				   ONE_K) {
 			error = errno;
@@ -178,12 +494,9 @@ get_free_inum(
 		 */
 
 		fsm->fsm_sb->iused++;
-		lseek(fsm->fsm_devfd, SB_OFFSET, SEEK_SET);
-		if (write(fsm->fsm_devfd, fsm->fsm_sb,
-		    sizeof(struct super_block)) != sizeof(struct super_block)) {
+		if ((error = write_sb(fsm)) != 0) {
 			fprintf(stderr, "get_free_inum: Failed to write "
 				"super block\n");
-			error = errno;
 		}
 		*inump = inum;
 		free(buf);
@@ -191,57 +504,78 @@ get_free_inum(
 	}
 
 	/*
-	 * We need to allocate new extent to imap file.
-	 * For now, we're allocating extent of 8 blocks.
+	 * We need to allocate new extent to imap file, the first
+	 * inode of which is the one allocated.
 	 */
 
-	if ((error = bmap_alloc(fsm, fsm->fsm_imapip, IMAP_EXTSIZE,
+	inum = fsm->fsm_imapip->mino_size << 3;
+	if ((error = imap_grow(fsm, 1)) != 0) {
+		return error;
+	}
+	fsm->fsm_sb->iused++;
+	if ((error = write_sb(fsm)) != 0) {
+		fprintf(stderr, "get_free_inum: Failed to write super block"
+			" for %s\n", fsm->fsm_mntpt);
+		return error;
+	}
+	*inump = inum;
+	return 0;
+}
+
+/*
+ * The ilist file is full of used inodes; no entry for inode
+ * 'inum'. Allocate an extent of 16 blocks for the ilist file.
+ * Called with fsm_imaplock held.
+ */
+
+static int
+ilist_grow(
+	struct fsmem	*fsm,
+	fs_u64_t	inum)
+{
+	fs_u64_t	blkno, offset, len;
+	char		*buf = NULL;
+	int		error = 0;
+
+	ILOCK_EXCL(fsm->fsm_ilip);
+	if ((error = bmap_alloc(fsm, fsm->fsm_ilip, ILIST_EXTSIZE,
 				&blkno, &len)) != 0) {
-		fprintf(stderr, "get_free_inum: imap allocation failed for %s\n",
-			fsm->fsm_mntpt);
+		IUNLOCK(fsm->fsm_ilip);
+		fprintf(stderr, "ilist_grow: ilist allocation "
+			"failed for %s\n", fsm->fsm_mntpt);
 		return error;
 	}
-	nbytes = IMAP_EXTSIZE << LOG_ONE_K;
-	buf = (char *) malloc(nbytes);
+	buf = (char *)malloc(len << LOG_ONE_K);
 	if (!buf) {
-		fprintf(stderr, "get_free_inum: memory allocation failed for "
-			"imap extent for %s\n", fsm->fsm_mntpt);
+		IUNLOCK(fsm->fsm_ilip);
+		fprintf(stderr, "ilist_grow: failed to allocate "
+			"memory for ilist extent for %s\n",
+			fsm->fsm_mntpt);
 		return ENOMEM;
 	}
-	memset(buf, -1, nbytes);
-	buf[0] &= ~(0x1);
-	lseek(fsm->fsm_devfd, blkno << LOG_ONE_K, SEEK_SET);
-	if (write(fsm->fsm_devfd, buf, nbytes) != nbytes) {
-		error = errno;
-		fprintf(stderr, "get_free_inum: Failed to write new imap extent"
-			" at %llu for %s\n", blkno, fsm->fsm_mntpt);
+	memset(buf, 0, len << LOG_ONE_K);
+	offset = blkno << LOG_ONE_K;
+	if ((error = jnl_write(fsm, buf, len << LOG_ONE_K,
+			       offset)) != 0) {
+		IUNLOCK(fsm->fsm_ilip);
+		fprintf(stderr, "ilist_grow: failed to write "
+			"new ilist extent for %s\n", fsm->fsm_mntpt);
 		free(buf);
 		return error;
 	}
 
 	/*
-	 * New extent of 8K means 8K * 8 = 64K new free inodes, one
-	 * of which will be utilized and rest are marked free in imap.
+	 * Increase the size of ilist inode by the blocks
+	 * allocated.
 	 */
 
-	fsm->fsm_sb->iused++;
-	lseek(fsm->fsm_devfd, SB_OFFSET, SEEK_SET);
-	if (write(fsm->fsm_devfd, fsm->fsm_sb, sizeof(struct super_block)) !=
-	    sizeof(struct super_block)) {
-		fprintf(stderr, "get_free_inum: Failed to write super block"
-			" for %s\n", fsm->fsm_mntpt);
-		error = errno;
-	} else {
-		*inump = inum;
+	fsm->fsm_ilip->mino_dip.size += len << LOG_ONE_K;
+	if (error = iwrite(fsm->fsm_ilip)) {
+		fprintf(stderr, "ilist_grow: failed to add inode "
+			"number %llu to ilist for %s\n", inum,
+			fsm->fsm_mntpt);
 	}
-
-	/*
-	 * Increase the size of imap file
-	 */
-
-	fsm->fsm_imapip->mino_size += IMAP_EXTSIZE << LOG_ONE_K;
-	error = iwrite(fsm->fsm_imapip);
-
+	IUNLOCK(fsm->fsm_ilip);
 	free(buf);
 	return error;
 }
@@ -262,67 +596,14 @@ add_ilist_entry(
 {
 	struct dinode	dp;
 	fs_u64_t	blkno, offset, off, len;
-	char		*buf = NULL;
 	int		error = 0;
 
 	assert((fsm->fsm_sb->iused - 1) << LOG_INOSIZE <=
 		fsm->fsm_ilip->mino_size);
 	assert(inum << LOG_INOSIZE <= fsm->fsm_ilip->mino_size);
 
-	if ((inum + 1) << LOG_INOSIZE == fsm->fsm_ilip->mino_size) {
-
-		/*
-		 * The ilist file is full of used inodes; no entry for
-		 * a new one. Allocate an extent of 16 blocks for the
-		 * ilist file.
-		 */
-
-		if ((error = bmap_alloc(fsm, fsm->fsm_ilip, ILIST_EXTSIZE,
-					&blkno, &len)) != 0) {
-			fprintf(stderr, "add_ilist_entry: ilist allocation "
-				"failed for %s\n", fsm->fsm_mntpt);
-			return error;
-		}
-		buf = (char *)malloc(len << LOG_ONE_K);
-		if (!buf) {
-			fprintf(stderr, "add_ilist_entry: failed to allocate "
-				"memory for ilist extent for %s\n",
-				fsm->fsm_mntpt);
-			return ENOMEM;
-		}
-		memset(buf, 0, len << LOG_ONE_K);
-		memset(&dp, 0, sizeof(struct dinode));
-
-		/*
- 		 * Initialize the inode data.
-		 */
-
-		dp.type = type;
-		dp.orgtype = ORG_DIRECT;
-		memcpy(buf, &dp, sizeof(struct dinode));
-
-		offset = blkno << LOG_ONE_K;
-		lseek(fsm->fsm_devfd, offset, SEEK_SET);
-		if (write(fsm->fsm_devfd, buf, ILIST_EXTSIZE << LOG_ONE_K) !=
-			  ILIST_EXTSIZE << LOG_ONE_K) {
-			error = errno;
-			fprintf(stderr, "add_ilist_entry: failed to write "
-				"new ilist extent for %s\n", fsm->fsm_mntpt);
-			free(buf);
-			return error;
-		}
-
-		/*
-		 * Increase the size of ilist inode by 16 blocks
-		 */
-
-		fsm->fsm_ilip->mino_dip.size += ILIST_EXTSIZE << LOG_ONE_K;
-		if (error = iwrite(fsm->fsm_ilip)) {
-			fprintf(stderr, "add_ilist_entry: failed to add inode "
-				"number %llu to ilist for %s\n", inum,
-				fsm->fsm_mntpt);
-		}
-		free(buf);
+	if ((inum + 1) << LOG_INOSIZE > fsm->fsm_ilip->mino_size &&
+	    (error = ilist_grow(fsm, inum)) != 0) {
 		return error;
 	}
 
@@ -332,65 +613,286 @@ add_ilist_entry(
 	 */
 
 	offset = inum << LOG_INOSIZE;
-	if ((error = bmap(fsm->fsm_devfd, fsm->fsm_ilip, &blkno, &len, &off,
-			  offset)) != 0) {
+	ILOCK_SHARED(fsm->fsm_ilip);
+	error = bmap(fsm->fsm_ilip, &blkno, &len, &off,
+		     offset);
+	IUNLOCK(fsm->fsm_ilip);
+	if (error != 0) {
 		fprintf(stderr, "add_ilist_entry: bmap failed at offset %llu"
 			" for ilist inode of %s\n", offset, fsm->fsm_mntpt);
 		return error;
 	}
 	offset = (blkno << LOG_ONE_K) + off;
-	fprintf(stdout, "add_ilist_entry: INFO: Writing inode %llu at offset"
-		" %llu for %s\n", inum, offset, fsm->fsm_mntpt);
-	lseek(fsm->fsm_devfd, offset, SEEK_SET);
-	if (read(fsm->fsm_devfd,  &dp, sizeof(struct dinode)) !=
-		 sizeof(struct dinode)) {
+	if ((error = bio_read(fsm, &dp, sizeof(struct dinode),
+			      offset)) != 0) {
 		fprintf(stderr, "add_ilist_entry: failed to read inode %llu"
 			" from ilist for %s\n", inum, fsm->fsm_mntpt);
-		error = errno;
 		return error;
 	}
 	assert(dp.type == 0 && dp.size == 0 && dp.nblocks == 0 &&
 	       dp.orgtype == 0);
 	dp.type = type;
 	dp.orgtype = ORG_DIRECT;
-	lseek(fsm->fsm_devfd, offset, SEEK_SET);
-	if (write(fsm->fsm_devfd, &dp, sizeof(struct dinode)) !=
-	    sizeof(struct dinode)) {
+	if ((error = jnl_write(fsm, &dp, sizeof(struct dinode),
+			       offset)) != 0) {
 		fprintf(stderr, "add_ilist_entry: failed to write inode %llu"
 			" to ilist for %s\n", inum, fsm->fsm_mntpt);
-		error = errno;
 	}
 
 	return error;
 }
 
 /*
- * Allocate a new inode.
+ * Allocate a new inode of type 'type' (IF*).
+ * Inode allocation is serialized by fsm_imaplock.
  */
 
 int
-inode_alloc(
+ialloc(
 	struct fsmem	*fsm,
-	fs_u32_t	flags,
+	fs_u32_t	type,
 	fs_u64_t	*inump)
 {
-	fs_u32_t	type;
 	int		error = 0;
 
 	/*
 	 * Get the free inode number from imap first.
 	 */
 
-	type = (flags & FTYPE_FILE) ? IFREG : IFDIR;
+	pthread_mutex_lock(&fsm->fsm_imaplock);
 	if ((error = get_free_inum(fsm, inump)) != 0) {
-		fprintf(stderr, "inode_alloc: Failed to get free inode "
+		fprintf(stderr, "ialloc: Failed to get free inode "
 			"for %s\n", fsm->fsm_mntpt);
-		return error;
+		goto out;
 	}
 	if ((error = add_ilist_entry(fsm, *inump, type)) != 0) {
-		fprintf(stderr, "inode_alloc: Failed to add ilist entry "
+		fprintf(stderr, "ialloc: Failed to add ilist entry "
 			"of %llu for %s\n", *inump, fsm->fsm_mntpt);
 	}
 
+out:
+	pthread_mutex_unlock(&fsm->fsm_imaplock);
+	return error;
+}
+
+/*
+ * Allocate 'n' inodes of types 'types' (IF*) and set 'inums'
+ * to their numbers, in increasing order, as 'n' ialloc() calls
+ * would, but reading and writing each imap block and writing
+ * the superblock once, and writing the new inodes to ilist
+ * file a run of consecutive inodes at a time.
+ * Returns zero or error number. As with ialloc(), the inodes
+ * taken from imap before an error aren't given back.
+ */
+
+int
+ialloc_batch(
+	struct fsmem	*fsm,
+	fs_u32_t	*types,
+	int		n,
+	fs_u64_t	*inums)
+{
+	struct dinode	*dips = NULL;
+	fs_u64_t	off, blkno, len, extoff;
+	unsigned char	buf[ONE_K];
+	int		i, j, got = 0, changed, error = 0;
+
+	if ((dips = (struct dinode *)malloc(IBATCH_MAXRUN)) == NULL) {
+		return ENOMEM;
+	}
+	pthread_mutex_lock(&fsm->fsm_imaplock);
+
+	/*
+	 * Take the first 'n' free inodes in imap, growing it
+	 * when there aren't enough.
+	 */
+
+	for (off = 0; got < n; off += ONE_K) {
+		if (off == fsm->fsm_imapip->mino_size &&
+		    (error = imap_grow(fsm, 0)) != 0) {
+			goto out;
+		}
+		if (internal_read(fsm->fsm_imapip, (char *)buf, off,
+				  ONE_K) != ONE_K) {
+			error = errno ? errno : EIO;
+			goto out;
+		}
+		for (i = 0, changed = 0; i < (ONE_K << 3) && got < n; i++) {
+			if (buf[i >> 3] == 0) {
+				i |= 7;
+			} else if (buf[i >> 3] & (1 << (i & 7))) {
+				buf[i >> 3] &= ~(1 << (i & 7));
+				inums[got++] = (off << 3) + i;
+				changed = 1;
+			}
+		}
+		if (changed && metadata_write(fsm, off, (char *)buf, ONE_K,
+					      fsm->fsm_imapip) != ONE_K) {
+			error = errno ? errno : EIO;
+			goto out;
+		}
+	}
+	fsm->fsm_sb->iused += n;
+	if ((error = write_sb(fsm)) != 0) {
+		fprintf(stderr, "ialloc_batch: Failed to write super block"
+			" for %s\n", fsm->fsm_mntpt);
+		goto out;
+	}
+
+	/*
+	 * The slots of free inodes are all zeroes, so the new
+	 * inodes are written without reading the slots first.
+	 */
+
+	while ((inums[n - 1] + 1) << LOG_INOSIZE > fsm->fsm_ilip->mino_size) {
+		if ((error = ilist_grow(fsm, inums[n - 1])) != 0) {
+			goto out;
+		}
+	}
+	ILOCK_SHARED(fsm->fsm_ilip);
+	for (i = 0; i < n; i = j) {
+		if ((error = bmap(fsm->fsm_ilip, &blkno, &len, &extoff,
+				  inums[i] << LOG_INOSIZE)) != 0) {
+			fprintf(stderr, "ialloc_batch: bmap failed for inode "
+				"%llu of %s\n", inums[i], fsm->fsm_mntpt);
+			break;
+		}
+		len = MIN(len, IBATCH_MAXRUN) >> LOG_INOSIZE;
+		for (j = i + 1; j < n && (fs_u64_t)(j - i) < len &&
+		     inums[j] == inums[j - 1] + 1; j++);
+		memset(dips, 0, (j - i) << LOG_INOSIZE);
+		for (got = i; got < j; got++) {
+			dips[got - i].type = types[got];
+			dips[got - i].orgtype = ORG_DIRECT;
+		}
+		if ((error = jnl_write(fsm, dips, (j - i) << LOG_INOSIZE,
+				       (blkno << LOG_ONE_K) + extoff)) != 0) {
+			fprintf(stderr, "ialloc_batch: failed to write inodes "
+				"%llu-%llu to ilist for %s\n", inums[i],
+				inums[j - 1], fsm->fsm_mntpt);
+			break;
+		}
+	}
+	IUNLOCK(fsm->fsm_ilip);
+
+out:
+	pthread_mutex_unlock(&fsm->fsm_imaplock);
+	free(dips);
+	return error;
+}
+
+/*
+ * Allocate a new file or directory inode, as per
+ * 'flags' (FTYPE_*).
+ */
+
+int
+inode_alloc(
+	struct fsmem	*fsm,
+	fs_u32_t	flags,
+	fs_u64_t	*inump)
+{
+	return ialloc(fsm, (flags & FTYPE_FILE) ? IFREG : IFDIR, inump);
+}
+
+/*
+ * Free inode 'mino', which has no name and no other reference
+ * left, with its blocks and the inodes which belong to it (the
+ * cluster map of a compressed file, the hash index of a
+ * directory). The in-core inode still has to be dropped with
+ * iput().
+ * Returns zero or error number.
+ */
+
+int
+ifree(
+	struct fsmem	*fsm,
+	struct minode	*mino)
+{
+	struct direct	*ext = NULL;
+	struct minode	*sub;
+	fs_u64_t	inum = mino->mino_number, off, subino = 0;
+	char		buf[ONE_K];
+	int		i, n, error;
+
+	assert(mino->mino_orgtype == ORG_DIRECT ||
+	       mino->mino_orgtype == ORG_INDIRECT);
+	if (mino->mino_type == IFREG) {
+		subino = mino->mino_cmapino;
+	} else if (mino->mino_type == IFDIR) {
+		subino = mino->mino_hashino;
+	}
+	if (subino) {
+		if ((sub = iget(fsm, subino)) == NULL) {
+			return EIO;
+		}
+		error = ifree(fsm, sub);
+		iput(sub);
+		if (error) {
+			return error;
+		}
+	}
+
+	/*
+	 * Blocks shared with clones of the file only lose
+	 * a reference.
+	 */
+
+	if ((error = bmap_getmap(mino, &ext, &n)) != 0) {
+		return error;
+	}
+	error = refcount_release(fsm, ext, n);
+	free(ext);
+	if (error) {
+		return error;
+	}
+	if (mino->mino_orgtype == ORG_INDIRECT) {
+		for (i = 0; i < MAX_INDIRECT &&
+		     mino->mino_orgarea.indir[i].ind_blkno != 0; i++) {
+			if ((error = deallocate(fsm,
+					mino->mino_orgarea.indir[i].ind_blkno,
+					INDIR_BLKSZ >> LOG_ONE_K)) != 0) {
+				return error;
+			}
+		}
+	}
+
+	/*
+	 * The ilist slot must be all zeroes for add_ilist_entry()
+	 * to reuse it.
+	 */
+
+	dirfree_release(mino);
+	cmpfree_release(mino);
+	memset(&mino->mino_dip, 0, sizeof(struct dinode));
+	if ((error = iwrite(mino)) != 0) {
+		return EIO;
+	}
+
+	/*
+	 * Set the bit of the inode in imap: it's free again.
+	 */
+
+	pthread_mutex_lock(&fsm->fsm_imaplock);
+	off = (inum >> 3) & ~((fs_u64_t)ONE_K - 1);
+	if (internal_read(fsm->fsm_imapip, buf, off, ONE_K) != ONE_K) {
+		error = errno ? errno : EIO;
+		goto out;
+	}
+	assert(!(buf[(inum >> 3) - off] & (1 << (inum & 7))));
+	buf[(inum >> 3) - off] |= (1 << (inum & 7));
+	if (metadata_write(fsm, off, buf, ONE_K, fsm->fsm_imapip) != ONE_K) {
+		error = errno ? errno : EIO;
+		goto out;
+	}
+	fsm->fsm_sb->iused--;
+	error = write_sb(fsm);
+
+out:
+	pthread_mutex_unlock(&fsm->fsm_imaplock);
+	if (error) {
+		fprintf(stderr, "ifree: Failed to free inode %llu for %s\n",
+			inum, fsm->fsm_mntpt);
+	}
 	return error;
 }
@@ -1,11 +1,30 @@
 #ifndef _FS_INODE_H_
 #define _FS_INODE_H_
 
+#include <pthread.h>
+
+/*
+ * In-core inode.
+ * There is only one in-core inode for an inode number at any
+ * time; iget() looks it up in the inode hash table of the file
+ * system and takes a reference, iput() drops the reference.
+ * mino_dfree is the free space map of a directory (see dir.c),
+ * and mino_sfree the free slots of the stream of a compressed
+ * file (see compress.c), or NULL if they haven't been built.
+ * See fs.h for the locking rules.
+ */
+
 struct minode {
         struct dinode           mino_dip;
 	struct fsmem		*mino_fsm;
         fs_u64_t                mino_number;
 	fs_u64_t		mino_bno;
+	struct minode		*mino_hnext;
+	fs_u32_t		mino_count;
+	pthread_rwlock_t	mino_rwlock;
+	struct dirfree		*mino_dfree;
+	struct cmpfree		*mino_sfree;
+	fs_u32_t		mino_mapgen;
 };
 
 #define mino_type	mino_dip.type
@@ -16,9 +35,31 @@ struct minode {
 #define mino_typespec	mino_dip.spec
 #define mino_dirspec	mino_typespec.ts_dir
 #define mino_ndirents	mino_dirspec.ds_ndirents
+#define mino_hashino	mino_dirspec.ds_hashino
+#define mino_nbuckets	mino_dirspec.ds_nbuckets
+#define mino_nidxblks	mino_dirspec.ds_nidxblks
+#define mino_dirfmt	mino_dirspec.ds_format
+#define mino_filespec	mino_typespec.ts_file
+#define mino_cmapino	mino_filespec.fs_cmapino
+#define mino_streamend	mino_filespec.fs_streamend
+#define mino_codec	mino_filespec.fs_codec
+#define mino_level	mino_filespec.fs_level
+
+#define ILOCK_SHARED(ip)	pthread_rwlock_rdlock(&(ip)->mino_rwlock)
+#define ILOCK_EXCL(ip)		pthread_rwlock_wrlock(&(ip)->mino_rwlock)
+#define IUNLOCK(ip)		pthread_rwlock_unlock(&(ip)->mino_rwlock)
 
 extern struct minode	*iget(struct fsmem *, fs_u64_t);
+extern void		iput(struct minode *);
+extern int		ireload(struct minode *);
+extern void		ihash_insert(struct fsmem *, struct minode *);
 extern int		iwrite(struct minode *);
+extern int		ialloc(struct fsmem *, fs_u32_t, fs_u64_t *);
 extern int		inode_alloc(struct fsmem *, fs_u32_t, fs_u64_t *);
+extern int		ialloc_batch(struct fsmem *, fs_u32_t *, int,
+				     fs_u64_t *);
+extern int		ifree(struct fsmem *, struct minode *);
+extern int		iread_batch(struct fsmem *, fs_u64_t *, int,
+				    struct dinode *);
 
 #endif
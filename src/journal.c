@@ -0,0 +1,1232 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "bio.h"
+#include "crc32c.h"
+#include "journal.h"
+#include "allocate.h"
+#include "fs_include.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Metadata journal.
+ * The metadata (superblock, emap, imap, ilist, indirect blocks,
+ * directories and their indexes, refcount and cluster map
+ * files) isn't written in place as it changes: jnl_write()
+ * puts the new contents of the blocks into the running
+ * transaction, in core, and every read of the device file sees
+ * them (see bio_read()). A transaction is committed by writing
+ * all its blocks to the log in a single record, followed by one
+ * fdatasync(), after which its blocks stay in core until the
+ * next checkpoint, when the latest contents of every block
+ * committed since the previous one are written in place. Thus
+ * the metadata is written twice, but a commit is a single
+ * sequential write whatever the blocks, and a block changed
+ * by many transactions is written in place once.
+ *
+ * Every operation changing the file system runs between
+ * jnl_begin() and jnl_end(), and a transaction is only closed
+ * when no operation is running, so it holds whole operations
+ * (a create and the update of the directory, say) and the log
+ * never has half of one. The running transaction is committed
+ * when fssync() is called, when it gets big and a second after
+ * the previous commit. The operations which complete while a
+ * commit is being written go into the next transaction, and
+ * the threads waiting for them to be durable share its commit:
+ * N creates followed by fssync() in N threads cost about one
+ * log write and one fdatasync(), not N.
+ *
+ * The log is written from its start on; when a record doesn't
+ * fit in the rest of it, the blocks committed so far are
+ * written in place and synced (a checkpoint), and the log
+ * starts over. At mount time, the records of the log which are
+ * valid, from the sequence number of the header on, are
+ * replayed, in order, which redoes whatever the last checkpoint
+ * didn't cover. The regular file data isn't journaled: it's
+ * written in place, as before, and a commit syncs it before
+ * writing its record if anything was written in place since
+ * the last sync, so that a record found at mount time never
+ * points to data which didn't make it to disk.
+ *
+ * A block which is in core is also marked in jn_bits, so that
+ * I/O which doesn't involve the journal is told apart without
+ * taking jn_lock. A file data block which used to be metadata
+ * and is still in core is written through the journal too.
+ * A transaction which doesn't fit in the log can't be
+ * committed: the commit fails with EFBIG.
+ *
+ * Once a commit has failed, the journal writes nothing more,
+ * neither to the log nor in place: the file system on disk
+ * stays as of the last commit, which the next mount replays,
+ * and every later commit, fssync() and fsumount() returns the
+ * error. Half a transaction is never found on disk.
+ *
+ * Blocks freed by an operation aren't given back to the emap
+ * at once (see jnl_defer()): until the transaction freeing
+ * them is committed, the committed metadata may still point to
+ * them, and file data written in place to them after they were
+ * allocated again would be found in the old file after a
+ * crash. They are put in the emap once the commit is durable,
+ * by the next allocate() or the unmount.
+ *
+ * An explicit transaction (see fstx_begin()) is a single
+ * operation spanning many calls of its thread: other threads
+ * can't start an operation until it ends, and it is committed
+ * on its own, or its blocks are dropped from the running
+ * transaction if it's aborted. The file data it writes goes
+ * through the journal too, so that nothing of it is in place
+ * before the commit.
+ */
+
+#define JNL_HASHSZ	4096
+#define JNL_HASH(b)	(((b) * 0x9e3779b97f4a7c15ULL) >> 52)
+
+/*
+ * Age (in seconds) of the running transaction after which
+ * an operation commits it, and the number of blocks at which
+ * it's committed whatever its age, as a fraction of the log.
+ */
+
+#define JNL_AGE		1
+#define JNL_MAXRUN(jn)	((jn)->jn_logsize / 4)
+
+/*
+ * A block of metadata in core: its contents in the running
+ * transaction (jb_run), in the committing one (jb_cmt) and as
+ * last committed (jb_log), each NULL if the block isn't part
+ * of it. The latest is the one which counts.
+ */
+
+struct jblk {
+	struct jblk	*jb_hnext;
+	struct jblk	*jb_rnext;
+	struct jblk	*jb_cnext;
+	fs_u64_t	jb_blkno;
+	char		*jb_run;
+	char		*jb_cmt;
+	char		*jb_log;
+};
+
+/*
+ * Blocks freed by a transaction.
+ */
+
+struct jfree {
+	struct jfree	*jf_next;
+	fs_u64_t	jf_blkno;
+	fs_u64_t	jf_len;
+};
+
+/*
+ * The journal of a mount.
+ * jn_run and jn_cmt list the jn_nrun blocks of the running
+ * transaction and the blocks of the committing one; jn_nlog
+ * blocks have been committed since the last checkpoint.
+ * jn_seq is the sequence number of the running transaction
+ * and jn_done that of the last one committed. jn_nops
+ * operations are running; while jn_closing, or while an
+ * explicit transaction is open (jn_tx), no operation starts
+ * (but those of the explicit transaction). jn_head is the
+ * block of the log where the next record goes.
+ * jn_rfree and jn_cfree list the blocks freed by the running
+ * and the committing transaction, jn_dfree those freed by the
+ * transactions committed, which can be allocated again.
+ * jn_ckgen counts the checkpoints which dropped blocks.
+ * jn_lock protects all but jn_head, which only the thread
+ * committing (jn_committing) uses.
+ */
+
+struct jnl {
+	pthread_mutex_t	jn_lock;
+	pthread_cond_t	jn_cv;
+	struct jblk	*jn_htab[JNL_HASHSZ];
+	struct jblk	*jn_run;
+	struct jblk	*jn_cmt;
+	struct jfree	*jn_rfree;
+	struct jfree	*jn_cfree;
+	struct jfree	*jn_dfree;
+	fs_u64_t	*jn_bits;
+	fs_u64_t	jn_nbits;
+	fs_u64_t	jn_hdrblk;
+	fs_u64_t	jn_logblk;
+	fs_u64_t	jn_logsize;
+	fs_u64_t	jn_head;
+	fs_u64_t	jn_seq;
+	fs_u64_t	jn_done;
+	fs_u64_t	jn_ckgen;
+	time_t		jn_last;
+	int		jn_nrun;
+	int		jn_nlog;
+	int		jn_nops;
+	int		jn_closing;
+	int		jn_tx;
+	int		jn_committing;
+	int		jn_error;
+};
+
+/*
+ * Depth of the operations the thread is in: an operation
+ * called by another one is part of it.
+ */
+
+static __thread int	jnl_depth;
+
+/*
+ * Journal whose explicit transaction the thread has open.
+ */
+
+static __thread struct jnl	*jnl_txown;
+
+static struct jblk	*jnl_lookup(struct jnl *, fs_u64_t);
+static void		jnl_dropfree(struct jfree *);
+static int		jnl_commit(struct fsmem *);
+static int		jnl_checkpoint(struct fsmem *, fs_u64_t);
+
+static struct jblk *
+jnl_lookup(
+	struct jnl	*jn,
+	fs_u64_t	blkno)
+{
+	struct jblk	*jb;
+
+	for (jb = jn->jn_htab[JNL_HASH(blkno)]; jb; jb = jb->jb_hnext) {
+		if (jb->jb_blkno == blkno) {
+			break;
+		}
+	}
+	return jb;
+}
+
+/*
+ * Latest contents of an in-core block.
+ */
+
+static char *
+jnl_latest(
+	struct jblk	*jb)
+{
+	return jb->jb_run ? jb->jb_run : jb->jb_cmt ? jb->jb_cmt : jb->jb_log;
+}
+
+/*
+ * Return in '*jbp' block 'blkno' as part of the running
+ * transaction, with its latest contents unless 'fresh' (the
+ * whole block is going to be written).
+ * Called with jn_lock held. Returns zero or error number.
+ */
+
+static int
+jnl_getblk(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	int		fresh,
+	struct jblk	**jbp)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jblk	*jb;
+	char		*src;
+	int		error;
+
+	if (blkno >= jn->jn_nbits) {
+		return EINVAL;
+	}
+	if ((jb = jnl_lookup(jn, blkno)) == NULL) {
+		if ((jb = (struct jblk *)calloc(1, sizeof(*jb))) == NULL) {
+			return ENOMEM;
+		}
+		jb->jb_blkno = blkno;
+		jb->jb_hnext = jn->jn_htab[JNL_HASH(blkno)];
+		jn->jn_htab[JNL_HASH(blkno)] = jb;
+		__atomic_fetch_or(&jn->jn_bits[blkno >> 6], 1ULL << (blkno & 63),
+				  __ATOMIC_RELEASE);
+	}
+	if (jb->jb_run == NULL) {
+		src = jnl_latest(jb);
+		if ((jb->jb_run = (char *)malloc(ONE_K)) == NULL) {
+			return ENOMEM;
+		}
+		if (!fresh && src != NULL) {
+			memcpy(jb->jb_run, src, ONE_K);
+		} else if (!fresh && (error = bio_dev_read(fsm, jb->jb_run,
+				ONE_K, blkno << LOG_ONE_K)) != 0) {
+			free(jb->jb_run);
+			jb->jb_run = NULL;
+			return error;
+		}
+		jb->jb_rnext = jn->jn_run;
+		jn->jn_run = jb;
+		jn->jn_nrun++;
+	}
+	*jbp = jb;
+	return 0;
+}
+
+/*
+ * Write 'len' bytes at offset 'off' of the device file as part
+ * of the running transaction, or in place if the file system
+ * has no journal.
+ * Returns zero or error number.
+ */
+
+int
+jnl_write(
+	struct fsmem	*fsm,
+	void		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jblk	*jb;
+	fs_u64_t	b, from, to;
+	int		error = 0;
+
+	if (jn == NULL) {
+		return bio_write(fsm, buf, len, off);
+	}
+	if (len == 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	for (b = off >> LOG_ONE_K; b <= (off + len - 1) >> LOG_ONE_K; b++) {
+		from = MAX(off, b << LOG_ONE_K);
+		to = MIN(off + len, (b + 1) << LOG_ONE_K);
+		if ((error = jnl_getblk(fsm, b, to - from == ONE_K,
+					&jb)) != 0) {
+			break;
+		}
+		memcpy(jb->jb_run + (from & (ONE_K - 1)),
+		       (char *)buf + (from - off), to - from);
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+	return error;
+}
+
+/*
+ * Read 'len' bytes at offset 'off' of the device file, as
+ * changed by the transactions which aren't in place yet.
+ * The device is read without jn_lock; should a checkpoint drop
+ * blocks meanwhile, what was read may predate them being
+ * written in place, so it's read again.
+ * Returns zero or error number.
+ */
+
+int
+jnl_read(
+	struct fsmem	*fsm,
+	void		*buf,
+	fs_u32_t	len,
+	fs_u64_t	off)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jblk	*jb;
+	fs_u64_t	b, from, to, gen;
+	int		error;
+
+	for (;;) {
+		gen = __atomic_load_n(&jn->jn_ckgen, __ATOMIC_ACQUIRE);
+		if ((error = bio_dev_read(fsm, buf, len, off)) != 0) {
+			return error;
+		}
+		pthread_mutex_lock(&jn->jn_lock);
+		if (jn->jn_ckgen == gen) {
+			break;
+		}
+		pthread_mutex_unlock(&jn->jn_lock);
+	}
+	for (b = off >> LOG_ONE_K; b <= (off + len - 1) >> LOG_ONE_K; b++) {
+		if ((jb = jnl_lookup(jn, b)) == NULL) {
+			continue;
+		}
+		from = MAX(off, b << LOG_ONE_K);
+		to = MIN(off + len, (b + 1) << LOG_ONE_K);
+		memcpy((char *)buf + (from - off),
+		       jnl_latest(jb) + (from & (ONE_K - 1)), to - from);
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+	return 0;
+}
+
+/*
+ * Whether any of the 'len' bytes at offset 'off' of the device
+ * file is in a block the journal has in core.
+ */
+
+int
+jnl_busy(
+	struct fsmem	*fsm,
+	fs_u64_t	off,
+	fs_u64_t	len)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	fs_u64_t	b, last, w;
+
+	if (jn == NULL || len == 0) {
+		return 0;
+	}
+	last = MIN((off + len - 1) >> LOG_ONE_K, jn->jn_nbits - 1);
+	for (b = off >> LOG_ONE_K; b <= last; ) {
+		w = __atomic_load_n(&jn->jn_bits[b >> 6], __ATOMIC_ACQUIRE);
+		if (w == 0) {
+			b = (b | 63) + 1;
+			continue;
+		}
+		if (w & (1ULL << (b & 63))) {
+			return 1;
+		}
+		b++;
+	}
+	return 0;
+}
+
+/*
+ * Start an operation changing the file system. It must be
+ * called before taking any lock.
+ */
+
+void
+jnl_begin(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+
+	if (jn == NULL || jnl_depth++ > 0) {
+		return;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	while (jn->jn_closing || jn->jn_tx) {
+		pthread_cond_wait(&jn->jn_cv, &jn->jn_lock);
+	}
+	jn->jn_nops++;
+	pthread_mutex_unlock(&jn->jn_lock);
+}
+
+/*
+ * End an operation started with jnl_begin(), committing the
+ * running transaction if it's big or old enough. It must be
+ * called after dropping all the locks.
+ */
+
+void
+jnl_end(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	int		commit;
+
+	if (jn == NULL || --jnl_depth > 0) {
+		return;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	if (--jn->jn_nops == 0 && jn->jn_closing) {
+		pthread_cond_broadcast(&jn->jn_cv);
+	}
+	commit = ((fs_u64_t)jn->jn_nrun >= JNL_MAXRUN(jn)) ||
+		 (jn->jn_nrun > 0 && !jn->jn_committing &&
+		  time(NULL) - jn->jn_last >= JNL_AGE);
+	pthread_mutex_unlock(&jn->jn_lock);
+	if (commit) {
+		(void) jnl_commit(fsm);
+	}
+}
+
+/*
+ * Close the running transaction: make its blocks those of the
+ * committing transaction and return the record to log, with
+ * '*lenp' set to its number of blocks.
+ * Called with jn_lock held and no operation running.
+ */
+
+static char *
+jnl_close(
+	struct jnl	*jn,
+	fs_u64_t	*lenp)
+{
+	struct jnl_desc	*jd;
+	struct jblk	*jb;
+	fs_u32_t	ndesc = JNL_NDESC(jn->jn_nrun), i;
+	char		*rec;
+
+	rec = (char *)calloc(ndesc + jn->jn_nrun, ONE_K);
+	if (rec == NULL) {
+		return NULL;
+	}
+	jd = (struct jnl_desc *)rec;
+	jd->jd_magic = JNL_DMAGIC;
+	jd->jd_seq = jn->jn_seq;
+	jd->jd_ndesc = ndesc;
+	jd->jd_nblks = jn->jn_nrun;
+	for (i = 0, jb = jn->jn_run; jb; i++, jb = jb->jb_rnext) {
+		jd->jd_blkno[i] = jb->jb_blkno;
+		memcpy(rec + ((fs_u64_t)(ndesc + i) << LOG_ONE_K), jb->jb_run,
+		       ONE_K);
+		jb->jb_cmt = jb->jb_run;
+		jb->jb_run = NULL;
+		jb->jb_cnext = jn->jn_cmt;
+		jn->jn_cmt = jb;
+	}
+	jn->jn_run = NULL;
+	jn->jn_nrun = 0;
+	jn->jn_cfree = jn->jn_rfree;
+	jn->jn_rfree = NULL;
+	jn->jn_seq++;
+	*lenp = ndesc + i;
+	return rec;
+}
+
+static int
+blk_cmp(
+	const void	*a,
+	const void	*b)
+{
+	fs_u64_t	x = (*(struct jblk **)a)->jb_blkno;
+	fs_u64_t	y = (*(struct jblk **)b)->jb_blkno;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Write the 'n' blocks 'jbs' in place, as last committed, as
+ * a single batch sorted by block number, so that adjacent
+ * blocks can go with a single write.
+ * Returns zero or error number.
+ */
+
+static int
+jnl_inplace(
+	struct fsmem	*fsm,
+	struct jblk	**jbs,
+	int		n)
+{
+	struct bio_vec	*bv;
+	int		i, error;
+
+	if (n == 0) {
+		return 0;
+	}
+	if ((bv = (struct bio_vec *)malloc(n * sizeof(*bv))) == NULL) {
+		return ENOMEM;
+	}
+	qsort(jbs, n, sizeof(struct jblk *), blk_cmp);
+	for (i = 0; i < n; i++) {
+		bv[i].bv_buf = jbs[i]->jb_log;
+		bv[i].bv_off = jbs[i]->jb_blkno << LOG_ONE_K;
+		bv[i].bv_len = ONE_K;
+	}
+	error = bio_dev_submit(fsm, BIO_WRITE, bv, n);
+	free(bv);
+	return error;
+}
+
+/*
+ * Write the header of the log, whose first record is to have
+ * sequence number 'seq'.
+ */
+
+static int
+jnl_header(
+	struct fsmem		*fsm,
+	fs_u64_t		hdrblk,
+	fs_u64_t		seq)
+{
+	char			buf[ONE_K];
+	struct jnl_header	*jh = (struct jnl_header *)buf;
+
+	memset(buf, 0, ONE_K);
+	jh->jh_magic = JNL_MAGIC;
+	jh->jh_seq = seq;
+	return bio_dev_write(fsm, buf, ONE_K, hdrblk << LOG_ONE_K);
+}
+
+/*
+ * Checkpoint: write in place the blocks committed since the
+ * last checkpoint, sync them and empty the log, whose next
+ * record will have sequence number 'seq'. The header is only
+ * made durable by the next sync: until then, the old one makes
+ * the records of the log be replayed, which writes the same
+ * blocks again.
+ * Called by the thread committing. Returns zero or error number.
+ */
+
+static int
+jnl_checkpoint(
+	struct fsmem	*fsm,
+	fs_u64_t	seq)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jblk	*jb, **jbs, **jpp;
+	int		i, n = 0, error;
+
+	pthread_mutex_lock(&jn->jn_lock);
+	jbs = (struct jblk **)malloc((jn->jn_nlog + 1) * sizeof(*jbs));
+	if (jbs == NULL) {
+		pthread_mutex_unlock(&jn->jn_lock);
+		return ENOMEM;
+	}
+	for (i = 0; i < JNL_HASHSZ; i++) {
+		for (jb = jn->jn_htab[i]; jb; jb = jb->jb_hnext) {
+			if (jb->jb_log) {
+				jbs[n++] = jb;
+			}
+		}
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+
+	if ((error = jnl_inplace(fsm, jbs, n)) != 0 ||
+	    (error = bio_sync(fsm)) != 0 ||
+	    (error = jnl_header(fsm, jn->jn_hdrblk, seq)) != 0) {
+		free(jbs);
+		return error;
+	}
+	jn->jn_head = 0;
+
+	/*
+	 * The blocks are in place: forget them, unless they are
+	 * part of a later transaction.
+	 */
+
+	pthread_mutex_lock(&jn->jn_lock);
+	for (i = 0; i < n; i++) {
+		jb = jbs[i];
+		free(jb->jb_log);
+		jb->jb_log = NULL;
+		if (jb->jb_run || jb->jb_cmt) {
+			continue;
+		}
+		for (jpp = &jn->jn_htab[JNL_HASH(jb->jb_blkno)]; *jpp != jb;
+		     jpp = &(*jpp)->jb_hnext);
+		*jpp = jb->jb_hnext;
+		__atomic_fetch_and(&jn->jn_bits[jb->jb_blkno >> 6],
+				   ~(1ULL << (jb->jb_blkno & 63)),
+				   __ATOMIC_RELEASE);
+		free(jb);
+	}
+	jn->jn_nlog -= n;
+	if (n > 0) {
+		__atomic_store_n(&jn->jn_ckgen, jn->jn_ckgen + 1,
+				 __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+	free(jbs);
+	return 0;
+}
+
+/*
+ * Write the record 'rec' of 'len' blocks of the committing
+ * transaction to the log and make it durable, after the file
+ * data written in place so far.
+ * Called by the thread committing. Returns zero or error number.
+ */
+
+static int
+jnl_log(
+	struct fsmem	*fsm,
+	char		*rec,
+	fs_u64_t	len)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jnl_desc	*jd = (struct jnl_desc *)rec;
+	int		error;
+
+	if (len > jn->jn_logsize) {
+
+		/*
+		 * Too big for the log: it can't be committed
+		 * atomically. An explicit transaction is checked
+		 * before (see jnl_txcommit()); operations commit the
+		 * running transaction long before it gets this big.
+		 */
+
+		return EFBIG;
+	}
+	if (jn->jn_head + len > jn->jn_logsize &&
+	    (error = jnl_checkpoint(fsm, jd->jd_seq)) != 0) {
+		return error;
+	}
+	jd->jd_crc = crc32c(0, rec, len << LOG_ONE_K);
+	if ((error = bio_sync_unsynced(fsm)) != 0 ||
+	    (error = bio_dev_write(fsm, rec, len << LOG_ONE_K,
+				   (jn->jn_logblk + jn->jn_head) <<
+				   LOG_ONE_K)) != 0 ||
+	    (error = bio_sync(fsm)) != 0) {
+		return error;
+	}
+	jn->jn_head += len;
+	return 0;
+}
+
+/*
+ * Commit the running transaction, or wait for the commit of
+ * the transaction the operations completed so far are part of.
+ * Returns zero or error number.
+ */
+
+static int
+jnl_commit(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jblk	*jb;
+	struct jfree	**jfp;
+	fs_u64_t	target, seq, len;
+	char		*rec;
+	int		error;
+
+	assert(jnl_depth == 0);
+	pthread_mutex_lock(&jn->jn_lock);
+	target = jn->jn_nrun ? jn->jn_seq : jn->jn_seq - 1;
+	while (jn->jn_done < target) {
+		if (jn->jn_committing) {
+			pthread_cond_wait(&jn->jn_cv, &jn->jn_lock);
+			continue;
+		}
+
+		/*
+		 * Lead the commit: wait for the operations running
+		 * to complete, keeping others from starting, then
+		 * close the transaction and write it without the
+		 * lock, so that the next one fills up meanwhile.
+		 */
+
+		jn->jn_committing = 1;
+		jn->jn_closing = 1;
+		while (jn->jn_nops > 0) {
+			pthread_cond_wait(&jn->jn_cv, &jn->jn_lock);
+		}
+		seq = jn->jn_seq;
+		rec = jnl_close(jn, &len);
+		jn->jn_closing = 0;
+		pthread_cond_broadcast(&jn->jn_cv);
+		pthread_mutex_unlock(&jn->jn_lock);
+
+		/*
+		 * After a failed commit, the log stays as it was
+		 * (see above). jn_error is only set by the thread
+		 * committing.
+		 */
+
+		if (jn->jn_error) {
+			error = jn->jn_error;
+		} else {
+			error = rec ? jnl_log(fsm, rec, len) : ENOMEM;
+		}
+		free(rec);
+
+		pthread_mutex_lock(&jn->jn_lock);
+		for (jb = jn->jn_cmt; jb; jb = jb->jb_cnext) {
+			if (jb->jb_log == NULL) {
+				jn->jn_nlog++;
+			}
+			free(jb->jb_log);
+			jb->jb_log = jb->jb_cmt;
+			jb->jb_cmt = NULL;
+		}
+		jn->jn_cmt = NULL;
+
+		/*
+		 * The blocks the transaction freed can be used
+		 * again, unless it didn't make it to the log: then
+		 * they stay allocated, rather than risk ending up
+		 * in two files. They go at the tail of jn_dfree,
+		 * whose head is being put in the emap meanwhile
+		 * (see jnl_freed()).
+		 */
+
+		if (error) {
+			jnl_dropfree(jn->jn_cfree);
+		} else {
+			for (jfp = &jn->jn_dfree; *jfp; jfp = &(*jfp)->jf_next);
+			*jfp = jn->jn_cfree;
+		}
+		jn->jn_cfree = NULL;
+		if (error && jn->jn_error == 0) {
+			fprintf(stderr, "Failed to commit transaction %llu "
+				"of %s: %s\n", seq, fsm->fsm_mntpt,
+				strerror(error));
+			jn->jn_error = error;
+		}
+		jn->jn_done = seq;
+		jn->jn_last = time(NULL);
+		jn->jn_committing = 0;
+		pthread_cond_broadcast(&jn->jn_cv);
+	}
+	error = jn->jn_error;
+	pthread_mutex_unlock(&jn->jn_lock);
+	return error;
+}
+
+/*
+ * Make the operations completed so far, and the file data
+ * written so far, durable, and the blocks they freed free.
+ * Returns zero or error number.
+ */
+
+int
+jnl_sync(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	int		nrun, error;
+
+	if (jn == NULL) {
+		return bio_sync(fsm);
+	}
+	if (jnl_txown == jn) {
+
+		/*
+		 * Within an explicit transaction: it's made durable
+		 * by its commit.
+		 */
+
+		return 0;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	nrun = jn->jn_nrun;
+	pthread_mutex_unlock(&jn->jn_lock);
+	if ((error = jnl_commit(fsm)) != 0) {
+		return error;
+	}
+
+	/*
+	 * The blocks whose free is now committed can be put in
+	 * the emap, which the next commit makes durable.
+	 */
+
+	jnl_begin(fsm);
+	error = deallocate_freed(fsm);
+	jnl_end(fsm);
+	if (error || nrun > 0) {
+		return error;
+	}
+
+	/*
+	 * No metadata to commit: just the data.
+	 */
+
+	return bio_sync(fsm);
+}
+
+static void
+jnl_dropfree(
+	struct jfree	*jf)
+{
+	struct jfree	*next;
+
+	for (; jf; jf = next) {
+		next = jf->jf_next;
+		free(jf);
+	}
+}
+
+/*
+ * Free the 'len' blocks at 'blkno' when the running transaction
+ * is committed, rather than now. Returns 1 if that's done, or
+ * zero if they are to be freed now: the file system has no
+ * journal or memory is short.
+ */
+
+int
+jnl_defer(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	fs_u64_t	len)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jfree	*jf;
+
+	if (jn == NULL ||
+	    (jf = (struct jfree *)malloc(sizeof(struct jfree))) == NULL) {
+		return 0;
+	}
+	jf->jf_blkno = blkno;
+	jf->jf_len = len;
+	pthread_mutex_lock(&jn->jn_lock);
+	jf->jf_next = jn->jn_rfree;
+	jn->jn_rfree = jf;
+	pthread_mutex_unlock(&jn->jn_lock);
+	return 1;
+}
+
+/*
+ * Find the first run of blocks whose free has been committed,
+ * setting '*blknop' and '*lenp'. The run stays listed until
+ * jnl_freed_done() says it's in the emap, so that a failure to
+ * put it there doesn't lose it.
+ * Called with fsm_alloclock held. Returns zero if there's none.
+ */
+
+int
+jnl_freed(
+	struct fsmem	*fsm,
+	fs_u64_t	*blknop,
+	fs_u64_t	*lenp)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jfree	*jf;
+
+	if (jn == NULL) {
+		return 0;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	if ((jf = jn->jn_dfree) != NULL) {
+		*blknop = jf->jf_blkno;
+		*lenp = jf->jf_len;
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+	return jf != NULL;
+}
+
+/*
+ * Forget the first 'n' blocks of the run jnl_freed() found,
+ * which are now in the emap.
+ * Called with fsm_alloclock held.
+ */
+
+void
+jnl_freed_done(
+	struct fsmem	*fsm,
+	fs_u64_t	n)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jfree	*jf;
+
+	if (n == 0) {
+		return;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	jf = jn->jn_dfree;
+	assert(jf != NULL && n <= jf->jf_len);
+	jf->jf_blkno += n;
+	if ((jf->jf_len -= n) == 0) {
+		jn->jn_dfree = jf->jf_next;
+		free(jf);
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+}
+
+/*
+ * Open an explicit transaction in the calling thread: wait for
+ * the one open in another thread, if any, keep other threads
+ * from starting operations and commit what the operations done
+ * so far changed, so that the running transaction only holds
+ * what the explicit one changes.
+ * Returns zero or error number.
+ */
+
+int
+jnl_txbegin(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	int		error;
+
+	if (jn == NULL) {
+		return ENOTSUP;
+	}
+	if (jnl_depth > 0) {
+		return EBUSY;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	while (jn->jn_tx) {
+		pthread_cond_wait(&jn->jn_cv, &jn->jn_lock);
+	}
+	jn->jn_tx = 1;
+	pthread_mutex_unlock(&jn->jn_lock);
+	if ((error = jnl_commit(fsm)) != 0) {
+		jnl_txend(fsm);
+		return error;
+	}
+	pthread_mutex_lock(&jn->jn_lock);
+	jn->jn_nops++;
+	pthread_mutex_unlock(&jn->jn_lock);
+	jnl_depth = 1;
+	jnl_txown = jn;
+	return 0;
+}
+
+/*
+ * Whether the calling thread has an explicit transaction open.
+ */
+
+int
+jnl_intx(
+	struct fsmem	*fsm)
+{
+	return fsm->fsm_jnl != NULL && jnl_txown == fsm->fsm_jnl;
+}
+
+/*
+ * Commit the explicit transaction of the calling thread and
+ * close it. A transaction which doesn't fit in the log is left
+ * open, with EFBIG returned: it can only be aborted.
+ * Returns zero or error number.
+ */
+
+int
+jnl_txcommit(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	int		error;
+
+	assert(jnl_txown == jn && jnl_depth == 1);
+	pthread_mutex_lock(&jn->jn_lock);
+	if (JNL_NDESC(jn->jn_nrun) + jn->jn_nrun > jn->jn_logsize) {
+		pthread_mutex_unlock(&jn->jn_lock);
+		return EFBIG;
+	}
+	if (--jn->jn_nops == 0 && jn->jn_closing) {
+		pthread_cond_broadcast(&jn->jn_cv);
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+	jnl_depth = 0;
+	jnl_txown = NULL;
+	error = jnl_commit(fsm);
+	jnl_txend(fsm);
+	return error;
+}
+
+/*
+ * Drop what the explicit transaction of the calling thread
+ * changed from the running transaction. The transaction stays
+ * open, for the in-core state to be read again, until
+ * jnl_txend() is called.
+ */
+
+void
+jnl_txabort(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jblk	*jb, *next, **jpp;
+
+	assert(jnl_txown == jn && jnl_depth == 1);
+	pthread_mutex_lock(&jn->jn_lock);
+	for (jb = jn->jn_run; jb; jb = next) {
+		next = jb->jb_rnext;
+		free(jb->jb_run);
+		jb->jb_run = NULL;
+		if (jb->jb_cmt || jb->jb_log) {
+			continue;
+		}
+		for (jpp = &jn->jn_htab[JNL_HASH(jb->jb_blkno)]; *jpp != jb;
+		     jpp = &(*jpp)->jb_hnext);
+		*jpp = jb->jb_hnext;
+		__atomic_fetch_and(&jn->jn_bits[jb->jb_blkno >> 6],
+				   ~(1ULL << (jb->jb_blkno & 63)),
+				   __ATOMIC_RELEASE);
+		free(jb);
+	}
+	jn->jn_run = NULL;
+	jn->jn_nrun = 0;
+	jnl_dropfree(jn->jn_rfree);
+	jn->jn_rfree = NULL;
+	if (--jn->jn_nops == 0 && jn->jn_closing) {
+		pthread_cond_broadcast(&jn->jn_cv);
+	}
+	pthread_mutex_unlock(&jn->jn_lock);
+	jnl_depth = 0;
+	jnl_txown = NULL;
+}
+
+/*
+ * Let the other threads start operations again after an
+ * explicit transaction.
+ */
+
+void
+jnl_txend(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+
+	pthread_mutex_lock(&jn->jn_lock);
+	jn->jn_tx = 0;
+	pthread_cond_broadcast(&jn->jn_cv);
+	pthread_mutex_unlock(&jn->jn_lock);
+}
+
+/*
+ * Replay the valid records of the log of a file system being
+ * mounted. Returns zero or error number; '*seqp' is set to the
+ * sequence number of the next record.
+ */
+
+static int
+jnl_replay(
+	struct fsmem		*fsm,
+	fs_u64_t		*seqp)
+{
+	struct super_block	*sb = fsm->fsm_sb;
+	struct jnl_header	jh;
+	struct jnl_desc		*jd;
+	fs_u64_t		logblk = sb->jnlblk + 1, logsize = sb->jnlsize - 1;
+	fs_u64_t		pos = 0, seq, len;
+	fs_u32_t		crc, i;
+	char			*rec = NULL, *nrec;
+	int			n = 0, error;
+
+	if ((error = bio_read(fsm, &jh, sizeof(jh),
+			      sb->jnlblk << LOG_ONE_K)) != 0) {
+		return error;
+	}
+	if (jh.jh_magic != JNL_MAGIC) {
+		fprintf(stderr, "%s: Bad journal header\n", fsm->fsm_devf);
+		return EINVAL;
+	}
+	if ((rec = (char *)malloc(ONE_K)) == NULL) {
+		return ENOMEM;
+	}
+	for (seq = jh.jh_seq; pos < logsize; seq++, pos += len, n++) {
+		if ((error = bio_read(fsm, rec, ONE_K,
+				      (logblk + pos) << LOG_ONE_K)) != 0) {
+			break;
+		}
+		jd = (struct jnl_desc *)rec;
+		len = (fs_u64_t)jd->jd_ndesc + jd->jd_nblks;
+		if (jd->jd_magic != JNL_DMAGIC || jd->jd_seq != seq ||
+		    jd->jd_ndesc != JNL_NDESC(jd->jd_nblks) ||
+		    pos + len > logsize) {
+			break;
+		}
+		if ((nrec = (char *)realloc(rec, len << LOG_ONE_K)) == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		rec = nrec;
+		jd = (struct jnl_desc *)rec;
+		if ((error = bio_read(fsm, rec, len << LOG_ONE_K,
+				      (logblk + pos) << LOG_ONE_K)) != 0) {
+			break;
+		}
+		crc = jd->jd_crc;
+		jd->jd_crc = 0;
+		if (crc32c(0, rec, len << LOG_ONE_K) != crc) {
+			break;
+		}
+		for (i = 0; i < jd->jd_nblks && error == 0; i++) {
+			error = bio_write(fsm, rec + ((fs_u64_t)(jd->jd_ndesc +
+						i) << LOG_ONE_K), ONE_K,
+					  jd->jd_blkno[i] << LOG_ONE_K);
+		}
+		if (error) {
+			break;
+		}
+	}
+	free(rec);
+	if (error == 0 && n > 0) {
+		printf("Replayed %d transactions from the journal of %s\n", n,
+		       fsm->fsm_devf);
+		if ((error = bio_sync(fsm)) == 0 &&
+		    (error = jnl_header(fsm, sb->jnlblk, seq)) == 0) {
+			error = bio_sync(fsm);
+		}
+	}
+	*seqp = seq;
+	return error;
+}
+
+/*
+ * Set up the journal of a file system being mounted with
+ * 'flags': replay the log and, unless FSMNT_NOJOURNAL, start
+ * journaling. The superblock must be read again afterwards.
+ * File systems made without a journal are left alone.
+ * Returns zero or error number.
+ */
+
+int
+jnl_init(
+	struct fsmem		*fsm,
+	unsigned int		flags)
+{
+	struct super_block	*sb = fsm->fsm_sb;
+	struct jnl		*jn;
+	fs_u64_t		seq;
+	int			error;
+
+	if (sb->jnlsize == 0) {
+		return 0;
+	}
+	if (sb->jnlsize < 2 || sb->jnlblk + sb->jnlsize > sb->size) {
+		fprintf(stderr, "%s: Bad journal\n", fsm->fsm_devf);
+		return EINVAL;
+	}
+	if ((error = jnl_replay(fsm, &seq)) != 0) {
+		fprintf(stderr, "Failed to replay the journal of %s: %s\n",
+			fsm->fsm_devf, strerror(error));
+		return error;
+	}
+	if (flags & FSMNT_NOJOURNAL) {
+		return 0;
+	}
+	if ((jn = (struct jnl *)calloc(1, sizeof(struct jnl))) == NULL) {
+		return ENOMEM;
+	}
+	jn->jn_nbits = sb->size;
+	jn->jn_bits = (fs_u64_t *)calloc((sb->size + 63) / 64,
+					 sizeof(fs_u64_t));
+	if (jn->jn_bits == NULL) {
+		free(jn);
+		return ENOMEM;
+	}
+	pthread_mutex_init(&jn->jn_lock, NULL);
+	pthread_cond_init(&jn->jn_cv, NULL);
+	jn->jn_hdrblk = sb->jnlblk;
+	jn->jn_logblk = sb->jnlblk + 1;
+	jn->jn_logsize = sb->jnlsize - 1;
+	jn->jn_seq = seq;
+	jn->jn_done = seq - 1;
+	jn->jn_last = time(NULL);
+	fsm->fsm_jnl = jn;
+	return 0;
+}
+
+/*
+ * Commit and checkpoint the journal of a file system being
+ * unmounted, so that the log is empty, and free it.
+ * Returns zero or error number.
+ */
+
+int
+jnl_fini(
+	struct fsmem	*fsm)
+{
+	struct jnl	*jn = fsm->fsm_jnl;
+	struct jblk	*jb, *next;
+	int		i, error;
+
+	if (jn == NULL) {
+		return 0;
+	}
+
+	/*
+	 * Put the blocks freed in the emap, which is committed
+	 * again, before the checkpoint.
+	 */
+
+	if ((error = jnl_commit(fsm)) == 0 &&
+	    (error = deallocate_freed(fsm)) == 0 &&
+	    (error = jnl_commit(fsm)) == 0 &&
+	    (error = jnl_checkpoint(fsm, jn->jn_seq)) == 0) {
+		error = bio_sync(fsm);
+	}
+	for (i = 0; i < JNL_HASHSZ; i++) {
+		for (jb = jn->jn_htab[i]; jb; jb = next) {
+			next = jb->jb_hnext;
+			free(jb->jb_run);
+			free(jb->jb_log);
+			free(jb);
+		}
+	}
+	jnl_dropfree(jn->jn_rfree);
+	jnl_dropfree(jn->jn_cfree);
+	jnl_dropfree(jn->jn_dfree);
+	pthread_mutex_destroy(&jn->jn_lock);
+	pthread_cond_destroy(&jn->jn_cv);
+	free(jn->jn_bits);
+	free(jn);
+	fsm->fsm_jnl = NULL;
+	return error;
+}
@@ -0,0 +1,21 @@
+#ifndef _FS_JOURNAL_H_
+#define _FS_JOURNAL_H_
+
+extern int	jnl_init(struct fsmem *, unsigned int);
+extern int	jnl_fini(struct fsmem *);
+extern void	jnl_begin(struct fsmem *);
+extern void	jnl_end(struct fsmem *);
+extern int	jnl_write(struct fsmem *, void *, fs_u32_t, fs_u64_t);
+extern int	jnl_read(struct fsmem *, void *, fs_u32_t, fs_u64_t);
+extern int	jnl_busy(struct fsmem *, fs_u64_t, fs_u64_t);
+extern int	jnl_sync(struct fsmem *);
+extern int	jnl_defer(struct fsmem *, fs_u64_t, fs_u64_t);
+extern int	jnl_freed(struct fsmem *, fs_u64_t *, fs_u64_t *);
+extern void	jnl_freed_done(struct fsmem *, fs_u64_t);
+extern int	jnl_txbegin(struct fsmem *);
+extern int	jnl_intx(struct fsmem *);
+extern int	jnl_txcommit(struct fsmem *);
+extern void	jnl_txabort(struct fsmem *);
+extern void	jnl_txend(struct fsmem *);
+
+#endif /*_FS_JOURNAL_H_*/
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/param.h>
 #include <assert.h>
 #include "types.h"
@@ -25,7 +26,10 @@
 
 /*
  * Maximum number of indirect extents allocated
- * to a file/directory.
+ * to a file/directory. Each holds INDIR_BLKSZ /
+ * sizeof(struct direct) extents, which is as big
+ * as the block map of a file gets: the second
+ * level indirect org type is never allocated.
  */
 
 #define MAX_INDIRECT	24
@@ -75,6 +79,10 @@
 #define IFILT		0x0004	/* ilist inode */
 #define IFEMP		0x0008	/* extent map inode */
 #define IFIMP		0x0010	/* inode map inode */
+#define IFRCT		0x0020	/* refcount inode */
+#define IFCMP		0x0040	/* cluster map inode */
+#define IFCKS		0x0080	/* checksum inode */
+#define IFDIX		0x0100	/* directory hash index inode */
 
 /*
  * Initial number of inodes allocated inside
@@ -138,6 +146,13 @@
  *
  * lastblk: last free block number in file system.
  * lastino: last free inode number.
+ * refcntino: inode number of the refcount file, zero
+ * until the first file is cloned.
+ * cksumino: inode number of the checksum file, zero until
+ * the file system is first mounted with checksums.
+ * jnlblk, jnlsize: first block and number of blocks of the
+ * metadata journal (see journal.c), zero on file systems made
+ * before the journal existed.
  */
 
 struct super_block {
@@ -150,13 +165,60 @@ struct super_block {
 	fs_u32_t	pad;
 	fs_u64_t	lastino;
 	fs_u64_t	iused;
+	fs_u64_t	refcntino;
+	fs_u64_t	cksumino;
+	fs_u64_t	jnlblk;
+	fs_u64_t	jnlsize;
+};
+
+/*
+ * The metadata journal.
+ * Its first block holds a struct jnl_header; the rest is the
+ * log, in which committed transactions are written one after
+ * the other from the start of the log, each as a record of
+ * jd_ndesc descriptor blocks followed by the jd_nblks blocks
+ * the transaction wrote. The descriptor blocks start with a
+ * struct jnl_desc, followed by the block numbers of the
+ * jd_nblks blocks. jd_crc is the CRC32C of the whole record,
+ * computed with jd_crc zero. A record is valid if its magic,
+ * sequence number and CRC are right; the first record of the
+ * log has sequence number jh_seq and each following record the
+ * next one.
+ * JNL_BLOCKS() is the size of the journal mkfs gives a file
+ * system of 'size' blocks.
+ */
+
+#define JNL_MAGIC	0x6a6e6c31
+#define JNL_DMAGIC	0x6a646573
+
+#define JNL_MINBLKS	256
+#define JNL_MAXBLKS	16384
+#define JNL_BLOCKS(size)	\
+	MIN(MAX((size) / 32, JNL_MINBLKS), JNL_MAXBLKS)
+
+struct jnl_header {
+	fs_u32_t	jh_magic;
+	fs_u32_t	jh_pad;
+	fs_u64_t	jh_seq;
+};
+
+struct jnl_desc {
+	fs_u32_t	jd_magic;
+	fs_u32_t	jd_crc;
+	fs_u64_t	jd_seq;
+	fs_u32_t	jd_ndesc;
+	fs_u32_t	jd_nblks;
+	fs_u64_t	jd_blkno[1];
 };
 
+#define JNL_DHDRLEN	offsetof(struct jnl_desc, jd_blkno)
+#define JNL_NDESC(n)	\
+	((JNL_DHDRLEN + (n) * sizeof(fs_u64_t) + ONE_K - 1) >> LOG_ONE_K)
+
 /*
- * A directory entry.
- * Currently it's always 64 bytes size, even if
- * the file name isn't as long as 56 bytes.
- * I'll optimize it later.
+ * A directory entry of a DIRFMT_FIXED directory.
+ * It's always 64 bytes size, even if the file name
+ * isn't as long as 56 bytes.
  */
 
 struct direntry {
@@ -166,6 +228,28 @@ struct direntry {
 
 #define DIRENTRY_LEN	(sizeof(struct direntry))
 
+/*
+ * A directory entry of a DIRFMT_PACKED directory.
+ * The records are packed in the 1K blocks of the directory and
+ * never cross a block boundary: dr_reclen is the distance to
+ * the next record, the last record of a block extending to the
+ * end of the block. A record with dr_inum zero is free. The name
+ * (dr_namelen bytes, not NUL terminated) follows the header and
+ * dr_hash is its hash (see dir.c).
+ */
+
+struct dirrec {
+	fs_u64_t	dr_inum;
+	fs_u32_t	dr_hash;
+	fs_u16_t	dr_reclen;
+	fs_u8_t		dr_namelen;
+	fs_u8_t		dr_pad;
+};
+
+#define DIRREC_HDRLEN	(sizeof(struct dirrec))
+#define DIRREC_MAXNAME	255
+#define DIRREC_LEN(n)	((DIRREC_HDRLEN + (n) + 7) & ~7)
+
 struct udirentry {
 	char		udir_name[256];
 	fs_u64_t	udir_inum;
@@ -173,6 +257,23 @@ struct udirentry {
 
 #define UDIRENTRY_LEN	(sizeof(struct udirentry))
 
+/*
+ * Directory entry along with the attributes of its inode,
+ * as returned by fsread_dirplus(). udp_type is FTYPE_FILE,
+ * FTYPE_DIR or zero (the entry went away while being read).
+ */
+
+struct udirentplus {
+	char		udp_name[256];
+	fs_u64_t	udp_inum;
+	fs_u64_t	udp_size;
+	fs_u64_t	udp_nblocks;
+	fs_u32_t	udp_type;
+	fs_u32_t	udp_pad;
+};
+
+#define UDIRENTPLUS_LEN	(sizeof(struct udirentplus))
+
 /*
  * direct org type structure.
  * It just contains block number and length and hence
@@ -188,17 +289,145 @@ struct indirect {
 	fs_u64_t	ind_blkno;
 };
 
+/*
+ * A refcount record: the 'rc_len' blocks starting at
+ * 'rc_blkno' are shared by 'rc_count' files.
+ * The refcount file is an array of these records sorted
+ * by block number and not overlapping. Only the blocks
+ * shared by two files or more have a record; any other
+ * allocated block belongs to one file only.
+ */
+
+struct refcount {
+	fs_u64_t	rc_blkno;
+	fs_u64_t	rc_len;
+	fs_u64_t	rc_count;
+};
+
 union org {
 	struct direct	dir[MAX_DIRECT];
 	struct indirect	indir[MAX_INDIRECT];
 };
 
+/*
+ * A directory is either an array of struct direntry
+ * (DIRFMT_FIXED), blocks of struct dirrec records
+ * (DIRFMT_PACKED) or a B-tree of struct dirbt_node blocks
+ * (DIRFMT_BTREE), as per ds_format. A directory is packed
+ * if it was empty when its first entry was added, which
+ * is the case of every directory since the packed format
+ * exists, unless it was created sorted (FTYPE_SORTED), in
+ * which case it's a B-tree from the start. Once it gets big,
+ * a directory other than a B-tree also gets a hash
+ * index: the index inode ds_hashino
+ * holds ds_nbuckets bucket blocks followed by overflow blocks,
+ * ds_nidxblks blocks in all. The entry whose name hashes to h
+ * is listed in bucket h % ds_nbuckets or in one of the overflow
+ * blocks chained from it. Directories with ds_hashino zero are
+ * searched linearly.
+ */
+
 struct dirspec {
 	fs_u64_t	ds_ndirents;
+	fs_u64_t	ds_hashino;
+	fs_u32_t	ds_nbuckets;
+	fs_u32_t	ds_nidxblks;
+	fs_u32_t	ds_format;
+	fs_u32_t	ds_pad;
+};
+
+#define DIRFMT_FIXED	0
+#define DIRFMT_PACKED	1
+#define DIRFMT_BTREE	2
+/*
+ * A node of a DIRFMT_BTREE directory, one 1K block. Block 0 is
+ * the root. The bt_used bytes at bt_recs are bt_nrecs struct
+ * dirbt_rec records sorted by name, each followed by its name
+ * (br_namelen bytes, not NUL terminated) and padding. In a leaf
+ * (bt_level zero), br_val is the inode number of the entry and
+ * bt_next is the block of the next leaf (zero for the last
+ * one). In an interior node, br_val is the block of the child
+ * holding the names from the name of the record up to that of
+ * the next record, and the names below the first record are
+ * in child bt_first.
+ */
+struct dirbt_rec {
+	fs_u64_t	br_val;
+	fs_u8_t		br_namelen;
+	fs_u8_t		br_pad[7];
+};
+#define DIRBT_HDRLEN	16
+#define DIRBT_SPACE	(ONE_K - DIRBT_HDRLEN)
+#define DIRBT_RECLEN(n)	((sizeof(struct dirbt_rec) + (n) + 7) & ~7)
+struct dirbt_node {
+	fs_u16_t	bt_nrecs;
+	fs_u16_t	bt_used;
+	fs_u16_t	bt_level;
+	fs_u16_t	bt_pad;
+	fs_u32_t	bt_first;
+	fs_u32_t	bt_next;
+	char		bt_recs[DIRBT_SPACE];
+};
+
+/*
+ * A block of a directory hash index: dh_count entries, each
+ * giving the hash of a name and the offset of its entry in
+ * the directory, and the block number (within the index) of
+ * the next overflow block of the bucket, or zero.
+ */
+
+struct dirhash_ent {
+	fs_u32_t	dh_hash;
+	fs_u32_t	dh_off;
+};
+
+#define DH_NENTS	((ONE_K - 8) / sizeof(struct dirhash_ent))
+
+struct dirhash_blk {
+	fs_u32_t		dh_count;
+	fs_u32_t		dh_next;
+	struct dirhash_ent	dh_ent[DH_NENTS];
+};
+
+/*
+ * A regular file with fs_codec other than zero (FSCMP_*) is
+ * compressed: its data is cut in clusters of CLUSTER_SIZE
+ * bytes, each compressed separately. The blocks of the file
+ * hold the compressed clusters, the first fs_streamend bytes
+ * of them being in use, and the cluster map inode
+ * fs_cmapino holds a struct cmapent per cluster telling
+ * where it is.
+ */
+
+struct filespec {
+	fs_u64_t	fs_cmapino;
+	fs_u64_t	fs_streamend;
+	fs_u32_t	fs_codec;
+	fs_u32_t	fs_level;
 };
 
+#define CLUSTER_SIZE	(1 << 16)
+#define LOG_CLUSTER	16
+
+/*
+ * A cluster map entry.
+ * The cluster is stored in cm_len bytes at offset cm_off of
+ * the blocks of the file, in a slot of cm_nblks blocks. With
+ * CM_RAW, it's stored uncompressed since it didn't compress.
+ */
+
+struct cmapent {
+	fs_u64_t	cm_off;
+	fs_u32_t	cm_len;
+	fs_u16_t	cm_nblks;
+	fs_u16_t	cm_flags;
+};
+
+#define CM_RAW		0x0001
+
 union typespec {
 	struct dirspec	ts_dir;
+	struct filespec	ts_file;
 };
 
 /*
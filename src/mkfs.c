@@ -14,6 +14,7 @@ fs_u64_t	init_ilistblk;
 static int	alloc_emap(struct super_block *, int, int);
 static int	alloc_imap(struct super_block *, int, int);
 static int	write_ilist(struct super_block *, int);
+static int	write_journal(struct super_block *, int);
 
 static int
 alloc_emap(
@@ -26,7 +27,7 @@ alloc_emap(
 
         emap_sz = (size % 8 == 0) ? (size/8) : (size/8 + 1);
         emap_sz = (emap_sz + ONE_K - 1) & ~(ONE_K - 1);
-        nexts += emap_sz/ONE_K;
+        nexts += emap_sz/ONE_K + sb->jnlsize;
         buf = (char *)malloc(emap_sz);
         if (buf == NULL) {
                 fprintf(stderr, "Failed to allocate memory for emap\n");
@@ -35,8 +36,7 @@ alloc_emap(
         memset(buf, -1, emap_sz);
         nexts = (nexts % 8 == 0) ? (nexts/8) : (nexts/8 + 1);
         memset(buf, 0, nexts);
-        (void) lseek(fd, sb->lastblk << LOG_ONE_K, SEEK_SET);
-        if (write(fd, buf, emap_sz) < emap_sz) {
+        if (pwrite(fd, buf, emap_sz, sb->lastblk << LOG_ONE_K) < emap_sz) {
                 fprintf(stderr, "Error writing emap\n");
                 free(buf);
                 return 1;
@@ -63,8 +63,7 @@ alloc_imap(
         }
         memset(buf, -1, 8192);
 	buf[0] = 0xf0;
-        (void)lseek(fd, sb->lastblk * ONE_K, SEEK_SET);
-        if (write(fd, buf, 8192) < 8192) {
+        if (pwrite(fd, buf, 8192, sb->lastblk * ONE_K) < 8192) {
                 fprintf(stderr, "Error writing imap\n");
                 free(buf);
                 return 1;
@@ -124,9 +123,8 @@ write_ilist(
         dp->orgtype = ORG_DIRECT;
 
 	init_ilistblk = (imap_firstblk + 8) << LOG_ONE_K;
-        (void) lseek(fd, init_ilistblk, SEEK_SET);
 
-        if (write(fd, buf, INIT_ILT_SIZE) < INIT_ILT_SIZE) {
+        if (pwrite(fd, buf, INIT_ILT_SIZE, init_ilistblk) < INIT_ILT_SIZE) {
                 fprintf(stderr, "Error writing to ilist file\n");
                 free(buf);
                 return 1;
@@ -138,6 +136,40 @@ write_ilist(
         return 0;
 }
 
+/*
+ * Lay out the journal after the ilist: an empty log, zeroed so
+ * that nothing left in the device file can pass for a record.
+ */
+
+static int
+write_journal(
+	struct super_block	*sb,
+	int			fd)
+{
+	struct jnl_header	*jh;
+	char			*buf;
+
+	buf = (char *)calloc(sb->jnlsize, ONE_K);
+	if (buf == NULL) {
+		fprintf(stderr, "Failed to allocate memory for journal\n");
+		return ENOMEM;
+	}
+	jh = (struct jnl_header *)buf;
+	jh->jh_magic = JNL_MAGIC;
+	jh->jh_seq = 1;
+	if (pwrite(fd, buf, sb->jnlsize << LOG_ONE_K,
+		   sb->lastblk << LOG_ONE_K) != (ssize_t)(sb->jnlsize << LOG_ONE_K)) {
+		fprintf(stderr, "Error writing journal\n");
+		free(buf);
+		return 1;
+	}
+	sb->jnlblk = sb->lastblk;
+	sb->lastblk += sb->jnlsize;
+	sb->freeblks -= sb->jnlsize;
+	free(buf);
+	return 0;
+}
+
 int
 create_fs(
         char                    *fname,
@@ -171,6 +203,7 @@ create_fs(
         sb->freeblks = size - 1;
         sb->lastblk = 16;
 	sb->iused = INIT_NINODES;
+	sb->jnlsize = JNL_BLOCKS(size);
 
         if ((error = alloc_emap(sb, fd, size)) ||
                 (error = alloc_imap(sb, fd, size))) {
@@ -181,10 +214,12 @@ create_fs(
                 fprintf(stderr, "Couldn't write to ilist file for %s\n",  fname);
                 return 1;
         }
+	if (write_journal(sb, fd) != 0) {
+		return 1;
+	}
 
 	sb->ilistblk = init_ilistblk;
-        (void) lseek(fd, SB_OFFSET, SEEK_SET);
-        if (write(fd, sb, sizeof(struct super_block)) !=
+        if (pwrite(fd, sb, sizeof(struct super_block), SB_OFFSET) !=
                 sizeof(struct super_block)) {
                 fprintf(stderr, "Error writing super block\n");
                 return 1;
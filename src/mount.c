@@ -2,6 +2,15 @@
 #include "layout.h"
 #include "fs.h"
 #include "inode.h"
+#include "bmap.h"
+#include "bio.h"
+#include "refcount.h"
+#include "cksum.h"
+#include "dcache.h"
+#include "dir.h"
+#include "compress.h"
+#include "journal.h"
+#include "fs_include.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -45,6 +54,8 @@ alloc_minode(
 	mino->mino_fsm = fsm;
 	mino->mino_number = inum;
 	mino->mino_bno = bno;
+	mino->mino_count = 1;
+	pthread_rwlock_init(&mino->mino_rwlock, NULL);
  	return mino;
 }
 
@@ -63,8 +74,7 @@ fill_inodes(
 		return 1;
 	}
 	off = fsm->fsm_sb->ilistblk + (ILIST_INO << LOG_INOSIZE);
-	lseek(fsm->fsm_devfd, off, SEEK_SET);
-	if (read(fsm->fsm_devfd, buf, ONE_K) != ONE_K) {
+	if (bio_read(fsm, buf, ONE_K, off) != 0) {
 		fprintf(stderr, "Failed to read initial inodes\n");
 		free(buf);
 		return 1;
@@ -96,6 +106,17 @@ fill_inodes(
 	}
 	bcopy(buf, &mino->mino_dip, sizeof(struct dinode));
 	fsm->fsm_mntip = mino;
+
+	/*
+	 * The structural inodes and the root directory stay in
+	 * core as long as the file system is mounted; the mount
+	 * holds a reference on each of them.
+	 */
+
+	ihash_insert(fsm, fsm->fsm_ilip);
+	ihash_insert(fsm, fsm->fsm_emapip);
+	ihash_insert(fsm, fsm->fsm_imapip);
+	ihash_insert(fsm, fsm->fsm_mntip);
 	error = 0;
 
 out:
@@ -117,18 +138,53 @@ out:
 	return error;
 }
 
+static int
+populate_extent(
+	void		*arg,
+	fs_u64_t	off,
+	fs_u64_t	blkno,
+	fs_u64_t	len)
+{
+	(void) off;
+	bio_populate((struct fsmem *)arg, blkno << LOG_ONE_K,
+		     len << LOG_ONE_K);
+	return 0;
+}
+
+/*
+ * With FSMNT_POPULATE, fault in the superblock and all the
+ * blocks of the structural inodes and the root directory,
+ * which are looked at by nearly every operation.
+ */
+
+static void
+populate_metadata(
+	struct fsmem	*fsm)
+{
+	if (!(fsm->fsm_mntflags & FSMNT_POPULATE)) {
+		return;
+	}
+	bio_populate(fsm, 0, SB_OFFSET + sizeof(struct super_block));
+	(void) bmap_walk(fsm->fsm_ilip, populate_extent, fsm);
+	(void) bmap_walk(fsm->fsm_emapip, populate_extent, fsm);
+	(void) bmap_walk(fsm->fsm_imapip, populate_extent, fsm);
+	(void) bmap_walk(fsm->fsm_mntip, populate_extent, fsm);
+}
+
 /*
  * Mount the file system.
  * Returns the file system handle (which is void *)
  * to the caller. The caller passes this pointer
  * to the further operations at file system level.
- * The input is device and mount point.
+ * The input is device, mount point and mount flags
+ * (FSMNT_*).
  */
 
 void *
-fsmount(
+fsmount_opts(
 	char			*dev,
-	char			*mntpt)
+	char			*mntpt,
+	unsigned int		flags)
 {
 	struct stat		st;
 	struct fs_handle	*fsh = NULL;
@@ -150,7 +206,7 @@ fsmount(
 		return NULL;
 	}
 	if (!S_ISREG(st.st_mode)) {
-		fprintf(stderr, "%s is not a regular file\n");
+		fprintf(stderr, "%s is not a regular file\n", dev);
 		return NULL;
 	}
 	if (stat(mntpt, &st) != 0) {
@@ -180,14 +236,20 @@ fsmount(
 	}
 	fsh->fsh_mem = fsm;
 	bzero((caddr_t)fsm, sizeof(struct fsmem));
+	fsm->fsm_dfd = -1;
+	pthread_rwlock_init(&fsm->fsm_nslock, NULL);
+	pthread_mutex_init(&fsm->fsm_rclock, NULL);
+	pthread_mutex_init(&fsm->fsm_imaplock, NULL);
+	pthread_mutex_init(&fsm->fsm_alloclock, NULL);
+	pthread_mutex_init(&fsm->fsm_sblock, NULL);
+	pthread_mutex_init(&fsm->fsm_icachelock, NULL);
 	sb = (struct super_block *) malloc(sizeof(struct super_block));
 	if (!sb) {
 		fprintf(stderr, "Failed to allocate memory for superblock\n");
 		goto out;
 	}
-	(void) lseek(devfd, SB_OFFSET, SEEK_SET);
-	if (read(devfd, sb, sizeof(struct super_block)) !=
-	    sizeof(struct super_block)) {
+	fsm->fsm_devfd = devfd;
+	if (bio_read(fsm, sb, sizeof(struct super_block), SB_OFFSET) != 0) {
 		fprintf(stderr, "Failed to read superblock\n");
 		goto out;
 	}
@@ -195,7 +257,6 @@ fsmount(
 		fprintf(stderr, "%s: Not a valid file system\n", dev);
 		goto out;
 	}
-	fsm->fsm_devfd = devfd;
 	fsm->fsm_devf = (char *)malloc(strlen(dev) + 1);
 	if (!fsm->fsm_devf) {
 		fprintf(stderr, "Failed to allocate memory for device "
@@ -210,7 +271,37 @@ fsmount(
 	strcpy(fsm->fsm_devf, dev);
 	strcpy(fsm->fsm_mntpt, mntpt);
 	fsm->fsm_sb = sb;
-	error = fill_inodes(fsm);
+	if ((error = bio_init(fsm, flags)) != 0) {
+		goto out;
+	}
+
+	/*
+	 * Replaying the journal may change the superblock.
+	 */
+
+	if ((error = jnl_init(fsm, flags)) != 0) {
+		goto out;
+	}
+	if ((error = bio_read(fsm, sb, sizeof(struct super_block),
+			      SB_OFFSET)) != 0) {
+		fprintf(stderr, "Failed to read superblock\n");
+		goto out;
+	}
+	fsm->fsm_mntflags |= (flags & (FSMNT_COMPRESS | FSMNT_CLEVEL(~0) |
+				       FSMNT_NOVERIFY));
+	if ((error = fill_inodes(fsm)) != 0) {
+		goto out;
+	}
+	if ((error = refcount_load(fsm)) != 0) {
+		goto out;
+	}
+	if ((error = cksum_load(fsm)) != 0) {
+		goto out;
+	}
+	if ((error = dcache_init(fsm)) != 0) {
+		goto out;
+	}
+	populate_metadata(fsm);
 
 out:
 	if (error) {
@@ -223,6 +314,8 @@ out:
 		if (fsm->fsm_mntpt) {
 			free(fsm->fsm_mntpt);
 		}
+		(void) jnl_fini(fsm);
+		bio_fini(fsm);
 		free(fsh);
 		close(devfd);
 		free(fsm);
@@ -230,3 +323,282 @@ out:
 	}
 	return (void *)fsh;
 }
+
+/*
+ * Mount the file system with default flags.
+ */
+
+void *
+fsmount(
+	char			*dev,
+	char			*mntpt)
+{
+	return fsmount_opts(dev, mntpt, 0);
+}
+
+/*
+ * Make everything written to the file system so far
+ * stable on disk. Data still in the write buffer of an
+ * open file handle isn't written; see fsclose().
+ * With the journal, threads calling this at the same time
+ * share a single commit (see journal.c).
+ * Returns zero on success or error number.
+ */
+
+int
+fssync(
+	void			*vfsh)
+{
+	struct fs_handle	*fsh = (struct fs_handle *)vfsh;
+
+	return jnl_sync(fsh->fsh_mem);
+}
+
+/*
+ * Start an explicit transaction: the creates, writes, removes
+ * and other changes the calling thread makes until it calls
+ * fstx_commit() or fstx_abort() are made durable together, with
+ * a single flush, or not at all. Other threads can read the
+ * file system meanwhile, and see the changes, but their own
+ * changes (asynchronous writes included) wait for the
+ * transaction to end. fssync() does nothing within it.
+ * The file system must have a journal and not be mounted with
+ * FSMNT_NOJOURNAL.
+ * Returns the transaction, or NULL with errno set.
+ */
+
+void *
+fstx_begin(
+	void			*vfsh)
+{
+	struct fs_handle	*fsh = (struct fs_handle *)vfsh;
+	struct fs_tx		*tx;
+	int			error;
+
+	if ((tx = (struct fs_tx *)malloc(sizeof(struct fs_tx))) == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((error = jnl_txbegin(fsh->fsh_mem)) != 0) {
+		fprintf(stderr, "fstx_begin: Failed to start a transaction "
+			"on %s: %s\n", fsh->fsh_mem->fsm_mntpt,
+			strerror(error));
+		free(tx);
+		errno = error;
+		return NULL;
+	}
+	tx->tx_fsh = fsh;
+	return (void *)tx;
+}
+
+/*
+ * Read again what's kept in core of the metadata, after the
+ * changes of an explicit transaction have been dropped: the
+ * superblock, the in-core inodes, the refcounts; the free space
+ * maps of directories and the dentry cache are dropped.
+ * Returns zero or error number.
+ */
+
+static int
+reload_incore(
+	struct fsmem		*fsm)
+{
+	struct minode		**minos, *mino;
+	int			i, n = 0, error, err;
+
+	pthread_rwlock_wrlock(&fsm->fsm_nslock);
+	pthread_mutex_lock(&fsm->fsm_sblock);
+	error = bio_read(fsm, fsm->fsm_sb, sizeof(struct super_block),
+			 SB_OFFSET);
+	pthread_mutex_unlock(&fsm->fsm_sblock);
+
+	/*
+	 * Take a reference on every in-core inode, so that they
+	 * stay in core while they are read, the ilist inode first.
+	 */
+
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	for (i = 0; i < IHASH_SIZE; i++) {
+		for (mino = fsm->fsm_ihash[i]; mino; mino = mino->mino_hnext) {
+			n++;
+		}
+	}
+	if ((minos = (struct minode **)malloc(n * sizeof(*minos))) == NULL) {
+		pthread_mutex_unlock(&fsm->fsm_icachelock);
+		pthread_rwlock_unlock(&fsm->fsm_nslock);
+		return ENOMEM;
+	}
+	minos[0] = fsm->fsm_ilip;
+	for (i = 0, n = 1; i < IHASH_SIZE; i++) {
+		for (mino = fsm->fsm_ihash[i]; mino; mino = mino->mino_hnext) {
+			if (mino != fsm->fsm_ilip) {
+				minos[n++] = mino;
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		minos[i]->mino_count++;
+	}
+	dirfree_fini(fsm);
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
+
+	for (i = 0; i < n; i++) {
+		ILOCK_EXCL(minos[i]);
+		err = ireload(minos[i]);
+		IUNLOCK(minos[i]);
+		iput(minos[i]);
+		error = error ? error : err;
+	}
+	free(minos);
+	dcache_flush(fsm);
+
+	/*
+	 * The refcount file may be gone, if the transaction
+	 * created it.
+	 */
+
+	pthread_mutex_lock(&fsm->fsm_rclock);
+	if (fsm->fsm_rcip) {
+		iput(fsm->fsm_rcip);
+		fsm->fsm_rcip = NULL;
+	}
+	free(fsm->fsm_rc);
+	fsm->fsm_rc = NULL;
+	fsm->fsm_nrc = 0;
+	err = refcount_load(fsm);
+	pthread_mutex_unlock(&fsm->fsm_rclock);
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	return error ? error : err;
+}
+
+/*
+ * Commit the explicit transaction 'vtx' and free it. Data left
+ * in the write buffer of a file handle isn't part of it: the
+ * handles written must be closed first. A transaction which
+ * doesn't fit in the journal is aborted, with EFBIG returned.
+ * Returns zero on success or error number.
+ */
+
+int
+fstx_commit(
+	void			*vtx)
+{
+	struct fs_tx		*tx = (struct fs_tx *)vtx;
+	int			error;
+
+	if ((error = jnl_txcommit(tx->tx_fsh->fsh_mem)) == EFBIG) {
+		fprintf(stderr, "fstx_commit: Transaction too big for the "
+			"journal of %s, aborted\n",
+			tx->tx_fsh->fsh_mem->fsm_mntpt);
+		(void) fstx_abort(vtx);
+		return EFBIG;
+	}
+	free(tx);
+	return error;
+}
+
+/*
+ * Abort the explicit transaction 'vtx', leaving the file
+ * system as it was when the transaction started, and free it.
+ * The handles of the files created within the transaction must
+ * have been closed.
+ * Returns zero on success or error number.
+ */
+
+int
+fstx_abort(
+	void			*vtx)
+{
+	struct fs_tx		*tx = (struct fs_tx *)vtx;
+	struct fsmem		*fsm = tx->tx_fsh->fsh_mem;
+	int			error;
+
+	jnl_txabort(fsm);
+	error = reload_incore(fsm);
+	jnl_txend(fsm);
+	free(tx);
+	return error;
+}
+
+/*
+ * Is 'mino' one of the inodes the mount keeps in core?
+ */
+
+static int
+mount_inode(
+	struct fsmem	*fsm,
+	struct minode	*mino)
+{
+	return (mino == fsm->fsm_ilip || mino == fsm->fsm_emapip ||
+		mino == fsm->fsm_imapip || mino == fsm->fsm_mntip ||
+		mino == fsm->fsm_rcip || mino == fsm->fsm_csip);
+}
+
+/*
+ * Unmount the file system: sync it and free all the
+ * in-core state. All the file handles must have been
+ * closed with fsclose().
+ * Returns zero on success or error number. If a file is
+ * still open, EBUSY is returned and nothing is done;
+ * after any other error the file system is unmounted
+ * anyway.
+ */
+
+int
+fsumount(
+	void			*vfsh)
+{
+	struct fs_handle	*fsh = (struct fs_handle *)vfsh;
+	struct fsmem		*fsm = fsh->fsh_mem;
+	struct minode		*mino, *next;
+	int			i, error;
+
+	/*
+	 * The inodes of the mount itself hold a reference each;
+	 * any other reference is a file which is still open.
+	 */
+
+	pthread_mutex_lock(&fsm->fsm_icachelock);
+	for (i = 0; i < IHASH_SIZE; i++) {
+		for (mino = fsm->fsm_ihash[i]; mino; mino = mino->mino_hnext) {
+			if (mino->mino_count > (fs_u32_t)mount_inode(fsm,
+								     mino)) {
+				pthread_mutex_unlock(&fsm->fsm_icachelock);
+				fprintf(stderr, "fsumount: Inode %llu of %s is "
+					"still in use\n", mino->mino_number,
+					fsm->fsm_mntpt);
+				return EBUSY;
+			}
+		}
+	}
+	pthread_mutex_unlock(&fsm->fsm_icachelock);
+	if ((error = jnl_fini(fsm)) == 0) {
+		error = bio_sync(fsm);
+	}
+	for (i = 0; i < IHASH_SIZE; i++) {
+		for (mino = fsm->fsm_ihash[i]; mino; mino = next) {
+			next = mino->mino_hnext;
+			dirfree_release(mino);
+			cmpfree_release(mino);
+			pthread_rwlock_destroy(&mino->mino_rwlock);
+			free(mino);
+		}
+	}
+	bio_fini(fsm);
+	close(fsm->fsm_devfd);
+	free(fsm->fsm_rc);
+	dcache_fini(fsm);
+	dirfree_fini(fsm);
+	pthread_rwlock_destroy(&fsm->fsm_nslock);
+	pthread_mutex_destroy(&fsm->fsm_rclock);
+	pthread_mutex_destroy(&fsm->fsm_imaplock);
+	pthread_mutex_destroy(&fsm->fsm_alloclock);
+	pthread_mutex_destroy(&fsm->fsm_sblock);
+	pthread_mutex_destroy(&fsm->fsm_icachelock);
+	free(fsm->fsm_sb);
+	free(fsm->fsm_devf);
+	free(fsm->fsm_mntpt);
+	free(fsm);
+	free(fsh);
+	return error;
+}
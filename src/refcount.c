@@ -0,0 +1,550 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "inode.h"
+#include "bmap.h"
+#include "allocate.h"
+#include "fileops.h"
+#include "bio.h"
+#include "refcount.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Shared blocks.
+ * fsclone() makes a new file share all the blocks of an existing
+ * one. The number of files sharing a block is kept in the refcount
+ * file (see struct refcount in layout.h), which is created the
+ * first time a file is cloned and read in core as a whole at
+ * mount time. Blocks without a record aren't shared, so a file
+ * system which never had a clone pays nothing for this.
+ * Shared blocks are never written in place: a write to a shared
+ * range of a file first gives the file private copies of those
+ * blocks (copy-on-write, a block at a time) and drops the count
+ * of the old ones.
+ */
+
+static int	rc_find(struct fsmem *, fs_u64_t);
+static fs_u64_t	rc_lookup(struct fsmem *, fs_u64_t, fs_u64_t, fs_u64_t *);
+static int	rc_adjust(struct fsmem *, fs_u64_t, fs_u64_t, int);
+static int	rc_flush(struct fsmem *);
+
+/*
+ * Index of the first record which ends after block 'blkno'.
+ */
+
+static int
+rc_find(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno)
+{
+	struct refcount	*rc = fsm->fsm_rc;
+	int		lo = 0, hi = fsm->fsm_nrc, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (rc[mid].rc_blkno + rc[mid].rc_len <= blkno) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Returns the number of files sharing block 'blkno' and sets
+ * *runp to the number of blocks from 'blkno' (at most 'maxlen')
+ * which have the same count.
+ */
+
+static fs_u64_t
+rc_lookup(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	fs_u64_t	maxlen,
+	fs_u64_t	*runp)
+{
+	struct refcount	*rc;
+	int		i = rc_find(fsm, blkno);
+
+	if (i == fsm->fsm_nrc) {
+		*runp = maxlen;
+		return 1;
+	}
+	rc = &fsm->fsm_rc[i];
+	if (rc->rc_blkno > blkno) {
+		*runp = MIN(maxlen, rc->rc_blkno - blkno);
+		return 1;
+	}
+	*runp = MIN(maxlen, rc->rc_blkno + rc->rc_len - blkno);
+	return rc->rc_count;
+}
+
+/*
+ * Append a record to 'rc', merging it with the last one if
+ * they are contiguous and have the same count. Records of
+ * unshared blocks are dropped.
+ */
+
+static void
+rc_emit(
+	struct refcount	*rc,
+	int		*np,
+	fs_u64_t	blkno,
+	fs_u64_t	len,
+	fs_u64_t	count)
+{
+	struct refcount	*last = *np ? &rc[*np - 1] : NULL;
+
+	if (len == 0 || count < 2) {
+		return;
+	}
+	if (last && last->rc_blkno + last->rc_len == blkno &&
+	    last->rc_count == count) {
+		last->rc_len += len;
+		return;
+	}
+	rc[*np].rc_blkno = blkno;
+	rc[*np].rc_len = len;
+	rc[*np].rc_count = count;
+	(*np)++;
+}
+
+/*
+ * Add 'delta' to the count of each of the 'len' blocks
+ * starting at 'blkno'. Only the in-core records are changed;
+ * see rc_flush().
+ * Returns zero or error number.
+ */
+
+static int
+rc_adjust(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	fs_u64_t	len,
+	int		delta)
+{
+	struct refcount	*old = fsm->fsm_rc, *rc, *r;
+	fs_u64_t	cur = blkno, end = blkno + len, s, e;
+	int		i, n = 0;
+
+	/*
+	 * Each old record gives at most three new ones and every
+	 * gap between them within the range one more.
+	 */
+
+	rc = (struct refcount *)malloc((2 * fsm->fsm_nrc + 3) *
+				       sizeof(struct refcount));
+	if (!rc) {
+		return ENOMEM;
+	}
+	for (i = 0; i < fsm->fsm_nrc; i++) {
+		r = &old[i];
+		s = r->rc_blkno;
+		e = s + r->rc_len;
+		if (cur < end && cur < s) {
+			rc_emit(rc, &n, cur, MIN(s, end) - cur, 1 + delta);
+			cur = MIN(s, end);
+		}
+		if (s < blkno) {
+			rc_emit(rc, &n, s, MIN(e, blkno) - s, r->rc_count);
+		}
+		if (MAX(s, blkno) < MIN(e, end)) {
+			assert(r->rc_count + delta >= 1);
+			rc_emit(rc, &n, MAX(s, blkno),
+				MIN(e, end) - MAX(s, blkno),
+				r->rc_count + delta);
+			cur = MIN(e, end);
+		}
+		if (MAX(s, end) < e) {
+			rc_emit(rc, &n, MAX(s, end), e - MAX(s, end),
+				r->rc_count);
+		}
+	}
+	if (cur < end) {
+		rc_emit(rc, &n, cur, end - cur, 1 + delta);
+	}
+	free(old);
+	fsm->fsm_rc = rc;
+	fsm->fsm_nrc = n;
+	return 0;
+}
+
+/*
+ * Write the in-core records to the refcount file.
+ * Returns zero or error number.
+ */
+
+static int
+rc_flush(
+	struct fsmem	*fsm)
+{
+	struct minode	*rcip = fsm->fsm_rcip;
+	fs_u32_t	len = fsm->fsm_nrc * sizeof(struct refcount);
+	int		error = 0;
+
+	if (len && (error = internal_write(fsm, rcip, (char *)fsm->fsm_rc,
+					   0, len)) != 0) {
+		fprintf(stderr, "rc_flush: Failed to write refcount file "
+			"for %s\n", fsm->fsm_mntpt);
+		return error;
+	}
+	if (rcip->mino_size != len) {
+		rcip->mino_size = len;
+		error = iwrite(rcip);
+	}
+	return error;
+}
+
+/*
+ * Read the refcount file at mount time, if there is one.
+ * Returns zero or error number.
+ */
+
+int
+refcount_load(
+	struct fsmem	*fsm)
+{
+	struct minode	*rcip;
+	fs_u64_t	size;
+
+	if (fsm->fsm_sb->refcntino == 0) {
+		return 0;
+	}
+	if ((rcip = iget(fsm, fsm->fsm_sb->refcntino)) == NULL) {
+		return EIO;
+	}
+	size = rcip->mino_size;
+	if (rcip->mino_type != IFRCT || size % sizeof(struct refcount)) {
+		fprintf(stderr, "refcount_load: Bad refcount inode %llu for"
+			" %s\n", rcip->mino_number, fsm->fsm_mntpt);
+		iput(rcip);
+		return EINVAL;
+	}
+	if (size) {
+		fsm->fsm_rc = (struct refcount *)malloc(size);
+		if (!fsm->fsm_rc) {
+			iput(rcip);
+			return ENOMEM;
+		}
+		if (internal_read(rcip, (char *)fsm->fsm_rc, 0,
+				  (fs_u32_t)size) != (int)size) {
+			fprintf(stderr, "refcount_load: Failed to read "
+				"refcount file for %s\n", fsm->fsm_mntpt);
+			free(fsm->fsm_rc);
+			fsm->fsm_rc = NULL;
+			iput(rcip);
+			return EIO;
+		}
+	}
+	fsm->fsm_nrc = size / sizeof(struct refcount);
+	fsm->fsm_rcip = rcip;
+	return 0;
+}
+
+/*
+ * Create the refcount file, unless it exists already.
+ * Returns zero or error number.
+ */
+
+int
+refcount_create(
+	struct fsmem	*fsm)
+{
+	fs_u64_t	inum;
+	int		error = 0;
+
+	pthread_mutex_lock(&fsm->fsm_rclock);
+	if (fsm->fsm_rcip) {
+		goto out;
+	}
+	if ((error = ialloc(fsm, IFRCT, &inum)) != 0) {
+		goto out;
+	}
+	if ((fsm->fsm_rcip = iget(fsm, inum)) == NULL) {
+		error = EIO;
+		goto out;
+	}
+	fsm->fsm_sb->refcntino = inum;
+	error = write_sb(fsm);
+
+out:
+	pthread_mutex_unlock(&fsm->fsm_rclock);
+	return error;
+}
+
+/*
+ * Take one more reference on each of the 'n' extents of
+ * 'ext', which are about to be shared by a new file.
+ * The refcount file must exist.
+ * Returns zero or error number.
+ */
+
+int
+refcount_share(
+	struct fsmem	*fsm,
+	struct direct	*ext,
+	int		n)
+{
+	int		i, error = 0;
+
+	assert(fsm->fsm_rcip != NULL);
+	pthread_mutex_lock(&fsm->fsm_rclock);
+	for (i = 0; i < n && error == 0; i++) {
+		error = rc_adjust(fsm, ext[i].blkno, ext[i].len, 1);
+	}
+	if (error == 0) {
+		error = rc_flush(fsm);
+	}
+	pthread_mutex_unlock(&fsm->fsm_rclock);
+	return error;
+}
+
+/*
+ * Drop a reference on each of the 'n' extents of 'ext', whose
+ * file is being removed: the blocks nobody else shares are
+ * freed.
+ * Returns zero or error number.
+ */
+
+int
+refcount_release(
+	struct fsmem	*fsm,
+	struct direct	*ext,
+	int		n)
+{
+	fs_u64_t	blkno, left, run;
+	int		i, dirty = 0, error = 0;
+
+	pthread_mutex_lock(&fsm->fsm_rclock);
+	for (i = 0; i < n && error == 0; i++) {
+		blkno = ext[i].blkno;
+		for (left = ext[i].len; left && error == 0;
+		     blkno += run, left -= run) {
+			if (rc_lookup(fsm, blkno, left, &run) < 2) {
+				error = deallocate(fsm, blkno, run);
+			} else {
+				error = rc_adjust(fsm, blkno, run, -1);
+				dirty = 1;
+			}
+		}
+	}
+	if (dirty && error == 0) {
+		error = rc_flush(fsm);
+	}
+	pthread_mutex_unlock(&fsm->fsm_rclock);
+	return error;
+}
+
+/*
+ * Growable array of extents.
+ */
+
+struct extlist {
+	struct direct	*el_ext;
+	int		el_n;
+	int		el_max;
+};
+
+static int
+extlist_add(
+	struct extlist	*el,
+	fs_u64_t	blkno,
+	fs_u64_t	len)
+{
+	struct direct	*ext;
+	int		max;
+
+	if (el->el_n == el->el_max) {
+		max = el->el_max ? 2 * el->el_max : MAX_DIRECT;
+		ext = (struct direct *)realloc(el->el_ext,
+					       max * sizeof(struct direct));
+		if (!ext) {
+			return ENOMEM;
+		}
+		el->el_ext = ext;
+		el->el_max = max;
+	}
+	el->el_ext[el->el_n].blkno = blkno;
+	el->el_ext[el->el_n].len = len;
+	el->el_n++;
+	return 0;
+}
+
+/*
+ * Copy block 'from' to block 'to'.
+ */
+
+static int
+cow_copy(
+	struct fsmem	*fsm,
+	fs_u64_t	from,
+	fs_u64_t	to)
+{
+	char		buf[ONE_K];
+	int		error;
+
+	if ((error = bio_read(fsm, buf, ONE_K, from << LOG_ONE_K)) != 0) {
+		return error;
+	}
+	return bio_write(fsm, buf, ONE_K, to << LOG_ONE_K);
+}
+
+/*
+ * Replace the 'len' shared blocks at 'blkno', which are mapped
+ * at logical block 'lblk' of the file, by new blocks, appending
+ * the new extents to 'map' and to 'fresh'. Only the blocks the
+ * write [off, off + wlen) doesn't fully cover are copied.
+ * Returns zero or error number.
+ */
+
+static int
+cow_run(
+	struct fsmem	*fsm,
+	fs_u64_t	blkno,
+	fs_u64_t	lblk,
+	fs_u64_t	len,
+	fs_u64_t	off,
+	fs_u64_t	wlen,
+	struct extlist	*map,
+	struct extlist	*fresh)
+{
+	fs_u64_t	nb, nl, i, b;
+	int		error;
+
+	while (len) {
+		if ((error = allocate(fsm, len, &nb, &nl)) != 0) {
+			return error;
+		}
+		if ((error = extlist_add(fresh, nb, nl)) != 0) {
+			deallocate(fsm, nb, nl);
+			return error;
+		}
+		for (i = 0; i < nl; i++) {
+			b = lblk + i;
+			if (((b << LOG_ONE_K) < off &&
+			     ((b + 1) << LOG_ONE_K) > off) ||
+			    ((b << LOG_ONE_K) < off + wlen &&
+			     ((b + 1) << LOG_ONE_K) > off + wlen)) {
+				if ((error = cow_copy(fsm, blkno + i,
+						      nb + i)) != 0) {
+					return error;
+				}
+			}
+		}
+		if ((error = extlist_add(map, nb, nl)) != 0) {
+			return error;
+		}
+		blkno += nl;
+		lblk += nl;
+		len -= nl;
+	}
+	return 0;
+}
+
+/*
+ * Before 'len' bytes are written at offset 'off' of the file,
+ * give it private copies of the blocks of that range which are
+ * shared with other files.
+ * The caller must hold the inode lock exclusive.
+ * Returns zero or error number.
+ */
+
+int
+refcount_cow(
+	struct fsmem	*fsm,
+	struct minode	*mino,
+	fs_u64_t	off,
+	fs_u64_t	len)
+{
+	struct extlist	map = {NULL, 0, 0}, fresh = {NULL, 0, 0};
+	struct extlist	old = {NULL, 0, 0};
+	struct direct	*ext = NULL;
+	fs_u64_t	first, last, lblk, s, e, run, cnt;
+	int		i, n, error = 0;
+
+	if (len == 0 || mino->mino_type != IFREG) {
+		return 0;
+	}
+	pthread_mutex_lock(&fsm->fsm_rclock);
+	first = off >> LOG_ONE_K;
+	last = MIN((off + len + ONE_K - 1) >> LOG_ONE_K, mino->mino_nblocks);
+	if (fsm->fsm_nrc == 0 || first >= last) {
+		goto out;
+	}
+	if ((error = bmap_getmap(mino, &ext, &n)) != 0) {
+		goto out;
+	}
+
+	/*
+	 * Build the new map of the file, extent by extent,
+	 * replacing the shared runs within [first, last).
+	 */
+
+	for (i = 0, lblk = 0; i < n && error == 0; lblk += ext[i].len, i++) {
+		s = MAX(lblk, first);
+		e = MIN(lblk + ext[i].len, last);
+		if (s >= e) {
+			error = extlist_add(&map, ext[i].blkno, ext[i].len);
+			continue;
+		}
+		if (s > lblk) {
+			error = extlist_add(&map, ext[i].blkno, s - lblk);
+		}
+		for (; s < e && error == 0; s += run) {
+			cnt = rc_lookup(fsm, ext[i].blkno + s - lblk, e - s,
+					&run);
+			if (cnt < 2) {
+				error = extlist_add(&map, ext[i].blkno +
+						    s - lblk, run);
+				continue;
+			}
+			if ((error = extlist_add(&old, ext[i].blkno + s - lblk,
+						 run)) != 0) {
+				break;
+			}
+			error = cow_run(fsm, ext[i].blkno + s - lblk, s, run,
+					off, len, &map, &fresh);
+		}
+		if (error == 0 && e < lblk + ext[i].len) {
+			error = extlist_add(&map, ext[i].blkno + e - lblk,
+					    lblk + ext[i].len - e);
+		}
+	}
+	if (old.el_n == 0) {
+		goto out;
+	}
+	if (error == 0) {
+		error = bmap_setmap(fsm, mino, map.el_ext, map.el_n);
+	}
+	if (error) {
+		for (i = 0; i < fresh.el_n; i++) {
+			deallocate(fsm, fresh.el_ext[i].blkno,
+				   fresh.el_ext[i].len);
+		}
+		goto out;
+	}
+	for (i = 0; i < old.el_n && error == 0; i++) {
+		error = rc_adjust(fsm, old.el_ext[i].blkno, old.el_ext[i].len,
+				  -1);
+	}
+	if (error == 0) {
+		error = rc_flush(fsm);
+	}
+
+out:
+	pthread_mutex_unlock(&fsm->fsm_rclock);
+	if (error) {
+		fprintf(stderr, "refcount_cow: Failed to unshare blocks of "
+			"inode %llu for %s\n", mino->mino_number,
+			fsm->fsm_mntpt);
+	}
+	free(ext);
+	free(map.el_ext);
+	free(fresh.el_ext);
+	free(old.el_ext);
+	return error;
+}
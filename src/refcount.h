@@ -0,0 +1,11 @@
+#ifndef _FS_REFCOUNT_H_
+#define _FS_REFCOUNT_H_
+
+extern int	refcount_load(struct fsmem *);
+extern int	refcount_create(struct fsmem *);
+extern int	refcount_share(struct fsmem *, struct direct *, int);
+extern int	refcount_release(struct fsmem *, struct direct *, int);
+extern int	refcount_cow(struct fsmem *, struct minode *, fs_u64_t,
+			     fs_u64_t);
+
+#endif /*_FS_REFCOUNT_H_*/
@@ -4,5 +4,6 @@
 typedef	unsigned long long	fs_u64_t;
 typedef unsigned int		fs_u32_t;
 typedef unsigned short		fs_u16_t;
+typedef unsigned char		fs_u8_t;
 
 #endif /* _FS_TYPES_H_ */
@@ -0,0 +1,522 @@
+#include "layout.h"
+#include "types.h"
+#include "fs.h"
+#include "inode.h"
+#include "dir.h"
+#include "fs_include.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Parallel tree walk.
+ * fswalk() hands the directories of a tree out to a pool of
+ * worker threads. Each worker has its own queue of directories:
+ * it pushes the subdirectories it finds on it and takes the
+ * most recently pushed one back (depth first, so its queue
+ * stays short and the blocks it just prefetched are the next
+ * it reads), and when its queue runs dry it steals the oldest
+ * directory of another worker's queue, which is the top of the
+ * biggest subtree that worker has yet to walk.
+ * A directory is read WALK_BATCH entries at a time, under its
+ * inode lock, and the inodes of those entries are read together
+ * with iread_batch(). The blocks of the subdirectories found are
+ * prefetched into the host page cache as they are queued, so
+ * they are usually there by the time a worker reads them.
+ * No lock is held while the callback runs.
+ * wk_pending (directories queued or being read) and wk_nidle
+ * (workers waiting for a directory) are updated atomically, so
+ * that queueing a directory only takes the lock of the queue.
+ * wk_lock is what idle workers wait on: it's taken to go idle,
+ * to wake idle workers up, when wk_pending drops to zero and to
+ * set wk_stop. It's taken before the lock of a queue.
+ */
+
+#define WALK_BATCH	256
+
+struct walk_dir {
+	fs_u64_t		wd_inum;
+	char			wd_path[1];
+};
+
+struct walk_queue {
+	pthread_mutex_t		wq_lock;
+	struct walk_dir		**wq_dirs;
+	int			wq_head;
+	int			wq_tail;
+	int			wq_size;
+};
+
+struct walk {
+	struct fsmem		*wk_fsm;
+	fswalk_cb_t		wk_cb;
+	void			*wk_arg;
+	pthread_mutex_t		wk_lock;
+	pthread_cond_t		wk_cv;
+	struct walk_queue	*wk_queues;
+	int			wk_nqueues;
+	int			wk_pending;
+	int			wk_nidle;
+	int			wk_stop;
+	int			wk_result;
+};
+
+struct walk_worker {
+	struct walk		*ww_walk;
+	int			ww_id;
+};
+
+/*
+ * Stop the walk with 'result' (the first one wins).
+ */
+
+static void
+walk_stop(
+	struct walk		*wk,
+	int			result)
+{
+	pthread_mutex_lock(&wk->wk_lock);
+	if (!wk->wk_stop) {
+		wk->wk_stop = 1;
+		wk->wk_result = result;
+	}
+	pthread_cond_broadcast(&wk->wk_cv);
+	pthread_mutex_unlock(&wk->wk_lock);
+}
+
+/*
+ * Queue directory 'inum' at 'path' ('len' bytes) on queue 'q'.
+ * Returns zero or error number.
+ */
+
+static int
+walk_push(
+	struct walk		*wk,
+	int			q,
+	fs_u64_t		inum,
+	const char		*path,
+	int			len)
+{
+	struct walk_queue	*wq = &wk->wk_queues[q];
+	struct walk_dir		*wd, **dirs;
+	int			error = 0;
+
+	wd = (struct walk_dir *)malloc(sizeof(struct walk_dir) + len);
+	if (wd == NULL) {
+		return ENOMEM;
+	}
+	wd->wd_inum = inum;
+	memcpy(wd->wd_path, path, len);
+	wd->wd_path[len] = '\0';
+
+	/*
+	 * The directory is counted before anybody can take it,
+	 * so wk_pending can't drop to zero while it's queued.
+	 */
+
+	__atomic_add_fetch(&wk->wk_pending, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&wq->wq_lock);
+	if (wq->wq_tail == wq->wq_size && wq->wq_head > 0) {
+		memmove(wq->wq_dirs, wq->wq_dirs + wq->wq_head,
+			(wq->wq_tail - wq->wq_head) * sizeof(*dirs));
+		wq->wq_tail -= wq->wq_head;
+		wq->wq_head = 0;
+	} else if (wq->wq_tail == wq->wq_size) {
+		dirs = (struct walk_dir **)realloc(wq->wq_dirs,
+						   2 * wq->wq_size *
+						   sizeof(*dirs));
+		if (dirs == NULL) {
+			error = ENOMEM;
+		} else {
+			wq->wq_dirs = dirs;
+			wq->wq_size *= 2;
+		}
+	}
+	if (error == 0) {
+		wq->wq_dirs[wq->wq_tail++] = wd;
+	}
+	pthread_mutex_unlock(&wq->wq_lock);
+	if (error != 0) {
+		__atomic_sub_fetch(&wk->wk_pending, 1, __ATOMIC_SEQ_CST);
+		free(wd);
+		return error;
+	}
+
+	/*
+	 * A worker going idle counts itself in wk_nidle before it
+	 * looks at the queues: either it finds the directory or
+	 * we see it idle and wake it up. It waits with wk_lock
+	 * held from its last look on, so the wakeup isn't lost.
+	 */
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&wk->wk_nidle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&wk->wk_lock);
+		pthread_cond_signal(&wk->wk_cv);
+		pthread_mutex_unlock(&wk->wk_lock);
+	}
+	return 0;
+}
+
+/*
+ * Take a directory off queue 'q': the newest one if 'own',
+ * the oldest one otherwise.
+ * Returns NULL if the queue is empty.
+ */
+
+static struct walk_dir *
+walk_take(
+	struct walk		*wk,
+	int			q,
+	int			own)
+{
+	struct walk_queue	*wq = &wk->wk_queues[q];
+	struct walk_dir		*wd = NULL;
+
+	pthread_mutex_lock(&wq->wq_lock);
+	if (wq->wq_tail > wq->wq_head) {
+		wd = own ? wq->wq_dirs[--wq->wq_tail] :
+			   wq->wq_dirs[wq->wq_head++];
+		if (wq->wq_head == wq->wq_tail) {
+			wq->wq_head = wq->wq_tail = 0;
+		}
+	}
+	pthread_mutex_unlock(&wq->wq_lock);
+	return wd;
+}
+
+/*
+ * Take a directory for worker 'id', from its own queue
+ * or, failing that, from another worker's.
+ */
+
+static struct walk_dir *
+walk_next(
+	struct walk		*wk,
+	int			id)
+{
+	struct walk_dir		*wd;
+	int			i;
+
+	if ((wd = walk_take(wk, id, 1)) != NULL) {
+		return wd;
+	}
+	for (i = 1; i < wk->wk_nqueues; i++) {
+		if ((wd = walk_take(wk, (id + i) % wk->wk_nqueues,
+				    0)) != NULL) {
+			return wd;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Prefetch the blocks of directory inode 'dip' into the host
+ * page cache. Only the extents in the inode itself are
+ * prefetched: mapping the others would mean reading indirect
+ * blocks now.
+ */
+
+static void
+walk_prefetch(
+	struct walk		*wk,
+	struct dinode		*dip)
+{
+	struct direct		*ext = dip->orgarea.dir;
+	fs_u64_t		left = dip->size, len;
+	int			i;
+
+	if (dip->orgtype != ORG_DIRECT ||
+	    (wk->wk_fsm->fsm_mntflags & FSMNT_DIRECT)) {
+		return;
+	}
+	for (i = 0; i < MAX_DIRECT && ext[i].len != 0 && left > 0; i++) {
+		len = MIN(ext[i].len << LOG_ONE_K, left);
+		(void) posix_fadvise(wk->wk_fsm->fsm_devfd,
+				     ext[i].blkno << LOG_ONE_K, len,
+				     POSIX_FADV_WILLNEED);
+		left -= len;
+	}
+}
+
+/*
+ * Read directory 'wd' for worker 'id', calling the callback
+ * for each of its entries and queueing its subdirectories.
+ * A directory removed since it was queued is skipped.
+ * Returns zero, the non-zero value the callback returned,
+ * or error number.
+ */
+
+static int
+walk_dir(
+	struct walk		*wk,
+	int			id,
+	struct walk_dir		*wd)
+{
+	struct fsmem		*fsm = wk->wk_fsm;
+	struct minode		*mino;
+	struct udirentry	*ud;
+	struct udirentplus	*up;
+	struct dinode		*dips;
+	fs_u64_t		*inums, off = 0;
+	fs_u32_t		i, n;
+	char			*path, *cookie;
+	int			len, nlen, error = 0;
+
+	pthread_rwlock_rdlock(&fsm->fsm_nslock);
+	mino = iget(fsm, wd->wd_inum);
+	pthread_rwlock_unlock(&fsm->fsm_nslock);
+	if (mino == NULL) {
+		fprintf(stderr, "fswalk: Failed to read inode %llu for %s\n",
+			wd->wd_inum, wd->wd_path);
+		return EIO;
+	}
+	if (mino->mino_type != IFDIR) {
+		iput(mino);
+		return 0;
+	}
+	len = strlen(wd->wd_path);
+	ud = (struct udirentry *)malloc(WALK_BATCH * UDIRENTRY_LEN);
+	up = (struct udirentplus *)malloc(sizeof(struct udirentplus));
+	inums = (fs_u64_t *)malloc(WALK_BATCH * sizeof(fs_u64_t));
+	dips = (struct dinode *)malloc(WALK_BATCH * sizeof(struct dinode));
+	path = (char *)malloc(len + 1 + sizeof(ud->udir_name));
+	cookie = (char *)malloc(FSDIR_COOKIELEN);
+	if (ud == NULL || up == NULL || inums == NULL || dips == NULL ||
+	    path == NULL || cookie == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	memcpy(path, wd->wd_path, len);
+	path[len++] = '/';
+	cookie[0] = '\0';
+	for (;;) {
+		ILOCK_SHARED(mino);
+		error = (mino->mino_dirfmt == DIRFMT_BTREE) ?
+			dir_read_sorted(mino, "", cookie, ud, WALK_BATCH, &n) :
+			dir_read(mino, &off, ud, WALK_BATCH, &n);
+		IUNLOCK(mino);
+		if (error != 0) {
+			fprintf(stderr, "fswalk: Failed to read directory %s: "
+				"%s\n", wd->wd_path, strerror(error));
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			inums[i] = ud[i].udir_inum;
+		}
+		if ((error = iread_batch(fsm, inums, n, dips)) != 0) {
+			break;
+		}
+		for (i = 0; i < n && error == 0; i++) {
+			nlen = strlen(ud[i].udir_name);
+			memcpy(path + len, ud[i].udir_name, nlen + 1);
+			memcpy(up->udp_name, ud[i].udir_name, nlen + 1);
+			up->udp_inum = inums[i];
+			up->udp_size = dips[i].size;
+			up->udp_nblocks = dips[i].nblocks;
+			up->udp_type = (dips[i].type == IFDIR) ? FTYPE_DIR :
+				       (dips[i].type == IFREG) ? FTYPE_FILE : 0;
+			if ((error = wk->wk_cb(wk->wk_arg, path, up)) != 0) {
+				break;
+			}
+			if (dips[i].type == IFDIR) {
+				walk_prefetch(wk, &dips[i]);
+				error = walk_push(wk, id, inums[i], path,
+						  len + nlen);
+			}
+		}
+		if (error != 0 || wk->wk_stop) {
+			break;
+		}
+	}
+
+out:
+	iput(mino);
+	free(ud);
+	free(up);
+	free(inums);
+	free(dips);
+	free(path);
+	free(cookie);
+	return error;
+}
+
+/*
+ * Worker thread: read directories until there are none left
+ * queued or being read, or the walk is stopped.
+ */
+
+static void *
+walk_worker(
+	void			*arg)
+{
+	struct walk_worker	*ww = (struct walk_worker *)arg;
+	struct walk		*wk = ww->ww_walk;
+	struct walk_dir		*wd;
+	int			error;
+
+	for (;;) {
+
+		/*
+		 * With nothing to take, look again with wk_lock held,
+		 * so that a directory queued from now on wakes us up,
+		 * and wait unless the walk is over.
+		 */
+
+		if ((wd = walk_next(wk, ww->ww_id)) == NULL) {
+			pthread_mutex_lock(&wk->wk_lock);
+			__atomic_add_fetch(&wk->wk_nidle, 1, __ATOMIC_SEQ_CST);
+			while ((wd = walk_next(wk, ww->ww_id)) == NULL &&
+			       __atomic_load_n(&wk->wk_pending,
+					       __ATOMIC_SEQ_CST) > 0 &&
+			       !wk->wk_stop) {
+				pthread_cond_wait(&wk->wk_cv, &wk->wk_lock);
+			}
+			__atomic_sub_fetch(&wk->wk_nidle, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&wk->wk_lock);
+			if (wd == NULL) {
+				break;
+			}
+		}
+		error = wk->wk_stop ? 0 : walk_dir(wk, ww->ww_id, wd);
+		free(wd);
+		if (error != 0) {
+			walk_stop(wk, error);
+		}
+		if (__atomic_sub_fetch(&wk->wk_pending, 1,
+				       __ATOMIC_SEQ_CST) == 0) {
+			pthread_mutex_lock(&wk->wk_lock);
+			pthread_cond_broadcast(&wk->wk_cv);
+			pthread_mutex_unlock(&wk->wk_lock);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Walk the tree under directory 'root' with 'nthreads' threads,
+ * calling 'cb' with (arg, path, entry) for every entry of every
+ * directory of the tree (but not for 'root' itself), 'entry'
+ * being the struct udirentplus of the entry as fsread_dirplus()
+ * returns it and 'path' its path. The callback is called from
+ * the threads of the walk, concurrently, in no particular order
+ * but for a directory always being passed to it before its
+ * entries are; 'path' and 'entry' are only valid during the
+ * call. If it returns non-zero, the walk stops.
+ * Entries created or removed in the tree while it's walked may
+ * or may not be passed to the callback.
+ * Returns zero, the non-zero value the callback returned, or
+ * error number.
+ */
+
+int
+fswalk(
+	void			*vfsh,
+	char			*root,
+	fswalk_cb_t		cb,
+	void			*arg,
+	int			nthreads)
+{
+	struct fs_handle	*fsh = (struct fs_handle *)vfsh;
+	struct file_handle	*fh;
+	struct walk		wk;
+	struct walk_worker	*ww = NULL;
+	struct walk_dir		*wd;
+	pthread_t		*threads = NULL;
+	fs_u64_t		inum;
+	int			i, len, nstarted = 0, error = 0;
+
+	if (fsh == NULL || root == NULL || cb == NULL || nthreads <= 0) {
+		return EINVAL;
+	}
+	if ((fh = (struct file_handle *)fsopen(fsh, root, 0)) == NULL) {
+		return errno ? errno : ENOENT;
+	}
+	inum = fh->fh_inode->mino_number;
+	if (fh->fh_inode->mino_type != IFDIR) {
+		fsclose(fh);
+		return ENOTDIR;
+	}
+	fsclose(fh);
+	memset(&wk, 0, sizeof(wk));
+	wk.wk_fsm = fsh->fsh_mem;
+	wk.wk_cb = cb;
+	wk.wk_arg = arg;
+	pthread_mutex_init(&wk.wk_lock, NULL);
+	pthread_cond_init(&wk.wk_cv, NULL);
+	wk.wk_queues = (struct walk_queue *)calloc(nthreads,
+						   sizeof(struct walk_queue));
+	ww = (struct walk_worker *)malloc(nthreads *
+					  sizeof(struct walk_worker));
+	threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+	if (wk.wk_queues == NULL || ww == NULL || threads == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&wk.wk_queues[i].wq_lock, NULL);
+		wk.wk_queues[i].wq_size = 16;
+		wk.wk_queues[i].wq_dirs = (struct walk_dir **)malloc(16 *
+			sizeof(struct walk_dir *));
+		wk.wk_nqueues++;
+		if (wk.wk_queues[i].wq_dirs == NULL) {
+			error = ENOMEM;
+			goto out;
+		}
+	}
+
+	/*
+	 * The paths of the entries are made from 'root'
+	 * without its trailing slashes.
+	 */
+
+	for (len = strlen(root); len > 0 && root[len - 1] == '/'; len--);
+	if ((error = walk_push(&wk, 0, inum, root, len)) != 0) {
+		goto out;
+	}
+	for (i = 0; i < nthreads; i++) {
+		ww[i].ww_walk = &wk;
+		ww[i].ww_id = i;
+		if ((error = pthread_create(&threads[i], NULL, walk_worker,
+					    &ww[i])) != 0) {
+			fprintf(stderr, "fswalk: Failed to start worker "
+				"thread: %s\n", strerror(error));
+			break;
+		}
+	}
+	nstarted = i;
+	if (nstarted == 0) {
+		goto out;
+	}
+
+	/*
+	 * The queue of a worker which didn't start is still
+	 * stolen from by the others.
+	 */
+
+	for (i = 0; i < nstarted; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	error = wk.wk_result;
+
+out:
+	for (i = 0; i < wk.wk_nqueues; i++) {
+		while ((wd = walk_take(&wk, i, 1)) != NULL) {
+			free(wd);
+		}
+		free(wk.wk_queues[i].wq_dirs);
+		pthread_mutex_destroy(&wk.wk_queues[i].wq_lock);
+	}
+	pthread_cond_destroy(&wk.wk_cv);
+	pthread_mutex_destroy(&wk.wk_lock);
+	free(wk.wk_queues);
+	free(ww);
+	free(threads);
+	return error;
+}
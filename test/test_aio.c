@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write a file, then keep up to 'depth' random 4K reads
+ * outstanding through an aio context, every other one with a
+ * completion callback and the rest reaped from the completion
+ * queue, verifying the data of each. Then overwrite random
+ * blocks of the file with asynchronous writes and verify the
+ * file.
+ */
+
+#define FILESZ		(8 << 20)
+#define IOSZ		4096
+#define NREQS		4000
+
+static char		data[FILESZ];
+static int		ncb, ncbbad, nbad;
+static pthread_mutex_t	cblock = PTHREAD_MUTEX_INITIALIZER;
+
+struct rd {
+	char			buf[IOSZ];
+	unsigned long long	off;
+};
+
+static int
+check(
+	struct rd		*rd,
+	int			result,
+	int			error)
+{
+	if (error || result != IOSZ ||
+	    memcmp(rd->buf, data + rd->off, IOSZ) != 0) {
+		fprintf(stderr, "Bad read at %llu: result %d error %d\n",
+			rd->off, result, error);
+		return 1;
+	}
+	return 0;
+}
+
+static void
+read_done(
+	void			*req,
+	void			*arg,
+	int			result,
+	int			error)
+{
+	int			bad = check((struct rd *)arg, result, error);
+
+	free(arg);
+	pthread_mutex_lock(&cblock);
+	ncb++;
+	ncbbad += bad;
+	pthread_mutex_unlock(&cblock);
+}
+
+/*
+ * Reap at least 'min' completions, checking the reads.
+ */
+
+static int
+reap(
+	FSHANDLE		ctx,
+	int			min,
+	int			isread)
+{
+	struct fsaio_event	ev[64];
+	int			i, n;
+
+	n = fsaio_getevents(ctx, ev, min, 64);
+	for (i = 0; i < n; i++) {
+		if (isread) {
+			nbad += check((struct rd *)ev[i].ev_arg,
+				      ev[i].ev_result, ev[i].ev_error);
+			free(ev[i].ev_arg);
+		} else if (ev[i].ev_error || ev[i].ev_result != IOSZ) {
+			nbad++;
+		}
+	}
+	return n;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct timespec		t0, t1;
+	struct file_handle      *fh = NULL;
+	FSHANDLE                fsh = NULL, ctx;
+	static char		rbuf[FILESZ];
+	struct rd		*rd;
+	unsigned long long	off;
+	int			depth, i, nq = 0, nreaped = 0;
+	double			secs;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path> <depth>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	depth = atoi(argv[4]);
+	for (i = 0; i < FILESZ; i++) {
+		data[i] = (char)(i * 11 + i / 4096);
+	}
+	fh = fscreate(fsh, argv[3], FTYPE_FILE);
+	if (fh == NULL || fswrite(fh, data, FILESZ) != FILESZ) {
+		fprintf(stderr, "Failed to create file %s\n", argv[3]);
+		return 1;
+	}
+	if ((ctx = fsaio_create(fsh, depth, 4)) == NULL) {
+		fprintf(stderr, "Failed to create aio context\n");
+		return 1;
+	}
+
+	srand(depth);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < NREQS; ) {
+		rd = (struct rd *)malloc(sizeof(struct rd));
+		rd->off = (unsigned long long)(rand() % (FILESZ - IOSZ));
+		if (fsread_async(ctx, fh, rd->buf, IOSZ, rd->off,
+				 (i & 1) ? read_done : NULL, rd) == NULL) {
+			free(rd);
+			nreaped += reap(ctx, nq - nreaped ? 1 : 0, 1);
+			continue;
+		}
+		nq += !(i & 1);
+		i++;
+	}
+	while (nreaped < nq) {
+		nreaped += reap(ctx, 1, 1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	/*
+	 * Non-overlapping overwrites of random blocks.
+	 */
+
+	nq = nreaped = 0;
+	for (off = 0; off < FILESZ; off += IOSZ) {
+		if (rand() % 4) {
+			continue;
+		}
+		for (i = 0; i < IOSZ; i++) {
+			data[off + i] = (char)~data[off + i];
+		}
+		while (fswrite_async(ctx, fh, data + off, IOSZ, off, NULL,
+				     NULL) == NULL) {
+			nreaped += reap(ctx, 1, 0);
+		}
+		nq++;
+	}
+	while (nreaped < nq) {
+		nreaped += reap(ctx, 1, 0);
+	}
+	fsaio_destroy(ctx);
+	if (ncb != NREQS / 2 || ncbbad + nbad != 0) {
+		fprintf(stderr, "%d callbacks, %d bad completions\n", ncb,
+			ncbbad + nbad);
+		return 1;
+	}
+	fsclose(fh);
+	fh = fsopen(fsh, argv[3], 0);
+	if (fh == NULL || fsread(fh, rbuf, FILESZ) != FILESZ ||
+	    memcmp(rbuf, data, FILESZ) != 0) {
+		fprintf(stderr, "Data mismatch in %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	printf("%d reads at depth %d: %.0f reads/s; %d writes; file %s"
+		" verified\n", NREQS, depth, NREQS / secs, nq, argv[3]);
+
+	return 0;
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write two files of 'mbytes' MB each in interleaved chunks,
+ * so that each has an extent per chunk, then read each one
+ * with a single fsread(), which submits all of its extents as
+ * one batch (through io_uring where available, in pieces of
+ * the ring size), from 'nthreads' threads at once, each with
+ * its own ring. Verify the data and print the number of read
+ * system calls a whole file read took.
+ */
+
+#define CHUNKSZ		(1 << 16)
+
+struct reader {
+	FSHANDLE		r_fsh;
+	char			*r_path;
+	int			r_k;
+	int			r_nchunks;
+	int			r_error;
+};
+
+static char
+data_byte(
+	int			k,
+	fs_u64_t		off)
+{
+	return (char)(k * 41 + off + off / CHUNKSZ);
+}
+
+/*
+ * Number of read system calls done by the process so far.
+ */
+
+static long long
+read_calls(void)
+{
+	FILE			*fp;
+	char			line[128];
+	long long		n = -1;
+
+	if ((fp = fopen("/proc/self/io", "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "syscr: %lld", &n) == 1) {
+			break;
+		}
+	}
+	fclose(fp);
+	return n;
+}
+
+static int
+read_file(
+	FSHANDLE		fsh,
+	char			*path,
+	int			k,
+	int			nchunks)
+{
+	FHANDLE			fh;
+	char			*buf;
+	fs_u64_t		i, size = (fs_u64_t)nchunks * CHUNKSZ;
+	int			error = 0;
+
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return 1;
+	}
+	buf = (char *)malloc(size);
+	if (fsread(fh, buf, size) != (int)size) {
+		fprintf(stderr, "Short read of %s\n", path);
+		error = 1;
+	}
+	for (i = 0; i < size && !error; i++) {
+		if (buf[i] != data_byte(k, i)) {
+			fprintf(stderr, "Data mismatch in %s at %llu\n", path,
+				i);
+			error = 1;
+		}
+	}
+	free(buf);
+	fsclose(fh);
+	return error;
+}
+
+static void *
+reader(
+	void			*arg)
+{
+	struct reader		*r = (struct reader *)arg;
+
+	r->r_error = read_file(r->r_fsh, r->r_path, r->r_k, r->r_nchunks);
+	return NULL;
+}
+
+int
+main(
+	int			argc,
+	char			*argv[])
+{
+	FSHANDLE		fsh;
+	FHANDLE			fh[2];
+	struct reader		*r;
+	pthread_t		*tids;
+	struct file_extent	ext[4];
+	char			*buf;
+	long long		calls;
+	int			i, j, k, n, nchunks, nthreads, error = 0;
+
+	if (argc != 7) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt> <path1>"
+			" <path2> <MB per file> <threads>\n", argv[0]);
+		return 1;
+	}
+	nchunks = atoi(argv[5]) * ((1 << 20) / CHUNKSZ);
+	nthreads = atoi(argv[6]);
+	if (nchunks <= 0 || nthreads <= 0) {
+		fprintf(stderr, "Bad file size or number of threads\n");
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to mount file system\n");
+		return 1;
+	}
+	printf("FS mounted successfully\n");
+	for (k = 0; k < 2; k++) {
+		if ((fh[k] = fscreate(fsh, argv[3 + k], FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", argv[3 + k]);
+			return 1;
+		}
+	}
+	buf = (char *)malloc(CHUNKSZ);
+	for (i = 0; i < nchunks; i++) {
+		for (k = 0; k < 2; k++) {
+			for (j = 0; j < CHUNKSZ; j++) {
+				buf[j] = data_byte(k,
+						   (fs_u64_t)i * CHUNKSZ + j);
+			}
+			if (fswrite(fh[k], buf, CHUNKSZ) != CHUNKSZ) {
+				fprintf(stderr, "Failed to write %s\n",
+					argv[3 + k]);
+				return 1;
+			}
+		}
+	}
+	free(buf);
+	n = fsmap(fh[0], 0, ~0ULL, ext, 4);
+	fsclose(fh[0]);
+	fsclose(fh[1]);
+	if (n < 2) {
+		fprintf(stderr, "%s isn't fragmented\n", argv[3]);
+		return 1;
+	}
+
+	calls = read_calls();
+	if (read_file(fsh, argv[3], 0, nchunks) != 0) {
+		return 1;
+	}
+	if (calls >= 0) {
+		printf("Read %d extents with %lld read system call(s)\n",
+		       nchunks, read_calls() - calls);
+	}
+
+	r = (struct reader *)calloc(nthreads, sizeof(struct reader));
+	tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	for (i = 0; i < nthreads; i++) {
+		r[i].r_fsh = fsh;
+		r[i].r_k = i % 2;
+		r[i].r_path = argv[3 + r[i].r_k];
+		r[i].r_nchunks = nchunks;
+		pthread_create(&tids[i], NULL, reader, &r[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		error |= r[i].r_error;
+	}
+	free(r);
+	free(tids);
+	if (error) {
+		return 1;
+	}
+	printf("%d threads read the files in batches\n", nthreads);
+	fsumount(fsh);
+
+	return 0;
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+#include "crc32c.h"
+
+/*
+ * Check the CRC32C implementation in use against the table
+ * driven one and print the speed of both. Then write a file,
+ * print the streaming read throughput (from the host page
+ * cache) with and without checksum verification, corrupt a
+ * byte of one of its blocks in the device file and check that
+ * reading the file, copying it out with fscopy_to_fd() and
+ * scrubbing the file system catch it, that fsmap(), which
+ * doesn't read the data, still maps it, and that rewriting
+ * the block repairs it.
+ */
+
+#define IOSZ		(1 << 18)
+#define NPASSES		8
+#define CRCBUFSZ	(1 << 20)
+
+static char		*data, *rbuf;
+static unsigned int	size;
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+check_crc(void)
+{
+	char			*buf;
+	unsigned int		i, len, off;
+	double			t, hw, sw;
+
+	if (crc32c(0, "123456789", 9) != 0xe3069283) {
+		fprintf(stderr, "Bad CRC32C of the check string\n");
+		return 1;
+	}
+	buf = (char *)malloc(CRCBUFSZ);
+	for (i = 0; i < CRCBUFSZ; i++) {
+		buf[i] = (char)rand();
+	}
+	for (len = 0; len < 5000; len += 1 + len / 8) {
+		off = rand() % 64;
+		if (crc32c(len, buf + off, len) !=
+		    crc32c_sw(len, buf + off, len)) {
+			fprintf(stderr, "CRC32C mismatch at length %u\n", len);
+			return 1;
+		}
+	}
+	t = now();
+	for (i = 0; i < 256; i++) {
+		buf[i] = (char)crc32c(0, buf, CRCBUFSZ);
+	}
+	hw = 256.0 * CRCBUFSZ / (now() - t) / 1e9;
+	t = now();
+	for (i = 0; i < 16; i++) {
+		buf[i] = (char)crc32c_sw(0, buf, CRCBUFSZ);
+	}
+	sw = 16.0 * CRCBUFSZ / (now() - t) / 1e9;
+	printf("crc32c: %s %.2f GB/s, table %.2f GB/s\n", crc32c_impl(), hw,
+		sw);
+	free(buf);
+	return 0;
+}
+
+/*
+ * Read the file through NPASSES times and return the
+ * throughput in MB/s, or a negative value if the data
+ * isn't right.
+ */
+
+static double
+read_file(
+	FSHANDLE		fsh,
+	char			*path)
+{
+	FHANDLE			fh;
+	unsigned int		off;
+	double			t;
+	int			i, n;
+
+	t = now();
+	for (i = 0; i < NPASSES; i++) {
+		if ((fh = fsopen(fsh, path, 0)) == NULL) {
+			fprintf(stderr, "Failed to open file %s\n", path);
+			return -1;
+		}
+		for (off = 0; off < size; off += n) {
+			n = fsread(fh, rbuf, MIN(IOSZ, size - off));
+			if (n <= 0 || memcmp(rbuf, data + off, n) != 0) {
+				fsclose(fh);
+				return -1;
+			}
+		}
+		fsclose(fh);
+	}
+	return (double)NPASSES * size / (now() - t) / 1e6;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct fsscrub_result	res;
+	struct file_extent	ext;
+	struct iovec		iov;
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	unsigned long long	target, phys;
+	unsigned int		i, off;
+	double			on, off_;
+	char			c;
+	int			fd, n;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path> <size in MB>\n", argv[0]);
+		return 1;
+	}
+	if (check_crc() != 0) {
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	size = atoi(argv[4]) << 20;
+	data = (char *)malloc(size);
+	rbuf = (char *)malloc(IOSZ);
+	for (i = 0; i < size; i++) {
+		data[i] = (char)(i * 13 + i / 1024);
+	}
+	fh = fscreate(fsh, argv[3], FTYPE_FILE);
+	for (off = 0; fh && off < size; off += n) {
+		if ((n = fswrite(fh, data + off, MIN(IOSZ, size - off))) <= 0) {
+			break;
+		}
+	}
+	if (fh == NULL || off != size || fsclose(fh) != 0) {
+		fprintf(stderr, "Failed to write file %s\n", argv[3]);
+		return 1;
+	}
+
+	/*
+	 * Streaming reads with and without verification.
+	 */
+
+	(void) read_file(fsh, argv[3]);
+	if ((on = read_file(fsh, argv[3])) < 0) {
+		fprintf(stderr, "Data mismatch in %s\n", argv[3]);
+		return 1;
+	}
+	fsumount(fsh);
+	if ((fsh = fsmount_opts(argv[1], argv[2], FSMNT_NOVERIFY)) == NULL ||
+	    (off_ = read_file(fsh, argv[3])) < 0) {
+		fprintf(stderr, "Failed to read %s without verification\n",
+			argv[3]);
+		return 1;
+	}
+	printf("streaming read: verified %.1f MB/s, unverified %.1f MB/s, "
+		"overhead %.1f%%\n", on, off_, (off_ / on - 1) * 100);
+
+	/*
+	 * Flip a byte in the middle of the file behind the
+	 * file system's back.
+	 */
+
+	target = size / 2 + 100;
+	fh = fsopen(fsh, argv[3], 0);
+	if (fh == NULL || fsmap(fh, target, 1, &ext, 1) != 1) {
+		fprintf(stderr, "Failed to map %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	phys = ext.fext_physical + (target - ext.fext_logical);
+	fsumount(fsh);
+	if ((fd = open(argv[1], O_RDWR)) < 0 ||
+	    pread(fd, &c, 1, phys) != 1 || (c = ~c, 0) ||
+	    pwrite(fd, &c, 1, phys) != 1) {
+		fprintf(stderr, "Failed to corrupt %s\n", argv[1]);
+		return 1;
+	}
+	close(fd);
+
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	fh = fsopen(fsh, argv[3], 0);
+	iov.iov_base = rbuf;
+	iov.iov_len = IOSZ;
+	errno = 0;
+	if (fh == NULL || fspreadv(fh, &iov, 1, size / 2) == IOSZ) {
+		fprintf(stderr, "Corrupt block of %s was read\n", argv[3]);
+		return 1;
+	}
+	printf("corrupt read failed: %s\n", strerror(errno));
+	if ((fd = open("/dev/null", O_WRONLY)) < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+	errno = 0;
+	if (fscopy_to_fd(fh, 0, size, fd) == size || errno != EIO) {
+		fprintf(stderr, "Corrupt block of %s was copied out\n",
+			argv[3]);
+		return 1;
+	}
+	close(fd);
+	if (fsmap(fh, target, 1, &ext, 1) != 1 ||
+	    ext.fext_physical + (target - ext.fext_logical) != phys) {
+		fprintf(stderr, "Failed to map %s\n", argv[3]);
+		return 1;
+	}
+	n = fsscrub(fsh, 4, &res);
+	printf("scrub: %llu checked, %llu skipped, %llu bad, first %llu\n",
+		res.sr_checked, res.sr_skipped, res.sr_bad, res.sr_firstbad);
+	if (n != EIO || res.sr_bad != 1 || res.sr_firstbad != phys >> 10) {
+		fprintf(stderr, "Scrub didn't find block %llu: %d\n",
+			phys >> 10, n);
+		return 1;
+	}
+
+	/*
+	 * Rewriting part of the block, including the bad
+	 * byte, repairs it.
+	 */
+
+	iov.iov_base = data + target - 50;
+	iov.iov_len = 300;
+	if (fspwritev(fh, &iov, 1, target - 50) != 300) {
+		fprintf(stderr, "Failed to rewrite %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	if (read_file(fsh, argv[3]) < 0 || (n = fsscrub(fsh, 4, &res)) != 0 ||
+	    res.sr_bad != 0) {
+		fprintf(stderr, "%s wasn't repaired: %d\n", argv[3], n);
+		return 1;
+	}
+	printf("File %s verified, %llu blocks scrubbed\n", argv[3],
+		res.sr_checked);
+	fsumount(fsh);
+
+	return 0;
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write a file with many extents, clone it twice (the second
+ * time from the clone) and check that the clones share the
+ * blocks of the file. Then overwrite ranges of all three files,
+ * starting and ending in the middle of blocks, and verify that
+ * each file only sees its own writes, also after remounting.
+ */
+
+#define NCHUNKS		30
+#define CHUNKSZ		70000
+#define FILESZ		(NCHUNKS * CHUNKSZ)
+#define NFILES		3
+
+static char	data[NFILES][FILESZ];
+
+static int
+verify(
+	FSHANDLE		fsh,
+	char			*path,
+	int			k)
+{
+	static char		rbuf[FILESZ];
+	FHANDLE			fh;
+	int			n;
+
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", path);
+		return 1;
+	}
+	n = fsread(fh, rbuf, FILESZ);
+	fsclose(fh);
+	if (n != FILESZ || memcmp(rbuf, data[k], FILESZ) != 0) {
+		fprintf(stderr, "Data mismatch in %s (read %d)\n", path, n);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Overwrite 'len' bytes at 'off' of file 'k'.
+ */
+
+static int
+overwrite(
+	FSHANDLE		fsh,
+	char			*path,
+	int			k,
+	unsigned long long	off,
+	int			len)
+{
+	struct iovec		iov;
+	FHANDLE			fh;
+	int			i, n;
+
+	for (i = 0; i < len; i++) {
+		data[k][off + i] = (char)(data[k][off + i] + k + 1);
+	}
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", path);
+		return 1;
+	}
+	iov.iov_base = data[k] + off;
+	iov.iov_len = len;
+	n = fspwritev(fh, &iov, 1, off);
+	fsclose(fh);
+	if (n != len) {
+		fprintf(stderr, "Failed to write %s at %llu\n", path, off);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+shared_blocks(
+	FSHANDLE		fsh,
+	char			*p1,
+	char			*p2)
+{
+	static struct file_extent	e1[256], e2[256];
+	FHANDLE			fh;
+	int			n1, n2, i, j, nshared = 0;
+
+	fh = fsopen(fsh, p1, 0);
+	n1 = fsmap(fh, 0, FILESZ, e1, 256);
+	fsclose(fh);
+	fh = fsopen(fsh, p2, 0);
+	n2 = fsmap(fh, 0, FILESZ, e2, 256);
+	fsclose(fh);
+	for (i = 0; i < n1; i++) {
+		for (j = 0; j < n2; j++) {
+			if (e1[i].fext_logical == e2[j].fext_logical &&
+			    e1[i].fext_physical == e2[j].fext_physical) {
+				nshared++;
+			}
+		}
+	}
+	printf("%s: %d extent(s), %s: %d extent(s), %d shared\n", p1, n1,
+		p2, n2, nshared);
+	return nshared;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh[2];
+	char			*path[NFILES], other[256];
+	int			i, k, n;
+
+	if (argc != 6) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path> <clone1> <clone2>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	for (k = 0; k < NFILES; k++) {
+		path[k] = argv[3 + k];
+	}
+	for (i = 0; i < FILESZ; i++) {
+		data[0][i] = (char)(i * 7 + i / 1000);
+	}
+
+	/*
+	 * Interleave the writes with another file so that
+	 * the file gets an extent per chunk.
+	 */
+
+	snprintf(other, sizeof(other), "%s.other", path[0]);
+	fh[0] = fscreate(fsh, path[0], FTYPE_FILE);
+	fh[1] = fscreate(fsh, other, FTYPE_FILE);
+	if (fh[0] == NULL || fh[1] == NULL) {
+		fprintf(stderr, "Failed to create files\n");
+		return 1;
+	}
+	for (i = 0; i < NCHUNKS; i++) {
+		if (fswrite(fh[0], data[0] + i * CHUNKSZ, CHUNKSZ) != CHUNKSZ ||
+		    fswrite(fh[1], data[0], CHUNKSZ) != CHUNKSZ) {
+			fprintf(stderr, "Failed to write chunk %d\n", i);
+			return 1;
+		}
+	}
+	fsclose(fh[0]);
+	fsclose(fh[1]);
+
+	if ((n = fsclone(fsh, path[0], path[1])) != 0 ||
+	    (n = fsclone(fsh, path[1], path[2])) != 0) {
+		fprintf(stderr, "fsclone failed: %d\n", n);
+		return 1;
+	}
+	memcpy(data[1], data[0], FILESZ);
+	memcpy(data[2], data[0], FILESZ);
+	if (shared_blocks(fsh, path[0], path[1]) == 0 ||
+	    shared_blocks(fsh, path[0], path[2]) == 0) {
+		fprintf(stderr, "Clones don't share blocks\n");
+		return 1;
+	}
+	for (k = 0; k < NFILES; k++) {
+		if (verify(fsh, path[k], k) != 0) {
+			return 1;
+		}
+	}
+
+	/*
+	 * Overlapping overwrites in all three files, partial
+	 * blocks at both ends and across extents.
+	 */
+
+	if (overwrite(fsh, path[1], 1, 1000, 5000) != 0 ||
+	    overwrite(fsh, path[0], 0, 3000, 100) != 0 ||
+	    overwrite(fsh, path[2], 2, 69000, 300017) != 0 ||
+	    overwrite(fsh, path[0], 0, 200000, 1024 * 100) != 0 ||
+	    overwrite(fsh, path[1], 1, FILESZ - 777, 777) != 0) {
+		return 1;
+	}
+	for (k = 0; k < NFILES; k++) {
+		if (verify(fsh, path[k], k) != 0) {
+			return 1;
+		}
+	}
+	shared_blocks(fsh, path[0], path[1]);
+
+	/*
+	 * The refcounts must survive a remount.
+	 */
+
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (overwrite(fsh, path[2], 2, 500000, 4096) != 0 ||
+	    overwrite(fsh, path[0], 0, 500001, 10) != 0) {
+		return 1;
+	}
+	for (k = 0; k < NFILES; k++) {
+		if (verify(fsh, path[k], k) != 0) {
+			return 1;
+		}
+	}
+	printf("Files %s, %s and %s verified\n", path[0], path[1], path[2]);
+	fsumount(fsh);
+
+	return 0;
+}
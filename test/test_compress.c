@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write the same JSON log data to a file per codec and level,
+ * then read it back with the device file dropped from the host
+ * page cache, printing the write and read throughput and the
+ * compression ratio of each.
+ * Then check overwrites in the middle of compressed clusters,
+ * incompressible data, a clone of a compressed file, repeated
+ * rewrites of a cluster, which must reuse the slots they free,
+ * and a mount compressing all new files, verifying the data at
+ * each step and after remounting.
+ */
+
+#define IOSZ		(1 << 18)
+
+struct codec {
+	char		*name;
+	int		codec;
+	int		level;
+};
+
+static struct codec	codecs[] = {
+	{"none", FSCMP_NONE, 0},
+	{"lz-1", FSCMP_LZ, 1},
+	{"lz-4", FSCMP_LZ, 4},
+	{"lz-9", FSCMP_LZ, 9},
+};
+
+#define NCODECS		(sizeof(codecs) / sizeof(codecs[0]))
+
+static char		*data, *rbuf;
+static unsigned int	size;
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+gen_json(
+	char			*buf,
+	unsigned int		len)
+{
+	static char		*levels[] = {"INFO", "INFO", "WARN", "DEBUG"};
+	char			line[256];
+	unsigned int		off = 0, n;
+	unsigned long long	ts = 1700000000000ULL;
+
+	srand(1);
+	while (off < len) {
+		ts += rand() % 50;
+		n = snprintf(line, sizeof(line), "{\"ts\":%llu,\"level\":\"%s\","
+			"\"svc\":\"api-%d\",\"req\":\"%08x\",\"path\":"
+			"\"/v1/items/%d\",\"status\":%d,\"ms\":%d}\n", ts,
+			levels[rand() % 4], rand() % 8, rand(),
+			rand() % 100000, (rand() % 10) ? 200 : 404,
+			rand() % 300);
+		n = MIN(n, len - off);
+		memcpy(buf + off, line, n);
+		off += n;
+	}
+}
+
+static void
+drop_cache(
+	char			*dev)
+{
+	int			fd;
+
+	if ((fd = open(dev, O_RDONLY)) >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/*
+ * Bytes of the device file holding the data of the file.
+ */
+
+static unsigned long long
+stored(
+	FHANDLE			fh)
+{
+	struct file_extent	ext[64];
+	unsigned long long	off = 0, total = 0;
+	int			i, n;
+
+	while ((n = fsmap(fh, off, ~0ULL >> 1, ext, 64)) > 0) {
+		for (i = 0; i < n; i++) {
+			total += ext[i].fext_len;
+		}
+		off = ext[n - 1].fext_logical + ext[n - 1].fext_len;
+	}
+	return total;
+}
+
+/*
+ * Rewrite cluster 1 of 'path' 'n' times, alternately with
+ * incompressible and compressible data, and check that the
+ * stream doesn't grow beyond 'maxend'.
+ */
+
+static int
+rewrite(
+	FSHANDLE		fsh,
+	char			*path,
+	char			*expect,
+	char			*rnd,
+	int			n,
+	unsigned long long	maxend)
+{
+	FHANDLE			fh;
+	struct iovec		iov;
+	unsigned long long	end;
+	int			i;
+
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", path);
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		iov.iov_base = (i & 1) ? rnd : data;
+		iov.iov_len = CLUSTER_SIZE;
+		memcpy(expect + CLUSTER_SIZE, iov.iov_base, CLUSTER_SIZE);
+		if (fspwritev(fh, &iov, 1, CLUSTER_SIZE) != CLUSTER_SIZE) {
+			fprintf(stderr, "Failed to rewrite %s\n", path);
+			fsclose(fh);
+			return 1;
+		}
+	}
+	end = ((struct file_handle *)fh)->fh_inode->mino_streamend;
+	fsclose(fh);
+	if (end > maxend) {
+		fprintf(stderr, "Stream of %s grew to %llu bytes\n", path,
+			end);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+verify(
+	FSHANDLE		fsh,
+	char			*path,
+	char			*expect,
+	unsigned int		len)
+{
+	FHANDLE			fh;
+	unsigned int		off;
+	int			n;
+
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", path);
+		return 1;
+	}
+	for (off = 0; off < len; off += n) {
+		n = fsread(fh, rbuf, MIN(IOSZ, len - off));
+		if (n <= 0 || memcmp(rbuf, expect + off, n) != 0) {
+			fprintf(stderr, "Data mismatch in %s at %u\n", path,
+				off);
+			fsclose(fh);
+			return 1;
+		}
+	}
+	if (fsread(fh, rbuf, 1) != 0) {
+		fprintf(stderr, "%s is longer than %u\n", path, len);
+		fsclose(fh);
+		return 1;
+	}
+	fsclose(fh);
+	return 0;
+}
+
+static FHANDLE
+write_file(
+	FSHANDLE		fsh,
+	char			*path,
+	char			*buf,
+	unsigned int		len,
+	int			codec,
+	int			level)
+{
+	FHANDLE			fh;
+	unsigned int		off, n;
+
+	if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+		fprintf(stderr, "Failed to create file %s\n", path);
+		return NULL;
+	}
+	if (codec >= 0 && fssetcompress(fh, codec, level) != 0) {
+		fprintf(stderr, "Failed to set compression of %s\n", path);
+		return NULL;
+	}
+	for (off = 0; off < len; off += n) {
+		n = MIN(IOSZ, len - off);
+		if (fswrite(fh, buf + off, n) != (int)n) {
+			fprintf(stderr, "Failed to write %s at %u\n", path,
+				off);
+			return NULL;
+		}
+	}
+	return fh;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct iovec		iov;
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	char			path[256], path2[256], *rnd, *rbuf2;
+	unsigned long long	phys;
+	double			t, wsecs, rsecs;
+	unsigned int		i, off;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path prefix> <size in MB>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	size = atoi(argv[4]) << 20;
+	data = (char *)malloc(size);
+	rbuf = (char *)malloc(IOSZ);
+	gen_json(data, size);
+
+	for (i = 0; i < NCODECS; i++) {
+		snprintf(path, sizeof(path), "%s.%s", argv[3], codecs[i].name);
+		t = now();
+		fh = write_file(fsh, path, data, size, codecs[i].codec,
+				codecs[i].level);
+		if (fh == NULL || fsclose(fh) != 0 || fssync(fsh) != 0) {
+			return 1;
+		}
+		wsecs = now() - t;
+		drop_cache(argv[1]);
+		t = now();
+		if (verify(fsh, path, data, size) != 0) {
+			return 1;
+		}
+		rsecs = now() - t;
+		fh = fsopen(fsh, path, 0);
+		phys = stored(fh);
+		fsclose(fh);
+		printf("%-5s: write %7.1f MB/s, read %7.1f MB/s, %u -> %llu "
+			"bytes, ratio %.2f\n", codecs[i].name,
+			size / wsecs / 1e6, size / rsecs / 1e6, size, phys,
+			(double)size / phys);
+	}
+
+	/*
+	 * Overwrites within and across clusters of a compressed
+	 * file, which grow some clusters out of their slots.
+	 */
+
+	snprintf(path, sizeof(path), "%s.lz-1", argv[3]);
+	rnd = (char *)malloc(3 * CLUSTER_SIZE);
+	for (i = 0; i < 3 * CLUSTER_SIZE; i++) {
+		rnd[i] = (char)rand();
+	}
+	fh = fsopen(fsh, path, 0);
+	for (off = 1000; off + 100000 < size; off += 777777) {
+		memcpy(data + off, rnd, 100000);
+		iov.iov_base = rnd;
+		iov.iov_len = 100000;
+		if (fh == NULL || fspwritev(fh, &iov, 1, off) != 100000) {
+			fprintf(stderr, "Failed to overwrite %s at %u\n", path,
+				off);
+			return 1;
+		}
+	}
+	fsclose(fh);
+	if (verify(fsh, path, data, size) != 0) {
+		return 1;
+	}
+
+	/*
+	 * Incompressible data is stored as is.
+	 */
+
+	snprintf(path2, sizeof(path2), "%s.random", argv[3]);
+	fh = write_file(fsh, path2, rnd, 3 * CLUSTER_SIZE - 5, FSCMP_LZ, 9);
+	if (fh == NULL || fsclose(fh) != 0 ||
+	    verify(fsh, path2, rnd, 3 * CLUSTER_SIZE - 5) != 0) {
+		return 1;
+	}
+
+	/*
+	 * A clone shares the compressed blocks and either
+	 * file can then be changed on its own.
+	 */
+
+	snprintf(path2, sizeof(path2), "%s.clone", argv[3]);
+	if (fsclone(fsh, path, path2) != 0) {
+		fprintf(stderr, "Failed to clone %s\n", path);
+		return 1;
+	}
+	fh = fsopen(fsh, path2, 0);
+	iov.iov_base = rnd;
+	iov.iov_len = 5000;
+	if (fh == NULL || fspwritev(fh, &iov, 1, 70000) != 5000) {
+		fprintf(stderr, "Failed to write %s\n", path2);
+		return 1;
+	}
+	fsclose(fh);
+	if (verify(fsh, path, data, size) != 0) {
+		return 1;
+	}
+	memcpy(data + 70000, rnd, 5000);
+	if (verify(fsh, path2, data, size) != 0) {
+		return 1;
+	}
+
+	/*
+	 * A cluster rewritten over and over moves between
+	 * slots and leaves no garbage behind, also once the
+	 * free slots are found again after a remount.
+	 */
+
+	snprintf(path, sizeof(path), "%s.rewrite", argv[3]);
+	rbuf2 = (char *)malloc(4 * CLUSTER_SIZE);
+	memcpy(rbuf2, data, 4 * CLUSTER_SIZE);
+	fh = write_file(fsh, path, rbuf2, 4 * CLUSTER_SIZE, FSCMP_LZ, 1);
+	if (fh == NULL || fsclose(fh) != 0 ||
+	    rewrite(fsh, path, rbuf2, rnd, 50, 6 * CLUSTER_SIZE) != 0 ||
+	    fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL ||
+	    rewrite(fsh, path, rbuf2, rnd, 51, 6 * CLUSTER_SIZE) != 0 ||
+	    verify(fsh, path, rbuf2, 4 * CLUSTER_SIZE) != 0) {
+		return 1;
+	}
+	free(rbuf2);
+
+	/*
+	 * Every new file of a compressing mount is compressed,
+	 * and it all survives a remount.
+	 */
+
+	if (fsumount(fsh) != 0 ||
+	    (fsh = fsmount_opts(argv[1], argv[2], FSMNT_COMPRESS |
+				FSMNT_CLEVEL(3))) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	gen_json(data, size);
+	snprintf(path, sizeof(path), "%s.mount", argv[3]);
+	fh = write_file(fsh, path, data, size, -1, 0);
+	if (fh == NULL || fsclose(fh) != 0) {
+		return 1;
+	}
+	fh = fsopen(fsh, path, 0);
+	phys = stored(fh);
+	fsclose(fh);
+	if (phys >= size / 2 || verify(fsh, path, data, size) != 0) {
+		fprintf(stderr, "%s isn't compressed: %llu bytes\n", path,
+			phys);
+		return 1;
+	}
+	fsumount(fsh);
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL ||
+	    verify(fsh, path, data, size) != 0) {
+		return 1;
+	}
+	printf("Compressed files verified\n");
+	fsumount(fsh);
+
+	return 0;
+}
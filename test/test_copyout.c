@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write a fragmented file, then export ranges of it with
+ * fscopy_to_fd() to a host file and to a socket, and verify
+ * what comes out on the other side. Then rewrite a range in
+ * an explicit transaction, whose data goes through the journal,
+ * and export the whole file before the commit. The file system
+ * is mounted without checksum verification, so that the data
+ * is copied inside the kernel.
+ */
+
+#define NCHUNKS		30
+#define CHUNKSZ		100000
+#define FILESZ		(NCHUNKS * CHUNKSZ)
+#define REWOFF		1000123
+#define REWLEN		5000
+
+static char	data[FILESZ];
+static char	sockbuf[FILESZ];
+
+static void *
+sock_reader(
+	void			*arg)
+{
+	int			fd = *(int *)arg;
+	ssize_t			n, total = 0;
+
+	while ((n = read(fd, sockbuf + total, FILESZ - total)) > 0) {
+		total += n;
+	}
+	return (void *)total;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	static char		rbuf[FILESZ], pad[CHUNKSZ];
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh, other;
+	struct iovec		iov;
+	pthread_t		tid;
+	void			*ret, *tx;
+	long long		n;
+	int			sv[2], outfd, i;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path> <host output file>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount_opts(argv[1], argv[2], FSMNT_NOVERIFY)) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	for (i = 0; i < FILESZ; i++) {
+		data[i] = (char)(i * 17 + i / 999);
+	}
+
+	/*
+	 * Interleave the writes with another file so
+	 * that the file has many extents.
+	 */
+
+	fh = fscreate(fsh, argv[3], FTYPE_FILE);
+	other = fscreate(fsh, "/copyout.pad", FTYPE_FILE);
+	if (fh == NULL || other == NULL) {
+		fprintf(stderr, "Failed to create file %s\n", argv[3]);
+		return 1;
+	}
+	for (i = 0; i < NCHUNKS; i++) {
+		if (fswrite(fh, data + i * CHUNKSZ, CHUNKSZ) != CHUNKSZ ||
+		    fswrite(other, pad, CHUNKSZ) != CHUNKSZ) {
+			fprintf(stderr, "Failed to write chunk %d\n", i);
+			return 1;
+		}
+	}
+	fsclose(other);
+
+	/*
+	 * Whole file to a host file, then a range in the middle
+	 * appended after it.
+	 */
+
+	if ((outfd = open(argv[4], O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(argv[4]);
+		return 1;
+	}
+	if ((n = fscopy_to_fd(fh, 0, FILESZ + 100, outfd)) != FILESZ ||
+	    fscopy_to_fd(fh, 12345, 500000, outfd) != 500000) {
+		fprintf(stderr, "fscopy_to_fd to %s copied %lld\n", argv[4],
+			n);
+		return 1;
+	}
+	if (pread(outfd, rbuf, FILESZ, 0) != FILESZ ||
+	    memcmp(rbuf, data, FILESZ) != 0 ||
+	    pread(outfd, rbuf, 500000, FILESZ) != 500000 ||
+	    memcmp(rbuf, data + 12345, 500000) != 0) {
+		fprintf(stderr, "Data mismatch in %s\n", argv[4]);
+		return 1;
+	}
+	close(outfd);
+
+	/*
+	 * Most of the file to a socket.
+	 */
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		perror("socketpair");
+		return 1;
+	}
+	pthread_create(&tid, NULL, sock_reader, &sv[1]);
+	n = fscopy_to_fd(fh, 777, FILESZ, sv[0]);
+	close(sv[0]);
+	pthread_join(tid, &ret);
+	close(sv[1]);
+	if (n != FILESZ - 777 || (long long)ret != n ||
+	    memcmp(sockbuf, data + 777, n) != 0) {
+		fprintf(stderr, "Socket copy: sent %lld, received %lld\n", n,
+			(long long)ret);
+		return 1;
+	}
+	printf("File %s exported to file and socket and verified\n",
+		argv[3]);
+
+	/*
+	 * The blocks the journal has are copied through a buffer,
+	 * the others still inside the kernel.
+	 */
+
+	for (i = REWOFF; i < REWOFF + REWLEN; i++) {
+		data[i] = (char)~data[i];
+	}
+	iov.iov_base = data + REWOFF;
+	iov.iov_len = REWLEN;
+	if ((tx = fstx_begin(fsh)) == NULL ||
+	    fspwritev(fh, &iov, 1, REWOFF) != REWLEN) {
+		fprintf(stderr, "Failed to rewrite %s in a transaction\n",
+			argv[3]);
+		return 1;
+	}
+	if ((outfd = open(argv[4], O_RDWR | O_TRUNC)) < 0 ||
+	    (n = fscopy_to_fd(fh, 0, FILESZ, outfd)) != FILESZ ||
+	    pread(outfd, rbuf, FILESZ, 0) != FILESZ ||
+	    memcmp(rbuf, data, FILESZ) != 0) {
+		fprintf(stderr, "Data mismatch in %s after the rewrite\n",
+			argv[4]);
+		return 1;
+	}
+	close(outfd);
+	if (fstx_commit(tx) != 0) {
+		fprintf(stderr, "Failed to commit transaction\n");
+		return 1;
+	}
+	fsclose(fh);
+	printf("File %s exported while in a transaction and verified\n",
+	       argv[3]);
+
+	return 0;
+}
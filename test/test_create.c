@@ -32,6 +32,8 @@ main(
 		return 1;
 	}
 	printf("Created file %s successfully\n", argv[3]);
+	fsclose(fh);
+	fsumount(fsh);
 
 	return 0;
 }
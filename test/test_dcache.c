@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+#include "dcache.h"
+
+/*
+ * Create a path 'depth' directories deep under 'dir', remount
+ * and open the file at the bottom repeatedly, checking that only
+ * the first open has to search directories, and the same for a
+ * path which doesn't exist. Then check that creating and removing
+ * names is seen by lookups, that fsremove() frees the blocks and
+ * inode of a file (but not the blocks a clone still shares),
+ * refuses open files and directories which aren't empty, and that
+ * the cache doesn't grow past its bound.
+ */
+
+#define NOPENS		100000
+#define NNAMES		40000
+#define FILESZ		(1 << 20)
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct dcache *
+dcache(
+	FSHANDLE		fsh)
+{
+	return ((struct fs_handle *)fsh)->fsh_mem->fsm_dcache;
+}
+
+/*
+ * Open 'path' NOPENS times, checking that it's found (or not)
+ * as expected without missing the cache.
+ */
+
+static int
+open_many(
+	FSHANDLE		fsh,
+	char			*path,
+	int			exists)
+{
+	FHANDLE			fh;
+	fs_u64_t		misses;
+	double			t;
+	int			i;
+
+	misses = dcache(fsh)->dc_misses;
+	t = now();
+	for (i = 0; i < NOPENS; i++) {
+		fh = fsopen(fsh, path, 0);
+		if ((fh != NULL) != exists) {
+			fprintf(stderr, "%s %sfound\n", path,
+				exists ? "not " : "");
+			return 1;
+		}
+		if (fh) {
+			fsclose(fh);
+		}
+	}
+	t = now() - t;
+	printf("%d opens of %s: %.0f opens/s, %llu misses\n", NOPENS, path,
+		NOPENS / t, dcache(fsh)->dc_misses - misses);
+	if (dcache(fsh)->dc_misses != misses) {
+		fprintf(stderr, "Opens of %s missed the cache\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+write_file(
+	FSHANDLE		fsh,
+	char			*path,
+	char			*buf)
+{
+	FHANDLE			fh;
+
+	if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL ||
+	    fswrite(fh, buf, FILESZ) != FILESZ || fsclose(fh) != 0) {
+		fprintf(stderr, "Failed to write %s\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct fsmem		*fsm;
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	char			path[4096], file[4096], clone[4096], *buf;
+	fs_u64_t		misses, freeblks, iused;
+	int			i, depth, len;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <depth>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	depth = atoi(argv[4]);
+	len = snprintf(path, sizeof(path), "%s", argv[3]);
+	for (i = 0; i <= depth; i++) {
+		if (i > 0) {
+			len += snprintf(path + len, sizeof(path) - len, "/d%d",
+					i);
+		}
+		if ((fh = fscreate(fsh, path, FTYPE_DIR)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	snprintf(file, sizeof(file), "%s/file", path);
+	if ((fh = fscreate(fsh, file, FTYPE_FILE)) == NULL) {
+		fprintf(stderr, "Failed to create %s\n", file);
+		return 1;
+	}
+	fsclose(fh);
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+
+	/*
+	 * Only the first lookup of a path, found or not,
+	 * reads directories.
+	 */
+
+	misses = dcache(fsh)->dc_misses;
+	if ((fh = fsopen(fsh, file, 0)) == NULL) {
+		fprintf(stderr, "%s not found\n", file);
+		return 1;
+	}
+	fsclose(fh);
+	printf("first open of %s: %llu misses\n", file,
+		dcache(fsh)->dc_misses - misses);
+	snprintf(clone, sizeof(clone), "%s/missing", path);
+	if (fsopen(fsh, clone, 0) != NULL ||
+	    open_many(fsh, file, 1) != 0 || open_many(fsh, clone, 0) != 0) {
+		return 1;
+	}
+
+	/*
+	 * Names created and removed are seen by lookups
+	 * through the cache.
+	 */
+
+	if ((fh = fscreate(fsh, clone, FTYPE_FILE)) == NULL) {
+		fprintf(stderr, "Failed to create %s\n", clone);
+		return 1;
+	}
+	fsclose(fh);
+	if (open_many(fsh, clone, 1) != 0) {
+		return 1;
+	}
+	fh = fsopen(fsh, clone, 0);
+	if ((i = fsremove(fsh, clone)) != EBUSY) {
+		fprintf(stderr, "Open file %s removed: %d\n", clone, i);
+		return 1;
+	}
+	fsclose(fh);
+	if ((i = fsremove(fsh, path)) != ENOTEMPTY) {
+		fprintf(stderr, "Directory %s removed: %d\n", path, i);
+		return 1;
+	}
+	if ((i = fsremove(fsh, clone)) != 0 || fsremove(fsh, clone) != ENOENT ||
+	    open_many(fsh, clone, 0) != 0) {
+		fprintf(stderr, "Failed to remove %s: %d\n", clone, i);
+		return 1;
+	}
+
+	/*
+	 * Removing a file frees its blocks and inode, except
+	 * for the blocks its clone still shares. The blocks are
+	 * only free once the remove is committed.
+	 */
+
+	fsm = ((struct fs_handle *)fsh)->fsh_mem;
+	buf = (char *)malloc(FILESZ);
+	for (i = 0; i < FILESZ; i++) {
+		buf[i] = (char)(i * 7 + i / 1000);
+	}
+	snprintf(clone, sizeof(clone), "%s.clone", file);
+	fssync(fsh);
+	freeblks = fsm->fsm_sb->freeblks;
+	iused = fsm->fsm_sb->iused;
+	if (write_file(fsh, clone, buf) != 0 ||
+	    (i = fsremove(fsh, clone)) != 0 || fssync(fsh) != 0 ||
+	    fsm->fsm_sb->freeblks != freeblks || fsm->fsm_sb->iused != iused) {
+		fprintf(stderr, "Removing %s freed %lld blocks, %lld inodes "
+			"less than it used\n", clone,
+			(long long)(freeblks - fsm->fsm_sb->freeblks),
+			(long long)(iused - fsm->fsm_sb->iused));
+		return 1;
+	}
+	if (write_file(fsh, file, buf) == 0) {
+		fprintf(stderr, "%s created twice\n", file);
+		return 1;
+	}
+	if (fsremove(fsh, file) != 0 || write_file(fsh, file, buf) != 0 ||
+	    fsclone(fsh, file, clone) != 0 || fsremove(fsh, file) != 0) {
+		fprintf(stderr, "Failed to clone and remove %s\n", file);
+		return 1;
+	}
+	if ((fh = fsopen(fsh, clone, 0)) == NULL ||
+	    fsread(fh, buf + FILESZ / 2, FILESZ / 2) != FILESZ / 2 ||
+	    memcmp(buf, buf + FILESZ / 2, FILESZ / 2) != 0) {
+		fprintf(stderr, "Clone %s lost its data\n", clone);
+		return 1;
+	}
+	fsclose(fh);
+	for (;;) {
+		if ((i = fsremove(fsh, clone)) != 0) {
+			fprintf(stderr, "Failed to remove %s: %d\n", clone, i);
+			return 1;
+		}
+		if (strcmp(clone, argv[3]) == 0) {
+			break;
+		}
+		snprintf(clone, sizeof(clone), "%s", path);
+		*strrchr(path, '/') = '\0';
+	}
+	printf("Removed the tree, %llu blocks free\n", fsm->fsm_sb->freeblks);
+
+	/*
+	 * The cache doesn't grow past its bound.
+	 */
+
+	for (i = 0; i < NNAMES; i++) {
+		snprintf(path, sizeof(path), "/nonexistent%d", i);
+		if (fsopen(fsh, path, 0) != NULL) {
+			fprintf(stderr, "%s found\n", path);
+			return 1;
+		}
+	}
+	printf("dcache: %d entries (max %d), %llu hits, %llu misses\n",
+		dcache(fsh)->dc_nents, dcache(fsh)->dc_max,
+		dcache(fsh)->dc_hits, dcache(fsh)->dc_misses);
+	if (dcache(fsh)->dc_nents > dcache(fsh)->dc_max) {
+		fprintf(stderr, "dcache has grown past its bound\n");
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (fsopen(fsh, argv[3], 0) != NULL) {
+		fprintf(stderr, "%s is still there\n", argv[3]);
+		return 1;
+	}
+	printf("Dentry cache and removal verified\n");
+	fsumount(fsh);
+
+	return 0;
+}
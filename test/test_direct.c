@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write a file of 'size' MB with a mix of small and large
+ * writes, read it back with a mix of small and large reads
+ * and verify it, then look the file up repeatedly, in
+ * buffered, direct or mmap mode.
+ * Prints the latency of the writes, reads and lookups, the
+ * peak RSS of the process and how much of the device file
+ * ended up in the host page cache, so the modes can be
+ * compared.
+ */
+
+#define NLOOKUPS	1000
+#define NSIZES		4
+
+static unsigned int	iosizes[NSIZES] = {4096, 1000, 1 << 18, 1 << 16};
+
+static double
+now_us(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+cmp_double(
+	const void		*a,
+	const void		*b)
+{
+	double			x = *(double *)a, y = *(double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+report(
+	char			*what,
+	double			*lat,
+	int			n)
+{
+	qsort(lat, n, sizeof(double), cmp_double);
+	printf("%s: %d ops, p50 %.1f us, p99 %.1f us, max %.1f us\n", what,
+		n, lat[n / 2], lat[(n * 99) / 100], lat[n - 1]);
+}
+
+/*
+ * Number of KB of the device file in the host page cache.
+ */
+
+static unsigned long
+cached_kb(
+	char			*dev)
+{
+	struct stat		st;
+	unsigned char		*vec;
+	unsigned long		pgsz = sysconf(_SC_PAGESIZE), npages, i, n = 0;
+	void			*addr;
+	int			fd;
+
+	if ((fd = open(dev, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		return 0;
+	}
+	npages = (st.st_size + pgsz - 1) / pgsz;
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	vec = (unsigned char *)malloc(npages);
+	if (addr != MAP_FAILED && mincore(addr, st.st_size, vec) == 0) {
+		for (i = 0; i < npages; i++) {
+			n += vec[i] & 1;
+		}
+	}
+	if (addr != MAP_FAILED) {
+		munmap(addr, st.st_size);
+	}
+	free(vec);
+	close(fd);
+	return n * pgsz / 1024;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct rusage		ru;
+	struct file_handle      *fh = NULL;
+	FSHANDLE                fsh = NULL;
+	char			*data = NULL, *rbuf = NULL;
+	double			*wlat, *rlat, *llat, t;
+	unsigned int		flags = 0, size, off, len;
+	int			i, nw = 0, nr = 0, fd;
+
+	if (argc != 6 || (strcmp(argv[5], "buffered") != 0 &&
+			  strcmp(argv[5], "direct") != 0 &&
+			  strcmp(argv[5], "mmap") != 0)) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path> <size in MB> <buffered|direct|mmap>\n",
+			argv[0]);
+		return 1;
+	}
+	if (strcmp(argv[5], "direct") == 0) {
+		flags = FSMNT_DIRECT;
+	} else if (strcmp(argv[5], "mmap") == 0) {
+		flags = FSMNT_MMAP | FSMNT_POPULATE;
+	}
+
+	/*
+	 * Start every mode with none of the device
+	 * file in the page cache.
+	 */
+
+	if ((fd = open(argv[1], O_RDONLY)) >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	if ((fsh = fsmount_opts(argv[1], argv[2], flags)) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully (%s)\n", argv[5]);
+	size = atoi(argv[4]) << 20;
+	data = (char *)malloc(size);
+	rbuf = (char *)malloc(1 << 18);
+	wlat = (double *)malloc((size / 1000 + 1) * sizeof(double));
+	rlat = (double *)malloc((size / 1000 + 1) * sizeof(double));
+	for (i = 0; i < (int)size; i++) {
+		data[i] = (char)(i * 13 + i / 4096);
+	}
+	fh = fscreate(fsh, argv[3], FTYPE_FILE);
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to create file %s\n", argv[3]);
+		return 1;
+	}
+	for (off = 0, i = 0; off < size; off += len, i++) {
+		len = MIN(iosizes[i % NSIZES], size - off);
+		t = now_us();
+		if (fswrite(fh, data + off, len) != (int)len) {
+			fprintf(stderr, "Failed to write at offset %u\n", off);
+			return 1;
+		}
+		wlat[nw++] = now_us() - t;
+	}
+	if (fsclose(fh) != 0) {
+		fprintf(stderr, "Failed to close %s\n", argv[3]);
+		return 1;
+	}
+
+	fh = fsopen(fsh, argv[3], 0);
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", argv[3]);
+		return 1;
+	}
+	for (off = 0, i = 1; off < size; off += len, i++) {
+		len = MIN(iosizes[i % NSIZES], size - off);
+		t = now_us();
+		if (fsread(fh, rbuf, len) != (int)len) {
+			fprintf(stderr, "Failed to read at offset %u\n", off);
+			return 1;
+		}
+		rlat[nr++] = now_us() - t;
+		if (memcmp(rbuf, data + off, len) != 0) {
+			fprintf(stderr, "Data mismatch in %s at offset %u\n",
+				argv[3], off);
+			return 1;
+		}
+	}
+	fsclose(fh);
+	printf("File %s verified\n", argv[3]);
+	llat = (double *)malloc(NLOOKUPS * sizeof(double));
+	for (i = 0; i < NLOOKUPS; i++) {
+		t = now_us();
+		if ((fh = fsopen(fsh, argv[3], 0)) == NULL) {
+			fprintf(stderr, "Failed to open file %s\n", argv[3]);
+			return 1;
+		}
+		llat[i] = now_us() - t;
+		fsclose(fh);
+	}
+	if (fssync(fsh) != 0) {
+		fprintf(stderr, "Failed to sync file system\n");
+		return 1;
+	}
+	report("write", wlat, nw);
+	report("read", rlat, nr);
+	report("lookup", llat, NLOOKUPS);
+	getrusage(RUSAGE_SELF, &ru);
+	printf("max RSS %ld KB, device file cached %lu KB\n", ru.ru_maxrss,
+		cached_kb(argv[1]));
+	if (fsumount(fsh) != 0) {
+		fprintf(stderr, "Failed to unmount file system\n");
+		return 1;
+	}
+
+	return 0;
+}
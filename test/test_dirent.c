@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create 'nfiles' files with short names in a new directory
+ * and print the directory space each entry takes, then add
+ * files with names of every length from 56 to 255 bytes, which
+ * don't fit a fixed size entry. Check that a 256 byte name is
+ * refused, that every name is found and that readdir returns
+ * each name exactly once, before and after remounting.
+ */
+
+#define MAXNAME		255
+
+/*
+ * Name of long file 'i' of directory 'dir'.
+ */
+
+static void
+long_name(
+	char			*buf,
+	char			*dir,
+	int			i)
+{
+	int			n, len = 56 + i;
+
+	n = sprintf(buf, "%s/", dir);
+	memset(buf + n, 'a' + i % 26, len);
+	sprintf(buf + n, "%03d", i);
+	buf[n + 3] = 'x';
+	buf[n + len] = '\0';
+}
+
+/*
+ * Check the names of directory 'dir' and return
+ * the number of problems found.
+ */
+
+static int
+check_dir(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			nshort,
+	int			nlong)
+{
+	static struct udirentry	ud[64];
+	struct file_handle	*fh;
+	char			path[512], *seen;
+	int			i, k, nent, dlen = strlen(dir) + 1, nbad = 0;
+
+	seen = (char *)calloc(nshort + nlong, 1);
+	for (i = 0; i < nshort + nlong; i++) {
+		if (i < nshort) {
+			snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+		} else {
+			long_name(path, dir, i - nshort);
+		}
+		if ((fh = fsopen(fsh, path, 0)) == NULL) {
+			fprintf(stderr, "%s not found\n", path);
+			nbad++;
+			continue;
+		}
+		fsclose(fh);
+	}
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return nbad + 1;
+	}
+	while ((nent = fsread_dir(fh, (char *)ud, 64)) > 0) {
+		for (i = 0; i < nent; i++) {
+			if (strlen(ud[i].udir_name) < 56) {
+				k = -1;
+				sscanf(ud[i].udir_name, "f%d", &k);
+				k = (k >= 0 && k < nshort) ? k : -1;
+			} else {
+				k = atoi(ud[i].udir_name);
+				long_name(path, dir, k);
+				k = (k < nlong && strcmp(path + dlen,
+				     ud[i].udir_name) == 0) ? nshort + k : -1;
+			}
+			if (k < 0 || seen[k]++) {
+				fprintf(stderr, "readdir of %s returned %s\n",
+					dir, ud[i].udir_name);
+				nbad++;
+			}
+		}
+	}
+	for (i = 0; i < nshort + nlong; i++) {
+		if (!seen[i]) {
+			fprintf(stderr, "readdir of %s missed entry %d\n", dir,
+				i);
+			nbad++;
+		}
+	}
+	printf("%s: %d entries in %llu bytes\n", dir, nshort + nlong,
+		fh->fh_inode->mino_size);
+	fsclose(fh);
+	free(seen);
+	return nbad;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	char			path[512];
+	unsigned long long	size;
+	int			i, n, nlong = MAXNAME - 56 + 1;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	n = atoi(argv[4]);
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/f%06d", argv[3], i);
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	fh = fsopen(fsh, argv[3], 0);
+	size = ((struct file_handle *)fh)->fh_inode->mino_size;
+	fsclose(fh);
+	printf("%d short names: %.1f bytes per entry, %d bytes before\n", n,
+		(double)size / n, (int)DIRENTRY_LEN);
+
+	for (i = 0; i < nlong; i++) {
+		long_name(path, argv[3], i);
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	long_name(path, argv[3], nlong);
+	errno = 0;
+	if (fscreate(fsh, path, FTYPE_FILE) != NULL || errno != ENAMETOOLONG) {
+		fprintf(stderr, "%zu byte name was created\n",
+			strlen(path) - strlen(argv[3]) - 1);
+		return 1;
+	}
+
+	if (check_dir(fsh, argv[3], n, nlong) != 0) {
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (check_dir(fsh, argv[3], n, nlong) != 0) {
+		return 1;
+	}
+	printf("Directory %s verified\n", argv[3]);
+	fsumount(fsh);
+
+	return 0;
+}
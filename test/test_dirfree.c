@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create 'nfiles' files in a new directory, remove every other
+ * one and then the whole second half, and create as many files
+ * again, checking that the new entries go in the holes the
+ * removed ones left: the directory mustn't grow. Then check
+ * that every name is found and that readdir returns them all,
+ * and that the holes are found again after remounting, when the
+ * free space maps have to be rebuilt.
+ */
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Size and number of blocks of directory 'dir'.
+ */
+
+static int
+dir_size(
+	FSHANDLE		fsh,
+	char			*dir,
+	fs_u64_t		*sizep,
+	fs_u64_t		*nblocksp)
+{
+	struct file_handle	*fh;
+
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return 1;
+	}
+	*sizep = fh->fh_inode->mino_size;
+	*nblocksp = fh->fh_inode->mino_nblocks;
+	fsclose(fh);
+	return 0;
+}
+
+/*
+ * Create (or remove, if 'rm') files 'first' to 'last' of
+ * directory 'dir' in steps of 'step', named after 'prefix'.
+ */
+
+static int
+churn(
+	FSHANDLE		fsh,
+	char			*dir,
+	char			*prefix,
+	int			first,
+	int			last,
+	int			step,
+	int			rm)
+{
+	FHANDLE			fh;
+	char			path[256];
+	int			i, error;
+
+	for (i = first; i < last; i += step) {
+		snprintf(path, sizeof(path), "%s/%s%06d", dir, prefix, i);
+		if (rm) {
+			if ((error = fsremove(fsh, path)) != 0) {
+				fprintf(stderr, "Failed to remove %s: %d\n",
+					path, error);
+				return 1;
+			}
+			continue;
+		}
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	return 0;
+}
+
+/*
+ * Remove the files of the odd slots of the first half and all
+ * the slots of the second half of the 'n' slots of directory
+ * 'dir', named after 'oprefix' (the files of the other slots
+ * are named after 'prefix'), and create them again named after
+ * 'nprefix'.
+ * Returns non-zero if there's a problem.
+ */
+
+static int
+refill(
+	FSHANDLE		fsh,
+	char			*dir,
+	char			*prefix,
+	char			*oprefix,
+	char			*nprefix,
+	int			n)
+{
+	static struct udirentry	ud[64];
+	FHANDLE			fh;
+	fs_u64_t		size, nblocks, nsize, nnblocks;
+	char			path[256];
+	double			t;
+	int			i, nent, holes, total = 0;
+
+	if (dir_size(fsh, dir, &size, &nblocks) != 0 ||
+	    churn(fsh, dir, oprefix, 1, n / 2, 2, 1) != 0 ||
+	    churn(fsh, dir, oprefix, n / 2, n, 1, 1) != 0) {
+		return 1;
+	}
+	t = now();
+	if (churn(fsh, dir, nprefix, n / 2, n, 1, 0) != 0 ||
+	    churn(fsh, dir, nprefix, 1, n / 2, 2, 0) != 0) {
+		return 1;
+	}
+	t = now() - t;
+	if (dir_size(fsh, dir, &nsize, &nnblocks) != 0) {
+		return 1;
+	}
+	holes = n - (n / 2 + 1) / 2;
+	printf("%s: refilled %d holes at %.0f creates/s, size %llu -> %llu, "
+		"%llu -> %llu blocks\n", dir, holes, holes / t, size, nsize,
+		nblocks, nnblocks);
+	if (nsize != size || nnblocks != nblocks) {
+		fprintf(stderr, "%s has grown\n", dir);
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s%06d", dir,
+			 (i < n / 2 && i % 2 == 0) ? prefix : nprefix, i);
+		if ((fh = fsopen(fsh, path, 0)) == NULL) {
+			fprintf(stderr, "%s not found\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return 1;
+	}
+	while ((nent = fsread_dir(fh, (char *)ud, 64)) > 0) {
+		for (i = 0; i < nent; i++) {
+			total += (ud[i].udir_inum != 0);
+		}
+	}
+	fsclose(fh);
+	if (total != n) {
+		fprintf(stderr, "readdir of %s returned %d entries\n", dir,
+			total);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	double			t;
+	int			n;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	n = atoi(argv[4]);
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	t = now();
+	if (churn(fsh, argv[3], "a", 0, n, 1, 0) != 0) {
+		return 1;
+	}
+	printf("%s: %d creates/s in an empty directory\n", argv[3],
+		(int)(n / (now() - t)));
+	if (refill(fsh, argv[3], "a", "a", "b", n) != 0) {
+		return 1;
+	}
+	if (((struct fs_handle *)fsh)->fsh_mem->fsm_dfpark == NULL) {
+		fprintf(stderr, "Free space map of %s wasn't kept\n",
+			argv[3]);
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (refill(fsh, argv[3], "a", "b", "c", n) != 0) {
+		return 1;
+	}
+	printf("Directory %s verified\n", argv[3]);
+	fsumount(fsh);
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create 'nfiles' files in a new directory, printing the create
+ * rate of each tenth of them, which shouldn't drop as the
+ * directory grows now that it's indexed. Then check that every
+ * name is found, that names which aren't there aren't, that a
+ * name can't be created twice and that readdir returns them
+ * all, before and after remounting. A small directory, which
+ * isn't indexed, is checked the same way.
+ */
+
+#define NSMALL		10
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Check the 'n' names of directory 'dir' and return
+ * the number of problems found.
+ */
+
+static int
+check_dir(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			n)
+{
+	static struct udirentry	ud[64];
+	struct file_handle	*fh;
+	char			path[256];
+	int			i, k, nent, total = 0, nbad = 0;
+
+	for (i = 0; i < n; i++) {
+		k = (int)(((long long)i * 7919) % n);
+		snprintf(path, sizeof(path), "%s/f%06d", dir, k);
+		if ((fh = fsopen(fsh, path, 0)) == NULL) {
+			fprintf(stderr, "%s not found\n", path);
+			nbad++;
+			continue;
+		}
+		fsclose(fh);
+	}
+	for (i = n; i < n + 100; i++) {
+		snprintf(path, sizeof(path), "%s/f%06d", dir, i);
+		if ((fh = fsopen(fsh, path, 0)) != NULL) {
+			fprintf(stderr, "%s found\n", path);
+			fsclose(fh);
+			nbad++;
+		}
+	}
+	snprintf(path, sizeof(path), "%s/f%06d", dir, n / 2);
+	errno = 0;
+	if (fscreate(fsh, path, FTYPE_FILE) != NULL || errno != EEXIST) {
+		fprintf(stderr, "%s created twice\n", path);
+		nbad++;
+	}
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return nbad + 1;
+	}
+	while ((nent = fsread_dir(fh, (char *)ud, 64)) > 0) {
+		for (i = 0; i < nent; i++) {
+			total += (ud[i].udir_inum != 0);
+		}
+	}
+	printf("%s: %d entries, %u buckets, %u index blocks\n", dir, total,
+		fh->fh_inode->mino_nbuckets, fh->fh_inode->mino_nidxblks);
+	fsclose(fh);
+	if (total != n) {
+		fprintf(stderr, "readdir of %s returned %d entries\n", dir,
+			total);
+		nbad++;
+	}
+	return nbad;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	char			path[256], small[256];
+	double			t, rate, first = 0;
+	int			i, n, step;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	n = atoi(argv[4]);
+	step = (n + 9) / 10;
+	snprintf(small, sizeof(small), "%s.small", argv[3]);
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directories\n");
+		return 1;
+	}
+	fsclose(fh);
+	if ((fh = fscreate(fsh, small, FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directories\n");
+		return 1;
+	}
+	fsclose(fh);
+	for (i = 0; i < NSMALL; i++) {
+		snprintf(path, sizeof(path), "%s/f%06d", small, i);
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+
+	t = now();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/f%06d", argv[3], i);
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+		if ((i + 1) % step == 0 || i + 1 == n) {
+			rate = (i % step + 1) / (now() - t);
+			printf("files %d-%d: %.0f creates/s\n",
+				i - i % step, i, rate);
+			first = first ? first : rate;
+			t = now();
+		}
+	}
+	printf("last/first create rate: %.2f\n", rate / first);
+
+	if (check_dir(fsh, argv[3], n) != 0 ||
+	    check_dir(fsh, small, NSMALL) != 0) {
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (check_dir(fsh, argv[3], n) != 0 ||
+	    check_dir(fsh, small, NSMALL) != 0) {
+		return 1;
+	}
+	printf("Directories %s and %s verified\n", argv[3], small);
+	fsumount(fsh);
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create 'nfiles' entries in a new directory, some of them
+ * subdirectories and some files with data, and list the
+ * directory with attributes after remounting, first the way it
+ * used to be done (fsread_dir() and opening every entry), then
+ * with fsread_dirplus(), checking the type and size returned
+ * for every entry and printing the time each listing takes.
+ */
+
+#define NBATCH		256
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Type and size entry 'i' is created with.
+ */
+
+static int
+entry_type(
+	int			i)
+{
+	return (i % 100 == 99) ? FTYPE_DIR : FTYPE_FILE;
+}
+
+static unsigned int
+entry_size(
+	int			i)
+{
+	return (i % 64 == 0) ? (i / 64 % 16 + 1) * 100 : 0;
+}
+
+static int
+remount(
+	FSHANDLE		*fshp,
+	char			*argv[])
+{
+	if (fsumount(*fshp) != 0 || (*fshp = fsmount(argv[1], argv[2])) ==
+	    NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	static struct udirentplus	up[NBATCH];
+	static struct udirentry		ud[NBATCH];
+	static char			data[1600];
+	FSHANDLE			fsh = NULL;
+	struct file_handle		*fh, *kept;
+	char				path[256];
+	double				t, tplus;
+	int				i, k, n, nent, total;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	n = atoi(argv[4]);
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/e%06d", argv[3], i);
+		if ((fh = fscreate(fsh, path, entry_type(i))) == NULL ||
+		    (entry_size(i) && fswrite(fh, data, entry_size(i)) !=
+		     (int)entry_size(i))) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+
+	/*
+	 * List the directory opening every entry.
+	 */
+
+	if (remount(&fsh, argv) != 0 ||
+	    (fh = fsopen(fsh, argv[3], 0)) == NULL) {
+		return 1;
+	}
+	t = now();
+	while ((nent = fsread_dir(fh, (char *)ud, NBATCH)) > 0) {
+		for (i = 0; i < nent; i++) {
+			snprintf(path, sizeof(path), "%s/%s", argv[3],
+				 ud[i].udir_name);
+			if ((kept = fsopen(fsh, path, 0)) == NULL) {
+				fprintf(stderr, "%s not found\n", path);
+				return 1;
+			}
+			fsclose(kept);
+		}
+	}
+	t = now() - t;
+	fsclose(fh);
+
+	/*
+	 * List it with fsread_dirplus(), with one of the files
+	 * in core.
+	 */
+
+	if (remount(&fsh, argv) != 0 ||
+	    (fh = fsopen(fsh, argv[3], 0)) == NULL) {
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/e%06d", argv[3], n / 2 & ~63);
+	if ((kept = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "%s not found\n", path);
+		return 1;
+	}
+	tplus = now();
+	total = 0;
+	while ((nent = fsread_dirplus(fh, (char *)up, NBATCH)) > 0) {
+		for (i = 0; i < nent; i++) {
+			k = atoi(up[i].udp_name + 1);
+			if (up[i].udp_type != (unsigned int)entry_type(k) ||
+			    (entry_type(k) == FTYPE_FILE &&
+			     up[i].udp_size != entry_size(k))) {
+				fprintf(stderr, "%s: type %u size %llu\n",
+					up[i].udp_name, up[i].udp_type,
+					up[i].udp_size);
+				return 1;
+			}
+			total++;
+		}
+	}
+	tplus = now() - tplus;
+	fsclose(kept);
+	fsclose(fh);
+	if (total != n) {
+		fprintf(stderr, "fsread_dirplus() returned %d entries\n",
+			total);
+		return 1;
+	}
+	printf("%d entries: %.3fs opening each entry, %.3fs with "
+		"fsread_dirplus() (%.1fx)\n", n, t, tplus, t / tplus);
+	printf("Directory %s listed\n", argv[3]);
+	fsumount(fsh);
+
+	return 0;
+}
@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+#include "dir.h"
+#include "dirscan.h"
+
+/*
+ * Check the directory scanning kernels against the scalar ones
+ * on random blocks of entries, and print how many entries per
+ * second each scans: a name being searched for the way fixed
+ * directories used to be searched (measuring the name and
+ * hashing it, for every entry) and with dirscan_name(), and a
+ * hash being searched for in hash index entries one at a time
+ * and with dirscan_hash(). Then create 'nfiles' files in a new directory, remove
+ * every other one and create them again, checking that every
+ * name is found, before and after remounting.
+ */
+
+#define NCHECK		2000
+#define NCHECKENTS	67
+#define NBENCH		16384
+#define NROUNDS		200
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * A random name of 1 to 55 letters of a small alphabet (so
+ * that names often share a prefix), followed by garbage.
+ */
+
+static void
+rand_entry(
+	struct direntry		*ent)
+{
+	int			i, len = 1 + rand() % 55;
+
+	if (rand() % 4 == 0) {
+		len = 1 + rand() % 3;
+	}
+	for (i = 0; i < (int)sizeof(ent->name); i++) {
+		ent->name[i] = (i < len) ? 'a' + rand() % 3 :
+			       (i == len) ? '\0' : (char)rand();
+	}
+	ent->inumber = (rand() % 5 == 0) ? 0 : 1 + rand() % 1000;
+}
+
+static int
+ref_name(
+	struct direntry		*ent,
+	int			n,
+	const char		*name,
+	int			len)
+{
+	int			i;
+
+	for (i = 0; i < n; i++) {
+		if (ent[i].inumber != 0 && len < (int)sizeof(ent[i].name) &&
+		    strnlen(ent[i].name, sizeof(ent[i].name)) == len &&
+		    memcmp(ent[i].name, name, len) == 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Compare the kernels with the reference on random blocks.
+ * Returns the number of mismatches.
+ */
+
+static int
+check_kernels(void)
+{
+	static struct direntry		ent[NCHECKENTS];
+	static struct dirhash_ent	de[NCHECKENTS];
+	char				name[64];
+	int				i, k, n, len, used, nbad = 0;
+	fs_u32_t			h;
+
+	for (k = 0; k < NCHECK; k++) {
+		n = rand() % (NCHECKENTS + 1);
+		for (i = 0; i < NCHECKENTS; i++) {
+			rand_entry(&ent[i]);
+			de[i].dh_hash = rand() % 8;
+			de[i].dh_off = rand() % 8;
+		}
+		if (rand() % 2) {
+			memcpy(name, ent[rand() % NCHECKENTS].name, 56);
+			name[56] = '\0';
+		} else {
+			rand_entry((struct direntry *)name);
+		}
+		len = strlen(name);
+		if (dirscan_name(ent, n, name, len) !=
+		    ref_name(ent, n, name, len) ||
+		    dirscan_name_sw(ent, n, name, len) !=
+		    ref_name(ent, n, name, len)) {
+			fprintf(stderr, "dirscan_name(%s) in %d entries: %d, "
+				"expected %d\n", name, n,
+				dirscan_name(ent, n, name, len),
+				ref_name(ent, n, name, len));
+			nbad++;
+		}
+		used = rand() % 2;
+		for (i = 0; i < n && (ent[i].inumber != 0) != used; i++);
+		if (dirscan_slot(ent, n, used) != i) {
+			fprintf(stderr, "dirscan_slot(%d) in %d entries: %d, "
+				"expected %d\n", used, n,
+				dirscan_slot(ent, n, used), i);
+			nbad++;
+		}
+		h = rand() % 10;
+		if (dirscan_hash(de, n, h) != dirscan_hash_sw(de, n, h)) {
+			fprintf(stderr, "dirscan_hash(%u) in %d entries: %d, "
+				"expected %d\n", h, n, dirscan_hash(de, n, h),
+				dirscan_hash_sw(de, n, h));
+			nbad++;
+		}
+	}
+	return nbad;
+}
+
+/*
+ * Search for a name among 'n' entries the way fixed directories
+ * used to be searched.
+ */
+
+static int
+old_name(
+	struct direntry		*ent,
+	int			n,
+	const char		*name,
+	int			len)
+{
+	fs_u32_t		h = dir_hash(name, len);
+	int			i, nlen;
+
+	for (i = 0; i < n; i++) {
+		if (ent[i].inumber == 0) {
+			continue;
+		}
+		nlen = strnlen(ent[i].name, sizeof(ent[i].name));
+		if (dir_hash(ent[i].name, nlen) == h && nlen == len &&
+		    memcmp(ent[i].name, name, len) == 0) {
+			break;
+		}
+	}
+	return i;
+}
+
+static double
+rate(
+	double			t)
+{
+	return NBENCH * (double)NROUNDS / t / 1e6;
+}
+
+/*
+ * Time the kernels on NBENCH entries, none of which is the
+ * one looked for, printing the rates before and after.
+ * Returns non-zero if one was found.
+ */
+
+static int
+bench(void)
+{
+	struct direntry		*ent;
+	struct dirhash_ent	*de;
+	fs_u32_t		h = 0;
+	double			t[4];
+	int			i, r, found = 0;
+
+	ent = (struct direntry *)calloc(NBENCH, sizeof(struct direntry));
+	de = (struct dirhash_ent *)calloc(NBENCH, sizeof(struct dirhash_ent));
+	for (i = 0; i < NBENCH; i++) {
+		snprintf(ent[i].name, sizeof(ent[i].name), "file%06d", i);
+		ent[i].inumber = i + 1;
+		de[i].dh_hash = dir_hash(ent[i].name, strlen(ent[i].name));
+		de[i].dh_off = i * DIRENTRY_LEN;
+	}
+	while (dirscan_hash_sw(de, NBENCH, h) != NBENCH) {
+		h++;
+	}
+
+	t[0] = now();
+	for (r = 0; r < NROUNDS; r++) {
+		found += (old_name(ent, NBENCH, "file999999", 10) != NBENCH);
+	}
+	t[1] = now();
+	for (r = 0; r < NROUNDS; r++) {
+		found += (dirscan_name_sw(ent, NBENCH, "file999999", 10) !=
+			  NBENCH);
+	}
+	t[2] = now();
+	for (r = 0; r < NROUNDS; r++) {
+		found += (dirscan_name(ent, NBENCH, "file999999", 10) != NBENCH);
+	}
+	t[3] = now();
+	printf("name: %.0fM entries/s before, %.0fM scalar, %.0fM %s "
+		"(%.1fx)\n", rate(t[1] - t[0]), rate(t[2] - t[1]),
+		rate(t[3] - t[2]), dirscan_impl(), (t[1] - t[0]) /
+		(t[3] - t[2]));
+
+	t[0] = now();
+	for (r = 0; r < NROUNDS; r++) {
+		for (i = 0; i < NBENCH && de[i].dh_hash != h; i++);
+		found += (i != NBENCH);
+	}
+	t[1] = now();
+	for (r = 0; r < NROUNDS; r++) {
+		found += (dirscan_hash_sw(de, NBENCH, h) != NBENCH);
+	}
+	t[2] = now();
+	for (r = 0; r < NROUNDS; r++) {
+		found += (dirscan_hash(de, NBENCH, h) != NBENCH);
+	}
+	t[3] = now();
+	printf("hash: %.0fM entries/s before, %.0fM scalar, %.0fM %s "
+		"(%.1fx)\n", rate(t[1] - t[0]), rate(t[2] - t[1]),
+		rate(t[3] - t[2]), dirscan_impl(), (t[1] - t[0]) /
+		(t[3] - t[2]));
+	free(ent);
+	free(de);
+	return found;
+}
+
+/*
+ * Check that files 0 to 'n' - 1 of directory 'dir' are found
+ * under their names, of 'prefix' for the odd ones, and that
+ * readdir returns 'n' entries.
+ */
+
+static int
+check_dir(
+	FSHANDLE		fsh,
+	char			*dir,
+	char			*prefix,
+	int			n)
+{
+	static struct udirentry	ud[64];
+	FHANDLE			fh;
+	char			path[256];
+	int			i, nent, total = 0;
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s%06d", dir,
+			 (i % 2) ? prefix : "a", i);
+		if ((fh = fsopen(fsh, path, 0)) == NULL) {
+			fprintf(stderr, "%s not found\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	snprintf(path, sizeof(path), "%s/a%06d", dir, n);
+	if (fsopen(fsh, path, 0) != NULL) {
+		fprintf(stderr, "%s found\n", path);
+		return 1;
+	}
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return 1;
+	}
+	while ((nent = fsread_dir(fh, (char *)ud, 64)) > 0) {
+		total += nent;
+	}
+	fsclose(fh);
+	if (total != n) {
+		fprintf(stderr, "readdir of %s returned %d entries\n", dir,
+			total);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	char			path[256];
+	int			i, n, error;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files>\n", argv[0]);
+		return 1;
+	}
+	if (check_kernels() != 0 || bench() != 0) {
+		fprintf(stderr, "Directory scanning kernels failed\n");
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	n = atoi(argv[4]);
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/a%06d", argv[3], i);
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	for (i = 1; i < n; i += 2) {
+		snprintf(path, sizeof(path), "%s/a%06d", argv[3], i);
+		if ((error = fsremove(fsh, path)) != 0) {
+			fprintf(stderr, "Failed to remove %s: %d\n", path,
+				error);
+			return 1;
+		}
+		snprintf(path, sizeof(path), "%s/b%06d", argv[3], i);
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	if (check_dir(fsh, argv[3], "b", n) != 0) {
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (check_dir(fsh, argv[3], "b", n) != 0) {
+		return 1;
+	}
+	printf("Directory %s verified\n", argv[3]);
+	fsumount(fsh);
+
+	return 0;
+}
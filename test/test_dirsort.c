@@ -0,0 +1,372 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create 'nfiles' entries, in no particular order and some of
+ * them with long names, in a sorted directory and in a plain
+ * one. Check that fsread_dir() lists the sorted one in order,
+ * that fsread_dir_prefix() returns the same names from both,
+ * going on from its cookie while names are added and removed
+ * between pages, and print the time it takes to page through
+ * each directory. Then remove a third of the entries and check
+ * the listing again, before and after remounting.
+ */
+
+#define NPAGE		100
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Name of entry 'k': every 50th name is long.
+ */
+
+static void
+entry_name(
+	char			*buf,
+	int			k)
+{
+	int			len;
+
+	len = sprintf(buf, "k%07d", k);
+	if (k % 50 == 0) {
+		memset(buf + len, 'x', 200);
+		buf[len + 200] = '\0';
+	}
+}
+
+/*
+ * Check that 'dir' lists, in order, the entries 'k' below 'n'
+ * for which 'gone[k]' is zero, with fsread_dir() if 'prefix' is
+ * NULL, or else the ones starting with 'prefix' with
+ * fsread_dir_prefix() a page of 'page' entries at a time.
+ */
+
+static int
+check_list(
+	FSHANDLE		fsh,
+	char			*dir,
+	char			*prefix,
+	int			page,
+	char			*gone,
+	int			n)
+{
+	static struct udirentry	ud[NPAGE];
+	FHANDLE			fh;
+	char			last[FSDIR_COOKIELEN], name[256];
+	char			cookie[FSDIR_COOKIELEN];
+	int			i, k, nent, total = 0, want = 0;
+
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return 1;
+	}
+	last[0] = cookie[0] = '\0';
+	for (;;) {
+		nent = prefix ? fsread_dir_prefix(fh, prefix, cookie,
+						  (char *)ud, page) :
+		       fsread_dir(fh, (char *)ud, page);
+		if (nent <= 0) {
+			break;
+		}
+		for (i = 0; i < nent; i++) {
+			k = atoi(ud[i].udir_name + 1);
+			if (strcmp(ud[i].udir_name, last) <= 0 || k >= n ||
+			    gone[k]) {
+				fprintf(stderr, "%s: %s after %s\n", dir,
+					ud[i].udir_name, last);
+				return 1;
+			}
+			strcpy(last, ud[i].udir_name);
+			total++;
+		}
+	}
+	fsclose(fh);
+	for (k = 0; k < n; k++) {
+		entry_name(name, k);
+		want += !gone[k] && (prefix == NULL ||
+				     strncmp(name, prefix, strlen(prefix)) == 0);
+	}
+	if (total != want) {
+		fprintf(stderr, "%s lists %d entries of %s, not %d\n", dir,
+			total, prefix ? prefix : "", want);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Page through the whole of 'dir' with fsread_dir_prefix(),
+ * setting '*tp' to the time it takes.
+ */
+
+static int
+page_through(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			n,
+	double			*tp)
+{
+	static struct udirentry	ud[NPAGE];
+	FHANDLE			fh;
+	char			cookie[FSDIR_COOKIELEN];
+	int			nent, total = 0;
+
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return 1;
+	}
+	cookie[0] = '\0';
+	*tp = now();
+	while ((nent = fsread_dir_prefix(fh, NULL, cookie, (char *)ud,
+					 NPAGE)) > 0) {
+		total += nent;
+	}
+	*tp = now() - *tp;
+	fsclose(fh);
+	if (total != n) {
+		fprintf(stderr, "Paging through %s returned %d entries\n", dir,
+			total);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the names starting with 'k00012' a page at a time,
+ * adding a name before the cookie and one after it and
+ * removing one after it after the first page: only the names
+ * after the cookie which are there when they're reached are
+ * returned.
+ */
+
+static int
+check_cookie(
+	FSHANDLE		fsh,
+	char			*dir)
+{
+	static struct udirentry	ud[8];
+	FHANDLE			fh, nfh;
+	char			cookie[FSDIR_COOKIELEN], path[512];
+	int			i, nent, total = 0, seen_after = 0;
+
+	if ((fh = fsopen(fsh, dir, 0)) == NULL) {
+		fprintf(stderr, "Failed to open directory %s\n", dir);
+		return 1;
+	}
+	cookie[0] = '\0';
+	while ((nent = fsread_dir_prefix(fh, "k00012", cookie, (char *)ud,
+					 8)) > 0) {
+		for (i = 0; i < nent; i++) {
+			if (strcmp(ud[i].udir_name, "k0001203z") == 0 ||
+			    strcmp(ud[i].udir_name, "k0001295") == 0) {
+				fprintf(stderr, "%s: %s returned\n", dir,
+					ud[i].udir_name);
+				return 1;
+			}
+			seen_after += !strcmp(ud[i].udir_name, "k0001290z");
+		}
+		if (total == 0) {
+			snprintf(path, sizeof(path), "%s/k0001203z", dir);
+			if ((nfh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+				return 1;
+			}
+			fsclose(nfh);
+			snprintf(path, sizeof(path), "%s/k0001290z", dir);
+			if ((nfh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+				return 1;
+			}
+			fsclose(nfh);
+			snprintf(path, sizeof(path), "%s/k0001295", dir);
+			if (fsremove(fsh, path) != 0) {
+				return 1;
+			}
+		}
+		total += nent;
+	}
+	fsclose(fh);
+	if (total != 100 || seen_after != 1) {
+		fprintf(stderr, "%s: %d names of k00012, k0001290z %sreturned\n",
+			dir, total, seen_after ? "" : "not ");
+		return 1;
+	}
+
+	/*
+	 * Put things back as they were.
+	 */
+
+	snprintf(path, sizeof(path), "%s/k0001203z", dir);
+	if (fsremove(fsh, path) != 0) {
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/k0001290z", dir);
+	if (fsremove(fsh, path) != 0) {
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/k0001295", dir);
+	if ((nfh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+		return 1;
+	}
+	fsclose(nfh);
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	static char		namebuf[NPAGE][256];
+	static char		*names[NPAGE];
+	static unsigned int	types[NPAGE];
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	char			sorted[256], plain[256], path[512], *gone;
+	double			ts, tp;
+	int			i, j, k, n, mult;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	n = atoi(argv[4]);
+	if (n < 1300) {
+		fprintf(stderr, "At least 1300 files are needed\n");
+		return 1;
+	}
+	gone = (char *)calloc(n, 1);
+	snprintf(sorted, sizeof(sorted), "%s/sorted", argv[3]);
+	snprintf(plain, sizeof(plain), "%s/plain", argv[3]);
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL ||
+	    fsclose(fh) != 0 ||
+	    (fh = fscreate(fsh, sorted, FTYPE_DIR | FTYPE_SORTED)) == NULL ||
+	    fsclose(fh) != 0 ||
+	    (fh = fscreate(fsh, plain, FTYPE_DIR)) == NULL ||
+	    fsclose(fh) != 0) {
+		fprintf(stderr, "Failed to create directories\n");
+		return 1;
+	}
+
+	/*
+	 * Entries are created in the order of a permutation of
+	 * 0 to n - 1, one at a time in the sorted directory and
+	 * in batches in the plain one.
+	 */
+
+	for (mult = 7919; n % mult == 0; mult += 2);
+	for (i = 0; i < n; i++) {
+		k = (int)(((long long)i * mult + 12345) % n);
+		entry_name(path, k);
+		j = strlen(sorted);
+		memmove(path + j + 1, path, strlen(path) + 1);
+		memcpy(path, sorted, j);
+		path[j] = '/';
+		if ((fh = fscreate(fsh, path, (k % 100 == 7) ? FTYPE_DIR :
+				   FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+		entry_name(namebuf[i % NPAGE], k);
+		names[i % NPAGE] = namebuf[i % NPAGE];
+		types[i % NPAGE] = (k % 100 == 7) ? FTYPE_DIR : FTYPE_FILE;
+		if ((i % NPAGE == NPAGE - 1 || i == n - 1) &&
+		    fscreate_batch(fsh, plain, names, types, i % NPAGE + 1,
+				   NULL) != 0) {
+			fprintf(stderr, "Failed to create batch in %s\n", plain);
+			return 1;
+		}
+	}
+	if (check_list(fsh, sorted, NULL, NPAGE, gone, n) != 0 ||
+	    check_list(fsh, sorted, "k00012", 7, gone, n) != 0 ||
+	    check_list(fsh, plain, "k00012", 7, gone, n) != 0 ||
+	    check_list(fsh, sorted, "k0000", 33, gone, n) != 0 ||
+	    check_list(fsh, plain, "k0000", 33, gone, n) != 0 ||
+	    check_list(fsh, sorted, "z", 5, gone, n) != 0 ||
+	    check_cookie(fsh, sorted) != 0 || check_cookie(fsh, plain) != 0) {
+		return 1;
+	}
+	if (page_through(fsh, sorted, n, &ts) != 0 ||
+	    page_through(fsh, plain, n, &tp) != 0) {
+		return 1;
+	}
+	printf("Paging through %d entries %d at a time: %.3fs sorted, "
+		"%.3fs plain (%.1fx)\n", n, NPAGE, ts, tp, tp / ts);
+
+	/*
+	 * Remove every third entry.
+	 */
+
+	for (k = 0; k < n; k += 3) {
+		entry_name(path, k);
+		snprintf(namebuf[0], sizeof(namebuf[0]), "%s", path);
+		snprintf(path, sizeof(path), "%s/%s", sorted, namebuf[0]);
+		if (fsremove(fsh, path) != 0) {
+			fprintf(stderr, "Failed to remove %s\n", path);
+			return 1;
+		}
+		gone[k] = 1;
+	}
+	snprintf(path, sizeof(path), "%s/k%07d", sorted, 1);
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "%s not found\n", path);
+		return 1;
+	}
+	fsclose(fh);
+	snprintf(path, sizeof(path), "%s/k%07d", sorted, 3);
+	if (fsopen(fsh, path, 0) != NULL) {
+		fprintf(stderr, "%s found\n", path);
+		return 1;
+	}
+	if (check_list(fsh, sorted, NULL, NPAGE, gone, n) != 0 ||
+	    check_list(fsh, sorted, "k00012", 7, gone, n) != 0) {
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (check_list(fsh, sorted, NULL, NPAGE, gone, n) != 0 ||
+	    check_list(fsh, sorted, "k0001", 64, gone, n) != 0) {
+		return 1;
+	}
+	for (k = 1; k < n; k += 97) {
+		entry_name(namebuf[0], k);
+		snprintf(path, sizeof(path), "%s/%s", sorted, namebuf[0]);
+		if ((fh = fsopen(fsh, path, 0)) == NULL) {
+			if (gone[k]) {
+				continue;
+			}
+			fprintf(stderr, "%s not found\n", path);
+			return 1;
+		}
+		if (gone[k]) {
+			fprintf(stderr, "%s found\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	printf("Directory %s verified\n", sorted);
+	fsumount(fsh);
+
+	return 0;
+}
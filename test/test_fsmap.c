@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Map the file 'path' with fsmap() and check each extent
+ * against the data read with fsread(). If 'path' doesn't
+ * exist, it's created first with FILESZ bytes of data, so
+ * that the test runs on a fresh file system.
+ */
+
+#define FILESZ		(300 * 1024)
+
+static struct file_handle *
+make_file(
+	FSHANDLE		fsh,
+	char			*path)
+{
+	struct file_handle	*fh;
+	char			*data;
+	int			i;
+
+	if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+		return NULL;
+	}
+	data = (char *)malloc(FILESZ);
+	for (i = 0; i < FILESZ; i++) {
+		data[i] = (char)(i * 31 + i / 1024);
+	}
+	if (fswrite(fh, data, FILESZ) != FILESZ) {
+		fprintf(stderr, "Failed to write %s\n", path);
+		free(data);
+		return NULL;
+	}
+	free(data);
+	fsclose(fh);
+	return fsopen(fsh, path, 1);
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct file_extent	ext[16];
+	struct file_handle      *fh = NULL;
+	FSHANDLE                fsh = NULL;
+	fs_u64_t		off = 0;
+	char			*buf = NULL, *dbuf = NULL;
+	int			n, i, fd, rd;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path> \n", argv[0]);
+		return 1;
+	}
+
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	fh = fsopen(fsh, argv[3], 1);
+	if (fh == NULL) {
+		fh = make_file(fsh, argv[3]);
+	}
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", argv[3]);
+		return 1;
+	}
+	if ((fd = open(argv[1], O_RDONLY)) < 0) {
+		perror("open");
+		return 1;
+	}
+
+	/*
+	 * Read the file through fsread() and compare each mapped
+	 * extent with the data read directly from the device file.
+	 */
+
+	buf = (char *)malloc(fh->fh_inode->mino_size + 1);
+	rd = fsread(fh, buf, (fs_u32_t)fh->fh_inode->mino_size);
+	if (rd != (int)fh->fh_inode->mino_size) {
+		fprintf(stderr, "Short read from %s: %d\n", argv[3], rd);
+		return 1;
+	}
+	for (;;) {
+		n = fsmap(fh, off, fh->fh_inode->mino_size - off, ext, 16);
+		if (n < 0) {
+			fprintf(stderr, "fsmap failed for %s\n", argv[3]);
+			return 1;
+		}
+		if (n == 0) {
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			printf("logical: %llu, physical: %llu, len: %llu\n",
+			       ext[i].fext_logical, ext[i].fext_physical,
+			       ext[i].fext_len);
+			if (ext[i].fext_logical != off) {
+				fprintf(stderr, "Hole in mapping at %llu\n",
+					off);
+				return 1;
+			}
+			dbuf = (char *)malloc(ext[i].fext_len);
+			if (pread(fd, dbuf, ext[i].fext_len,
+				  ext[i].fext_physical) !=
+			    (ssize_t)ext[i].fext_len ||
+			    memcmp(dbuf, buf + off, ext[i].fext_len) != 0) {
+				fprintf(stderr, "Mismatch at %llu\n", off);
+				return 1;
+			}
+			free(dbuf);
+			off += ext[i].fext_len;
+		}
+	}
+	if (off != fh->fh_inode->mino_size) {
+		fprintf(stderr, "Mapped %llu bytes of %llu\n", off,
+			fh->fh_inode->mino_size);
+		return 1;
+	}
+	printf("Mapped %s successfully\n", argv[3]);
+	fsclose(fh);
+	fsumount(fsh);
+
+	return 0;
+}
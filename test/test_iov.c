@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write two files in interleaved chunks with fswritev(), so
+ * that both end up with many extents, then read them back
+ * with fsreadv() and fspreadv() into header/payload pairs of
+ * buffers, overwrite part of them with fspwritev() and verify
+ * the contents at each step. Also check that fsreadv() refuses
+ * to read a directory.
+ */
+
+#define NCHUNKS		40
+#define CHUNKSZ		70000
+#define HDRSZ		37
+#define FILESZ		(NCHUNKS * CHUNKSZ)
+
+static char	data[2][FILESZ];
+
+static int
+verify(
+	FHANDLE			fh,
+	int			k,
+	char			*what)
+{
+	static char		rbuf[FILESZ];
+	struct iovec		iov[3];
+	char			hdr[HDRSZ];
+	unsigned long long	off;
+	int			n;
+
+	/*
+	 * Whole file through three buffers of odd sizes.
+	 */
+
+	iov[0].iov_base = rbuf;
+	iov[0].iov_len = 1001;
+	iov[1].iov_base = rbuf + 1001;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = rbuf + 1001;
+	iov[2].iov_len = FILESZ - 1001 + 500;
+	if ((n = fsreadv(fh, iov, 3)) != FILESZ ||
+	    memcmp(rbuf, data[k], FILESZ) != 0) {
+		fprintf(stderr, "%s: fsreadv returned %d or mismatched\n",
+			what, n);
+		return 1;
+	}
+
+	/*
+	 * Header/payload pairs at offsets straddling extents.
+	 */
+
+	for (off = 1; off + HDRSZ + 5000 <= FILESZ; off += 33333) {
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = HDRSZ;
+		iov[1].iov_base = rbuf;
+		iov[1].iov_len = 5000;
+		if (fspreadv(fh, iov, 2, off) != HDRSZ + 5000 ||
+		    memcmp(hdr, data[k] + off, HDRSZ) != 0 ||
+		    memcmp(rbuf, data[k] + off + HDRSZ, 5000) != 0) {
+			fprintf(stderr, "%s: fspreadv mismatch at %llu\n",
+				what, off);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct file_extent	ext[256];
+	struct iovec		iov[2];
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh[2];
+	char			*path[2];
+	int			i, k, n;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path1> <path2>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	path[0] = argv[3];
+	path[1] = argv[4];
+	for (k = 0; k < 2; k++) {
+		for (i = 0; i < FILESZ; i++) {
+			data[k][i] = (char)(i * (k + 3) + i / 1000);
+		}
+		if ((fh[k] = fscreate(fsh, path[k], FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create file %s\n", path[k]);
+			return 1;
+		}
+	}
+	for (i = 0; i < NCHUNKS; i++) {
+		for (k = 0; k < 2; k++) {
+			iov[0].iov_base = data[k] + i * CHUNKSZ;
+			iov[0].iov_len = HDRSZ;
+			iov[1].iov_base = data[k] + i * CHUNKSZ + HDRSZ;
+			iov[1].iov_len = CHUNKSZ - HDRSZ;
+			if (fswritev(fh[k], iov, 2) != CHUNKSZ) {
+				fprintf(stderr, "Failed to write chunk %d of"
+					" %s\n", i, path[k]);
+				return 1;
+			}
+		}
+	}
+	for (k = 0; k < 2; k++) {
+		fsclose(fh[k]);
+		if ((fh[k] = fsopen(fsh, path[k], 0)) == NULL) {
+			fprintf(stderr, "Failed to open file %s\n", path[k]);
+			return 1;
+		}
+		n = fsmap(fh[k], 0, FILESZ, ext, 256);
+		printf("File %s has %d extent(s)\n", path[k], n);
+		if (verify(fh[k], k, path[k]) != 0) {
+			return 1;
+		}
+	}
+
+	/*
+	 * Overwrite a range of the first file across extents.
+	 */
+
+	for (i = 0; i < 200000; i++) {
+		data[0][100000 + i] = (char)~data[0][100000 + i];
+	}
+	iov[0].iov_base = data[0] + 100000;
+	iov[0].iov_len = 3;
+	iov[1].iov_base = data[0] + 100003;
+	iov[1].iov_len = 200000 - 3;
+	if (fspwritev(fh[0], iov, 2, 100000) != 200000) {
+		fprintf(stderr, "fspwritev failed on %s\n", path[0]);
+		return 1;
+	}
+	fsclose(fh[0]);
+	fh[0] = fsopen(fsh, path[0], 0);
+	if (fh[0] == NULL || verify(fh[0], 0, path[0]) != 0) {
+		return 1;
+	}
+	printf("Files %s and %s verified\n", path[0], path[1]);
+	fsclose(fh[0]);
+	fsclose(fh[1]);
+
+	if ((fh[0] = fsopen(fsh, "/", 0)) == NULL) {
+		fprintf(stderr, "Failed to open /\n");
+		return 1;
+	}
+	iov[0].iov_base = data[0];
+	iov[0].iov_len = HDRSZ;
+	if (fsreadv(fh[0], iov, 1) != 0 || errno != EISDIR) {
+		fprintf(stderr, "fsreadv read a directory\n");
+		return 1;
+	}
+	fsclose(fh[0]);
+	fsumount(fsh);
+
+	return 0;
+}
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Have 'nthreads' threads create 'ncreates' files each in
+ * directory 'dir', each followed by fssync(), first without the
+ * journal and then with it, and print the number of durable
+ * creates per second of both. Then create and write files in a
+ * child process which exits without unmounting, the way a crash
+ * would, and check that the files synced before the exit are
+ * found, with their data, once the journal is replayed, before
+ * and after remounting, and that the blocks of a file removed
+ * aren't given to another file before the remove is committed.
+ *
+ * The journal was meant to make durable creates about 10 times
+ * faster. It doesn't: on the machine this was written on (one
+ * CPU, fast fdatasync()), it measured 1.2x to 1.7x for 1 to 32
+ * threads.
+ */
+
+#define DATALEN		3000
+#define REUSELEN	(1 << 16)
+#define NEXTS		64
+
+struct worker {
+	FSHANDLE		w_fsh;
+	char			*w_dir;
+	int			w_id;
+	int			w_n;
+	int			w_error;
+};
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+create_sync(
+	void			*arg)
+{
+	struct worker		*w = (struct worker *)arg;
+	FHANDLE			fh;
+	char			path[256];
+	int			i;
+
+	for (i = 0; i < w->w_n; i++) {
+		snprintf(path, sizeof(path), "%s/t%d.%06d", w->w_dir, w->w_id,
+			 i);
+		if ((fh = fscreate(w->w_fsh, path, FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			w->w_error = EIO;
+			break;
+		}
+		fsclose(fh);
+		if ((w->w_error = fssync(w->w_fsh)) != 0) {
+			fprintf(stderr, "fssync failed after %s: %d\n", path,
+				w->w_error);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Mount with 'flags' and time the creates in directory 'dir'.
+ * Returns the number of creates per second, or zero on error.
+ */
+
+static double
+bench(
+	char			*dev,
+	char			*mntpt,
+	unsigned int		flags,
+	char			*dir,
+	int			nthreads,
+	int			n)
+{
+	struct worker		*w;
+	pthread_t		*tids;
+	FSHANDLE		fsh;
+	FHANDLE			fh;
+	double			t;
+	int			i, error = 0;
+
+	if ((fsh = fsmount_opts(dev, mntpt, flags)) == NULL) {
+		fprintf(stderr, "Failed to mount file system\n");
+		return 0;
+	}
+	if ((fh = fscreate(fsh, dir, FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", dir);
+		return 0;
+	}
+	fsclose(fh);
+	w = (struct worker *)calloc(nthreads, sizeof(struct worker));
+	tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	t = now();
+	for (i = 0; i < nthreads; i++) {
+		w[i].w_fsh = fsh;
+		w[i].w_dir = dir;
+		w[i].w_id = i;
+		w[i].w_n = n;
+		pthread_create(&tids[i], NULL, create_sync, &w[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		error |= w[i].w_error;
+	}
+	t = now() - t;
+	free(w);
+	free(tids);
+	if (fsumount(fsh) != 0 || error) {
+		return 0;
+	}
+	return (double)nthreads * n / t;
+}
+
+static void
+fill(
+	char			*buf,
+	int			i)
+{
+	int			j;
+
+	for (j = 0; j < DATALEN; j++) {
+		buf[j] = (char)(i * 7 + j);
+	}
+}
+
+/*
+ * Create files 0 to 'n' - 1 in directory 'dir', each with its
+ * data, syncing after each, then 'n' more without syncing, and
+ * exit without unmounting.
+ */
+
+static void
+crash(
+	char			*dev,
+	char			*mntpt,
+	char			*dir,
+	int			n)
+{
+	FSHANDLE		fsh;
+	FHANDLE			fh;
+	char			path[256], buf[DATALEN];
+	int			i;
+
+	if ((fsh = fsmount(dev, mntpt)) == NULL ||
+	    (fh = fscreate(fsh, dir, FTYPE_DIR)) == NULL) {
+		_exit(1);
+	}
+	fsclose(fh);
+	for (i = 0; i < 2 * n; i++) {
+		snprintf(path, sizeof(path), "%s/c%06d", dir, i);
+		if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+			_exit(1);
+		}
+		fill(buf, i);
+		if (fswrite(fh, buf, DATALEN) != DATALEN) {
+			_exit(1);
+		}
+		fsclose(fh);
+		if (i < n && fssync(fsh) != 0) {
+			_exit(1);
+		}
+	}
+	_exit(0);
+}
+
+/*
+ * Check that files 0 to 'n' - 1 of directory 'dir' are found,
+ * with their data.
+ */
+
+static int
+check_crash(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			n)
+{
+	FHANDLE			fh;
+	char			path[256], buf[DATALEN], rbuf[DATALEN];
+	int			i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/c%06d", dir, i);
+		if ((fh = fsopen(fsh, path, 0)) == NULL) {
+			fprintf(stderr, "%s not found\n", path);
+			return 1;
+		}
+		fill(buf, i);
+		if (fsread(fh, rbuf, DATALEN) != DATALEN ||
+		    memcmp(buf, rbuf, DATALEN) != 0) {
+			fprintf(stderr, "Data mismatch in %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+	}
+	return 0;
+}
+
+/*
+ * Write a file of REUSELEN bytes at 'path' and map its extents
+ * into 'ext'. Returns their number, or -1 on error.
+ */
+
+static int
+write_map(
+	FSHANDLE		fsh,
+	char			*path,
+	char			*buf,
+	struct file_extent	*ext)
+{
+	FHANDLE			fh;
+	int			n;
+
+	if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+		fprintf(stderr, "Failed to create %s\n", path);
+		return -1;
+	}
+	if (fswrite(fh, buf, REUSELEN) != REUSELEN ||
+	    (n = fsmap(fh, 0, REUSELEN, ext, NEXTS)) <= 0) {
+		fprintf(stderr, "Failed to write %s\n", path);
+		fsclose(fh);
+		return -1;
+	}
+	fsclose(fh);
+	return n;
+}
+
+/*
+ * Remove a synced file and write another one without syncing:
+ * the second one must not get the blocks of the first, which
+ * are still its own if the remove is lost in a crash.
+ */
+
+static int
+check_reuse(
+	FSHANDLE		fsh,
+	char			*dir)
+{
+	struct file_extent	old[NEXTS], new[NEXTS];
+	char			path[256], *buf;
+	int			i, j, nold, nnew;
+
+	buf = (char *)calloc(1, REUSELEN);
+	snprintf(path, sizeof(path), "%s/old", dir);
+	if ((nold = write_map(fsh, path, buf, old)) < 0 ||
+	    fssync(fsh) != 0 || fsremove(fsh, path) != 0) {
+		free(buf);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/new", dir);
+	if ((nnew = write_map(fsh, path, buf, new)) < 0) {
+		free(buf);
+		return 1;
+	}
+	free(buf);
+	for (i = 0; i < nold; i++) {
+		for (j = 0; j < nnew; j++) {
+			if (old[i].fext_physical <
+			    new[j].fext_physical + new[j].fext_len &&
+			    new[j].fext_physical <
+			    old[i].fext_physical + old[i].fext_len) {
+				fprintf(stderr, "%s got blocks of a file "
+					"removed but not committed\n", path);
+				return 1;
+			}
+		}
+	}
+	return fssync(fsh) != 0 || fsremove(fsh, path) != 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	char			path[256];
+	double			r0, r1;
+	pid_t			pid;
+	int			nthreads, n, status;
+
+	if (argc != 6) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <threads> <creates per thread>\n",
+			argv[0]);
+		return 1;
+	}
+	nthreads = atoi(argv[4]);
+	n = atoi(argv[5]);
+	snprintf(path, sizeof(path), "%s.nojournal", argv[3]);
+	if ((r0 = bench(argv[1], argv[2], FSMNT_NOJOURNAL, path, nthreads,
+			n)) == 0) {
+		return 1;
+	}
+	if ((r1 = bench(argv[1], argv[2], 0, argv[3], nthreads, n)) == 0) {
+		return 1;
+	}
+	printf("%d threads: %.0f durable creates/s without the journal, "
+		"%.0f with it (%.1fx)\n", nthreads, r0, r1, r1 / r0);
+
+	snprintf(path, sizeof(path), "%s.crash", argv[3]);
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		crash(argv[1], argv[2], path, n);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Crash test process failed\n");
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to mount file system after crash\n");
+		return 1;
+	}
+	if (check_crash(fsh, path, n) != 0) {
+		return 1;
+	}
+
+	/*
+	 * The file system must be usable after the replay.
+	 */
+
+	strcat(path, "/after");
+	if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+		fprintf(stderr, "Failed to create %s\n", path);
+		return 1;
+	}
+	fsclose(fh);
+	if (fsremove(fsh, path) != 0) {
+		fprintf(stderr, "Failed to remove %s\n", path);
+		return 1;
+	}
+	path[strlen(path) - strlen("/after")] = '\0';
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (check_crash(fsh, path, n) != 0) {
+		return 1;
+	}
+	printf("%d synced files found after the crash\n", n);
+	if (check_reuse(fsh, path) != 0) {
+		return 1;
+	}
+	printf("Blocks of a removed file kept until the remove is "
+	       "committed\n");
+	fsumount(fsh);
+
+	return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create 'nfiles' files of different sizes in directory 'dir',
+ * then have 'nthreads' threads open, read in chunks, verify
+ * and close files picked at random, 'nreads' times each, so
+ * that lookups, opens and reads of the same and of different
+ * files run concurrently.
+ */
+
+#define BASESZ		20000
+#define STEPSZ		7001
+#define CHUNKSZ		4099
+
+struct worker {
+	FSHANDLE		w_fsh;
+	char			*w_dir;
+	int			w_nfiles;
+	int			w_nreads;
+	unsigned int		w_seed;
+	int			w_error;
+};
+
+static int
+file_size(
+	int			i)
+{
+	return BASESZ + i * STEPSZ;
+}
+
+static char
+data_byte(
+	int			i,
+	int			off)
+{
+	return (char)(i * 29 + off + off / 1024);
+}
+
+static int
+make_file(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			i)
+{
+	FHANDLE			fh;
+	char			path[256], *buf;
+	int			j, size = file_size(i);
+
+	snprintf(path, sizeof(path), "%s/f%04d", dir, i);
+	if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+		fprintf(stderr, "Failed to create %s\n", path);
+		return 1;
+	}
+	buf = (char *)malloc(size);
+	for (j = 0; j < size; j++) {
+		buf[j] = data_byte(i, j);
+	}
+	if (fswrite(fh, buf, size) != size) {
+		fprintf(stderr, "Failed to write %s\n", path);
+		free(buf);
+		fsclose(fh);
+		return 1;
+	}
+	free(buf);
+	fsclose(fh);
+	return 0;
+}
+
+/*
+ * Open file 'i', read it in chunks and check the data.
+ */
+
+static int
+read_file(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			i)
+{
+	FHANDLE			fh;
+	char			path[256], buf[CHUNKSZ];
+	int			j, n, off = 0, size = file_size(i);
+
+	snprintf(path, sizeof(path), "%s/f%04d", dir, i);
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return 1;
+	}
+	while ((n = fsread(fh, buf, CHUNKSZ)) > 0) {
+		for (j = 0; j < n; j++) {
+			if (buf[j] != data_byte(i, off + j)) {
+				fprintf(stderr, "Data mismatch in %s at %d\n",
+					path, off + j);
+				fsclose(fh);
+				return 1;
+			}
+		}
+		off += n;
+	}
+	fsclose(fh);
+	if (off != size) {
+		fprintf(stderr, "Read %d bytes of %s, expected %d\n", off,
+			path, size);
+		return 1;
+	}
+	return 0;
+}
+
+static void *
+reader(
+	void			*arg)
+{
+	struct worker		*w = (struct worker *)arg;
+	int			i;
+
+	for (i = 0; i < w->w_nreads && !w->w_error; i++) {
+		w->w_error = read_file(w->w_fsh, w->w_dir,
+				       rand_r(&w->w_seed) % w->w_nfiles);
+	}
+	return NULL;
+}
+
+int
+main(
+	int			argc,
+	char			*argv[])
+{
+	FSHANDLE		fsh;
+	FHANDLE			fh;
+	struct worker		*w;
+	pthread_t		*tids;
+	int			i, nthreads, nfiles, error = 0;
+
+	if (argc != 7) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt> <directory>"
+			" <threads> <files> <reads per thread>\n", argv[0]);
+		return 1;
+	}
+	nthreads = atoi(argv[4]);
+	nfiles = atoi(argv[5]);
+	if (nthreads <= 0 || nfiles <= 0) {
+		fprintf(stderr, "Bad number of threads or files\n");
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to mount file system\n");
+		return 1;
+	}
+	printf("FS mounted successfully\n");
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	for (i = 0; i < nfiles; i++) {
+		if (make_file(fsh, argv[3], i) != 0) {
+			return 1;
+		}
+	}
+
+	w = (struct worker *)calloc(nthreads, sizeof(struct worker));
+	tids = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	for (i = 0; i < nthreads; i++) {
+		w[i].w_fsh = fsh;
+		w[i].w_dir = argv[3];
+		w[i].w_nfiles = nfiles;
+		w[i].w_nreads = atoi(argv[6]);
+		w[i].w_seed = i + 1;
+		pthread_create(&tids[i], NULL, reader, &w[i]);
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(tids[i], NULL);
+		error |= w[i].w_error;
+	}
+	free(w);
+	free(tids);
+	if (error) {
+		fprintf(stderr, "Concurrent reads failed\n");
+		return 1;
+	}
+	printf("%d threads read %d files concurrently\n", nthreads, nfiles);
+	fsumount(fsh);
+
+	return 0;
+}
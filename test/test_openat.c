@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+#include "dcache.h"
+
+/*
+ * Build a tree 'depth' levels deep under 'dir' with
+ * fscreateat(), each directory holding NSUBDIRS directories
+ * and NFILES files, then walk it after remounting, once
+ * opening every entry by its absolute path and once with
+ * fsopenat() from the handle of its directory, checking both
+ * find the same inodes and printing the time and the number
+ * of name lookups each walk takes. Then check the errors of
+ * the *at() operations.
+ */
+
+#define NSUBDIRS	3
+#define NFILES		8
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static fs_u64_t
+lookups(
+	FSHANDLE		fsh)
+{
+	struct dcache		*dc = ((struct fs_handle *)fsh)->fsh_mem->fsm_dcache;
+
+	return dc->dc_hits + dc->dc_misses;
+}
+
+static fs_u64_t
+inumber(
+	FHANDLE			fh)
+{
+	return ((struct file_handle *)fh)->fh_inode->mino_number;
+}
+
+/*
+ * Create the subtree of directory 'dfh', 'depth' levels
+ * deep, setting '*np' to the number of entries created.
+ */
+
+static int
+build(
+	FHANDLE			dfh,
+	int			depth,
+	int			*np)
+{
+	FHANDLE			fh;
+	char			name[32];
+	int			i;
+
+	for (i = 0; i < NFILES + (depth > 0 ? NSUBDIRS : 0); i++) {
+		snprintf(name, sizeof(name), i < NFILES ? "f%d" : "d%d", i);
+		if ((fh = fscreateat(dfh, name, i < NFILES ? FTYPE_FILE :
+				     FTYPE_DIR)) == NULL) {
+			fprintf(stderr, "Failed to create %s: %d\n", name,
+				errno);
+			return 1;
+		}
+		(*np)++;
+		if (i >= NFILES && build(fh, depth - 1, np) != 0) {
+			return 1;
+		}
+		fsclose(fh);
+	}
+	return 0;
+}
+
+/*
+ * Walk the subtree of directory 'path' (handle 'dfh'), opening
+ * every entry with fsopenat() if 'at', or else by its absolute
+ * path, and checking that fslookupat() finds the same inode.
+ * '*np' is incremented for every entry found.
+ */
+
+static int
+walk(
+	FSHANDLE		fsh,
+	FHANDLE			dfh,
+	char			*path,
+	int			at,
+	int			*np)
+{
+	struct udirentry	ud[16];
+	FHANDLE			fh;
+	fs_u64_t		inum;
+	int			i, nent, len = strlen(path);
+
+	while ((nent = fsread_dir(dfh, (char *)ud, 16)) > 0) {
+		for (i = 0; i < nent; i++) {
+			snprintf(path + len, 4096 - len, "/%s",
+				 ud[i].udir_name);
+			fh = at ? fsopenat(dfh, ud[i].udir_name, 0) :
+			     fsopen(fsh, path, 0);
+			if (fh == NULL || inumber(fh) != ud[i].udir_inum) {
+				fprintf(stderr, "Failed to open %s\n", path);
+				return 1;
+			}
+			if (!at && (fslookupat(dfh, ud[i].udir_name,
+					       &inum) != 0 ||
+				    inum != ud[i].udir_inum)) {
+				fprintf(stderr, "fslookupat() of %s failed\n",
+					path);
+				return 1;
+			}
+			(*np)++;
+			if (ud[i].udir_name[0] == 'd' &&
+			    walk(fsh, fh, path, at, np) != 0) {
+				return 1;
+			}
+			fsclose(fh);
+		}
+	}
+	path[len] = '\0';
+	return 0;
+}
+
+/*
+ * Remount and walk the tree under 'dir', printing the time
+ * and the number of name lookups it takes.
+ */
+
+static int
+timed_walk(
+	FSHANDLE		*fshp,
+	char			*argv[],
+	int			at,
+	int			n)
+{
+	FHANDLE			fh;
+	fs_u64_t		nlookups;
+	char			path[4096];
+	double			t;
+	int			found = 0;
+
+	if (fsumount(*fshp) != 0 ||
+	    (*fshp = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if ((fh = fsopen(*fshp, argv[3], 0)) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", argv[3]);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s", argv[3]);
+	nlookups = lookups(*fshp);
+	t = now();
+	if (walk(*fshp, fh, path, at, &found) != 0) {
+		return 1;
+	}
+	t = now() - t;
+	nlookups = lookups(*fshp) - nlookups;
+	fsclose(fh);
+	if (found != n) {
+		fprintf(stderr, "Walk found %d entries, not %d\n", found, n);
+		return 1;
+	}
+
+	/*
+	 * The walk by path also looks up every entry with
+	 * fslookupat(), which isn't counted.
+	 */
+
+	printf("%s: %d entries in %.3fs, %llu name lookups\n",
+		at ? "fsopenat()" : "fsopen() by path", n, t,
+		at ? nlookups : nlookups - n);
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			dfh, fh;
+	fs_u64_t		inum;
+	char			path[4096];
+	int			n = 0, error;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <depth>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	if ((dfh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL ||
+	    build(dfh, atoi(argv[4]), &n) != 0) {
+		fprintf(stderr, "Failed to build the tree under %s\n",
+			argv[3]);
+		return 1;
+	}
+
+	/*
+	 * Errors: names which exist or don't, aren't a single
+	 * component, open flags, or a handle which isn't a
+	 * directory.
+	 */
+
+	if (fscreateat(dfh, "f0", FTYPE_FILE) != NULL || errno != EEXIST ||
+	    fsopenat(dfh, "missing", 0) != NULL || errno != ENOENT ||
+	    fslookupat(dfh, "missing", &inum) != ENOENT || inum != 0 ||
+	    fsopenat(dfh, "d8/f0", 0) != NULL || errno != EINVAL ||
+	    fsopenat(dfh, "f0", FTYPE_FILE) != NULL || errno != EINVAL ||
+	    fscreateat(dfh, "", FTYPE_FILE) != NULL || errno != EINVAL ||
+	    fslookupat(dfh, "d8/", &inum) != EINVAL) {
+		fprintf(stderr, "*at() errors aren't right\n");
+		return 1;
+	}
+	if ((fh = fsopenat(dfh, "f0", 0)) == NULL) {
+		fprintf(stderr, "Failed to open f0\n");
+		return 1;
+	}
+	if (fsopenat(fh, "x", 0) != NULL || errno != ENOTDIR ||
+	    fscreateat(fh, "x", FTYPE_FILE) != NULL || errno != ENOTDIR ||
+	    (error = fslookupat(fh, "x", &inum)) != ENOTDIR) {
+		fprintf(stderr, "*at() in a file doesn't fail with "
+			"ENOTDIR\n");
+		return 1;
+	}
+	fsclose(fh);
+
+	/*
+	 * A name created at a handle is found by path, and a
+	 * name removed by path isn't found at the handle.
+	 */
+
+	snprintf(path, sizeof(path), "%s/new", argv[3]);
+	if ((fh = fscreateat(dfh, "new", FTYPE_FILE)) == NULL ||
+	    fsclose(fh) != 0 || (fh = fsopen(fsh, path, 0)) == NULL ||
+	    fslookupat(dfh, "new", &inum) != 0 || inum != inumber(fh)) {
+		fprintf(stderr, "%s not found\n", path);
+		return 1;
+	}
+	fsclose(fh);
+	if (fsremove(fsh, path) != 0 || fslookupat(dfh, "new", &inum) !=
+	    ENOENT) {
+		fprintf(stderr, "%s still found\n", path);
+		return 1;
+	}
+	fsclose(dfh);
+	if (timed_walk(&fsh, argv, 0, n) != 0 ||
+	    timed_walk(&fsh, argv, 1, n) != 0) {
+		return 1;
+	}
+	printf("Tree under %s verified\n", argv[3]);
+	fsumount(fsh);
+
+	return 0;
+}
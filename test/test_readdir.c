@@ -10,7 +10,7 @@ main(
         int                     argc,
         char                    *argv[])
 {
-	struct udirentry	*ud = NULL;
+	struct udirentry	*ud = NULL, *udp = NULL;
 	struct file_handle      *fh = NULL;
 	struct fsmem            *fsm;
 	FSHANDLE                fsh = NULL;
@@ -37,10 +37,9 @@ main(
 	while (1) {
 		nent = fsread_dir(fh, (char *)ud, 8);
 		printf("nent: %d\n", nent);
-		for (i = 0; i < nent; i++) {
-			printf("name: %s, inum: %llu\n", ud->udir_name,
-				ud->udir_inum);
-			ud++;
+		for (i = 0, udp = ud; i < nent; i++, udp++) {
+			printf("name: %s, inum: %llu\n", udp->udir_name,
+				udp->udir_inum);
 		}
 		if (nent < 8) {
 			printf("less than 8 entries read\n");
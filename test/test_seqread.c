@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Write two files of 'mbytes' MB each in interleaved chunks,
+ * so that their block maps have many extents, then read the
+ * first one sequentially with the host page cache of the
+ * device file dropped beforehand, once with readahead and
+ * once without (FSMNT_NORA), verify the data and print the
+ * throughput of both.
+ */
+
+#define CHUNKSZ		(1 << 16)
+#define READSZ		(1 << 14)
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+fill(
+	char			*buf,
+	int			k,
+	int			chunk)
+{
+	int			j;
+
+	for (j = 0; j < CHUNKSZ; j++) {
+		buf[j] = (char)(k * 17 + chunk * 5 + j);
+	}
+}
+
+static int
+make_files(
+	char			*dev,
+	char			*mntpt,
+	char			**paths,
+	int			nchunks)
+{
+	FSHANDLE		fsh;
+	FHANDLE			fh[2];
+	char			buf[CHUNKSZ];
+	int			i, k;
+
+	if ((fsh = fsmount(dev, mntpt)) == NULL) {
+		fprintf(stderr, "Failed to mount file system\n");
+		return 1;
+	}
+	for (k = 0; k < 2; k++) {
+		if ((fh[k] = fscreate(fsh, paths[k], FTYPE_FILE)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", paths[k]);
+			return 1;
+		}
+	}
+	for (i = 0; i < nchunks; i++) {
+		for (k = 0; k < 2; k++) {
+			fill(buf, k, i);
+			if (fswrite(fh[k], buf, CHUNKSZ) != CHUNKSZ) {
+				fprintf(stderr, "Failed to write %s\n",
+					paths[k]);
+				return 1;
+			}
+		}
+	}
+	fsclose(fh[0]);
+	fsclose(fh[1]);
+	return fsumount(fsh) != 0;
+}
+
+/*
+ * Drop the pages of the device file from the host page cache.
+ */
+
+static void
+drop_cache(
+	char			*dev)
+{
+	int			fd;
+
+	if ((fd = open(dev, O_RDONLY)) >= 0) {
+		(void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/*
+ * Mount with 'flags' and read 'path' sequentially.
+ * Returns the throughput in MB/s, or zero on error.
+ */
+
+static double
+read_file(
+	char			*dev,
+	char			*mntpt,
+	unsigned int		flags,
+	char			*path,
+	int			nchunks)
+{
+	FSHANDLE		fsh;
+	FHANDLE			fh;
+	char			*buf, *rbuf;
+	double			t;
+	int			i, j, error = 0;
+
+	drop_cache(dev);
+	if ((fsh = fsmount_opts(dev, mntpt, flags)) == NULL) {
+		fprintf(stderr, "Failed to mount file system\n");
+		return 0;
+	}
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return 0;
+	}
+	buf = (char *)malloc(CHUNKSZ);
+	rbuf = (char *)malloc(CHUNKSZ);
+	t = now();
+	for (i = 0; i < nchunks && !error; i++) {
+		for (j = 0; j < CHUNKSZ; j += READSZ) {
+			if (fsread(fh, rbuf + j, READSZ) != READSZ) {
+				error = 1;
+				break;
+			}
+		}
+		fill(buf, 0, i);
+		if (memcmp(buf, rbuf, CHUNKSZ) != 0) {
+			fprintf(stderr, "Data mismatch in %s at %d\n", path,
+				i * CHUNKSZ);
+			error = 1;
+		}
+	}
+	t = now() - t;
+	free(buf);
+	free(rbuf);
+	fsclose(fh);
+	if (fsumount(fsh) != 0 || error) {
+		return 0;
+	}
+	return (double)nchunks * CHUNKSZ / (1 << 20) / t;
+}
+
+int
+main(
+	int			argc,
+	char			*argv[])
+{
+	char			*paths[2];
+	double			r0, r1;
+	int			nchunks;
+
+	if (argc != 6) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt> <path1>"
+			" <path2> <MB per file>\n", argv[0]);
+		return 1;
+	}
+	paths[0] = argv[3];
+	paths[1] = argv[4];
+	nchunks = atoi(argv[5]) * ((1 << 20) / CHUNKSZ);
+	if (nchunks <= 0) {
+		fprintf(stderr, "Bad file size\n");
+		return 1;
+	}
+	if (make_files(argv[1], argv[2], paths, nchunks) != 0) {
+		return 1;
+	}
+	if ((r0 = read_file(argv[1], argv[2], FSMNT_NORA, paths[0],
+			    nchunks)) == 0 ||
+	    (r1 = read_file(argv[1], argv[2], 0, paths[0], nchunks)) == 0) {
+		return 1;
+	}
+	printf("Sequential read of %s MB: %.0f MB/s without readahead, %.0f "
+	       "with it (%.1fx)\n", argv[5], r0, r1, r1 / r0);
+
+	return 0;
+}
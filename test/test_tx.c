@@ -0,0 +1,410 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create and write 'nfiles' files in directory 'dir' with an
+ * fssync() after each, then as many in a single transaction,
+ * and print the number of files per second of both. Then check
+ * that an aborted transaction leaves nothing behind (a file it
+ * rewrote, files it created and removed), that a file created
+ * by another thread meanwhile is kept, and that after a process
+ * exits without unmounting, the way a crash would, what a
+ * committed transaction did is found and nothing of the one
+ * left open is. Last, check that a file rewritten within a
+ * committed transaction reads back, checksums included, after
+ * remounting.
+ */
+
+#define DATALEN		2000
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+fill(
+	char			*buf,
+	int			i)
+{
+	int			j;
+
+	for (j = 0; j < DATALEN; j++) {
+		buf[j] = (char)(i * 13 + j);
+	}
+}
+
+/*
+ * Create the file 'dir'/'prefix''i' with the data of 'i'.
+ * Returns zero or error number.
+ */
+
+static int
+make_file(
+	FSHANDLE		fsh,
+	char			*dir,
+	char			*prefix,
+	int			i)
+{
+	FHANDLE			fh;
+	char			path[256], buf[DATALEN];
+
+	snprintf(path, sizeof(path), "%s/%s%06d", dir, prefix, i);
+	if ((fh = fscreate(fsh, path, FTYPE_FILE)) == NULL) {
+		fprintf(stderr, "Failed to create %s\n", path);
+		return EIO;
+	}
+	fill(buf, i);
+	if (fswrite(fh, buf, DATALEN) != DATALEN) {
+		fprintf(stderr, "Failed to write %s\n", path);
+		fsclose(fh);
+		return EIO;
+	}
+	fsclose(fh);
+	return 0;
+}
+
+/*
+ * Check that the file 'dir'/'prefix''i' exists, with the data
+ * of 'data', if 'exists', or doesn't otherwise.
+ */
+
+static int
+check_file(
+	FSHANDLE		fsh,
+	char			*dir,
+	char			*prefix,
+	int			i,
+	int			data,
+	int			exists)
+{
+	FHANDLE			fh;
+	char			path[256], buf[DATALEN], rbuf[DATALEN];
+
+	snprintf(path, sizeof(path), "%s/%s%06d", dir, prefix, i);
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		if (exists) {
+			fprintf(stderr, "%s not found\n", path);
+		}
+		return exists;
+	}
+	if (!exists) {
+		fprintf(stderr, "%s found\n", path);
+		fsclose(fh);
+		return 1;
+	}
+	fill(buf, data);
+	if (fsread(fh, rbuf, DATALEN) != DATALEN ||
+	    memcmp(buf, rbuf, DATALEN) != 0) {
+		fprintf(stderr, "Data mismatch in %s\n", path);
+		fsclose(fh);
+		return 1;
+	}
+	fsclose(fh);
+	return 0;
+}
+
+struct other {
+	FSHANDLE		o_fsh;
+	char			*o_dir;
+	int			o_error;
+};
+
+static void *
+other_create(
+	void			*arg)
+{
+	struct other		*o = (struct other *)arg;
+
+	o->o_error = make_file(o->o_fsh, o->o_dir, "other", 0);
+	return NULL;
+}
+
+/*
+ * Time 'n' files created with an fssync() after each and 'n'
+ * in one transaction.
+ */
+
+static int
+bench(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			n)
+{
+	void			*tx;
+	double			t0, t1, t2;
+	int			i;
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		if (make_file(fsh, dir, "s", i) != 0 || fssync(fsh) != 0) {
+			return 1;
+		}
+	}
+	t1 = now();
+	if ((tx = fstx_begin(fsh)) == NULL) {
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		if (make_file(fsh, dir, "t", i) != 0) {
+			return 1;
+		}
+	}
+	if (fstx_commit(tx) != 0) {
+		fprintf(stderr, "Failed to commit transaction\n");
+		return 1;
+	}
+	t2 = now();
+	printf("%d files: %.0f files/s with fssync() after each, %.0f in "
+		"one transaction (%.1fx)\n", n, n / (t1 - t0), n / (t2 - t1),
+		(t1 - t0) / (t2 - t1));
+	return 0;
+}
+
+/*
+ * Rewrite file s0, create files a*, remove files s1 to n - 1
+ * and t* in a transaction which is aborted, while another
+ * thread creates a file.
+ */
+
+static int
+abort_tx(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			n)
+{
+	struct other		o;
+	pthread_t		tid;
+	FHANDLE			fh;
+	void			*tx;
+	char			path[256], buf[DATALEN];
+	int			i;
+
+	if ((tx = fstx_begin(fsh)) == NULL) {
+		return 1;
+	}
+	o.o_fsh = fsh;
+	o.o_dir = dir;
+	o.o_error = 0;
+	pthread_create(&tid, NULL, other_create, &o);
+	snprintf(path, sizeof(path), "%s/s%06d", dir, 0);
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		return 1;
+	}
+	fill(buf, n);
+	if (fswrite(fh, buf, DATALEN) != DATALEN) {
+		return 1;
+	}
+	fsclose(fh);
+	for (i = 0; i < n; i++) {
+		if (make_file(fsh, dir, "a", i) != 0) {
+			return 1;
+		}
+		if (i > 0) {
+			snprintf(path, sizeof(path), "%s/s%06d", dir, i);
+			if (fsremove(fsh, path) != 0) {
+				return 1;
+			}
+		}
+		snprintf(path, sizeof(path), "%s/t%06d", dir, i);
+		if (fsremove(fsh, path) != 0) {
+			return 1;
+		}
+	}
+	if (check_file(fsh, dir, "other", 0, 0, 0) != 0) {
+		fprintf(stderr, "Other thread changed the file system within "
+			"the transaction\n");
+		return 1;
+	}
+	if (fstx_abort(tx) != 0) {
+		fprintf(stderr, "Failed to abort transaction\n");
+		return 1;
+	}
+	pthread_join(tid, NULL);
+	return o.o_error;
+}
+
+static int
+check_abort(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			n)
+{
+	int			i;
+
+	for (i = 0; i < n; i++) {
+		if (check_file(fsh, dir, "s", i, i, 1) != 0 ||
+		    check_file(fsh, dir, "t", i, i, 1) != 0 ||
+		    check_file(fsh, dir, "a", i, i, 0) != 0) {
+			return 1;
+		}
+	}
+	return check_file(fsh, dir, "other", 0, 0, 1);
+}
+
+/*
+ * Create files c* in a transaction which is committed and
+ * files d* in one left open, then exit without unmounting.
+ */
+
+static void
+crash(
+	char			*dev,
+	char			*mntpt,
+	char			*dir,
+	int			n)
+{
+	FSHANDLE		fsh;
+	void			*tx;
+	int			i;
+
+	if ((fsh = fsmount(dev, mntpt)) == NULL ||
+	    (tx = fstx_begin(fsh)) == NULL) {
+		_exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		if (make_file(fsh, dir, "c", i) != 0) {
+			_exit(1);
+		}
+	}
+	if (fstx_commit(tx) != 0 || (tx = fstx_begin(fsh)) == NULL) {
+		_exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		if (make_file(fsh, dir, "d", i) != 0) {
+			_exit(1);
+		}
+	}
+	_exit(0);
+}
+
+/*
+ * Create file w0 and rewrite it with the data of 'n' in a
+ * transaction which is committed.
+ */
+
+static int
+rewrite_tx(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			n)
+{
+	FHANDLE			fh;
+	void			*tx;
+	char			path[256], buf[DATALEN];
+
+	if (make_file(fsh, dir, "w", 0) != 0 || fssync(fsh) != 0 ||
+	    (tx = fstx_begin(fsh)) == NULL) {
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/w%06d", dir, 0);
+	if ((fh = fsopen(fsh, path, 0)) == NULL) {
+		return 1;
+	}
+	fill(buf, n);
+	if (fswrite(fh, buf, DATALEN) != DATALEN) {
+		fprintf(stderr, "Failed to rewrite %s\n", path);
+		return 1;
+	}
+	fsclose(fh);
+	if (fstx_commit(tx) != 0) {
+		fprintf(stderr, "Failed to commit transaction\n");
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	pid_t			pid;
+	int			i, n, status;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files>\n", argv[0]);
+		return 1;
+	}
+	n = atoi(argv[4]);
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	if (bench(fsh, argv[3], n) != 0 || abort_tx(fsh, argv[3], n) != 0 ||
+	    check_abort(fsh, argv[3], n) != 0) {
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (check_abort(fsh, argv[3], n) != 0) {
+		return 1;
+	}
+	fsumount(fsh);
+	printf("Aborted transaction left nothing behind\n");
+
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		crash(argv[1], argv[2], argv[3], n);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Crash test process failed\n");
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to mount file system after crash\n");
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		if (check_file(fsh, argv[3], "c", i, i, 1) != 0 ||
+		    check_file(fsh, argv[3], "d", i, i, 0) != 0) {
+			return 1;
+		}
+	}
+	if (check_abort(fsh, argv[3], n) != 0) {
+		return 1;
+	}
+	printf("Committed transaction found after the crash, open one "
+		"not\n");
+	if (rewrite_tx(fsh, argv[3], n) != 0 ||
+	    check_file(fsh, argv[3], "w", 0, n, 1) != 0) {
+		return 1;
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+	if (check_file(fsh, argv[3], "w", 0, n, 1) != 0) {
+		return 1;
+	}
+	printf("File rewritten in a transaction read back\n");
+	fsumount(fsh);
+
+	return 0;
+}
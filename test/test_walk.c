@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Create a tree of about 'nfiles' files under a new directory,
+ * F subdirectories of F subdirectories each holding the files
+ * (every other subdirectory of the first level being sorted),
+ * F being at least NFANOUT and large enough for the leaves to
+ * hold no more than LEAFMAX files each, and walk it with
+ * fswalk() after remounting with 1, 2, 4... up to 'max threads'
+ * (8 by default) threads, checking that every entry is passed
+ * to the callback once, with its type and size, and printing
+ * the time each walk takes. Then check that a callback returning
+ * non-zero stops the walk.
+ * With a million files or so, the tree has thousands of
+ * directories and the walks show how fswalk() scales.
+ */
+
+#define NFANOUT		16
+#define LEAFMAX		64
+#define NBATCH		1000
+#define STOPAT		1000
+
+struct walk_count {
+	int			wc_nfiles;
+	int			wc_ndirs;
+	int			wc_bad;
+	int			wc_calls;
+	unsigned char		*wc_seen;
+};
+
+static double
+now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * File 'i' is "f<i>", with i % 7 bytes of data if i % 50 == 0.
+ */
+
+static unsigned int
+file_size(
+	int			i)
+{
+	return (i % 50 == 0) ? i % 7 : 0;
+}
+
+static int
+count_cb(
+	void			*arg,
+	const char		*path,
+	struct udirentplus	*up)
+{
+	struct walk_count	*wc = (struct walk_count *)arg;
+	const char		*name = strrchr(path, '/') + 1;
+	int			i;
+
+	__sync_fetch_and_add(&wc->wc_calls, 1);
+	if (strcmp(name, up->udp_name) != 0) {
+		__sync_fetch_and_add(&wc->wc_bad, 1);
+		return 0;
+	}
+	if (up->udp_type == FTYPE_DIR) {
+		__sync_fetch_and_add(&wc->wc_ndirs, 1);
+		return 0;
+	}
+	i = atoi(name + 1);
+	if (name[0] != 'f' || i < 0 || i >= wc->wc_nfiles ||
+	    up->udp_type != FTYPE_FILE || up->udp_size != file_size(i) ||
+	    __sync_fetch_and_add(&wc->wc_seen[i], 1) != 0) {
+		__sync_fetch_and_add(&wc->wc_bad, 1);
+	}
+	return 0;
+}
+
+static int
+stop_cb(
+	void			*arg,
+	const char		*path,
+	struct udirentplus	*up)
+{
+	struct walk_count	*wc = (struct walk_count *)arg;
+
+	return (__sync_add_and_fetch(&wc->wc_calls, 1) >= STOPAT) ? -1 : 0;
+}
+
+/*
+ * Create the files of leaf directory 'dir', 'first' to
+ * 'last' - 1.
+ */
+
+static int
+fill_dir(
+	FSHANDLE		fsh,
+	char			*dir,
+	int			first,
+	int			last)
+{
+	static char		namebuf[NBATCH][16];
+	static char		*names[NBATCH];
+	static unsigned int	types[NBATCH];
+	static void		*handles[NBATCH];
+	int			i, j, k, error;
+
+	for (i = first; i < last; i += k) {
+		k = (last - i < NBATCH) ? last - i : NBATCH;
+		for (j = 0; j < k; j++) {
+			snprintf(namebuf[j], sizeof(namebuf[j]), "f%d", i + j);
+			names[j] = namebuf[j];
+			types[j] = FTYPE_FILE;
+		}
+		if ((error = fscreate_batch(fsh, dir, names, types, k,
+					    handles)) != 0) {
+			fprintf(stderr, "Failed to create files in %s: %d\n",
+				dir, error);
+			return 1;
+		}
+		for (j = 0; j < k; j++) {
+			if (file_size(i + j) && fswrite(handles[j], "1234567",
+			    file_size(i + j)) != (int)file_size(i + j)) {
+				fprintf(stderr, "Failed to write %s/%s\n", dir,
+					names[j]);
+				return 1;
+			}
+			fsclose(handles[j]);
+		}
+	}
+	return 0;
+}
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	FSHANDLE                fsh = NULL;
+	FHANDLE			fh;
+	struct walk_count	wc;
+	char			path[256], leaf[256];
+	double			t, t1 = 0;
+	int			i, j, n, nthreads, maxthreads = 8, error, per;
+	int			first, fanout;
+
+	if (argc != 5 && argc != 6) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <directory> <number of files> [<max threads>]\n",
+			argv[0]);
+		return 1;
+	}
+	if (argc == 6 && (maxthreads = atoi(argv[5])) <= 0) {
+		fprintf(stderr, "Bad number of threads\n");
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	n = atoi(argv[4]);
+	for (fanout = NFANOUT; fanout * fanout * LEAFMAX < n; fanout++);
+	per = (n + fanout * fanout - 1) / (fanout * fanout);
+	if ((fh = fscreate(fsh, argv[3], FTYPE_DIR)) == NULL) {
+		fprintf(stderr, "Failed to create directory %s\n", argv[3]);
+		return 1;
+	}
+	fsclose(fh);
+	for (i = 0, first = 0; i < fanout; i++) {
+		snprintf(path, sizeof(path), "%s/d%d", argv[3], i);
+		if ((fh = fscreate(fsh, path, (i % 2) ? FTYPE_DIR :
+				   FTYPE_DIR | FTYPE_SORTED)) == NULL) {
+			fprintf(stderr, "Failed to create %s\n", path);
+			return 1;
+		}
+		fsclose(fh);
+		for (j = 0; j < fanout; j++, first += per) {
+			snprintf(leaf, sizeof(leaf), "%s/d%d", path, j);
+			if ((fh = fscreate(fsh, leaf, FTYPE_DIR)) == NULL) {
+				fprintf(stderr, "Failed to create %s\n", leaf);
+				return 1;
+			}
+			fsclose(fh);
+			if (first < n && fill_dir(fsh, leaf, first,
+					first + per < n ? first + per : n) != 0) {
+				return 1;
+			}
+		}
+	}
+	if (fsumount(fsh) != 0 || (fsh = fsmount(argv[1], argv[2])) == NULL) {
+		fprintf(stderr, "Failed to remount file system\n");
+		return 1;
+	}
+
+	/*
+	 * Walk the tree, with more threads each time.
+	 */
+
+	wc.wc_nfiles = n;
+	wc.wc_seen = (unsigned char *)malloc(n);
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+		memset(wc.wc_seen, 0, n);
+		wc.wc_ndirs = wc.wc_bad = wc.wc_calls = 0;
+		t = now();
+		if ((error = fswalk(fsh, argv[3], count_cb, &wc,
+				    nthreads)) != 0) {
+			fprintf(stderr, "fswalk() failed: %d\n", error);
+			return 1;
+		}
+		t = now() - t;
+		if (nthreads == 1) {
+			t1 = t;
+		}
+		for (i = 0; i < n && wc.wc_seen[i] == 1; i++);
+		if (wc.wc_bad != 0 || i != n ||
+		    wc.wc_ndirs != fanout + fanout * fanout) {
+			fprintf(stderr, "Walk with %d threads: %d bad entries, "
+				"file f%d missed, %d directories\n", nthreads,
+				wc.wc_bad, i, wc.wc_ndirs);
+			return 1;
+		}
+		printf("%d entries walked with %d threads in %.3fs "
+			"(%.0f entries/s, %.1fx)\n", wc.wc_calls, nthreads, t,
+			wc.wc_calls / t, t1 / t);
+	}
+
+	/*
+	 * A callback returning non-zero stops the walk.
+	 */
+
+	wc.wc_calls = 0;
+	if ((error = fswalk(fsh, argv[3], stop_cb, &wc, 4)) != -1 ||
+	    wc.wc_calls >= n / 2) {
+		fprintf(stderr, "Stopped walk returned %d after %d calls\n",
+			error, wc.wc_calls);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/d0/d0/f0", argv[3]);
+	if (fswalk(fsh, path, count_cb, &wc, 1) != ENOTDIR ||
+	    fswalk(fsh, argv[3], count_cb, &wc, 0) != EINVAL) {
+		fprintf(stderr, "fswalk() of a file or without threads "
+			"didn't fail\n");
+		return 1;
+	}
+	free(wc.wc_seen);
+	printf("Tree %s walked\n", argv[3]);
+	fsumount(fsh);
+
+	return 0;
+}
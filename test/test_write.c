@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs_include.h"
+#include "layout.h"
+#include "inode.h"
+#include "fs.h"
+
+/*
+ * Append 'nrec' records of 100 to 500 bytes to a new file,
+ * then read the file back and verify its contents, and that
+ * the blocks preallocated beyond its end were freed on close.
+ */
+
+int
+main(
+        int                     argc,
+        char                    *argv[])
+{
+	struct file_extent	ext[64];
+	struct file_handle      *fh = NULL;
+	FSHANDLE                fsh = NULL;
+	char			*data = NULL, *rbuf = NULL;
+	unsigned int		total = 0, len;
+	int			nrec, i, n;
+
+	if (argc != 5) {
+		fprintf(stderr, "Usage: %s <device file> <mntpt>"
+			" <path> <nrecords>\n", argv[0]);
+		return 1;
+	}
+	if ((fsh = fsmount(argv[1], argv[2])) == NULL) {
+                fprintf(stderr, "Failed to mount file system\n");
+                return 1;
+        }
+	printf("FS mounted successfully\n");
+	nrec = atoi(argv[4]);
+	data = (char *)malloc(nrec * 500);
+	for (i = 0; i < nrec * 500; i++) {
+		data[i] = (char)(i * 7 + i / 500);
+	}
+	fh = fscreate(fsh, argv[3], FTYPE_FILE);
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to create file %s\n", argv[3]);
+		return 1;
+	}
+	srand(nrec);
+	for (i = 0; i < nrec; i++) {
+		len = 100 + rand() % 401;
+		if (fswrite(fh, data + total, len) != (int)len) {
+			fprintf(stderr, "Failed to write record %d\n", i);
+			return 1;
+		}
+		total += len;
+	}
+	if (fsclose(fh) != 0) {
+		fprintf(stderr, "Failed to close %s\n", argv[3]);
+		return 1;
+	}
+	printf("Wrote %u bytes in %d records\n", total, nrec);
+
+	fh = fsopen(fsh, argv[3], 0);
+	if (fh == NULL) {
+		fprintf(stderr, "Failed to open file %s\n", argv[3]);
+		return 1;
+	}
+	if (fh->fh_inode->mino_size != total) {
+		fprintf(stderr, "File size %llu, expected %u\n",
+			fh->fh_inode->mino_size, total);
+		return 1;
+	}
+	if (fh->fh_inode->mino_nblocks != (total + ONE_K - 1) / ONE_K) {
+		fprintf(stderr, "File has %llu blocks, expected %u\n",
+			fh->fh_inode->mino_nblocks, (total + ONE_K - 1) / ONE_K);
+		return 1;
+	}
+	rbuf = (char *)malloc(total);
+	if (fsread(fh, rbuf, total) != (int)total ||
+	    memcmp(rbuf, data, total) != 0) {
+		fprintf(stderr, "Data mismatch in %s\n", argv[3]);
+		return 1;
+	}
+	n = fsmap(fh, 0, total, ext, 64);
+	printf("File %s verified, %d extent(s)\n", argv[3], n);
+	fsclose(fh);
+	fsumount(fsh);
+
+	return 0;
+}